@@ -0,0 +1,472 @@
+/*
+ * bench/bench.js: benchmark hyprlofs operations
+ *
+ * This sweeps each of several parameters (the number of mappings per
+ * operation, the length of their paths, and the number of mounts operated on
+ * concurrently) around a baseline for each kind of operation, and for each
+ * combination reports operation latency, how long each call blocked the event
+ * loop, event loop delay, garbage collection activity, the heap retained by the
+ * operations, and the time the binding itself spent marshalling mappings and in
+ * ioctls (from hyprlofs.stats()).
+ * Run with "--help" for options.  With "--json", each result is emitted as a
+ * single line of JSON, suitable for comparing between releases.
+ *
+ * This must be run as root in the global zone (or a zone that may mount
+ * hyprlofs filesystems), unless "--mock" is used to run against the bindings'
+ * in-memory emulation of hyprlofs instead.
+ */
+
+var mod_fs = require('fs');
+var mod_hyprlofs = require('hyprlofs');
+var mod_perf_hooks = require('perf_hooks');
+var mod_v8 = require('v8');
+var mod_vm = require('vm');
+
+var OPS = [ 'add', 'remove', 'list', 'set', 'clear' ];
+
+var config = {
+	'ops': OPS,
+	'iters': 100,
+	'batch': 1000,
+	'batches': [ 1, 10, 100, 1000, 10000 ],
+	'pathlen': 64,
+	'pathlens': [ 32, 128, 240 ],
+	'mounts': 1,
+	'mountcounts': [ 4, 16 ],
+	'json': false,
+	'mock': null
+};
+
+var tmpdir = '/var/tmp/hyprlofs.bench.' + process.pid;
+var gcs = { 'count': 0, 'time': 0 };
+var gc;
+var files = {};
+var mounts = [];
+
+function usage(msg)
+{
+	if (msg)
+		console.error('bench.js: %s', msg);
+	console.error([
+	    'usage: node bench/bench.js [options]',
+	    '',
+	    '    --ops OP[,OP...]     operations to benchmark (default: ' +
+		OPS.join(',') + ')',
+	    '    --iters N            operations per case (default: 100)',
+	    '    --batch N[,N...]     mappings per operation (default: ' +
+		config.batches.join(',') + ')',
+	    '    --pathlen N[,N...]   path lengths (default: ' +
+		config.pathlens.join(',') + ')',
+	    '    --mounts N[,N...]    concurrent mounts (default: ' +
+		config.mountcounts.join(',') + ')',
+	    '    --json               emit one line of JSON per case',
+	    '    --mock               use the mock backend instead of hyprlofs',
+	    '    --latency USEC       mock latency per request (implies --mock)',
+	    '    --entry-latency NSEC mock latency per mapping (implies --mock)'
+	].join('\n'));
+	process.exit(2);
+}
+
+function parseList(arg, numeric)
+{
+	if (arg === undefined)
+		usage('missing argument');
+
+	return (arg.split(',').map(function (s) {
+		var n = parseInt(s, 10);
+		if (!numeric)
+			return (s);
+		if (isNaN(n) || n <= 0)
+			usage('expected positive integer: ' + s);
+		return (n);
+	}));
+}
+
+function parseArgs(argv)
+{
+	for (var i = 0; i < argv.length; i++) {
+		switch (argv[i]) {
+		case '--ops':
+			config.ops = parseList(argv[++i], false);
+			config.ops.forEach(function (op) {
+				if (OPS.indexOf(op) == -1)
+					usage('unknown operation: ' + op);
+			});
+			break;
+		case '--iters':
+			config.iters = parseList(argv[++i], true)[0];
+			break;
+		case '--batch':
+			config.batches = parseList(argv[++i], true);
+			break;
+		case '--pathlen':
+			config.pathlens = parseList(argv[++i], true);
+			break;
+		case '--mounts':
+			config.mountcounts = parseList(argv[++i], true);
+			break;
+		case '--json':
+			config.json = true;
+			break;
+		case '--mock':
+			config.mock = config.mock || {};
+			break;
+		case '--latency':
+			config.mock = config.mock || {};
+			config.mock.latencyMicros = parseList(argv[++i], true)[0];
+			break;
+		case '--entry-latency':
+			config.mock = config.mock || {};
+			config.mock.entryNanos = parseList(argv[++i], true)[0];
+			break;
+		default:
+			usage(argv[i] == '--help' ? null :
+			    'unknown option: ' + argv[i]);
+			break;
+		}
+	}
+}
+
+/*
+ * Returns the path of a file whose full path is "len" bytes long, creating it
+ * if necessary.  Every mapping in a case refers to the same file under a
+ * different alias, so we need only one file per path length.
+ */
+function sourceFile(len)
+{
+	var prefix = tmpdir + '/files/';
+	var path;
+
+	if (files[len])
+		return (files[len]);
+
+	if (len <= prefix.length)
+		len = prefix.length + 1;
+	path = prefix + new Array(len - prefix.length + 1).join('f');
+	mod_fs.writeFileSync(path, '');
+	files[len] = path;
+	return (path);
+}
+
+function makeMappings(src, count, prefix)
+{
+	var mappings = new Array(count);
+
+	for (var i = 0; i < count; i++)
+		mappings[i] = [ src, prefix + i ];
+	return (mappings);
+}
+
+function percentile(sorted, p)
+{
+	if (sorted.length === 0)
+		return (0);
+	return (sorted[Math.min(sorted.length - 1,
+	    Math.floor(p * sorted.length))]);
+}
+
+/*
+ * Summarizes "samples", which are in nanoseconds, in microseconds.
+ */
+function summarize(samples)
+{
+	var sorted = samples.slice().sort(function (a, b) { return (a - b); });
+	var sum = 0;
+
+	sorted.forEach(function (v) { sum += v; });
+	return ({
+	    'min': sorted[0] / 1e3,
+	    'p50': percentile(sorted, 0.5) / 1e3,
+	    'p90': percentile(sorted, 0.9) / 1e3,
+	    'p99': percentile(sorted, 0.99) / 1e3,
+	    'max': sorted[sorted.length - 1] / 1e3,
+	    'mean': sum / sorted.length / 1e3
+	});
+}
+
+/*
+ * Invokes "func" (which starts an operation and returns its Promise), recording
+ * how long the call itself took (i.e., how long it blocked the event loop) in
+ * "blocked" and how long the operation took to complete in "latency".
+ */
+function timed(func, latency, blocked)
+{
+	var start = process.hrtime.bigint();
+	var p = func();
+
+	blocked.push(Number(process.hrtime.bigint() - start));
+	return (p.then(function (rv) {
+		latency.push(Number(process.hrtime.bigint() - start));
+		return (rv);
+	}));
+}
+
+/*
+ * Each kind of operation has an untimed "setup" that runs before each
+ * iteration on each mount and a timed "run".
+ */
+var cases = {
+    'add': {
+	'setup': function (fs) { return (fs.removeAll()); },
+	'run': function (fs, c) { return (fs.addMappings(c.mappings)); }
+    },
+    'remove': {
+	'setup': function (fs, c) { return (fs.addMappings(c.mappings)); },
+	'run': function (fs, c) { return (fs.removeMappings(c.aliases)); }
+    },
+    'list': {
+	'once': function (fs, c) {
+		return (fs.removeAll().then(function () {
+			return (fs.addMappings(c.mappings));
+		}));
+	},
+	'run': function (fs) { return (fs.listMappings()); }
+    },
+    'set': {
+	/*
+	 * Each iteration replaces half of the mappings, alternating between
+	 * two overlapping sets.
+	 */
+	'once': function (fs, c) { return (fs.setMappings(c.mappings)); },
+	'run': function (fs, c, i) {
+		return (fs.setMappings(i % 2 === 0 ? c.alternate : c.mappings));
+	}
+    },
+    'clear': {
+	'setup': function (fs, c) { return (fs.addMappings(c.mappings)); },
+	'run': function (fs) { return (fs.removeAll()); }
+    }
+};
+
+async function runCase(op, batch, pathlen, nmounts)
+{
+	var kind = cases[op];
+	var src = sourceFile(pathlen);
+	var c = {
+	    'mappings': makeMappings(src, batch, 'file_'),
+	    'aliases': []
+	};
+	var latency = [], blocked = [];
+	var fss = mounts.slice(0, nmounts);
+	var histogram, native, before, start, elapsed, gc0, heap0, i;
+
+	c.mappings.forEach(function (m) { c.aliases.push(m[1]); });
+	c.alternate = c.mappings.slice(0, Math.floor(batch / 2)).concat(
+	    makeMappings(src, batch - Math.floor(batch / 2), 'other_'));
+
+	await Promise.all(fss.map(function (fs) {
+		return (kind.once ? kind.once(fs, c) : fs.removeAll());
+	}));
+
+	histogram = mod_perf_hooks.monitorEventLoopDelay({ 'resolution': 1 });
+	native = { 'marshal': 0, 'nmarshal': 0, 'ioctl': 0, 'nioctl': 0,
+	    'ioctls': 0 };
+	gc0 = { 'count': gcs.count, 'time': gcs.time };
+
+	/*
+	 * Collecting garbage before each heap sample means that the difference
+	 * is what the operations left live, rather than whatever happened to be
+	 * collected in between (which can make it negative).
+	 */
+	heap0 = await heapUsed();
+	elapsed = 0;
+
+	for (i = 0; i < config.iters; i++) {
+		if (kind.setup) {
+			await Promise.all(fss.map(function (fs) {
+				return (kind.setup(fs, c, i));
+			}));
+		}
+
+		/*
+		 * Only the operations themselves count towards the native
+		 * statistics and event loop delay.
+		 */
+		before = mod_hyprlofs.stats();
+		histogram.enable();
+		start = process.hrtime.bigint();
+		await Promise.all(fss.map(function (fs) {
+			return (timed(function () {
+				return (kind.run(fs, c, i));
+			}, latency, blocked));
+		}));
+		elapsed += Number(process.hrtime.bigint() - start);
+		histogram.disable();
+		accumulate(native, before, mod_hyprlofs.stats());
+	}
+
+	return ({
+	    'op': op,
+	    'batch': batch,
+	    'pathlen': pathlen,
+	    'mounts': nmounts,
+	    'iters': config.iters,
+	    'mock': config.mock,
+	    'opsPerSec': latency.length / (elapsed / 1e9),
+	    'mappingsPerSec': latency.length * batch / (elapsed / 1e9),
+	    'latencyUs': summarize(latency),
+	    'blockedUs': summarize(blocked),
+	    'loopDelayUs': {
+		'p50': histogram.percentile(50) / 1e3,
+		'p99': histogram.percentile(99) / 1e3,
+		'max': histogram.max / 1e3
+	    },
+	    'gcPerOp': (gcs.count - gc0.count) / latency.length,
+	    'gcMsPerOp': (gcs.time - gc0.time) / latency.length,
+	    'retainedHeapBytesPerOp': (await heapUsed() - heap0) /
+		latency.length,
+	    'nativeUs': {
+		'marshal': native.marshal / Math.max(1, native.nmarshal) / 1e3,
+		'ioctl': native.ioctl / Math.max(1, native.nioctl) / 1e3,
+		'ioctlsPerOp': native.ioctls / latency.length
+	    }
+	});
+}
+
+/*
+ * Returns the size of the live heap.  Some objects can't be freed until
+ * finalizers run after the collection that found them unreachable (including
+ * the binding's), so we keep collecting until the heap stops shrinking.
+ */
+async function heapUsed()
+{
+	var used, last = Infinity;
+
+	for (var i = 0; i < 10; i++) {
+		gc();
+		used = process.memoryUsage().heapUsed;
+		if (used >= last)
+			break;
+		last = used;
+		await new Promise(function (resolve) { setImmediate(resolve); });
+	}
+
+	return (Math.min(used, last));
+}
+
+/*
+ * The native statistics are cumulative for the whole process, so we add up the
+ * differences across just the timed part of each iteration.
+ */
+function accumulate(acc, before, after)
+{
+	acc.marshal += after.marshalTime.sum - before.marshalTime.sum;
+	acc.nmarshal += after.marshalTime.count - before.marshalTime.count;
+	acc.ioctl += after.ioctlTime.sum - before.ioctlTime.sum;
+	acc.nioctl += after.ioctlTime.count - before.ioctlTime.count;
+	Object.keys(after.ioctls).forEach(function (cmd) {
+		acc.ioctls += after.ioctls[cmd] - before.ioctls[cmd];
+	});
+}
+
+function report(result)
+{
+	if (config.json) {
+		console.log(JSON.stringify(result));
+		return;
+	}
+
+	console.log('%s: batch %d, pathlen %d, %d mount%s, %d iters',
+	    result.op, result.batch, result.pathlen, result.mounts,
+	    result.mounts == 1 ? '' : 's', result.iters);
+	console.log('    latency (us):    p50 %s  p90 %s  p99 %s  max %s',
+	    result.latencyUs.p50.toFixed(1), result.latencyUs.p90.toFixed(1),
+	    result.latencyUs.p99.toFixed(1), result.latencyUs.max.toFixed(1));
+	console.log('    blocked (us):    p50 %s  p99 %s  max %s',
+	    result.blockedUs.p50.toFixed(1), result.blockedUs.p99.toFixed(1),
+	    result.blockedUs.max.toFixed(1));
+	console.log('    native (us):     marshal %s  ioctl %s  (%s ioctls/op)',
+	    result.nativeUs.marshal.toFixed(1),
+	    result.nativeUs.ioctl.toFixed(1),
+	    result.nativeUs.ioctlsPerOp.toFixed(2));
+	console.log('    throughput:      %s ops/s, %s mappings/s',
+	    result.opsPerSec.toFixed(0), result.mappingsPerSec.toFixed(0));
+	console.log('    gc:              %s per op, %s ms per op, ' +
+	    '%s bytes retained per op', result.gcPerOp.toFixed(3),
+	    result.gcMsPerOp.toFixed(3),
+	    result.retainedHeapBytesPerOp.toFixed(0));
+}
+
+async function main()
+{
+	var maxmounts, seen = {};
+
+	parseArgs(process.argv.slice(2));
+
+	/*
+	 * This is equivalent to running node with --expose-gc, but works with
+	 * "npm run bench".  Only contexts created afterwards get gc().
+	 */
+	mod_v8.setFlagsFromString('--expose-gc');
+	gc = mod_vm.runInNewContext('gc');
+	if (config.mock !== null)
+		mod_hyprlofs.setBackend('mock', config.mock);
+	maxmounts = Math.max.apply(null, config.mountcounts.concat(
+	    [ config.mounts ]));
+
+	new mod_perf_hooks.PerformanceObserver(function (list) {
+		list.getEntries().forEach(function (entry) {
+			/* Skip the collections we force ourselves. */
+			if (entry.detail.flags & mod_perf_hooks.constants.
+			    NODE_PERFORMANCE_GC_FLAGS_FORCED)
+				return;
+			gcs.count++;
+			gcs.time += entry.duration;
+		});
+	}).observe({ 'entryTypes': [ 'gc' ] });
+
+	mod_fs.mkdirSync(tmpdir);
+	mod_fs.mkdirSync(tmpdir + '/files');
+	for (var i = 0; i < maxmounts; i++) {
+		mod_fs.mkdirSync(tmpdir + '/mnt' + i);
+		mounts.push(new mod_hyprlofs.Filesystem(tmpdir + '/mnt' + i));
+	}
+
+	try {
+		await Promise.all(mounts.map(function (fs) {
+			return (fs.mount());
+		}));
+
+		/*
+		 * Vary one parameter at a time around the baseline, skipping
+		 * combinations we've already done.
+		 */
+		for (var op of config.ops) {
+			var runs = [];
+			config.batches.forEach(function (b) {
+				runs.push([ b, config.pathlen, config.mounts ]);
+			});
+			config.pathlens.forEach(function (l) {
+				runs.push([ config.batch, l, config.mounts ]);
+			});
+			config.mountcounts.forEach(function (m) {
+				runs.push([ config.batch, config.pathlen, m ]);
+			});
+
+			for (var run of runs) {
+				var key = [ op ].concat(run).join('/');
+				if (seen[key])
+					continue;
+				seen[key] = true;
+				report(await runCase(op, run[0], run[1],
+				    run[2]));
+			}
+		}
+	} finally {
+		await Promise.all(mounts.map(function (fs) {
+			return (fs.unmount().catch(function () {}));
+		}));
+		for (i = 0; i < maxmounts; i++)
+			mod_fs.rmdirSync(tmpdir + '/mnt' + i);
+		Object.keys(files).forEach(function (len) {
+			mod_fs.unlinkSync(files[len]);
+		});
+		mod_fs.rmdirSync(tmpdir + '/files');
+		mod_fs.rmdirSync(tmpdir);
+	}
+}
+
+main().catch(function (err) {
+	console.error('bench.js: %s', err.stack);
+	process.exit(1);
+});
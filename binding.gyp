@@ -1,8 +1,82 @@
 {
+  'variables': {
+    'hyprlofs_obj_dir': '<(PRODUCT_DIR)/obj.target'
+  },
   'targets': [
     {
       'target_name': 'hyprlofs',
-      'sources': [ 'hyprlofs.cc' ]
+      'defines': [ 'NAPI_VERSION=8' ],
+      'conditions': [
+        [ 'OS=="solaris"', {
+          #
+          # With DTrace, the object is built separately so that "dtrace -G"
+          # can process its probe sites and generate the provider object
+          # before both are linked into the module.
+          #
+          'dependencies': [ 'hyprlofs_provider' ],
+          'libraries': [
+            '<(hyprlofs_obj_dir)/hyprlofs_objs/hyprlofs.o',
+            '<(hyprlofs_obj_dir)/hyprlofs_provider/hyprlofs_provider.o'
+          ]
+        }, {
+          #
+          # Elsewhere, there's no hyprlofs, so only the mock backend works
+          # (the kernel backend fails with ENOTSUP), which is enough to run
+          # the tests in test/mock.js and the benchmarks.
+          #
+          'sources': [ 'hyprlofs.cc' ],
+          'defines': [ 'HYPRLOFS_MOCK_ONLY=1' ]
+        } ]
+      ]
     }
+  ],
+  'conditions': [
+    [ 'OS=="solaris"', {
+      'targets': [
+        {
+          'target_name': 'hyprlofs_provider_header',
+          'type': 'none',
+          'actions': [ {
+            'action_name': 'dtrace_header',
+            'inputs': [ 'hyprlofs_provider.d' ],
+            'outputs': [ '<(SHARED_INTERMEDIATE_DIR)/hyprlofs_provider.h' ],
+            'action': [ 'dtrace', '-h', '-xnolibs', '-s', '<@(_inputs)',
+              '-o', '<@(_outputs)' ]
+          } ]
+        },
+        {
+          'target_name': 'hyprlofs_objs',
+          'type': 'static_library',
+          'sources': [ 'hyprlofs.cc' ],
+          'defines': [ 'NAPI_VERSION=8', 'HAVE_DTRACE=1' ],
+          'cflags': [ '-fPIC' ],
+          'include_dirs': [ '<(SHARED_INTERMEDIATE_DIR)' ],
+          'dependencies': [ 'hyprlofs_provider_header' ]
+        },
+        {
+          'target_name': 'hyprlofs_provider',
+          'type': 'none',
+          'dependencies': [ 'hyprlofs_objs' ],
+          'conditions': [
+            [ 'target_arch=="ia32"', {
+              'variables': { 'dtrace_arch': '-32' }
+            }, {
+              'variables': { 'dtrace_arch': '-64' }
+            } ]
+          ],
+          'actions': [ {
+            'action_name': 'dtrace_provider',
+            'inputs': [
+              'hyprlofs_provider.d',
+              '<(hyprlofs_obj_dir)/hyprlofs_objs/hyprlofs.o'
+            ],
+            'outputs': [ '<(hyprlofs_obj_dir)/hyprlofs_provider/hyprlofs_provider.o' ],
+            'action': [ 'dtrace', '<(dtrace_arch)', '-G', '-xnolibs',
+              '-s', 'hyprlofs_provider.d',
+              '<(hyprlofs_obj_dir)/hyprlofs_objs/hyprlofs.o', '-o', '<@(_outputs)' ]
+          } ]
+        }
+      ]
+    } ]
   ]
 }
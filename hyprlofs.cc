@@ -1,27 +1,137 @@
 /*
  * hyprlofs.cc: Node.js bindings for SmartOS's hyprlofs filesystem.
+ *
+ * These bindings are written against Node-API, so they're not tied to a
+ * particular V8 or Node version, and they keep no per-process JavaScript state,
+ * so they may be loaded in any number of worker threads.  Each Filesystem
+ * object belongs to the environment (main thread or worker) that created it.
  */
 
-#include <v8.h>
-#include <node.h>
-#include <node_object_wrap.h>
+#include <node_api.h>
+#include <uv.h>
 
 #include <assert.h>
+#include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#ifdef HYPRLOFS_MOCK_ONLY
+#include <sys/param.h>
+#include <time.h>
+#else
 #include <sys/mount.h>
 #include <sys/fs/hyprlofs.h>
+#endif
 
-using namespace v8;
-using namespace node;
+/*
+ * USDT probes are generated from hyprlofs_provider.d when building on illumos
+ * (see binding.gyp).  Elsewhere, they compile away to nothing.  Probe arguments
+ * that take any work to compute are only computed when the probe is enabled.
+ */
+#ifdef HAVE_DTRACE
+#include "hyprlofs_provider.h"
+#else
+#define	HYPRLOFS_OP_START(op, mountpt, opname, nentries)
+#define	HYPRLOFS_OP_START_ENABLED()		(0)
+#define	HYPRLOFS_OP_DONE(op, mountpt, opname, nentries, err)
+#define	HYPRLOFS_OP_DONE_ENABLED()		(0)
+#define	HYPRLOFS_IOCTL_ENTRY(mountpt, cmd, nentries)
+#define	HYPRLOFS_IOCTL_ENTRY_ENABLED()		(0)
+#define	HYPRLOFS_IOCTL_RETURN(mountpt, cmd, rv, err)
+#define	HYPRLOFS_IOCTL_RETURN_ENABLED()		(0)
+#define	HYPRLOFS_MARSHAL_START(cmd, nentries)
+#define	HYPRLOFS_MARSHAL_START_ENABLED()	(0)
+#define	HYPRLOFS_MARSHAL_DONE(cmd, nentries, failed)
+#define	HYPRLOFS_MARSHAL_DONE_ENABLED()		(0)
+#endif
+
+/*
+ * Builds for systems other than illumos (see binding.gyp) have only a working
+ * mock backend (see hyprlofs_backend_t), and there's no <sys/fs/hyprlofs.h>.
+ * For those, we define the kernel's ioctl interface ourselves, along with the few
+ * other illumos interfaces we use.
+ */
+#ifdef HYPRLOFS_MOCK_ONLY
+#define	HYPRLOFS_ADD_ENTRIES	(('H' << 8) | 1)
+#define	HYPRLOFS_RM_ENTRIES	(('H' << 8) | 2)
+#define	HYPRLOFS_RM_ALL		(('H' << 8) | 3)
+#define	HYPRLOFS_GET_ENTRIES	(('H' << 8) | 4)
+
+#define	MAX_MNTOPT_STR		1024
+
+typedef unsigned int uint_t;
+typedef int64_t hrtime_t;
+
+typedef struct hyprlofs_entry {
+	char			*hle_path;	/* file to map */
+	uint_t			hle_plen;	/* length of hle_path */
+	char			*hle_name;	/* name in the mount */
+	uint_t			hle_nlen;	/* length of hle_name */
+} hyprlofs_entry_t;
+
+typedef struct hyprlofs_entries {
+	uint_t			hle_len;	/* number of entries */
+	hyprlofs_entry_t	*hle_entries;	/* the entries */
+} hyprlofs_entries_t;
+
+typedef struct hyprlofs_curr_entry {
+	char			hce_path[MAXPATHLEN];	/* mapped file */
+	char			hce_name[MAXPATHLEN];	/* name in the mount */
+} hyprlofs_curr_entry_t;
+
+typedef struct hyprlofs_curr_entries {
+	uint_t			hce_cnt;	/* number of entries */
+	hyprlofs_curr_entry_t	*hce_entries;	/* the entries */
+} hyprlofs_curr_entries_t;
+
+static hrtime_t
+gethrtime(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((hrtime_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+static size_t
+strlcpy(char *dst, const char *src, size_t size)
+{
+	size_t len = strlen(src);
+
+	if (size != 0) {
+		size_t n = len < size ? len : size - 1;
+		bcopy(src, dst, n);
+		dst[n] = '\0';
+	}
+
+	return (len);
+}
+
+static size_t
+strlcat(char *dst, const char *src, size_t size)
+{
+	size_t len = strnlen(dst, size);
+
+	if (len == size)
+		return (len + strlen(src));
+
+	return (len + strlcpy(dst + len, src, size - len));
+}
+#endif
+#endif
 
 /*
  * This flag controls whether to emit debug output to stderr whenever we make a
@@ -29,721 +139,8344 @@ using namespace node;
  */
 static bool hyprlofs_debug = false;
 
+/*
+ * When fetching the current mappings, we size the initial request based on the
+ * number of mappings we saw the last time, plus this fraction (expressed as a
+ * shift) for growth, plus a fixed minimum.
+ */
+#define	HYPRLOFS_GET_HEADROOM_SHIFT	4
+#define	HYPRLOFS_GET_HEADROOM_MIN	16
+
+/*
+ * When validating the paths of an add operation, we split the entries among at
+ * most HYPRLOFS_VALIDATE_MAXJOBS concurrent threadpool jobs (the size of the
+ * libuv threadpool by default) of at least HYPRLOFS_VALIDATE_MINJOB entries
+ * each.
+ */
+#define	HYPRLOFS_VALIDATE_MAXJOBS	4
+#define	HYPRLOFS_VALIDATE_MINJOB	64
+
+/*
+ * The default number of mountpoint fds a MountManager keeps open.
+ */
+#define	HYPRLOFS_POOL_MAXOPEN		128
+
+/*
+ * The default and maximum number of threads in a ThreadPool.  The default
+ * matches the size of Node's own threadpool.
+ */
+#define	HYPRLOFS_TPOOL_SIZE		4
+#define	HYPRLOFS_TPOOL_MAXSIZE		128
+
+/*
+ * The default number of mappings restore() and removeByPrefix() pass to each
+ * ioctl.
+ */
+#define	HYPRLOFS_IOCTL_CHUNK		4096
+
+/*
+ * Statistics are kept for each of the HYPRLOFS_NCMDS ioctl commands (see
+ * hyprlofs_cmdidx) and for errno values below HYPRLOFS_NERRNO.  Histograms have
+ * one bucket for zero and one for each power of two.
+ */
+#define	HYPRLOFS_NCMDS			4
+#define	HYPRLOFS_NERRNO			256
+#define	HYPRLOFS_HIST_NBUCKETS		64
+
+/*
+ * The largest number of arguments accepted by any of our entry points.
+ */
+#define	HYPRLOFS_MAXARGS		3
+
+#define	HYPRLOFS_METHOD(name, func)	\
+	{ (name), NULL, (func), NULL, NULL, NULL, napi_default, NULL }
+
 class HyprlofsFilesystem;
 
+typedef struct hyprlofs_op hyprlofs_op_t;
+
+/*
+ * A simple chained hash table keyed on strings.  Nodes are allocated by the
+ * consumer (sometimes all at once, as an array) and linked into the table, so
+ * inserting and removing nodes only allocates memory when the bucket array
+ * needs to grow.
+ */
+typedef struct hyprlofs_hnode hyprlofs_hnode_t;
+
+struct hyprlofs_hnode {
+	hyprlofs_hnode_t	*hn_next;	/* next node in bucket */
+	const char		*hn_key;	/* key string */
+	uint32_t		hn_hash;	/* hash of hn_key */
+	void			*hn_value;	/* consumer's value */
+};
+
+typedef struct hyprlofs_htable {
+	hyprlofs_hnode_t	**ht_buckets;	/* bucket array */
+	uint32_t		ht_nbuckets;	/* number of buckets */
+	uint32_t		ht_count;	/* number of nodes */
+} hyprlofs_htable_t;
+
+/*
+ * Objects created with internPaths share the directory parts of the paths in
+ * their indexes via a per-environment table of reference-counted strings,
+ * keyed on the string itself.  The table is itself held by the module and by
+ * each of those objects, and it's only accessed from the event loop context.
+ * Worker threads only ever read strings that their own object holds.
+ */
+typedef struct hyprlofs_istr {
+	hyprlofs_hnode_t	is_node;	/* table linkage */
+	uint_t			is_refs;	/* mappings using this */
+	size_t			is_len;		/* length of is_str */
+	char			is_str[1];	/* the string */
+} hyprlofs_istr_t;
+
+typedef struct hyprlofs_intern {
+	hyprlofs_htable_t	hi_table;	/* string -> hyprlofs_istr_t */
+	uint_t			hi_refs;	/* module and Filesystems */
+} hyprlofs_intern_t;
+
+/*
+ * In "owned" mode, each HyprlofsFilesystem maintains an index of the mappings
+ * it believes to be present on the mount, keyed on alias.  Each mapping is a
+ * single allocation containing both strings.  If the path's directory has been
+ * interned (see hyprlofs_intern_t), hm_dir refers to it, and only the rest of
+ * the path is stored here.  The node's value points back to the mapping
+ * itself.
+ */
+typedef struct hyprlofs_mapping {
+	hyprlofs_hnode_t	hm_node;	/* index linkage */
+	hyprlofs_istr_t		*hm_dir;	/* start of path, or NULL */
+	const char		*hm_path;	/* (rest of) mapped file */
+	char			hm_strs[1];	/* alias, then path */
+} hyprlofs_mapping_t;
+
+/*
+ * Paths whose directory is shorter than this are never interned, since the
+ * reference would save little.
+ */
+#define	HYPRLOFS_INTERN_MIN		16
+
+/*
+ * A MountManager owns a pool of open mountpoint fds shared by the Filesystem
+ * objects created with it, with one entry per mountpoint path.  Each entry is
+ * held by the ioctls currently using its fd.  Entries that aren't held are kept
+ * on an LRU list, and whenever more than hp_maxopen entries are open, the least
+ * recently used idle ones are closed.  Held entries are never closed, so the
+ * number of fds open may briefly exceed hp_maxopen by the number of ioctls in
+ * flight.  An entry that's "defunct" has been removed from the table (because
+ * the fd no longer refers to a hyprlofs mount, or the mount is going away) and
+ * is closed when its last hold is released.
+ *
+ * Pools are used by threadpool threads running ioctls for different mounts at
+ * the same time, so everything in the pool is protected by hp_lock.  The pool
+ * itself is reference-counted by the MountManager and each of its Filesystems,
+ * since any of them may be collected first.
+ */
+typedef struct hyprlofs_poolent hyprlofs_poolent_t;
+
+struct hyprlofs_poolent {
+	hyprlofs_hnode_t	pe_node;	/* table linkage, on pe_path */
+	hyprlofs_poolent_t	*pe_prev;	/* previous idle entry */
+	hyprlofs_poolent_t	*pe_next;	/* next idle entry */
+	int			pe_fd;		/* open mountpoint */
+	uint_t			pe_holds;	/* ioctls using pe_fd */
+	bool			pe_defunct;	/* close when last released */
+	char			pe_path[1];	/* mountpoint path */
+};
+
+typedef struct hyprlofs_pool {
+	pthread_mutex_t		hp_lock;	/* protects all fields */
+	uint_t			hp_refs;	/* manager and Filesystems */
+	uint_t			hp_maxopen;	/* entries to keep open */
+	hyprlofs_htable_t	hp_table;	/* path -> entry */
+	hyprlofs_poolent_t	*hp_lru_head;	/* least recently used */
+	hyprlofs_poolent_t	*hp_lru_tail;	/* most recently used */
+} hyprlofs_pool_t;
+
+/*
+ * A cursor iterates a set of current mappings, which come either from the
+ * kernel (as an array of hyprlofs_curr_entry_t) or from an index.  If
+ * hc_prefix is set, only mappings whose aliases begin with it are returned.
+ */
+typedef struct hyprlofs_cursor {
+	const hyprlofs_curr_entries_t *hc_curr;	/* kernel mappings */
+	uint_t			hc_pos;		/* next position in hc_curr */
+	const hyprlofs_htable_t	*hc_table;	/* index mappings */
+	uint32_t		hc_bucket;	/* next bucket in hc_table */
+	const hyprlofs_hnode_t	*hc_node;	/* next node in hc_table */
+	const char		*hc_prefix;	/* alias prefix, if any */
+	size_t			hc_prefixlen;	/* length of hc_prefix */
+	char			hc_path[MAXPATHLEN]; /* interned path */
+} hyprlofs_cursor_t;
+
+/*
+ * Describes an entry of an add operation in partial or validate mode that could
+ * not be applied: its index within the operation's entries and the reason.
+ */
+typedef struct hyprlofs_failure {
+	uint_t			hf_index;	/* index of entry */
+	int			hf_errno;	/* error */
+} hyprlofs_failure_t;
+
+/*
+ * A unit of work to be run off the event loop, which is handed either to Node's
+ * threadpool (as hw_work) or to a private ThreadPool.  Either way, hw_complete
+ * must call hyprlofs_work_done before doing anything else.
+ */
+typedef struct hyprlofs_tpool hyprlofs_tpool_t;
+typedef struct hyprlofs_work hyprlofs_work_t;
+
+struct hyprlofs_work {
+	napi_async_work		hw_work;	/* Node's work, if any */
+	hyprlofs_work_t		*hw_next;	/* next in tpool's lists */
+	napi_async_execute_callback hw_execute;	/* runs off event loop */
+	napi_async_complete_callback hw_complete; /* runs in event loop */
+	void			*hw_arg;	/* argument to both */
+	bool			hw_background;	/* background priority */
+};
+
+/*
+ * A ThreadPool is a private set of threads for running hyprlofs operations, so
+ * that they neither wait behind nor delay other work on Node's threadpool.
+ * Work is queued on tp_queue, and as each item is finished it's moved to
+ * tp_done, and the event loop is notified via tp_tsfn to run its completion
+ * callback.  tp_outstanding counts the work that's been submitted but not yet
+ * completed, and while it's non-zero, tp_tsfn keeps the event loop alive.
+ * Interactive work is queued ahead of background work: tp_queue_fg is the last
+ * interactive item in tp_queue, if any.  Unless the pool has only one thread,
+ * one thread is always left for interactive work, so background work (which
+ * may be waiting for a rate limit) never occupies every thread.
+ *
+ * A pool belongs to the environment that created it.  tp_refs and
+ * tp_outstanding are only used in its event loop context.  Everything else
+ * that's not immutable is protected by tp_lock.
+ */
+struct hyprlofs_tpool {
+	napi_env		tp_env;		/* owning environment */
+	napi_threadsafe_function tp_tsfn;	/* notifies event loop */
+	napi_ref		tp_resource;	/* async resource */
+	napi_async_context	tp_context;	/* for completions */
+	pthread_t		*tp_threads;	/* worker threads */
+	uint_t			tp_nthreads;	/* number of threads */
+	uint_t			tp_refs;	/* references */
+	uint_t			tp_outstanding;	/* submitted, not completed */
+
+	pthread_mutex_t		tp_lock;	/* protects fields below */
+	pthread_cond_t		tp_workcv;	/* work queued or exiting */
+	pthread_cond_t		tp_donecv;	/* work finished */
+	bool			tp_exiting;	/* pool being destroyed */
+	hyprlofs_work_t		*tp_queue;	/* work not yet started */
+	hyprlofs_work_t		*tp_queue_tail;	/* last in tp_queue */
+	hyprlofs_work_t		*tp_queue_fg;	/* last interactive work */
+	hyprlofs_work_t		*tp_done;	/* work to be completed */
+	hyprlofs_work_t		*tp_done_tail;	/* last in tp_done */
+	uint_t			tp_nqueued;	/* length of tp_queue */
+	uint_t			tp_nrunning;	/* work being run */
+	uint_t			tp_nbackground;	/* background work running */
+	uint_t			tp_maxqueued;	/* high-water tp_nqueued */
+	uint64_t		tp_nsubmitted;	/* total work submitted */
+	uint64_t		tp_ncompleted;	/* total work finished */
+};
+
+/*
+ * A histogram of the values passed to hyprlofs_hist_add.  Bucket 0 counts zero
+ * values, and bucket i > 0 counts values from 2^(i-1) to 2^i - 1, as for
+ * DTrace's quantize().
+ */
+typedef struct hyprlofs_hist {
+	uint64_t		hh_count;	/* number of values */
+	uint64_t		hh_sum;		/* sum of values */
+	uint64_t		hh_buckets[HYPRLOFS_HIST_NBUCKETS];
+} hyprlofs_hist_t;
+
+/*
+ * Statistics for a single operation.  The worker thread running the operation
+ * updates the ioctl fields, and hyprlofs_stats_record folds the whole thing
+ * into the object's and environment's hyprlofs_stats_t when it completes.
+ */
+typedef struct hyprlofs_opstats {
+	hrtime_t		hos_queued;	/* when requested */
+	hrtime_t		hos_dispatched;	/* when dispatched */
+	hrtime_t		hos_marshal;	/* time marshalling entries */
+	hrtime_t		hos_ioctl;	/* time in ioctls */
+	hrtime_t		hos_throttled;	/* time rate-limited */
+	uint_t			hos_nioctls[HYPRLOFS_NCMDS]; /* by command */
+	uint_t			hos_e2big;	/* GET retries */
+} hyprlofs_opstats_t;
+
+/*
+ * Cumulative statistics for a Filesystem or for all of the Filesystems in an
+ * environment.  These are only accessed in the event loop context.  Times are
+ * in nanoseconds.  See README.md.
+ */
+typedef struct hyprlofs_stats {
+	uint64_t		hs_nops;	/* operations completed */
+	uint64_t		hs_nioctls[HYPRLOFS_NCMDS]; /* by command */
+	uint64_t		hs_e2big;	/* GET retries */
+	uint64_t		hs_errors[HYPRLOFS_NERRNO]; /* by errno */
+	hyprlofs_hist_t		hs_entries;	/* entries per operation */
+	hyprlofs_hist_t		hs_queued;	/* time queued */
+	hyprlofs_hist_t		hs_marshal;	/* time marshalling */
+	hyprlofs_hist_t		hs_ioctl;	/* time in ioctls */
+	hyprlofs_hist_t		hs_throttled;	/* time rate-limited */
+} hyprlofs_stats_t;
+
+/*
+ * External strings aren't part of Node-API version 8, but newer versions of
+ * Node provide node_api_create_external_string_latin1 anyway, so we look for it
+ * at runtime.  This is its signature.
+ */
+typedef napi_status (*hyprlofs_extstr_f)(napi_env, char *, size_t,
+    napi_finalize, void *, napi_value *, bool *);
+
+/*
+ * Packed mappings backing external strings are freed when the last of those
+ * strings (and the listing itself) lets go of them.
+ */
+typedef struct hyprlofs_xbuf {
+	uint_t			hx_refs;	/* strings, plus the listing */
+	char			*hx_data;	/* packed mappings */
+} hyprlofs_xbuf_t;
+
+/*
+ * Per-environment state for this module.
+ */
+typedef struct hyprlofs_module {
+	hyprlofs_tpool_t	*hm_tpool;	/* default ThreadPool */
+	hyprlofs_stats_t	hm_stats;	/* all Filesystems */
+	hyprlofs_intern_t	*hm_intern;	/* shared dirs, if created */
+	hyprlofs_extstr_f	hm_extstr;	/* external strings, if any */
+} hyprlofs_module_t;
+
+/*
+ * One of several threadpool jobs validating the paths of entries "hsj_start"
+ * through "hsj_start + hsj_count - 1" of an add operation.
+ */
+typedef struct hyprlofs_statjob {
+	hyprlofs_work_t		hsj_work;	/* threadpool work */
+	hyprlofs_op_t		*hsj_op;	/* operation */
+	uint_t			hsj_start;	/* first entry */
+	uint_t			hsj_count;	/* number of entries */
+} hyprlofs_statjob_t;
+
+/*
+ * An addMappingsMulti request is carried out as a separate add operation on
+ * each of its filesystems, all of which share the same entries (hg_entries),
+ * marshalled once.  The kernel only reads the entries, so several worker
+ * threads may pass them to their ioctls at the same time.  As each operation
+ * completes, its result is stored at its index in hg_errors, and when the last
+ * one has completed, the caller is told about all of them at once.  This is
+ * only accessed in the event loop context.
+ */
+typedef struct hyprlofs_group {
+	hyprlofs_entries_t	*hg_entries;	/* shared entries */
+	uint_t			hg_pending;	/* operations outstanding */
+	uint_t			hg_nfailed;	/* operations failed */
+	napi_ref		hg_errors;	/* result of each operation */
+	napi_ref		hg_callback;	/* user callback, if any */
+	napi_deferred		hg_deferred;	/* else, settles promise */
+} hyprlofs_group_t;
+
+/*
+ * The arguments to one of our entry points.  Arguments that weren't supplied
+ * (up to HYPRLOFS_MAXARGS) are undefined.
+ */
+typedef struct hyprlofs_args {
+	size_t			ha_argc;	/* number supplied */
+	napi_value		ha_argv[HYPRLOFS_MAXARGS]; /* arguments */
+	napi_value		ha_this;	/* receiver */
+} hyprlofs_args_t;
+
+/*
+ * A budget for marshalling the mappings of a single operation: at most
+ * hy_entries mappings or hy_usec microseconds of work per event loop
+ * iteration, whichever comes first.  Zero means no limit, and an operation
+ * with no limits at all is marshalled at once.  See hyprlofs_op_marshal.
+ */
+typedef struct hyprlofs_yield {
+	uint_t			hy_entries;	/* mappings per iteration */
+	uint_t			hy_usec;	/* time per iteration */
+} hyprlofs_yield_t;
+
+/*
+ * Each operation belongs to a priority class.  Interactive operations are run
+ * ahead of background ones that haven't started yet on a private ThreadPool,
+ * and on their own object when they're independent (see queueAhead), and
+ * they're never throttled.  Background operations wait for rate limits (see
+ * hyprlofs_bucket_t).  Operations that add or remove mappings default to the
+ * class their object was created with.
+ */
+typedef enum hyprlofs_pri {
+	HYPRLOFS_PRI_DEFAULT = 0,		/* object's default */
+	HYPRLOFS_PRI_INTERACTIVE,		/* run ahead */
+	HYPRLOFS_PRI_BACKGROUND			/* yield and throttle */
+} hyprlofs_pri_t;
+
+/*
+ * A token bucket limiting the number of mappings added or removed per second
+ * to hb_rate, with bursts of up to a second's worth.  Background operations
+ * wait for enough tokens before each ioctl, while interactive ones just take
+ * what they use, which may leave the bucket in debt.  An hb_rate of zero means
+ * no limit.  These are used from worker threads.
+ */
+typedef struct hyprlofs_bucket {
+	pthread_mutex_t		hb_lock;	/* protects fields below */
+	uint32_t		hb_rate;	/* entries per second */
+	double			hb_tokens;	/* entries available */
+	hrtime_t		hb_last;	/* when last refilled */
+} hyprlofs_bucket_t;
+
+/*
+ * All of the mounts in the process share this rate limit, set by
+ * setRateLimit.  It starts out unlimited.
+ */
+static hyprlofs_bucket_t hyprlofs_bucket = {
+	PTHREAD_MUTEX_INITIALIZER, 0, 0, 0
+};
+
+/*
+ * Mounts, unmounts, and ioctls go through a backend: either the kernel, or an
+ * in-memory emulation of hyprlofs (the "mock" backend) for exercising and
+ * benchmarking the bindings where hyprlofs isn't available.  The whole process
+ * uses the same backend, which is set with setBackend.  Like the system calls
+ * they stand in for, these functions return -1 with errno set on failure.
+ */
+typedef struct hyprlofs_backend {
+	const char	*hbk_name;			/* for setBackend */
+	int		(*hbk_mount)(const char *, char *, int); /* mount(2) */
+	int		(*hbk_umount)(const char *);	/* umount(2) */
+	int		(*hbk_ioctl)(int, int, void *);	/* ioctl(2) */
+} hyprlofs_backend_t;
+
+/*
+ * The mock backend keeps a list of mounts, each with a table of its mappings
+ * keyed on name.  Mounts are identified by the device and inode of their
+ * mountpoint, so that an ioctl on an fd for the mountpoint finds its mount
+ * without the mock having to keep track of fds.
+ */
+typedef struct hyprlofs_mockent {
+	hyprlofs_hnode_t	hme_node;	/* in hmm_entries */
+	char			*hme_path;	/* mapped file (after hme_name) */
+	char			hme_name[1];	/* name in the mount */
+} hyprlofs_mockent_t;
+
+typedef struct hyprlofs_mockmnt hyprlofs_mockmnt_t;
+
+struct hyprlofs_mockmnt {
+	hyprlofs_mockmnt_t	*hmm_next;	/* next mount */
+	dev_t			hmm_dev;	/* mountpoint's device */
+	ino_t			hmm_ino;	/* mountpoint's inode */
+	hyprlofs_htable_t	hmm_entries;	/* mappings by name */
+};
+
+/*
+ * A fault for the mock backend to inject: after letting hf_after requests for
+ * command hf_cmd (an ioctl command, HYPRLOFS_MOCK_MOUNT, or HYPRLOFS_MOCK_UMOUNT)
+ * through, the next hf_count of them fail with hf_errno.  Each fault counts
+ * matching requests separately, and the first one to fire fails the request.
+ */
+#define	HYPRLOFS_MOCK_MOUNT	(-1)
+#define	HYPRLOFS_MOCK_UMOUNT	(-2)
+
+typedef struct hyprlofs_fault {
+	int			hf_cmd;		/* command to fail */
+	int			hf_errno;	/* error to fail with */
+	uint32_t		hf_after;	/* requests still to allow */
+	uint32_t		hf_count;	/* requests still to fail */
+} hyprlofs_fault_t;
+
+/*
+ * The mock backend's state is shared by the whole process, like the kernel's.
+ * Each request is delayed by hk_latency microseconds, plus hk_entrylat
+ * nanoseconds for each entry passed.  hk_lock protects everything here, but
+ * isn't held while a request is delayed.
+ */
+typedef struct hyprlofs_mock {
+	pthread_mutex_t		hk_lock;	/* protects fields below */
+	hyprlofs_mockmnt_t	*hk_mounts;	/* list of mounts */
+	uint32_t		hk_latency;	/* usec per request */
+	uint32_t		hk_entrylat;	/* nsec per entry */
+	hyprlofs_fault_t	*hk_faults;	/* faults to inject */
+	uint_t			hk_nfaults;	/* length of hk_faults */
+} hyprlofs_mock_t;
+
+static hyprlofs_mock_t hyprlofs_mock = {
+	PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, NULL, 0
+};
+
+/*
+ * A change recorded in a Filesystem's journal (see hfs_journal).  hj_type is
+ * one of "add", "remove", "clear", or "reset".  hj_alias and hj_path, either of
+ * which may be NULL, share a single allocation headed by hj_alias.
+ */
+typedef struct hyprlofs_jrec {
+	uint64_t		hj_seq;		/* sequence number */
+	const char		*hj_type;	/* kind of change */
+	char			*hj_alias;	/* alias, if any */
+	char			*hj_path;	/* file, if any */
+} hyprlofs_jrec_t;
+
+/*
+ * Each asynchronous operation requested by a caller is described by a
+ * hyprlofs_op_t.  Operations are queued on their HyprlofsFilesystem in the
+ * order they were requested and dispatched one at a time.  The fields below
+ * the callback (or promise) are written only by the worker thread while the
+ * operation is running, and read back in the event loop context once it has
+ * completed.
+ */
+struct hyprlofs_op {
+	hyprlofs_op_t		*hop_next;	/* next queued operation */
+	HyprlofsFilesystem	*hop_hfs;	/* owning filesystem */
+	napi_env		hop_env;	/* requesting environment */
+	hyprlofs_work_t		hop_work;	/* threadpool work */
+	void			(*hop_run)(hyprlofs_op_t *); /* worker */
+	napi_ref		hop_callback;	/* user callback, if any */
+	napi_deferred		hop_deferred;	/* else, settles promise */
+	hyprlofs_opstats_t	hop_stats;	/* see hyprlofs_stats_record */
+
+	/* ioctl-specific operation state */
+	int			hop_ioctl_cmd;	/* ioctl cmd, or -1 */
+	void			*hop_ioctl_arg;	/* ioctl arg */
+
+	/*
+	 * Mount-specific state.  hop_mountopts is the option string passed to
+	 * mount(2), which the kernel overwrites with the options in effect.
+	 * hop_mounthint is the number of mappings the caller expects the mount
+	 * to hold, or 0.
+	 */
+	char			*hop_mountopts;	/* mount options */
+	uint_t			hop_mounthint;	/* expected mappings */
+
+	/*
+	 * Snapshot-specific state.  hop_file is the file written by snapshot()
+	 * or read by restore().  restore() maps the file at hop_map, and the
+	 * entries in hop_ioctl_arg point into it.  hop_errpath, if set, is
+	 * reported as the path of a failure instead of the mountpoint.
+	 */
+	char			*hop_file;	/* snapshot file */
+	void			*hop_map;	/* mapped snapshot */
+	size_t			hop_maplen;	/* size of hop_map */
+	uint_t			hop_restorechunk; /* mappings per ioctl */
+	const char		*hop_errpath;	/* path for errors */
+
+	/*
+	 * For listByPrefix and removeByPrefix, only mappings whose aliases
+	 * begin with hop_prefix are considered.  See hyprlofs_op_filter.
+	 */
+	char			*hop_prefix;	/* alias prefix, or NULL */
+
+	/* result state */
+	char			hop_opname[32];	/* operation name */
+	int			hop_rv;		/* async rv */
+	int			hop_errno;	/* async errno */
+
+	/*
+	 * Operations that fetch the current mappings store them in
+	 * hop_curr_ents when they come from the kernel.  Either way,
+	 * hop_cursor is initialized to iterate them, and hop_count is the
+	 * number of mappings.
+	 */
+	hyprlofs_curr_entries_t	hop_curr_ents;	/* current mappings */
+	hyprlofs_cursor_t	hop_cursor;	/* iterates mappings */
+	uint_t			hop_count;	/* number of mappings */
+
+	/*
+	 * For listings delivered in chunks, hop_chunksize is the maximum
+	 * number of mappings passed to each call of hop_onchunk, and
+	 * hop_chunkdone is the number delivered so far.  See listChunk().
+	 */
+	uint_t			hop_chunksize;	/* mappings per chunk, or 0 */
+	uint_t			hop_chunkdone;	/* mappings delivered */
+	napi_ref		hop_onchunk;	/* user chunk callback */
+
+	/*
+	 * For listings returned in packed form, the worker thread converts the
+	 * mappings into hop_packbuf, a sequence of NUL-terminated strings in
+	 * the same format accepted by addMappingsBuffer, and hop_packoffs, the
+	 * offsets of each of those strings.  Ownership of both passes to the
+	 * Buffers handed back to the user.  Listings with format "external"
+	 * are packed the same way, but returned as arrays of strings that may
+	 * refer to hop_packbuf (see hyprlofs_mappings_external).
+	 */
+	bool			hop_packed;	/* pack the mappings */
+	bool			hop_external;	/* then return strings */
+	char			*hop_packbuf;	/* packed strings */
+	size_t			hop_packlen;	/* size of hop_packbuf */
+	uint32_t		*hop_packoffs;	/* offset of each string */
+
+	/*
+	 * When several queued add or remove operations are coalesced into a
+	 * single ioctl, the first of them is dispatched with hop_merged
+	 * describing the union of all of their entries, and the rest are
+	 * chained from it via hop_coalesced.  Each operation keeps its own
+	 * hop_ioctl_arg and gets its own result.
+	 */
+	hyprlofs_op_t		*hop_coalesced;	/* next op in this ioctl */
+	hyprlofs_entries_t	*hop_merged;	/* combined entries */
+
+	/*
+	 * Operations issued on behalf of an addMappingsMulti request belong to
+	 * hop_group, which owns their entries (hop_ioctl_arg) and reports
+	 * their results (see hyprlofs_group_done).
+	 */
+	hyprlofs_group_t	*hop_group;	/* owning request, if any */
+	uint_t			hop_groupidx;	/* index within hop_group */
+
+	/*
+	 * If hop_pri is HYPRLOFS_PRI_DEFAULT when the operation is queued, it's
+	 * replaced with the object's default for operations that add or
+	 * remove mappings, and with HYPRLOFS_PRI_INTERACTIVE for the rest (see
+	 * async()).
+	 */
+	hyprlofs_pri_t		hop_pri;	/* priority class */
+
+	/*
+	 * Operations with a marshalling budget (hop_yield) convert the
+	 * caller's array (hop_marshalsrc) into hop_ioctl_arg one piece per
+	 * event loop iteration.  The operation is queued in the meantime, but
+	 * isn't dispatched until hop_marshalling is cleared.  Each mapping is
+	 * visited twice, as in hyprlofs_entries_populate: hop_marshalpass is 0
+	 * while recording the lengths of the strings and 1 while copying them
+	 * to hop_marshalstrp.  hop_marshalnext is the next mapping to visit.
+	 */
+	hyprlofs_yield_t	hop_yield;	/* marshalling budget */
+	bool			hop_marshalling; /* not yet marshalled */
+	uint_t			hop_marshalpass; /* current pass */
+	uint_t			hop_marshalnext; /* next mapping */
+	size_t			hop_marshalbytes; /* string storage needed */
+	char			*hop_marshalstrp; /* next string */
+	napi_ref		hop_marshalsrc;	/* source array */
+
+	/*
+	 * For operations whose entries point directly into a caller-supplied
+	 * Buffer, we hold a reference to the Buffer until the operation
+	 * completes.
+	 */
+	napi_ref		hop_buffer;	/* backing Buffer */
+
+	/*
+	 * Add and remove operations with a chunkSize are issued as a series of
+	 * ioctls of at most hop_batchsize entries each, with each ioctl handed
+	 * to the threadpool separately.  hop_ioctl_arg holds the chunk being
+	 * applied.  While that's happening, the next chunk is marshalled from
+	 * hop_batchsrc (or hop_buffer, starting at hop_batchbufoff) into
+	 * hop_batchnext, so marshalling overlaps with the kernel's work.
+	 */
+	uint_t			hop_batchsize;	/* entries per chunk, or 0 */
+	uint_t			hop_batchtotal;	/* total entries */
+	uint_t			hop_batchdone;	/* entries applied */
+	uint_t			hop_batchqueued; /* entries marshalled */
+	size_t			hop_batchbufoff; /* next chunk in hop_buffer */
+	hyprlofs_entries_t	*hop_batchnext;	/* next chunk, if marshalled */
+	napi_ref		hop_batchsrc;	/* source array */
+	napi_ref		hop_onprogress;	/* progress callback */
+
+	/*
+	 * Add operations in partial mode skip entries that can't be applied
+	 * rather than failing as a whole.  In validate mode, the paths of all
+	 * entries are first checked by several concurrent threadpool jobs
+	 * (hop_statjobs), which record the result for each entry in
+	 * hop_staterrs, and entries whose paths are invalid are skipped.  In
+	 * either case, the worker records each skipped entry (in order) in
+	 * hop_failures, and these are converted back in the event loop into the
+	 * [path, alias, errno] tuples accumulated in hop_failed.
+	 */
+	bool			hop_partial;	/* partial mode */
+	bool			hop_validate;	/* validate mode */
+	hyprlofs_statjob_t	*hop_statjobs;	/* validation jobs */
+	uint_t			hop_statpending; /* jobs outstanding */
+	int			*hop_staterrs;	/* stat(2) result by entry */
+	hyprlofs_failure_t	*hop_failures;	/* entries not applied */
+	uint_t			hop_nfailures;	/* length of hop_failures */
+	napi_ref		hop_failed;	/* failures, for JavaScript */
+
+	/*
+	 * setMappings-specific state.  hop_set_rm and hop_set_add are the
+	 * changes that were applied, which are kept until the operation
+	 * completes so that they can be applied to the index, too.
+	 */
+	uint_t			hop_nadded;	/* mappings added */
+	uint_t			hop_nremoved;	/* mappings removed */
+	hyprlofs_entries_t	*hop_set_rm;	/* mappings removed */
+	hyprlofs_entries_t	*hop_set_add;	/* mappings added */
+
+	/*
+	 * In owned mode, if a change to the mount fails, it's not clear which
+	 * parts of it were applied, so the worker fetches the mappings from the
+	 * kernel into hop_resync_ents in order to rebuild the index.
+	 */
+	bool			hop_resynced;	/* hop_resync_ents valid */
+	hyprlofs_curr_entries_t	hop_resync_ents; /* mappings for index */
+};
+
 static const char *hyprlofs_cmdname(int);
-static hyprlofs_entries_t *hyprlofs_entries_populate_add(const Local<Array>&);
-static hyprlofs_entries_t *hyprlofs_entries_populate_remove(
-    const Local<Array>&);
+static int hyprlofs_cmdidx(int);
+static int hyprlofs_entry_measure(napi_env, napi_value, uint_t, bool,
+    hyprlofs_entry_t *);
+static char *hyprlofs_entry_copy(napi_env, napi_value, uint_t, bool, bool,
+    hyprlofs_entry_t *, char *);
+static size_t hyprlofs_entry_strsize(const hyprlofs_entry_t *, bool);
+static hyprlofs_entries_t *hyprlofs_entries_populate(napi_env, napi_value,
+    bool, uint_t, uint_t);
+static hyprlofs_entries_t *hyprlofs_entries_populate_add(napi_env, napi_value,
+    uint_t, uint_t);
+static hyprlofs_entries_t *hyprlofs_entries_populate_remove(napi_env,
+    napi_value, uint_t, uint_t);
+static int hyprlofs_buffer_count(const char *, size_t, bool, uint_t *);
+static hyprlofs_entries_t *hyprlofs_entries_populate_buffer(char *, size_t,
+    bool, uint_t, size_t *);
+static hyprlofs_entries_t *hyprlofs_entries_alloc(uint_t);
+static hyprlofs_entries_t *hyprlofs_entries_grow(hyprlofs_entries_t *, size_t,
+    char **);
+static char *hyprlofs_entries_copystr(napi_env, char *, napi_value, size_t);
 static void hyprlofs_entries_free(hyprlofs_entries_t *);
+static hyprlofs_op_t *hyprlofs_op_alloc(napi_env, void (*)(hyprlofs_op_t *),
+    napi_value);
+static void hyprlofs_op_free(hyprlofs_op_t *);
+static void hyprlofs_group_done(napi_env, hyprlofs_group_t *, uint_t,
+    napi_value);
+static uint_t hyprlofs_op_nentries(const hyprlofs_op_t *);
+static int hyprlofs_op_marshal_start(hyprlofs_op_t *, napi_value, uint_t,
+    const hyprlofs_yield_t *);
+static int hyprlofs_op_marshal(hyprlofs_op_t *);
+static const char *hyprlofs_yield_parse(napi_env, napi_value,
+    hyprlofs_yield_t *);
+static void hyprlofs_stats_record(hyprlofs_stats_t *, const hyprlofs_op_t *);
+static void hyprlofs_hist_add(hyprlofs_hist_t *, uint64_t);
+static napi_value hyprlofs_stats_object(napi_env, const hyprlofs_stats_t *);
+static napi_value hyprlofs_hist_object(napi_env, const hyprlofs_hist_t *);
+static napi_value hyprlofs_module_stats(napi_env, napi_callback_info);
+static uint_t hyprlofs_batch_len(uint_t, uint_t);
+static void hyprlofs_op_batch(hyprlofs_op_t *, uint_t, uint_t, napi_value);
+static void hyprlofs_op_batch_prepare(hyprlofs_op_t *);
+static bool hyprlofs_op_applied(const hyprlofs_op_t *,
+    const hyprlofs_curr_entries_t *);
+static bool hyprlofs_entry_applied(const hyprlofs_entry_t *, int,
+    const hyprlofs_curr_entries_t *);
+static bool hyprlofs_op_checked(const hyprlofs_op_t *);
+static void hyprlofs_op_failures(hyprlofs_op_t *);
+static int hyprlofs_failure_cmp(const void *, const void *);
+static int hyprlofs_curr_entry_cmp(const void *, const void *);
+static uint_t hyprlofs_get_headroom(uint_t);
+static int hyprlofs_mappings_pack(hyprlofs_op_t *);
+static void hyprlofs_op_filter(hyprlofs_op_t *);
+static int hyprlofs_file_write(const char *, const char *, size_t,
+    const char **);
+static void hyprlofs_buffer_free(napi_env, void *, void *);
+static napi_value hyprlofs_mappings_external(napi_env, hyprlofs_op_t *);
+static napi_value hyprlofs_xbuf_string(napi_env, hyprlofs_extstr_f,
+    hyprlofs_xbuf_t *, char *);
+static void hyprlofs_xbuf_rele(hyprlofs_xbuf_t *);
+static void hyprlofs_xbuf_free(napi_env, void *, void *);
+static napi_value hyprlofs_mappings_array(napi_env, hyprlofs_cursor_t *,
+    uint_t);
+static bool hyprlofs_path_matches(const char *, const char *, size_t);
+static void hyprlofs_cursor_init_curr(hyprlofs_cursor_t *,
+    const hyprlofs_curr_entries_t *);
+static void hyprlofs_cursor_init_index(hyprlofs_cursor_t *,
+    const hyprlofs_htable_t *);
+static bool hyprlofs_cursor_step(hyprlofs_cursor_t *, const char **,
+    const char **);
+static bool hyprlofs_cursor_next(hyprlofs_cursor_t *, const char **,
+    const char **);
+static int hyprlofs_htable_init(hyprlofs_htable_t *, uint32_t);
+static int hyprlofs_htable_reserve(hyprlofs_htable_t *, uint32_t);
+static void hyprlofs_htable_fini(hyprlofs_htable_t *);
+static hyprlofs_hnode_t *hyprlofs_htable_lookup(const hyprlofs_htable_t *,
+    const char *);
+static void hyprlofs_htable_insert(hyprlofs_htable_t *, hyprlofs_hnode_t *);
+static hyprlofs_hnode_t *hyprlofs_htable_remove(hyprlofs_htable_t *,
+    const char *);
+static int hyprlofs_index_put(hyprlofs_htable_t *, hyprlofs_intern_t *,
+    const char *, size_t, const char *, size_t);
+static void hyprlofs_index_delete(hyprlofs_htable_t *, hyprlofs_intern_t *,
+    const char *);
+static void hyprlofs_index_clear(hyprlofs_htable_t *, hyprlofs_intern_t *);
+static int hyprlofs_index_load(hyprlofs_htable_t *, hyprlofs_intern_t *,
+    hyprlofs_cursor_t *);
+static void hyprlofs_mapping_free(hyprlofs_intern_t *, hyprlofs_mapping_t *);
+static hyprlofs_intern_t *hyprlofs_intern_create(void);
+static void hyprlofs_intern_hold(hyprlofs_intern_t *);
+static void hyprlofs_intern_rele(hyprlofs_intern_t *);
+static hyprlofs_istr_t *hyprlofs_intern_get(hyprlofs_intern_t *, const char *,
+    size_t);
+static void hyprlofs_intern_put(hyprlofs_intern_t *, hyprlofs_istr_t *);
+static int hyprlofs_open(const char *);
+static hyprlofs_pool_t *hyprlofs_pool_create(uint_t);
+static void hyprlofs_pool_hold(hyprlofs_pool_t *);
+static void hyprlofs_pool_rele(hyprlofs_pool_t *);
+static int hyprlofs_pool_get(hyprlofs_pool_t *, const char *,
+    hyprlofs_poolent_t **);
+static void hyprlofs_pool_put(hyprlofs_pool_t *, hyprlofs_poolent_t *, bool);
+static void hyprlofs_pool_purge(hyprlofs_pool_t *, const char *);
+static napi_value hyprlofs_mgr_new(napi_env, napi_callback_info);
+static void hyprlofs_mgr_finalize(napi_env, void *, void *);
+static napi_value hyprlofs_tpool_new(napi_env, napi_callback_info);
+static void hyprlofs_tpool_finalize(napi_env, void *, void *);
+static napi_value hyprlofs_tpool_stats(napi_env, napi_callback_info);
+static napi_value hyprlofs_set_tpool(napi_env, napi_callback_info);
+static napi_value hyprlofs_set_rate(napi_env, napi_callback_info);
+static const char *hyprlofs_pri_parse(napi_env, napi_value, hyprlofs_pri_t *);
+static const char *hyprlofs_rate_parse(napi_env, napi_value, uint32_t *);
+static void hyprlofs_bucket_set(hyprlofs_bucket_t *, uint32_t);
+static uint32_t hyprlofs_bucket_rate(hyprlofs_bucket_t *);
+static hrtime_t hyprlofs_bucket_take(hyprlofs_bucket_t *, uint_t, bool);
+static hyprlofs_work_t *hyprlofs_tpool_next(hyprlofs_tpool_t *);
+static napi_value hyprlofs_set_backend(napi_env, napi_callback_info);
+static const char *hyprlofs_fault_parse(napi_env, napi_value,
+    hyprlofs_fault_t *);
+static int hyprlofs_kernel_mount(const char *, char *, int);
+static int hyprlofs_kernel_umount(const char *);
+static int hyprlofs_kernel_ioctl(int, int, void *);
+static int hyprlofs_mock_mount(const char *, char *, int);
+static int hyprlofs_mock_umount(const char *);
+static int hyprlofs_mock_ioctl(int, int, void *);
+static int hyprlofs_mock_enter(int, uint_t);
+static hyprlofs_mockmnt_t **hyprlofs_mock_find(dev_t, ino_t);
+static int hyprlofs_mock_prepare(const hyprlofs_entries_t *,
+    hyprlofs_mockent_t ***, uint_t *);
+static void hyprlofs_mock_add(hyprlofs_mockmnt_t *, hyprlofs_mockent_t **,
+    uint_t);
+static int hyprlofs_mock_remove(hyprlofs_mockmnt_t *,
+    const hyprlofs_entries_t *);
+static int hyprlofs_mock_get(hyprlofs_mockmnt_t *, hyprlofs_curr_entries_t *);
+static void hyprlofs_mock_clear(hyprlofs_mockmnt_t *);
+static bool hyprlofs_mock_name_valid(const char *);
+static void hyprlofs_module_finalize(napi_env, void *, void *);
+static hyprlofs_tpool_t *hyprlofs_tpool_create(napi_env, uint_t);
+static void hyprlofs_tpool_destroy(hyprlofs_tpool_t *);
+static void hyprlofs_tpool_hold(hyprlofs_tpool_t *);
+static void hyprlofs_tpool_rele(hyprlofs_tpool_t *);
+static void hyprlofs_tpool_submit(hyprlofs_tpool_t *, hyprlofs_work_t *);
+static void *hyprlofs_tpool_thread(void *);
+static void hyprlofs_tpool_drain(hyprlofs_tpool_t *);
+static void hyprlofs_tpool_notify(napi_env, napi_value, void *, void *);
+static void hyprlofs_tpool_cleanup(void *);
+
+static void hyprlofs_args_get(napi_env, napi_callback_info, hyprlofs_args_t *);
+static void *hyprlofs_unwrap(napi_env, napi_value, const napi_type_tag *);
+static napi_value hyprlofs_throw(napi_env, const char *);
+static napi_value hyprlofs_errno_error(napi_env, int, const char *,
+    const char *);
+static const char *hyprlofs_errname(int, char *, size_t);
+static void hyprlofs_call(napi_env, napi_value, size_t, napi_value *);
+static void hyprlofs_work_queue(napi_env, hyprlofs_tpool_t *, hyprlofs_work_t *,
+    napi_async_execute_callback, napi_async_complete_callback, void *);
+static void hyprlofs_work_done(napi_env, hyprlofs_work_t *);
+static void hyprlofs_work_noop(napi_env, void *);
+static napi_ref hyprlofs_ref(napi_env, napi_value);
+static napi_value hyprlofs_deref(napi_env, napi_ref);
+static void hyprlofs_unref(napi_env, napi_ref *);
+static napi_valuetype hyprlofs_typeof(napi_env, napi_value);
+static bool hyprlofs_is_array(napi_env, napi_value);
+static bool hyprlofs_is_buffer(napi_env, napi_value);
+static bool hyprlofs_truthy(napi_env, napi_value);
+static bool hyprlofs_get_uint32(napi_env, napi_value, uint32_t *);
+static uint32_t hyprlofs_array_length(napi_env, napi_value);
+static void hyprlofs_buffer_data(napi_env, napi_value, char **, size_t *);
+static napi_value hyprlofs_buffer_give(napi_env, void *, size_t);
+static int hyprlofs_strlen(napi_env, napi_value, uint_t *);
+static char *hyprlofs_strdup(napi_env, napi_value);
+static napi_value hyprlofs_get(napi_env, napi_value, const char *);
+static void hyprlofs_set(napi_env, napi_value, const char *, napi_value);
+static napi_value hyprlofs_string(napi_env, const char *, size_t);
+static napi_value hyprlofs_uint(napi_env, uint32_t);
+static napi_value hyprlofs_double(napi_env, double);
+static napi_value hyprlofs_array(napi_env, uint32_t);
+static napi_value hyprlofs_null(napi_env);
+static napi_value hyprlofs_undefined(napi_env);
+
+/*
+ * The backends.  The first one is the default, even in builds without hyprlofs,
+ * so that nothing uses the mock without asking for it.
+ */
+static const hyprlofs_backend_t hyprlofs_backends[] = {
+	{ "kernel", hyprlofs_kernel_mount, hyprlofs_kernel_umount,
+	    hyprlofs_kernel_ioctl },
+	{ "mock", hyprlofs_mock_mount, hyprlofs_mock_umount,
+	    hyprlofs_mock_ioctl }
+};
+
+static const hyprlofs_backend_t *hyprlofs_backend = &hyprlofs_backends[0];
 
 /*
  * The HyprlofsFilesystem is the nexus of administration.  Users construct an
  * instance of this object to operate on any hyprlofs mount, and then invoke
  * methods to add, remove, or clear mappings.  See README.md for details.
  */
-class HyprlofsFilesystem : node::ObjectWrap {
+class HyprlofsFilesystem {
 public:
-	static void Initialize(Handle<Object> target);
+	static napi_value Initialize(napi_env, napi_value);
 
 protected:
-	HyprlofsFilesystem(const char *, bool);
+	HyprlofsFilesystem(napi_env, const char *, bool, bool,
+	    hyprlofs_pool_t *, hyprlofs_tpool_t *);
 	~HyprlofsFilesystem();
 
-	void async(void (*)(uv_work_t *), Local<Value>);
-	void doIoctl(int, void *);
+	void Ref();
+	void Unref();
+	static void Finalize(napi_env, void *, void *);
 
-	static void eioAsyncFini(uv_work_t *);
-	static void eioIoctlRun(uv_work_t *);
-	static void eioIoctlGetRun(uv_work_t *);
-	static void eioMountRun(uv_work_t *);
-	static void eioUmountRun(uv_work_t *);
+	napi_value async(hyprlofs_op_t *);
+	void dispatch();
+	void submit(hyprlofs_op_t *);
+	void coalesce(hyprlofs_op_t *);
+	bool chainable(const hyprlofs_op_t *, hyprlofs_htable_t *,
+	    hyprlofs_hnode_t *, uint_t *);
+	static bool coalescable(const hyprlofs_op_t *, const hyprlofs_op_t *);
+	static const char *opName(const hyprlofs_op_t *);
+	static bool mutates(const hyprlofs_op_t *);
+	static bool reorderable(const hyprlofs_op_t *);
+	bool queueAhead(hyprlofs_op_t *);
+	void complete(hyprlofs_op_t *);
+	void doIoctl(hyprlofs_op_t *, int, void *);
+	void issueIoctl(hyprlofs_op_t *, int, void *);
+	uint_t throttleMax(const hyprlofs_op_t *);
+	void throttle(hyprlofs_op_t *, uint_t);
+	void doGetEntries(hyprlofs_op_t *, hyprlofs_curr_entries_t *);
+	void doFetchEntries(hyprlofs_op_t *);
+	void doCoalescedRecover(hyprlofs_op_t *);
+	void doAddChecked(hyprlofs_op_t *);
+	void doSetMappings(hyprlofs_op_t *);
+	void doResync(hyprlofs_op_t *);
+	void indexUpdate(hyprlofs_op_t *);
+	void indexApply(hyprlofs_op_t *);
+	void journalUpdate(hyprlofs_op_t *);
+	void journalApply(hyprlofs_op_t *);
+	void journalEntries(const hyprlofs_op_t *, const char *,
+	    const hyprlofs_entries_t *);
+	void journalRecord(const char *, const hyprlofs_entry_t *);
+	void journalNotify(uint64_t);
+	napi_value journalArray(uint64_t);
+	bool batchNext(hyprlofs_op_t *);
 
-	static Handle<Value> New(const Arguments&);
-	static Handle<Value> Mount(const Arguments&);
-	static Handle<Value> Unmount(const Arguments&);
-	static Handle<Value> AddMappings(const Arguments&);
-	static Handle<Value> ListMappings(const Arguments&);
-	static Handle<Value> RemoveAll(const Arguments&);
-	static Handle<Value> RemoveMappings(const Arguments& );
+	static void eioRun(napi_env, void *);
+	static void eioAsyncFini(napi_env, napi_status, void *);
+	static void eioStatRun(napi_env, void *);
+	static void eioStatFini(napi_env, napi_status, void *);
+	static void listChunk(napi_env, napi_status, void *);
+	static void marshalNext(napi_env, napi_status, void *);
+	static void marshalFail(napi_env, napi_status, void *);
+	static void eioIoctlRun(hyprlofs_op_t *);
+	static void eioIoctlGetRun(hyprlofs_op_t *);
+	static void eioMountRun(hyprlofs_op_t *);
+	static void eioSetRun(hyprlofs_op_t *);
+	static void eioReplaceRun(hyprlofs_op_t *);
+	static void eioSnapshotRun(hyprlofs_op_t *);
+	static void eioRestoreRun(hyprlofs_op_t *);
+	static void eioPrefixRemoveRun(hyprlofs_op_t *);
+	static void eioResyncRun(hyprlofs_op_t *);
+	static void eioUmountRun(hyprlofs_op_t *);
 
-	int argsCheck(const char *, const Arguments&, int);
+	static napi_value New(napi_env, napi_callback_info);
+	static napi_value Mount(napi_env, napi_callback_info);
+	static napi_value Unmount(napi_env, napi_callback_info);
+	static napi_value AddMappings(napi_env, napi_callback_info);
+	static napi_value AddMappingsBuffer(napi_env, napi_callback_info);
+	static napi_value AddMappingsMulti(napi_env, napi_callback_info);
+	static napi_value HasMapping(napi_env, napi_callback_info);
+	static napi_value ListMappings(napi_env, napi_callback_info);
+	static napi_value ListByPrefix(napi_env, napi_callback_info);
+	static napi_value RemoveByPrefix(napi_env, napi_callback_info);
+	static napi_value RemoveAll(napi_env, napi_callback_info);
+	static napi_value RemoveMappings(napi_env, napi_callback_info);
+	static napi_value RemoveMappingsBuffer(napi_env, napi_callback_info);
+	static napi_value SetMappings(napi_env, napi_callback_info);
+	static napi_value ReplaceAll(napi_env, napi_callback_info);
+	static napi_value Snapshot(napi_env, napi_callback_info);
+	static napi_value Restore(napi_env, napi_callback_info);
+	static napi_value Resync(napi_env, napi_callback_info);
+	static napi_value Stats(napi_env, napi_callback_info);
+	static napi_value ChangesSince(napi_env, napi_callback_info);
+	static napi_value JournalSeq(napi_env, napi_callback_info);
+	static napi_value On(napi_env, napi_callback_info);
+	static napi_value Off(napi_env, napi_callback_info);
 
-private:
-	static Persistent<FunctionTemplate> hfs_templ;
+	static HyprlofsFilesystem *argsInit(napi_env, napi_callback_info,
+	    hyprlofs_args_t *);
+	int argsCheck(const char *, const hyprlofs_args_t *, int);
+	int listenerCheck(const char *, const hyprlofs_args_t *);
+	int argsBatch(const char *, const hyprlofs_args_t *, int *, uint_t *,
+	    napi_value *, bool *, bool *, hyprlofs_yield_t *,
+	    hyprlofs_pri_t *);
+	static napi_value setCommon(napi_env, napi_callback_info, const char *,
+	    void (*)(hyprlofs_op_t *));
+	static napi_value listCommon(napi_env, napi_callback_info, const char *,
+	    bool);
 
+private:
 	/* immutable state */
+	napi_env		hfs_env;		/* owning environment */
+	napi_ref		hfs_wrapper;		/* JavaScript object */
 	bool			hfs_debug;		/* debug output */
-	int			hfs_fd;			/* mountpoint fd */
+	bool			hfs_owned;		/* maintain index */
 	char			hfs_label[PATH_MAX];	/* mountpoint path */
+	hyprlofs_pool_t		*hfs_pool;		/* shared fds, if any */
+	hyprlofs_tpool_t	*hfs_tpool;		/* private threads */
+	hyprlofs_intern_t	*hfs_intern;		/* shared dirs, if any */
+	hyprlofs_yield_t	hfs_yield;		/* default budget */
+	hyprlofs_pri_t		hfs_pri;		/* default priority */
+	hyprlofs_bucket_t	*hfs_bucket;		/* rate limit, if any */
 
 	/*
-	 * Several invariants are maintained for these fields:
-	 *
-	 * While an asynchronous task (triggered by a caller invoking one of
-	 * several methods on this object) is pending:
-	 *
-	 *     hfs_pending is true. We will not allow another asynchronous task
-	 *     to be issued while hfs_pending is true.
-	 *
-	 *     hfs_callback refers to the JS callback function to be invoked
-	 *     upon completion of the task.
-	 *
-	 *     hfs_ioctl_cmd refers to the ioctl command if this is an ioctl
-	 *     task or -1 otherwise.
-	 *
-	 * After an asynchronous task completes, hfs_rv and hfs_errno are valid
-	 * until the next asynchronous task is dispatched.
-	 *
-	 * For ioctl tasks, hfs_ioctl_arg is valid from when the task is
-	 * dispatched until it completes.
+	 * hfs_fd and hfs_get_hint are only ever touched by the worker thread
+	 * running the in-flight operation, and since at most one operation is
+	 * in flight for a given object at a time, they need no further
+	 * synchronization.  Objects created with a MountManager use its pool
+	 * instead of hfs_fd.
+	 */
+	int			hfs_fd;			/* mountpoint fd */
+	uint_t			hfs_get_hint;		/* last GET count */
+
+	/*
+	 * Operations are processed in FIFO order, except that independent
+	 * interactive add and remove operations may be queued ahead of
+	 * background ones (see queueAhead).  While an operation is
+	 * running in the threadpool, hfs_inflight refers to it, and any
+	 * operations requested in the meantime are appended to the queue
+	 * headed by hfs_queue.  When an operation completes, eioAsyncFini
+	 * dispatches the next queued operation (if any) before invoking the
+	 * completed operation's callback, so the threadpool can begin working
+	 * on it without waiting for JavaScript.  Consecutive queued add (or
+	 * remove) operations are dispatched together as a single ioctl; see
+	 * coalesce().
 	 *
-	 * For the "get" ioctl specifically (which is the only one that returns
-	 * data from the ioctl), hfs_curr_ents and hfs_entv are valid only
-	 * when processing the ioctl completion.
+	 * These fields are only accessed from the event loop context.
+	 */
+	hyprlofs_op_t		*hfs_inflight;	/* operation outstanding */
+	hyprlofs_op_t		*hfs_queue;	/* first queued operation */
+	hyprlofs_op_t		*hfs_queue_tail; /* last queued operation */
+
+	/*
+	 * In owned mode, hfs_index describes the mappings on the mount, as
+	 * established by this object's own successful operations, and is used
+	 * to answer listMappings, hasMapping, and setMappings without asking
+	 * the kernel.  If a change fails, the index is rebuilt from the
+	 * kernel's view of the mapping; if that isn't possible (or we run out
+	 * of memory maintaining the index), hfs_index_stale is set and we fall
+	 * back to the kernel until the index is rebuilt.
 	 *
-	 * These invariants are mostly maintained by async() (which dispatches
-	 * new tasks) and eioAsyncFini (which handles completion).  Each
-	 * function dispatching an aysnc ioctl takes care of setting ioctl_cmd
-	 * and ioctl_arg first.
+	 * The index is only modified in the event loop context while no
+	 * operation is in flight (just before the next one is dispatched), so
+	 * the worker thread may read it while an operation is in flight.
 	 */
+	hyprlofs_htable_t	hfs_index;	/* alias -> mapping */
+	bool			hfs_index_stale; /* index not usable */
 
-	/* common async operation state */
-	char			hfs_opname[32];	/* operation name */
-	bool 			hfs_pending;	/* operation outstanding */
-	Persistent<Function>	hfs_callback;	/* user callback */
-	int			hfs_rv;		/* current async rv */
-	int			hfs_errno;	/* current async errno */
+	/*
+	 * Statistics about completed operations, updated in the event loop
+	 * context as each one completes.  See hyprlofs_stats_record.
+	 */
+	hyprlofs_stats_t	hfs_stats;	/* operation statistics */
 
-	/* ioctl-specific operation state */
-	int			hfs_ioctl_cmd;	/* current ioctl cmd */
-	void			*hfs_ioctl_arg;	/* current ioctl arg */
+	/*
+	 * If hfs_jsize is non-zero, the most recent hfs_jsize changes made by
+	 * this object's operations are kept in hfs_journal, a circular buffer
+	 * of which the hfs_jcount entries starting at hfs_jhead are in use.
+	 * hfs_jseq is the sequence number of the most recent change.
+	 * Listeners for "change" events are kept in the array hfs_listeners,
+	 * which is replaced rather than modified so that it can be iterated
+	 * while listeners are being added and removed.  These fields are only
+	 * accessed from the event loop context.
+	 */
+	hyprlofs_jrec_t		*hfs_journal;	/* recent changes */
+	uint_t			hfs_jsize;	/* capacity of hfs_journal */
+	uint_t			hfs_jhead;	/* oldest change */
+	uint_t			hfs_jcount;	/* number of changes */
+	uint64_t		hfs_jseq;	/* last sequence number */
+	napi_ref		hfs_listeners;	/* "change" listeners */
+};
 
-	/* get-specific state */
-	hyprlofs_curr_entries_t	hfs_curr_ents;	/* current mappings */
-	hyprlofs_curr_entry_t	*hfs_entv;
+/*
+ * Objects that wrap native state are tagged with the type of that state so that
+ * methods can't be applied to the wrong kind of object.
+ */
+static const napi_type_tag hyprlofs_fs_tag = {
+	0x6879707266730001ULL, 0x9e3c4e1a5b7d2f01ULL
+};
+static const napi_type_tag hyprlofs_mgr_tag = {
+	0x6879707266730002ULL, 0x9e3c4e1a5b7d2f02ULL
+};
+static const napi_type_tag hyprlofs_tpool_tag = {
+	0x6879707266730003ULL, 0x9e3c4e1a5b7d2f03ULL
 };
 
 /*
  * The initializer for this Node module defines a Filesystem class backed by the
- * HyprlofsFilesystem class.  See README.md for details.
+ * HyprlofsFilesystem class.  See README.md for details.  This is invoked once
+ * for each environment that loads the module, and nothing it creates is shared
+ * between environments.
  */
-Persistent<FunctionTemplate> HyprlofsFilesystem::hfs_templ;
+NAPI_MODULE(hyprlofs, HyprlofsFilesystem::Initialize)
 
-NODE_MODULE(hyprlofs, HyprlofsFilesystem::Initialize)
-
-void
-HyprlofsFilesystem::Initialize(Handle<Object> target)
+napi_value
+HyprlofsFilesystem::Initialize(napi_env env, napi_value exports)
 {
-	HandleScope scope;
-	Local<FunctionTemplate> hfs =
-	    FunctionTemplate::New(HyprlofsFilesystem::New);
+	napi_property_descriptor methods[] = {
+		HYPRLOFS_METHOD("mount", HyprlofsFilesystem::Mount),
+		HYPRLOFS_METHOD("unmount", HyprlofsFilesystem::Unmount),
+		HYPRLOFS_METHOD("addMappings", HyprlofsFilesystem::AddMappings),
+		HYPRLOFS_METHOD("addMappingsBuffer",
+		    HyprlofsFilesystem::AddMappingsBuffer),
+		HYPRLOFS_METHOD("hasMapping", HyprlofsFilesystem::HasMapping),
+		HYPRLOFS_METHOD("listMappings",
+		    HyprlofsFilesystem::ListMappings),
+		HYPRLOFS_METHOD("listByPrefix",
+		    HyprlofsFilesystem::ListByPrefix),
+		HYPRLOFS_METHOD("removeByPrefix",
+		    HyprlofsFilesystem::RemoveByPrefix),
+		HYPRLOFS_METHOD("removeMappings",
+		    HyprlofsFilesystem::RemoveMappings),
+		HYPRLOFS_METHOD("removeMappingsBuffer",
+		    HyprlofsFilesystem::RemoveMappingsBuffer),
+		HYPRLOFS_METHOD("setMappings", HyprlofsFilesystem::SetMappings),
+		HYPRLOFS_METHOD("replaceAll", HyprlofsFilesystem::ReplaceAll),
+		HYPRLOFS_METHOD("removeAll", HyprlofsFilesystem::RemoveAll),
+		HYPRLOFS_METHOD("snapshot", HyprlofsFilesystem::Snapshot),
+		HYPRLOFS_METHOD("restore", HyprlofsFilesystem::Restore),
+		HYPRLOFS_METHOD("resync", HyprlofsFilesystem::Resync),
+		HYPRLOFS_METHOD("stats", HyprlofsFilesystem::Stats),
+		HYPRLOFS_METHOD("changesSince",
+		    HyprlofsFilesystem::ChangesSince),
+		HYPRLOFS_METHOD("journalSeq", HyprlofsFilesystem::JournalSeq),
+		HYPRLOFS_METHOD("on", HyprlofsFilesystem::On),
+		HYPRLOFS_METHOD("off", HyprlofsFilesystem::Off)
+	};
+	napi_property_descriptor tpool_methods[] = {
+		HYPRLOFS_METHOD("stats", hyprlofs_tpool_stats)
+	};
+	hyprlofs_module_t *modp;
+	napi_value hfs, mgr, tpool, settpool, setrate, setbackend, addmulti;
+	napi_value stats;
+
+	if ((modp = (hyprlofs_module_t *)calloc(1, sizeof (*modp))) == NULL ||
+	    napi_set_instance_data(env, modp, hyprlofs_module_finalize,
+	    NULL) != napi_ok) {
+		free(modp);
+		return (hyprlofs_throw(env, "hyprlofs: out of memory"));
+	}
 
-	hfs_templ = Persistent<FunctionTemplate>::New(hfs);
-	hfs_templ->InstanceTemplate()->SetInternalFieldCount(1);
-	hfs_templ->SetClassName(String::NewSymbol("Filesystem"));
+	modp->hm_extstr = (hyprlofs_extstr_f)dlsym(RTLD_DEFAULT,
+	    "node_api_create_external_string_latin1");
+
+	if (napi_define_class(env, "Filesystem", NAPI_AUTO_LENGTH,
+	    HyprlofsFilesystem::New, NULL,
+	    sizeof (methods) / sizeof (methods[0]), methods, &hfs) != napi_ok ||
+	    napi_define_class(env, "MountManager", NAPI_AUTO_LENGTH,
+	    hyprlofs_mgr_new, NULL, 0, NULL, &mgr) != napi_ok ||
+	    napi_define_class(env, "ThreadPool", NAPI_AUTO_LENGTH,
+	    hyprlofs_tpool_new, NULL, 1, tpool_methods, &tpool) != napi_ok ||
+	    napi_create_function(env, "setThreadPool", NAPI_AUTO_LENGTH,
+	    hyprlofs_set_tpool, NULL, &settpool) != napi_ok ||
+	    napi_create_function(env, "setRateLimit", NAPI_AUTO_LENGTH,
+	    hyprlofs_set_rate, NULL, &setrate) != napi_ok ||
+	    napi_create_function(env, "setBackend", NAPI_AUTO_LENGTH,
+	    hyprlofs_set_backend, NULL, &setbackend) != napi_ok ||
+	    napi_create_function(env, "addMappingsMulti", NAPI_AUTO_LENGTH,
+	    HyprlofsFilesystem::AddMappingsMulti, NULL, &addmulti) != napi_ok ||
+	    napi_create_function(env, "stats", NAPI_AUTO_LENGTH,
+	    hyprlofs_module_stats, NULL, &stats) != napi_ok)
+		return (NULL);
+
+	hyprlofs_set(env, exports, "Filesystem", hfs);
+	hyprlofs_set(env, exports, "MountManager", mgr);
+	hyprlofs_set(env, exports, "ThreadPool", tpool);
+	hyprlofs_set(env, exports, "setThreadPool", settpool);
+	hyprlofs_set(env, exports, "setRateLimit", setrate);
+	hyprlofs_set(env, exports, "setBackend", setbackend);
+	hyprlofs_set(env, exports, "addMappingsMulti", addmulti);
+	hyprlofs_set(env, exports, "stats", stats);
+	return (exports);
+}
 
-	NODE_SET_PROTOTYPE_METHOD(hfs_templ, "mount",
-	    HyprlofsFilesystem::Mount);
-	NODE_SET_PROTOTYPE_METHOD(hfs_templ, "unmount",
-	    HyprlofsFilesystem::Unmount);
-	NODE_SET_PROTOTYPE_METHOD(hfs_templ, "addMappings",
-	    HyprlofsFilesystem::AddMappings);
-	NODE_SET_PROTOTYPE_METHOD(hfs_templ, "listMappings",
-	    HyprlofsFilesystem::ListMappings);
-	NODE_SET_PROTOTYPE_METHOD(hfs_templ, "removeMappings",
-	    HyprlofsFilesystem::RemoveMappings);
-	NODE_SET_PROTOTYPE_METHOD(hfs_templ, "removeAll",
-	    HyprlofsFilesystem::RemoveAll);
+static void
+hyprlofs_module_finalize(napi_env env, void *data, void *hint)
+{
+	hyprlofs_module_t *modp = (hyprlofs_module_t *)data;
 
-	target->Set(String::NewSymbol("Filesystem"),
-	    hfs_templ->GetFunction());
+	if (modp->hm_tpool != NULL)
+		hyprlofs_tpool_rele(modp->hm_tpool);
+	if (modp->hm_intern != NULL)
+		hyprlofs_intern_rele(modp->hm_intern);
+	free(modp);
 }
 
 /*
  * This object wraps a mountpoint, caching the mountpoint path.  The mountpoint
  * path is not checked or used until the first time it's needed.
  */
-Handle<Value>
-HyprlofsFilesystem::New(const Arguments& args)
+napi_value
+HyprlofsFilesystem::New(napi_env env, napi_callback_info info)
 {
-	HandleScope scope;
+	char mountpt[PATH_MAX];
 	HyprlofsFilesystem *hfs;
-	bool debug = false;
+	hyprlofs_module_t *modp = NULL;
+	hyprlofs_pool_t *pool = NULL;
+	hyprlofs_tpool_t *tpool;
+	hyprlofs_args_t args;
+	napi_value target, options, manager, tpoolval, jsizeval;
+	hyprlofs_yield_t yield;
+	uint32_t jsize = 0, rate = 0;
+	hyprlofs_pri_t pri = HYPRLOFS_PRI_INTERACTIVE;
+	bool debug = false, owned = false, intern = false;
+	const char *msg;
+
+	hyprlofs_args_get(env, info, &args);
+	(void) napi_get_instance_data(env, (void **)&modp);
+	tpool = modp->hm_tpool;
+
+	if (napi_get_new_target(env, info, &target) != napi_ok ||
+	    target == NULL)
+		return (hyprlofs_throw(env,
+		    "Filesystem must be invoked with \"new\""));
+
+	if (args.ha_argc < 1 ||
+	    hyprlofs_typeof(env, args.ha_argv[0]) != napi_string)
+		return (hyprlofs_throw(env,
+		    "first argument must be a mountpoint"));
+
+	(void) napi_get_value_string_utf8(env, args.ha_argv[0], mountpt,
+	    sizeof (mountpt), NULL);
+	bzero(&yield, sizeof (yield));
+
+	/*
+	 * The second argument may be either an options object or, as it
+	 * always has been, a boolean indicating whether to enable debugging.
+	 */
+	if (args.ha_argc > 1 &&
+	    hyprlofs_typeof(env, args.ha_argv[1]) == napi_object) {
+		options = args.ha_argv[1];
+		debug = hyprlofs_truthy(env, hyprlofs_get(env, options,
+		    "debug"));
+		owned = hyprlofs_truthy(env, hyprlofs_get(env, options,
+		    "owned"));
+		intern = hyprlofs_truthy(env, hyprlofs_get(env, options,
+		    "internPaths"));
+		if (intern && !owned)
+			return (hyprlofs_throw(env,
+			    "internPaths requires owned"));
+		manager = hyprlofs_get(env, options, "manager");
+		if (hyprlofs_typeof(env, manager) != napi_undefined &&
+		    (pool = (hyprlofs_pool_t *)hyprlofs_unwrap(env, manager,
+		    &hyprlofs_mgr_tag)) == NULL)
+			return (hyprlofs_throw(env,
+			    "manager must be a MountManager"));
+		tpoolval = hyprlofs_get(env, options, "threadPool");
+		if (hyprlofs_typeof(env, tpoolval) == napi_null)
+			tpool = NULL;
+		else if (hyprlofs_typeof(env, tpoolval) != napi_undefined &&
+		    (tpool = (hyprlofs_tpool_t *)hyprlofs_unwrap(env, tpoolval,
+		    &hyprlofs_tpool_tag)) == NULL)
+			return (hyprlofs_throw(env,
+			    "threadPool must be a ThreadPool or null"));
+		if ((msg = hyprlofs_yield_parse(env, options, &yield)) != NULL ||
+		    (msg = hyprlofs_pri_parse(env, options, &pri)) != NULL ||
+		    (msg = hyprlofs_rate_parse(env, hyprlofs_get(env, options,
+		    "rateLimit"), &rate)) != NULL)
+			return (hyprlofs_throw(env, msg));
+		jsizeval = hyprlofs_get(env, options, "journalSize");
+		if (hyprlofs_typeof(env, jsizeval) != napi_undefined &&
+		    (!hyprlofs_get_uint32(env, jsizeval, &jsize) || jsize == 0))
+			return (hyprlofs_throw(env,
+			    "journalSize must be a positive integer"));
+	} else if (args.ha_argc > 1) {
+		debug = hyprlofs_truthy(env, args.ha_argv[1]);
+	}
 
-	if (args.Length() < 1 || !args[0]->IsString())
-		return (ThrowException(Exception::Error(String::New(
-		    "first argument must be a mountpoint"))));
+	if (intern && modp->hm_intern == NULL &&
+	    (modp->hm_intern = hyprlofs_intern_create()) == NULL)
+		return (hyprlofs_throw(env, "failed to create Filesystem"));
 
-	String::Utf8Value mountpt(args[0]->ToString());
+	hfs = new HyprlofsFilesystem(env, mountpt, debug, owned, pool, tpool);
+	hfs->hfs_yield = yield;
+	if (intern) {
+		hyprlofs_intern_hold(modp->hm_intern);
+		hfs->hfs_intern = modp->hm_intern;
+	}
+	if (jsize != 0 && (hfs->hfs_journal = (hyprlofs_jrec_t *)calloc(jsize,
+	    sizeof (hyprlofs_jrec_t))) == NULL) {
+		delete hfs;
+		return (hyprlofs_throw(env, "failed to create Filesystem"));
+	}
+	hfs->hfs_jsize = jsize;
+	hfs->hfs_pri = pri;
+	if (rate != 0 && (hfs->hfs_bucket = (hyprlofs_bucket_t *)malloc(
+	    sizeof (hyprlofs_bucket_t))) == NULL) {
+		delete hfs;
+		return (hyprlofs_throw(env, "failed to create Filesystem"));
+	}
+	if (hfs->hfs_bucket != NULL) {
+		(void) pthread_mutex_init(&hfs->hfs_bucket->hb_lock, NULL);
+		hyprlofs_bucket_set(hfs->hfs_bucket, rate);
+	}
+	if (napi_wrap(env, args.ha_this, hfs, HyprlofsFilesystem::Finalize,
+	    NULL, &hfs->hfs_wrapper) != napi_ok) {
+		delete hfs;
+		return (hyprlofs_throw(env, "failed to create Filesystem"));
+	}
 
-	if (args.Length() > 1)
-		debug = args[1]->BooleanValue();
+	(void) napi_type_tag_object(env, args.ha_this, &hyprlofs_fs_tag);
 
-	hfs = new HyprlofsFilesystem(*mountpt, debug);
-	hfs->Wrap(args.Holder());
-	return (args.This());
+	return (args.ha_this);
 }
 
-HyprlofsFilesystem::HyprlofsFilesystem(const char *label, bool debug) :
-    node::ObjectWrap(),
+HyprlofsFilesystem::HyprlofsFilesystem(napi_env env, const char *label,
+    bool debug, bool owned, hyprlofs_pool_t *pool, hyprlofs_tpool_t *tpool) :
+    hfs_env(env),
+    hfs_wrapper(NULL),
     hfs_debug(debug),
+    hfs_owned(owned),
+    hfs_pool(pool),
+    hfs_tpool(tpool),
+    hfs_intern(NULL),
+    hfs_pri(HYPRLOFS_PRI_INTERACTIVE),
+    hfs_bucket(NULL),
     hfs_fd(-1),
-    hfs_pending(false),
-    hfs_ioctl_cmd(-1),
-    hfs_ioctl_arg(NULL),
-    hfs_entv(NULL)
+    hfs_get_hint(0),
+    hfs_inflight(NULL),
+    hfs_queue(NULL),
+    hfs_queue_tail(NULL),
+    hfs_index_stale(true),
+    hfs_journal(NULL),
+    hfs_jsize(0),
+    hfs_jhead(0),
+    hfs_jcount(0),
+    hfs_jseq(0),
+    hfs_listeners(NULL)
 {
 	(void) strlcpy(hfs_label, label, sizeof (hfs_label));
-}
+	if (pool != NULL)
+		hyprlofs_pool_hold(pool);
+	if (tpool != NULL)
+		hyprlofs_tpool_hold(tpool);
+
+	/*
+	 * We don't know what's on the mount yet, so the index starts out
+	 * stale.  It becomes usable once we've mounted the filesystem, removed
+	 * all mappings, or fetched them from the kernel (e.g., via resync()).
+	 * The bucket array is allocated when the first mapping is indexed.
+	 */
+	bzero(&hfs_index, sizeof (hfs_index));
+	bzero(&hfs_stats, sizeof (hfs_stats));
+	bzero(&hfs_yield, sizeof (hfs_yield));
+}
+
+HyprlofsFilesystem::~HyprlofsFilesystem()
+{
+	/*
+	 * Each queued operation holds a reference on this object, so we
+	 * cannot be destroyed while any are outstanding.
+	 */
+	assert(this->hfs_inflight == NULL);
+	assert(this->hfs_queue == NULL);
+
+	if (this->hfs_fd != -1)
+		(void) close(this->hfs_fd);
+	if (this->hfs_pool != NULL)
+		hyprlofs_pool_rele(this->hfs_pool);
+	if (this->hfs_tpool != NULL)
+		hyprlofs_tpool_rele(this->hfs_tpool);
+
+	hyprlofs_index_clear(&this->hfs_index, this->hfs_intern);
+	hyprlofs_htable_fini(&this->hfs_index);
+	if (this->hfs_intern != NULL)
+		hyprlofs_intern_rele(this->hfs_intern);
+	if (this->hfs_bucket != NULL) {
+		(void) pthread_mutex_destroy(&this->hfs_bucket->hb_lock);
+		free(this->hfs_bucket);
+	}
+
+	for (uint_t i = 0; i < this->hfs_jcount; i++)
+		free(this->hfs_journal[(this->hfs_jhead + i) %
+		    this->hfs_jsize].hj_alias);
+	free(this->hfs_journal);
+	if (this->hfs_listeners != NULL)
+		(void) napi_delete_reference(this->hfs_env,
+		    this->hfs_listeners);
+
+	if (this->hfs_wrapper != NULL)
+		(void) napi_delete_reference(this->hfs_env, this->hfs_wrapper);
+}
+
+/*
+ * Invoked when the JavaScript object wrapping "data" has been collected (or its
+ * environment is being torn down).
+ */
+void
+HyprlofsFilesystem::Finalize(napi_env env, void *data, void *hint)
+{
+	delete (HyprlofsFilesystem *)data;
+}
+
+/*
+ * The reference to our JavaScript object starts out weak.  Each outstanding
+ * operation holds a strong reference (see async()), so the object cannot be
+ * collected while there's work to do on its behalf.
+ */
+void
+HyprlofsFilesystem::Ref()
+{
+	(void) napi_reference_ref(this->hfs_env, this->hfs_wrapper, NULL);
+}
+
+void
+HyprlofsFilesystem::Unref()
+{
+	(void) napi_reference_unref(this->hfs_env, this->hfs_wrapper, NULL);
+}
+
+/*
+ * See README.md.  The mappings hint is applied by eioMountRun (to the first
+ * GET) and indexApply (to the index) once the filesystem has been mounted.
+ */
+napi_value
+HyprlofsFilesystem::Mount(napi_env env, napi_callback_info info)
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_args_t args;
+	hyprlofs_op_t *op;
+	napi_value options, hint, extra = NULL;
+	uint32_t nmappings = 0;
+	char *optstr;
+	size_t len = 0;
+	int cbidx = 0;
+
+	if ((hfs = argsInit(env, info, &args)) == NULL)
+		return (NULL);
+
+	if (hyprlofs_typeof(env, args.ha_argv[0]) == napi_object) {
+		options = args.ha_argv[0];
+		cbidx = 1;
+
+		hint = hyprlofs_get(env, options, "expectedMappings");
+		if (hyprlofs_typeof(env, hint) != napi_undefined &&
+		    (!hyprlofs_get_uint32(env, hint, &nmappings) ||
+		    nmappings == 0))
+			return (hyprlofs_throw(env, "mount: expectedMappings "
+			    "must be a positive integer"));
+
+		extra = hyprlofs_get(env, options, "mountOptions");
+		if (hyprlofs_typeof(env, extra) == napi_undefined)
+			extra = NULL;
+		else if (hyprlofs_typeof(env, extra) != napi_string)
+			return (hyprlofs_throw(env,
+			    "mount: mountOptions must be a string"));
+		else if (napi_get_value_string_utf8(env, extra, NULL, 0,
+		    &len) != napi_ok || len > MAX_MNTOPT_STR - sizeof ("ro,"))
+			return (hyprlofs_throw(env,
+			    "mount: mountOptions is too long"));
+	}
+
+	if (hfs->argsCheck("mount", &args, cbidx) != 0)
+		return (NULL);
+
+	/*
+	 * Filesystems are always mounted read-only.  Any other options are
+	 * passed through, and the kernel ignores those it doesn't support.
+	 */
+	if ((optstr = (char *)malloc(MAX_MNTOPT_STR)) == NULL)
+		return (hyprlofs_throw(env, "mount: out of memory"));
+
+	(void) strlcpy(optstr, "ro", MAX_MNTOPT_STR);
+	if (extra != NULL && len > 0) {
+		(void) strlcat(optstr, ",", MAX_MNTOPT_STR);
+		(void) napi_get_value_string_utf8(env, extra, optstr + 3,
+		    MAX_MNTOPT_STR - 3, NULL);
+	}
+
+	op = hyprlofs_op_alloc(env, eioMountRun, args.ha_argv[cbidx]);
+	op->hop_mountopts = optstr;
+	op->hop_mounthint = nmappings;
+	return (hfs->async(op));
+}
+
+/*
+ * See README.md.
+ */
+napi_value
+HyprlofsFilesystem::Unmount(napi_env env, napi_callback_info info)
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_args_t args;
+	hyprlofs_op_t *op;
+
+	if ((hfs = argsInit(env, info, &args)) == NULL ||
+	    hfs->argsCheck("unmount", &args, 0) != 0)
+		return (NULL);
+
+	op = hyprlofs_op_alloc(env, eioUmountRun, args.ha_argv[0]);
+	return (hfs->async(op));
+}
+
+/*
+ * See README.md.
+ */
+napi_value
+HyprlofsFilesystem::AddMappings(napi_env env, napi_callback_info info)
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_args_t args;
+	hyprlofs_op_t *op;
+	hyprlofs_pri_t pri;
+	napi_value onprogress;
+	uint_t chunksize, nentries;
+	hyprlofs_yield_t yield;
+	bool partial, validate;
+	int cbidx;
+
+	if ((hfs = argsInit(env, info, &args)) == NULL)
+		return (NULL);
+
+	if (args.ha_argc < 1 || !hyprlofs_is_array(env, args.ha_argv[0]))
+		return (hyprlofs_throw(env, "addMappings: expected array"));
+
+	if (hfs->argsBatch("addMappings", &args, &cbidx, &chunksize,
+	    &onprogress, &partial, &validate, &yield, &pri) != 0 ||
+	    hfs->argsCheck("addMappings", &args, cbidx) != 0)
+		return (NULL);
+
+	nentries = hyprlofs_array_length(env, args.ha_argv[0]);
+	op = hyprlofs_op_alloc(env, eioIoctlRun, args.ha_argv[cbidx]);
+	op->hop_ioctl_cmd = HYPRLOFS_ADD_ENTRIES;
+	if (hyprlofs_op_marshal_start(op, args.ha_argv[0],
+	    hyprlofs_batch_len(chunksize, nentries),
+	    chunksize == 0 ? &yield : NULL) != 0) {
+		hyprlofs_op_free(op);
+		return (hyprlofs_throw(env, "addMappings: invalid mappings"));
+	}
+
+	op->hop_partial = partial;
+	op->hop_validate = validate;
+	if (chunksize != 0) {
+		hyprlofs_op_batch(op, chunksize, nentries, onprogress);
+		op->hop_batchsrc = hyprlofs_ref(env, args.ha_argv[0]);
+	}
+	op->hop_pri = pri;
+	return (hfs->async(op));
+}
+
+/*
+ * See README.md.
+ */
+napi_value
+HyprlofsFilesystem::Stats(napi_env env, napi_callback_info info)
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_args_t args;
+
+	if ((hfs = argsInit(env, info, &args)) == NULL)
+		return (NULL);
+
+	return (hyprlofs_stats_object(env, &hfs->hfs_stats));
+}
+
+/*
+ * See README.md.  Like hasMapping, this is answered synchronously, and only
+ * reflects operations that have completed.
+ */
+napi_value
+HyprlofsFilesystem::ChangesSince(napi_env env, napi_callback_info info)
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_args_t args;
+	double seq;
+
+	if ((hfs = argsInit(env, info, &args)) == NULL)
+		return (NULL);
+
+	if (args.ha_argc < 1 ||
+	    hyprlofs_typeof(env, args.ha_argv[0]) != napi_number ||
+	    napi_get_value_double(env, args.ha_argv[0], &seq) != napi_ok ||
+	    seq < 0 || seq != (double)(uint64_t)seq)
+		return (hyprlofs_throw(env,
+		    "changesSince: expected sequence number"));
+
+	if (hfs->hfs_jsize == 0)
+		return (hyprlofs_throw(env,
+		    "changesSince: journal is not enabled"));
+
+	/*
+	 * If changes after "seq" have already been discarded, the caller has
+	 * to fetch the mappings again.
+	 */
+	if ((uint64_t)seq < hfs->hfs_jseq - hfs->hfs_jcount)
+		return (hyprlofs_null(env));
+
+	return (hfs->journalArray((uint64_t)seq));
+}
+
+/*
+ * See README.md.
+ */
+napi_value
+HyprlofsFilesystem::JournalSeq(napi_env env, napi_callback_info info)
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_args_t args;
+
+	if ((hfs = argsInit(env, info, &args)) == NULL)
+		return (NULL);
+
+	if (hfs->hfs_jsize == 0)
+		return (hyprlofs_throw(env,
+		    "journalSeq: journal is not enabled"));
+
+	return (hyprlofs_double(env, (double)hfs->hfs_jseq));
+}
+
+/*
+ * See README.md.  These implement just enough of the EventEmitter interface for
+ * "change" events.  Listeners are added to (and removed from) a copy of the
+ * current array of listeners, which then replaces it.
+ */
+napi_value
+HyprlofsFilesystem::On(napi_env env, napi_callback_info info)
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_args_t args;
+	napi_value old, listeners, elt;
+	uint32_t i, n = 0;
+
+	if ((hfs = argsInit(env, info, &args)) == NULL ||
+	    hfs->listenerCheck("on", &args) != 0)
+		return (NULL);
+
+	if (hfs->hfs_listeners != NULL) {
+		old = hyprlofs_deref(env, hfs->hfs_listeners);
+		n = hyprlofs_array_length(env, old);
+	}
+
+	listeners = hyprlofs_array(env, n + 1);
+	for (i = 0; i < n; i++) {
+		if (napi_get_element(env, old, i, &elt) == napi_ok)
+			(void) napi_set_element(env, listeners, i, elt);
+	}
+	(void) napi_set_element(env, listeners, n, args.ha_argv[1]);
+
+	hyprlofs_unref(env, &hfs->hfs_listeners);
+	hfs->hfs_listeners = hyprlofs_ref(env, listeners);
+	return (args.ha_this);
+}
+
+napi_value
+HyprlofsFilesystem::Off(napi_env env, napi_callback_info info)
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_args_t args;
+	napi_value old, listeners, elt;
+	uint32_t i, j, n;
+	bool eq;
+
+	if ((hfs = argsInit(env, info, &args)) == NULL ||
+	    hfs->listenerCheck("off", &args) != 0)
+		return (NULL);
+
+	if (hfs->hfs_listeners == NULL)
+		return (args.ha_this);
+
+	/*
+	 * As with EventEmitter, only the most recently added instance of the
+	 * listener is removed.
+	 */
+	old = hyprlofs_deref(env, hfs->hfs_listeners);
+	n = hyprlofs_array_length(env, old);
+	for (i = n; i > 0; i--) {
+		if (napi_get_element(env, old, i - 1, &elt) == napi_ok &&
+		    napi_strict_equals(env, elt, args.ha_argv[1], &eq) ==
+		    napi_ok && eq)
+			break;
+	}
+
+	if (i == 0)
+		return (args.ha_this);
+
+	listeners = hyprlofs_array(env, n - 1);
+	for (j = 0; j < n; j++) {
+		if (j != i - 1 && napi_get_element(env, old, j, &elt) == napi_ok)
+			(void) napi_set_element(env, listeners,
+			    j < i - 1 ? j : j - 1, elt);
+	}
+
+	hyprlofs_unref(env, &hfs->hfs_listeners);
+	if (n > 1)
+		hfs->hfs_listeners = hyprlofs_ref(env, listeners);
+	return (args.ha_this);
+}
+
+/*
+ * Validates the arguments of on() or off(), named by "label": the name of an
+ * event we support and a listener function.  On failure, throws an exception
+ * and returns -1.
+ */
+int
+HyprlofsFilesystem::listenerCheck(const char *label,
+    const hyprlofs_args_t *argsp)
+{
+	napi_env env = this->hfs_env;
+	char event[16], msg[64];
+
+	if (argsp->ha_argc < 2 ||
+	    hyprlofs_typeof(env, argsp->ha_argv[0]) != napi_string ||
+	    hyprlofs_typeof(env, argsp->ha_argv[1]) != napi_function) {
+		(void) snprintf(msg, sizeof (msg),
+		    "%s: expected event name and listener", label);
+		(void) hyprlofs_throw(env, msg);
+		return (-1);
+	}
+
+	(void) napi_get_value_string_utf8(env, argsp->ha_argv[0], event,
+	    sizeof (event), NULL);
+	if (strcmp(event, "change") != 0) {
+		(void) snprintf(msg, sizeof (msg),
+		    "%s: unsupported event", label);
+		(void) hyprlofs_throw(env, msg);
+		return (-1);
+	}
+
+	if (this->hfs_jsize == 0) {
+		(void) snprintf(msg, sizeof (msg),
+		    "%s: journal is not enabled", label);
+		(void) hyprlofs_throw(env, msg);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * See README.md.  This is a function of the module rather than a method, and
+ * issues one add operation on each filesystem, which is queued and coalesced
+ * like any other.  Since each filesystem runs its operations independently,
+ * the ioctls for different mounts proceed in parallel.
+ */
+napi_value
+HyprlofsFilesystem::AddMappingsMulti(napi_env env, napi_callback_info info)
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_group_t *group;
+	hyprlofs_args_t args;
+	hyprlofs_op_t *op;
+	napi_value elt, errors, rv = NULL;
+	napi_valuetype type;
+	hrtime_t start, marshal;
+	uint_t nfs, i;
+
+	hyprlofs_args_get(env, info, &args);
+
+	if (!hyprlofs_is_array(env, args.ha_argv[0]) ||
+	    (nfs = hyprlofs_array_length(env, args.ha_argv[0])) == 0)
+		return (hyprlofs_throw(env,
+		    "addMappingsMulti: expected array of Filesystems"));
+
+	for (i = 0; i < nfs; i++) {
+		if (napi_get_element(env, args.ha_argv[0], i,
+		    &elt) != napi_ok ||
+		    hyprlofs_unwrap(env, elt, &hyprlofs_fs_tag) == NULL)
+			return (hyprlofs_throw(env,
+			    "addMappingsMulti: expected array of Filesystems"));
+	}
+
+	if (!hyprlofs_is_array(env, args.ha_argv[1]))
+		return (hyprlofs_throw(env,
+		    "addMappingsMulti: expected array"));
+
+	type = hyprlofs_typeof(env, args.ha_argv[2]);
+	if (type != napi_undefined && type != napi_function)
+		return (hyprlofs_throw(env,
+		    "addMappingsMulti: expected callback argument"));
+
+	if ((group = (hyprlofs_group_t *)calloc(1, sizeof (*group))) == NULL)
+		return (hyprlofs_throw(env, "addMappingsMulti: out of memory"));
+
+	start = gethrtime();
+	if ((group->hg_entries = hyprlofs_entries_populate_add(env,
+	    args.ha_argv[1], 0, hyprlofs_array_length(env,
+	    args.ha_argv[1]))) == NULL) {
+		free(group);
+		return (hyprlofs_throw(env,
+		    "addMappingsMulti: invalid mappings"));
+	}
+
+	marshal = gethrtime() - start;
+	if (type == napi_undefined &&
+	    napi_create_promise(env, &group->hg_deferred, &rv) != napi_ok) {
+		hyprlofs_entries_free(group->hg_entries);
+		free(group);
+		return (hyprlofs_throw(env, "failed to create Promise"));
+	}
+
+	errors = hyprlofs_array(env, nfs);
+	group->hg_errors = hyprlofs_ref(env, errors);
+	if (type == napi_function)
+		group->hg_callback = hyprlofs_ref(env, args.ha_argv[2]);
+	group->hg_pending = nfs;
+
+	for (i = 0; i < nfs; i++) {
+		(void) napi_get_element(env, args.ha_argv[0], i, &elt);
+		hfs = (HyprlofsFilesystem *)hyprlofs_unwrap(env, elt,
+		    &hyprlofs_fs_tag);
+		op = hyprlofs_op_alloc(env, eioIoctlRun, NULL);
+		op->hop_ioctl_cmd = HYPRLOFS_ADD_ENTRIES;
+		op->hop_ioctl_arg = group->hg_entries;
+		op->hop_group = group;
+		op->hop_groupidx = i;
+		if (i == 0)
+			op->hop_stats.hos_marshal = marshal;
+		(void) hfs->async(op);
+	}
+
+	return (rv);
+}
+
+/*
+ * See README.md.  The entries point directly into the Buffer's memory rather
+ * than copies of it.  Buffer contents live outside the JavaScript heap and
+ * never move, so this is safe as long as we hold a reference to the Buffer.
+ */
+napi_value
+HyprlofsFilesystem::AddMappingsBuffer(napi_env env, napi_callback_info info)
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_entries_t *entrylstp;
+	hyprlofs_args_t args;
+	hyprlofs_op_t *op;
+	hyprlofs_pri_t pri;
+	napi_value onprogress;
+	uint_t chunksize, nentries;
+	size_t len, used;
+	bool partial, validate;
+	char *buf;
+	hrtime_t start;
+	int cbidx;
+
+	if ((hfs = argsInit(env, info, &args)) == NULL)
+		return (NULL);
+
+	if (args.ha_argc < 1 || !hyprlofs_is_buffer(env, args.ha_argv[0]))
+		return (hyprlofs_throw(env,
+		    "addMappingsBuffer: expected buffer"));
+
+	if (hfs->argsBatch("addMappingsBuffer", &args, &cbidx, &chunksize,
+	    &onprogress, &partial, &validate, NULL, &pri) != 0 ||
+	    hfs->argsCheck("addMappingsBuffer", &args, cbidx) != 0)
+		return (NULL);
+
+	start = gethrtime();
+	hyprlofs_buffer_data(env, args.ha_argv[0], &buf, &len);
+	if (hyprlofs_buffer_count(buf, len, true, &nentries) != 0 ||
+	    (entrylstp = hyprlofs_entries_populate_buffer(buf, len, true,
+	    hyprlofs_batch_len(chunksize, nentries), &used)) == NULL)
+		return (hyprlofs_throw(env,
+		    "addMappingsBuffer: invalid mappings"));
+
+	op = hyprlofs_op_alloc(env, eioIoctlRun, args.ha_argv[cbidx]);
+	op->hop_stats.hos_marshal = gethrtime() - start;
+	op->hop_ioctl_cmd = HYPRLOFS_ADD_ENTRIES;
+	op->hop_ioctl_arg = entrylstp;
+	op->hop_buffer = hyprlofs_ref(env, args.ha_argv[0]);
+	op->hop_partial = partial;
+	op->hop_validate = validate;
+	if (chunksize != 0) {
+		hyprlofs_op_batch(op, chunksize, nentries, onprogress);
+		op->hop_batchbufoff = used;
+	}
+	op->hop_pri = pri;
+	return (hfs->async(op));
+}
+
+/*
+ * See README.md.  This is answered synchronously from the index, so it
+ * reflects the operations that have completed, not those still queued.
+ */
+napi_value
+HyprlofsFilesystem::HasMapping(napi_env env, napi_callback_info info)
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_args_t args;
+	napi_value rv;
+	char *alias;
+	bool found;
+
+	if ((hfs = argsInit(env, info, &args)) == NULL)
+		return (NULL);
+
+	if (args.ha_argc < 1 ||
+	    hyprlofs_typeof(env, args.ha_argv[0]) != napi_string)
+		return (hyprlofs_throw(env, "hasMapping: expected alias"));
+
+	if (!hfs->hfs_owned)
+		return (hyprlofs_throw(env,
+		    "hasMapping: filesystem is not owned"));
+
+	if (hfs->hfs_index_stale)
+		return (hyprlofs_throw(env, "hasMapping: index is stale"));
+
+	if ((alias = hyprlofs_strdup(env, args.ha_argv[0])) == NULL)
+		return (hyprlofs_throw(env, "hasMapping: out of memory"));
+
+	found = hyprlofs_htable_lookup(&hfs->hfs_index, alias) != NULL;
+	free(alias);
+
+	(void) napi_get_boolean(env, found, &rv);
+	return (rv);
+}
+
+/*
+ * See README.md.
+ */
+napi_value
+HyprlofsFilesystem::ListMappings(napi_env env, napi_callback_info info)
+{
+	return (listCommon(env, info, "listMappings", false));
+}
+
+/*
+ * See README.md.  This is a listMappings whose results are filtered in the
+ * worker thread (see hyprlofs_op_filter).
+ */
+napi_value
+HyprlofsFilesystem::ListByPrefix(napi_env env, napi_callback_info info)
+{
+	return (listCommon(env, info, "listByPrefix", true));
+}
+
+/*
+ * Common implementation of listMappings and listByPrefix, named by "label".  If
+ * "byprefix" is true, the first argument is the alias prefix and the options
+ * and callback follow it.
+ */
+napi_value
+HyprlofsFilesystem::listCommon(napi_env env, napi_callback_info info,
+    const char *label, bool byprefix)
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_args_t args;
+	hyprlofs_op_t *op;
+	napi_value options, chunkval, onchunk = NULL, format, fmtstr;
+	uint32_t chunksize = 0;
+	bool packed = false, external = false;
+	const char *err = NULL;
+	char fmt[16], msg[128];
+	char *prefix = NULL;
+	size_t base = byprefix ? 1 : 0;
+	int cbidx = (int)base;
+
+	if ((hfs = argsInit(env, info, &args)) == NULL)
+		return (NULL);
+
+	if (byprefix && (args.ha_argc < 1 ||
+	    hyprlofs_typeof(env, args.ha_argv[0]) != napi_string))
+		err = "expected prefix";
+
+	if (err == NULL && args.ha_argc > base &&
+	    hyprlofs_typeof(env, args.ha_argv[base]) == napi_object) {
+		options = args.ha_argv[base];
+		chunkval = hyprlofs_get(env, options, "chunkSize");
+		onchunk = hyprlofs_get(env, options, "onChunk");
+		format = hyprlofs_get(env, options, "format");
+		cbidx = (int)base + 1;
+
+		if (hyprlofs_typeof(env, format) != napi_undefined) {
+			if (napi_coerce_to_string(env, format, &fmtstr) !=
+			    napi_ok || napi_get_value_string_utf8(env, fmtstr,
+			    fmt, sizeof (fmt), NULL) != napi_ok)
+				return (NULL);
+
+			if (strcmp(fmt, "buffer") == 0)
+				packed = true;
+			else if (strcmp(fmt, "external") == 0)
+				packed = external = true;
+			else if (strcmp(fmt, "array") != 0)
+				err = "format must be \"array\", \"buffer\", or "
+				    "\"external\"";
+		}
+
+		if (err == NULL && packed &&
+		    hyprlofs_typeof(env, chunkval) != napi_undefined)
+			err = external ? "chunkSize is not supported with "
+			    "format \"external\"" : "chunkSize is not "
+			    "supported with format \"buffer\"";
+
+		if (err == NULL &&
+		    hyprlofs_typeof(env, chunkval) != napi_undefined &&
+		    (!hyprlofs_get_uint32(env, chunkval, &chunksize) ||
+		    chunksize == 0))
+			err = "chunkSize must be a positive integer";
+
+		if (err == NULL && chunksize != 0 &&
+		    hyprlofs_typeof(env, onchunk) != napi_function)
+			err = "expected onChunk function";
+	}
+
+	if (err != NULL) {
+		(void) snprintf(msg, sizeof (msg), "%s: %s", label, err);
+		return (hyprlofs_throw(env, msg));
+	}
+
+	if (hfs->argsCheck(label, &args, cbidx) != 0)
+		return (NULL);
+
+	if (byprefix &&
+	    (prefix = hyprlofs_strdup(env, args.ha_argv[0])) == NULL) {
+		(void) snprintf(msg, sizeof (msg), "%s: out of memory", label);
+		return (hyprlofs_throw(env, msg));
+	}
+
+	op = hyprlofs_op_alloc(env, eioIoctlGetRun, args.ha_argv[cbidx]);
+	op->hop_ioctl_cmd = HYPRLOFS_GET_ENTRIES;
+	op->hop_packed = packed;
+	op->hop_external = external;
+	op->hop_prefix = prefix;
+	if (chunksize != 0) {
+		op->hop_chunksize = chunksize;
+		op->hop_onchunk = hyprlofs_ref(env, onchunk);
+	}
+
+	return (hfs->async(op));
+}
+
+/*
+ * See README.md.  The matching mappings are found and removed by
+ * eioPrefixRemoveRun.
+ */
+napi_value
+HyprlofsFilesystem::RemoveByPrefix(napi_env env, napi_callback_info info)
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_args_t args;
+	hyprlofs_op_t *op;
+	char *prefix;
+
+	if ((hfs = argsInit(env, info, &args)) == NULL)
+		return (NULL);
+
+	if (args.ha_argc < 1 ||
+	    hyprlofs_typeof(env, args.ha_argv[0]) != napi_string)
+		return (hyprlofs_throw(env, "removeByPrefix: expected prefix"));
+
+	if (hfs->argsCheck("removeByPrefix", &args, 1) != 0)
+		return (NULL);
+
+	if ((prefix = hyprlofs_strdup(env, args.ha_argv[0])) == NULL)
+		return (hyprlofs_throw(env, "removeByPrefix: out of memory"));
+
+	op = hyprlofs_op_alloc(env, eioPrefixRemoveRun, args.ha_argv[1]);
+	op->hop_prefix = prefix;
+	return (hfs->async(op));
+}
+
+/*
+ * See README.md.
+ */
+napi_value
+HyprlofsFilesystem::RemoveMappings(napi_env env, napi_callback_info info)
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_args_t args;
+	hyprlofs_op_t *op;
+	hyprlofs_pri_t pri;
+	napi_value onprogress;
+	uint_t chunksize, nentries;
+	hyprlofs_yield_t yield;
+	int cbidx;
+
+	if ((hfs = argsInit(env, info, &args)) == NULL)
+		return (NULL);
+
+	if (args.ha_argc < 1 || !hyprlofs_is_array(env, args.ha_argv[0]))
+		return (hyprlofs_throw(env, "removeMappings: expected array"));
+
+	if (hfs->argsBatch("removeMappings", &args, &cbidx, &chunksize,
+	    &onprogress, NULL, NULL, &yield, &pri) != 0 ||
+	    hfs->argsCheck("removeMappings", &args, cbidx) != 0)
+		return (NULL);
+
+	nentries = hyprlofs_array_length(env, args.ha_argv[0]);
+	op = hyprlofs_op_alloc(env, eioIoctlRun, args.ha_argv[cbidx]);
+	op->hop_ioctl_cmd = HYPRLOFS_RM_ENTRIES;
+	if (hyprlofs_op_marshal_start(op, args.ha_argv[0],
+	    hyprlofs_batch_len(chunksize, nentries),
+	    chunksize == 0 ? &yield : NULL) != 0) {
+		hyprlofs_op_free(op);
+		return (hyprlofs_throw(env,
+		    "removeMappings: invalid mappings"));
+	}
+
+	if (chunksize != 0) {
+		hyprlofs_op_batch(op, chunksize, nentries, onprogress);
+		op->hop_batchsrc = hyprlofs_ref(env, args.ha_argv[0]);
+	}
+	op->hop_pri = pri;
+	return (hfs->async(op));
+}
+
+/*
+ * See README.md and AddMappingsBuffer.
+ */
+napi_value
+HyprlofsFilesystem::RemoveMappingsBuffer(napi_env env, napi_callback_info info)
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_entries_t *entrylstp;
+	hyprlofs_args_t args;
+	hyprlofs_op_t *op;
+	hyprlofs_pri_t pri;
+	napi_value onprogress;
+	uint_t chunksize, nentries;
+	size_t len, used;
+	char *buf;
+	hrtime_t start;
+	int cbidx;
+
+	if ((hfs = argsInit(env, info, &args)) == NULL)
+		return (NULL);
+
+	if (args.ha_argc < 1 || !hyprlofs_is_buffer(env, args.ha_argv[0]))
+		return (hyprlofs_throw(env,
+		    "removeMappingsBuffer: expected buffer"));
+
+	if (hfs->argsBatch("removeMappingsBuffer", &args, &cbidx, &chunksize,
+	    &onprogress, NULL, NULL, NULL, &pri) != 0 ||
+	    hfs->argsCheck("removeMappingsBuffer", &args, cbidx) != 0)
+		return (NULL);
+
+	start = gethrtime();
+	hyprlofs_buffer_data(env, args.ha_argv[0], &buf, &len);
+	if (hyprlofs_buffer_count(buf, len, false, &nentries) != 0 ||
+	    (entrylstp = hyprlofs_entries_populate_buffer(buf, len, false,
+	    hyprlofs_batch_len(chunksize, nentries), &used)) == NULL)
+		return (hyprlofs_throw(env,
+		    "removeMappingsBuffer: invalid mappings"));
+
+	op = hyprlofs_op_alloc(env, eioIoctlRun, args.ha_argv[cbidx]);
+	op->hop_stats.hos_marshal = gethrtime() - start;
+	op->hop_ioctl_cmd = HYPRLOFS_RM_ENTRIES;
+	op->hop_ioctl_arg = entrylstp;
+	op->hop_buffer = hyprlofs_ref(env, args.ha_argv[0]);
+	if (chunksize != 0) {
+		hyprlofs_op_batch(op, chunksize, nentries, onprogress);
+		op->hop_batchbufoff = used;
+	}
+	op->hop_pri = pri;
+	return (hfs->async(op));
+}
+
+/*
+ * See README.md.  The desired mappings may be specified either as an array (as
+ * for addMappings) or as a packed Buffer (as for addMappingsBuffer).  The work
+ * of comparing them with the current mappings is done in eioSetRun.
+ */
+napi_value
+HyprlofsFilesystem::SetMappings(napi_env env, napi_callback_info info)
+{
+	return (setCommon(env, info, "setMappings", eioSetRun));
+}
+
+/*
+ * See README.md.  The new mappings are specified as for setMappings, but rather
+ * than being compared with the current ones, they simply replace them (see
+ * eioReplaceRun).
+ */
+napi_value
+HyprlofsFilesystem::ReplaceAll(napi_env env, napi_callback_info info)
+{
+	return (setCommon(env, info, "replaceAll", eioReplaceRun));
+}
+
+/*
+ * Common implementation of setMappings and replaceAll, which differ only in the
+ * work function "run" that applies the marshalled mappings.
+ */
+napi_value
+HyprlofsFilesystem::setCommon(napi_env env, napi_callback_info info,
+    const char *label, void (*run)(hyprlofs_op_t *))
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_entries_t *entrylstp;
+	hyprlofs_args_t args;
+	hyprlofs_op_t *op;
+	uint_t nentries;
+	size_t len, used;
+	hrtime_t start;
+	bool isbuf;
+	char *buf;
+	char msg[64];
+
+	if ((hfs = argsInit(env, info, &args)) == NULL)
+		return (NULL);
+
+	isbuf = args.ha_argc > 0 && hyprlofs_is_buffer(env, args.ha_argv[0]);
+	if (args.ha_argc < 1 ||
+	    (!isbuf && !hyprlofs_is_array(env, args.ha_argv[0]))) {
+		(void) snprintf(msg, sizeof (msg),
+		    "%s: expected array or buffer", label);
+		return (hyprlofs_throw(env, msg));
+	}
+
+	if (hfs->argsCheck(label, &args, 1) != 0)
+		return (NULL);
+
+	(void) snprintf(msg, sizeof (msg), "%s: invalid mappings", label);
+	if (!isbuf) {
+		op = hyprlofs_op_alloc(env, run, args.ha_argv[1]);
+		if (hyprlofs_op_marshal_start(op, args.ha_argv[0],
+		    hyprlofs_array_length(env, args.ha_argv[0]),
+		    &hfs->hfs_yield) != 0) {
+			hyprlofs_op_free(op);
+			return (hyprlofs_throw(env, msg));
+		}
+		return (hfs->async(op));
+	}
+
+	start = gethrtime();
+	hyprlofs_buffer_data(env, args.ha_argv[0], &buf, &len);
+	if (hyprlofs_buffer_count(buf, len, true, &nentries) != 0 ||
+	    (entrylstp = hyprlofs_entries_populate_buffer(buf, len, true,
+	    nentries, &used)) == NULL)
+		return (hyprlofs_throw(env, msg));
+
+	op = hyprlofs_op_alloc(env, run, args.ha_argv[1]);
+	op->hop_stats.hos_marshal = gethrtime() - start;
+	op->hop_ioctl_arg = entrylstp;
+	op->hop_buffer = hyprlofs_ref(env, args.ha_argv[0]);
+	return (hfs->async(op));
+}
+
+/*
+ * See README.md.
+ */
+napi_value
+HyprlofsFilesystem::RemoveAll(napi_env env, napi_callback_info info)
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_args_t args;
+	hyprlofs_op_t *op;
+
+	if ((hfs = argsInit(env, info, &args)) == NULL ||
+	    hfs->argsCheck("removeAll", &args, 0) != 0)
+		return (NULL);
+
+	op = hyprlofs_op_alloc(env, eioIoctlRun, args.ha_argv[0]);
+	op->hop_ioctl_cmd = HYPRLOFS_RM_ALL;
+	return (hfs->async(op));
+}
+
+/*
+ * See README.md.  The mappings are written by eioSnapshotRun.
+ */
+napi_value
+HyprlofsFilesystem::Snapshot(napi_env env, napi_callback_info info)
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_args_t args;
+	hyprlofs_op_t *op;
+	char *file;
+
+	if ((hfs = argsInit(env, info, &args)) == NULL)
+		return (NULL);
+
+	if (args.ha_argc < 1 ||
+	    hyprlofs_typeof(env, args.ha_argv[0]) != napi_string)
+		return (hyprlofs_throw(env, "snapshot: expected path"));
+
+	if (hfs->argsCheck("snapshot", &args, 1) != 0)
+		return (NULL);
+
+	if ((file = hyprlofs_strdup(env, args.ha_argv[0])) == NULL)
+		return (hyprlofs_throw(env, "snapshot: out of memory"));
+
+	op = hyprlofs_op_alloc(env, eioSnapshotRun, args.ha_argv[1]);
+	op->hop_file = file;
+	return (hfs->async(op));
+}
+
+/*
+ * See README.md.  The snapshot is read and its mappings added by
+ * eioRestoreRun, so none of them are ever converted to JavaScript values.
+ */
+napi_value
+HyprlofsFilesystem::Restore(napi_env env, napi_callback_info info)
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_args_t args;
+	hyprlofs_op_t *op;
+	napi_value chunkval;
+	uint32_t chunksize = HYPRLOFS_IOCTL_CHUNK;
+	hyprlofs_pri_t pri = HYPRLOFS_PRI_DEFAULT;
+	const char *msg;
+	char errbuf[128];
+	int cbidx = 1;
+	char *file;
+
+	if ((hfs = argsInit(env, info, &args)) == NULL)
+		return (NULL);
+
+	if (args.ha_argc < 1 ||
+	    hyprlofs_typeof(env, args.ha_argv[0]) != napi_string)
+		return (hyprlofs_throw(env, "restore: expected path"));
+
+	if (args.ha_argc > 1 &&
+	    hyprlofs_typeof(env, args.ha_argv[1]) == napi_object) {
+		cbidx = 2;
+		chunkval = hyprlofs_get(env, args.ha_argv[1], "chunkSize");
+		if (hyprlofs_typeof(env, chunkval) != napi_undefined &&
+		    (!hyprlofs_get_uint32(env, chunkval, &chunksize) ||
+		    chunksize == 0))
+			return (hyprlofs_throw(env, "restore: chunkSize "
+			    "must be a positive integer"));
+		if ((msg = hyprlofs_pri_parse(env, args.ha_argv[1],
+		    &pri)) != NULL) {
+			(void) snprintf(errbuf, sizeof (errbuf),
+			    "restore: %s", msg);
+			return (hyprlofs_throw(env, errbuf));
+		}
+	}
+
+	if (hfs->argsCheck("restore", &args, cbidx) != 0)
+		return (NULL);
+
+	if ((file = hyprlofs_strdup(env, args.ha_argv[0])) == NULL)
+		return (hyprlofs_throw(env, "restore: out of memory"));
+
+	op = hyprlofs_op_alloc(env, eioRestoreRun, args.ha_argv[cbidx]);
+	op->hop_file = file;
+	op->hop_restorechunk = chunksize;
+	op->hop_pri = pri;
+	return (hfs->async(op));
+}
+
+/*
+ * See README.md.
+ */
+napi_value
+HyprlofsFilesystem::Resync(napi_env env, napi_callback_info info)
+{
+	HyprlofsFilesystem *hfs;
+	hyprlofs_args_t args;
+	hyprlofs_op_t *op;
+
+	if ((hfs = argsInit(env, info, &args)) == NULL)
+		return (NULL);
+
+	if (!hfs->hfs_owned)
+		return (hyprlofs_throw(env, "resync: filesystem is not owned"));
+
+	if (hfs->argsCheck("resync", &args, 0) != 0)
+		return (NULL);
+
+	op = hyprlofs_op_alloc(env, eioResyncRun, args.ha_argv[0]);
+	return (hfs->async(op));
+}
+
+/*
+ * Retrieves the arguments to a method into "argsp" and returns the
+ * HyprlofsFilesystem on which it was invoked.  If the receiver isn't a
+ * Filesystem, this returns NULL, and the caller must return back to JavaScript
+ * since an exception has already been scheduled to be thrown.
+ */
+HyprlofsFilesystem *
+HyprlofsFilesystem::argsInit(napi_env env, napi_callback_info info,
+    hyprlofs_args_t *argsp)
+{
+	void *hfs;
+
+	hyprlofs_args_get(env, info, argsp);
+	if ((hfs = hyprlofs_unwrap(env, argsp->ha_this,
+	    &hyprlofs_fs_tag)) == NULL) {
+		(void) napi_throw_type_error(env, NULL,
+		    "method invoked on an object that is not a Filesystem");
+		return (NULL);
+	}
+
+	return ((HyprlofsFilesystem *)hfs);
+}
+
+/*
+ * Validates arguments common to asynchronous functions.  The callback at "idx"
+ * may be omitted (or undefined), in which case the operation returns a Promise
+ * instead (see async).  If this function returns -1, the caller must return
+ * back to JavaScript without invoking more JavaScript code, since a JavaScript
+ * exception has already been scheduled to be thrown.
+ */
+int
+HyprlofsFilesystem::argsCheck(const char *label, const hyprlofs_args_t *argsp,
+    int idx)
+{
+	napi_valuetype type;
+	char errbuf[128];
+
+	type = hyprlofs_typeof(this->hfs_env, argsp->ha_argv[idx]);
+	if (type == napi_undefined || type == napi_function)
+		return (0);
+
+	(void) snprintf(errbuf, sizeof (errbuf),
+	    "%s: expected callback argument", label);
+	(void) hyprlofs_throw(this->hfs_env, errbuf);
+	return (-1);
+}
+
+/*
+ * Parses the optional "options" argument that may follow the mappings passed
+ * to the add and remove entry points, storing the index of the callback
+ * argument into "cbidxp", the requested chunk size (or 0) into "chunksizep",
+ * and the progress callback (if any) into "onprogressp".  For add operations,
+ * "partialp" and "validatep" are non-NULL and receive whether partial and
+ * validate mode were requested.  For array entry points, "yieldp" is non-NULL
+ * and receives the marshalling budget: this object's default, overridden by
+ * any given in "options".  The priority requested in "options", if any, is
+ * stored into "prip".  As with argsCheck, if this returns -1, an exception has
+ * already been scheduled.
+ */
+int
+HyprlofsFilesystem::argsBatch(const char *label, const hyprlofs_args_t *argsp,
+    int *cbidxp, uint_t *chunksizep, napi_value *onprogressp,
+    bool *partialp, bool *validatep, hyprlofs_yield_t *yieldp,
+    hyprlofs_pri_t *prip)
+{
+	napi_env env = this->hfs_env;
+	napi_value options, chunksize, onprogress;
+	uint32_t size = 0;
+	const char *msg = NULL;
+	char errbuf[128];
+
+	*cbidxp = 1;
+	*chunksizep = 0;
+	*onprogressp = NULL;
+	*prip = HYPRLOFS_PRI_DEFAULT;
+	if (partialp != NULL)
+		*partialp = false;
+	if (validatep != NULL)
+		*validatep = false;
+	if (yieldp != NULL)
+		*yieldp = this->hfs_yield;
+
+	if (argsp->ha_argc < 2 ||
+	    hyprlofs_typeof(env, argsp->ha_argv[1]) != napi_object)
+		return (0);
+
+	options = argsp->ha_argv[1];
+	chunksize = hyprlofs_get(env, options, "chunkSize");
+	onprogress = hyprlofs_get(env, options, "onProgress");
+	*cbidxp = 2;
+
+	if (hyprlofs_typeof(env, chunksize) != napi_undefined &&
+	    (!hyprlofs_get_uint32(env, chunksize, &size) || size == 0))
+		msg = "chunkSize must be a positive integer";
+	else if (hyprlofs_typeof(env, onprogress) != napi_undefined &&
+	    hyprlofs_typeof(env, onprogress) != napi_function)
+		msg = "onProgress must be a function";
+	else if (hyprlofs_typeof(env, onprogress) != napi_undefined &&
+	    size == 0)
+		msg = "onProgress requires chunkSize";
+	else if (yieldp != NULL)
+		msg = hyprlofs_yield_parse(env, options, yieldp);
+
+	if (msg == NULL)
+		msg = hyprlofs_pri_parse(env, options, prip);
+
+	if (msg != NULL) {
+		(void) snprintf(errbuf, sizeof (errbuf), "%s: %s", label, msg);
+		(void) hyprlofs_throw(env, errbuf);
+		return (-1);
+	}
+
+	*chunksizep = size;
+	*onprogressp = onprogress;
+	if (partialp != NULL)
+		*partialp = hyprlofs_truthy(env,
+		    hyprlofs_get(env, options, "partial"));
+	if (validatep != NULL)
+		*validatep = hyprlofs_truthy(env,
+		    hyprlofs_get(env, options, "validate"));
+	return (0);
+}
+
+/*
+ * Invoked from Unmount and the hyprlofs ioctl entry points, running in the
+ * event loop context, to invoke operations asynchronously.  The operation is
+ * appended to this object's queue and dispatched as soon as every operation
+ * requested before it has completed (and, if it's still being marshalled, once
+ * that's finished too).  If the caller supplied no callback, we return a
+ * Promise to be settled when the operation completes (see complete).
+ * Otherwise, we return undefined.
+ */
+napi_value
+HyprlofsFilesystem::async(hyprlofs_op_t *op)
+{
+	napi_value rv = NULL;
+
+	if (op->hop_callback == NULL && op->hop_group == NULL &&
+	    napi_create_promise(this->hfs_env, &op->hop_deferred, &rv) !=
+	    napi_ok) {
+		hyprlofs_op_free(op);
+		return (hyprlofs_throw(this->hfs_env,
+		    "failed to create Promise"));
+	}
+
+	op->hop_hfs = this;
+	op->hop_stats.hos_queued = gethrtime();
+
+	/*
+	 * The object's default priority only applies to operations that add
+	 * or remove particular mappings (including restore).  Everything else
+	 * is interactive unless it says otherwise.
+	 */
+	if (op->hop_pri == HYPRLOFS_PRI_DEFAULT)
+		op->hop_pri = (op->hop_run == HyprlofsFilesystem::eioIoctlRun &&
+		    (op->hop_ioctl_cmd == HYPRLOFS_ADD_ENTRIES ||
+		    op->hop_ioctl_cmd == HYPRLOFS_RM_ENTRIES)) ||
+		    op->hop_run == HyprlofsFilesystem::eioRestoreRun ?
+		    this->hfs_pri : HYPRLOFS_PRI_INTERACTIVE;
+	op->hop_work.hw_background = op->hop_pri == HYPRLOFS_PRI_BACKGROUND;
+	this->Ref();
+
+	if (HYPRLOFS_OP_START_ENABLED()) {
+		HYPRLOFS_OP_START((uintptr_t)op, this->hfs_label,
+		    (char *)opName(op), hyprlofs_op_nentries(op));
+	}
+
+	if (this->hfs_queue_tail == NULL) {
+		this->hfs_queue = op;
+		this->hfs_queue_tail = op;
+	} else if (!this->queueAhead(op)) {
+		this->hfs_queue_tail->hop_next = op;
+		this->hfs_queue_tail = op;
+	}
+
+	if (op->hop_marshalling)
+		hyprlofs_work_queue(this->hfs_env, NULL, &op->hop_work,
+		    hyprlofs_work_noop, marshalNext, op);
+
+	if (this->hfs_inflight == NULL)
+		this->dispatch();
+
+	return (rv);
+}
+
+/*
+ * Invoked from async() to queue interactive operation "op" ahead of background
+ * operations that haven't been dispatched yet, when it's safe to do so.  Only
+ * an add or remove operation can move, and only past the background add and
+ * remove operations at the end of the queue that involve none of its aliases,
+ * since the outcome is then the same in either order.  Any other operation is
+ * a barrier.  Returns true if "op" was queued, or false if it should just be
+ * appended.
+ */
+bool
+HyprlofsFilesystem::queueAhead(hyprlofs_op_t *op)
+{
+	hyprlofs_entries_t *entrylstp = (hyprlofs_entries_t *)op->hop_ioctl_arg;
+	hyprlofs_entries_t *otherp;
+	hyprlofs_hnode_t *nodes;
+	hyprlofs_htable_t table;
+	hyprlofs_op_t **nextp, **insp = NULL, *qop;
+	bool skip;
+	uint_t i;
+
+	if (op->hop_pri == HYPRLOFS_PRI_BACKGROUND || !reorderable(op) ||
+	    this->hfs_queue_tail->hop_pri != HYPRLOFS_PRI_BACKGROUND ||
+	    !reorderable(this->hfs_queue_tail))
+		return (false);
+
+	if ((nodes = (hyprlofs_hnode_t *)calloc(entrylstp->hle_len + 1,
+	    sizeof (hyprlofs_hnode_t))) == NULL)
+		return (false);
+
+	if (hyprlofs_htable_init(&table, entrylstp->hle_len) != 0) {
+		free(nodes);
+		return (false);
+	}
+
+	for (i = 0; i < entrylstp->hle_len; i++) {
+		nodes[i].hn_key = entrylstp->hle_entries[i].hle_name;
+		hyprlofs_htable_insert(&table, &nodes[i]);
+	}
+
+	/*
+	 * Find the start of the run of operations at the end of the queue that
+	 * "op" may precede.
+	 */
+	for (nextp = &this->hfs_queue; (qop = *nextp) != NULL;
+	    nextp = &qop->hop_next) {
+		skip = qop->hop_pri == HYPRLOFS_PRI_BACKGROUND &&
+		    reorderable(qop);
+		otherp = (hyprlofs_entries_t *)qop->hop_ioctl_arg;
+		for (i = 0; skip && i < otherp->hle_len; i++) {
+			if (hyprlofs_htable_lookup(&table,
+			    otherp->hle_entries[i].hle_name) != NULL)
+				skip = false;
+		}
+
+		if (!skip)
+			insp = NULL;
+		else if (insp == NULL)
+			insp = nextp;
+	}
+
+	hyprlofs_htable_fini(&table);
+	free(nodes);
+
+	if (insp == NULL)
+		return (false);
+
+	op->hop_next = *insp;
+	*insp = op;
+	return (true);
+}
+
+/*
+ * Returns true if queued operation "op" is a plain add or remove operation
+ * whose entries are all available, so that queueAhead can tell which aliases it
+ * involves.
+ */
+bool
+HyprlofsFilesystem::reorderable(const hyprlofs_op_t *op)
+{
+	return (op->hop_run == HyprlofsFilesystem::eioIoctlRun &&
+	    (op->hop_ioctl_cmd == HYPRLOFS_ADD_ENTRIES ||
+	    op->hop_ioctl_cmd == HYPRLOFS_RM_ENTRIES) &&
+	    op->hop_ioctl_arg != NULL && op->hop_batchsize == 0 &&
+	    !op->hop_marshalling && op->hop_rv == 0);
+}
+
+/*
+ * Dispatches the operation at the head of the queue, if there is one, it's been
+ * fully marshalled, and there isn't already one in flight.  This is pretty much
+ * boilerplate for Node add-ons implementing asynchronous operations.
+ */
+void
+HyprlofsFilesystem::dispatch()
+{
+	hyprlofs_op_t *op, *next;
+	hrtime_t now;
+
+	if (this->hfs_inflight != NULL || (op = this->hfs_queue) == NULL ||
+	    op->hop_marshalling)
+		return;
+
+	if ((this->hfs_queue = op->hop_next) == NULL)
+		this->hfs_queue_tail = NULL;
+	op->hop_next = NULL;
+
+	/*
+	 * An operation whose mappings turned out to be invalid part way
+	 * through marshalling (see marshalNext) fails without being
+	 * submitted.  It's still completed from a later event loop iteration,
+	 * since we may have been called from the entry point of another
+	 * operation.
+	 */
+	if (op->hop_rv != 0) {
+		this->hfs_inflight = op;
+		hyprlofs_work_queue(this->hfs_env, NULL, &op->hop_work,
+		    hyprlofs_work_noop, marshalFail, op);
+		return;
+	}
+
+	if (this->hfs_queue != NULL &&
+	    coalescable(op, this->hfs_queue))
+		this->coalesce(op);
+
+	now = gethrtime();
+	for (next = op; next != NULL; next = next->hop_coalesced)
+		next->hop_stats.hos_dispatched = now;
+
+	this->hfs_inflight = op;
+	this->submit(op);
+
+	if (op->hop_batchsize != 0)
+		hyprlofs_op_batch_prepare(op);
+}
+
+/*
+ * Hands operation "op" (or its next chunk) to the threadpool.  For add
+ * operations in validate mode, we first split the entries among several
+ * concurrent jobs that check their paths (see eioStatRun), and the operation
+ * itself is submitted once they've all finished (see eioStatFini).  If we can't
+ * allocate what we need for that, the worker checks the paths itself instead.
+ */
+void
+HyprlofsFilesystem::submit(hyprlofs_op_t *op)
+{
+	hyprlofs_entries_t *entrylstp = (hyprlofs_entries_t *)op->hop_ioctl_arg;
+	hyprlofs_statjob_t *jobp;
+	uint_t njobs, per, i;
+
+	if (op->hop_validate && entrylstp->hle_len > 0) {
+		assert(op->hop_staterrs == NULL && op->hop_statjobs == NULL);
+		njobs = entrylstp->hle_len / HYPRLOFS_VALIDATE_MINJOB + 1;
+		if (njobs > HYPRLOFS_VALIDATE_MAXJOBS)
+			njobs = HYPRLOFS_VALIDATE_MAXJOBS;
+		per = (entrylstp->hle_len + njobs - 1) / njobs;
+
+		op->hop_staterrs = (int *)calloc(entrylstp->hle_len,
+		    sizeof (int));
+		op->hop_statjobs = (hyprlofs_statjob_t *)calloc(njobs,
+		    sizeof (hyprlofs_statjob_t));
+		if (op->hop_staterrs != NULL && op->hop_statjobs != NULL) {
+			op->hop_statpending = njobs;
+			for (i = 0; i < njobs; i++) {
+				jobp = &op->hop_statjobs[i];
+				jobp->hsj_op = op;
+				jobp->hsj_work.hw_background =
+				    op->hop_work.hw_background;
+				jobp->hsj_start = i * per;
+				jobp->hsj_count = jobp->hsj_start >=
+				    entrylstp->hle_len ? 0 : MIN(per,
+				    entrylstp->hle_len - jobp->hsj_start);
+				hyprlofs_work_queue(this->hfs_env,
+				    this->hfs_tpool, &jobp->hsj_work,
+				    eioStatRun, eioStatFini, jobp);
+			}
+			return;
+		}
+
+		free(op->hop_staterrs);
+		free(op->hop_statjobs);
+		op->hop_staterrs = NULL;
+		op->hop_statjobs = NULL;
+	}
+
+	hyprlofs_work_queue(this->hfs_env, this->hfs_tpool, &op->hop_work,
+	    eioRun, eioAsyncFini, op);
+}
+
+/*
+ * Invoked outside the event loop (via the threadpool) to check the paths of one
+ * slice of the entries of an add operation in validate mode.
+ */
+void
+HyprlofsFilesystem::eioStatRun(napi_env env, void *arg)
+{
+	hyprlofs_statjob_t *jobp = (hyprlofs_statjob_t *)arg;
+	hyprlofs_op_t *op = jobp->hsj_op;
+	hyprlofs_entries_t *entrylstp = (hyprlofs_entries_t *)op->hop_ioctl_arg;
+	struct stat st;
+	uint_t i;
+
+	for (i = jobp->hsj_start; i < jobp->hsj_start + jobp->hsj_count; i++)
+		op->hop_staterrs[i] = stat(entrylstp->hle_entries[i].hle_path,
+		    &st) != 0 ? errno : 0;
+}
+
+/*
+ * Invoked in the context of the event loop as each validation job finishes.
+ * When the last one has finished, the operation itself is submitted.
+ */
+void
+HyprlofsFilesystem::eioStatFini(napi_env env, napi_status status, void *arg)
+{
+	hyprlofs_statjob_t *jobp = (hyprlofs_statjob_t *)arg;
+	hyprlofs_op_t *op = jobp->hsj_op;
+
+	hyprlofs_work_done(env, &jobp->hsj_work);
+
+	assert(op->hop_statpending > 0);
+	if (--op->hop_statpending > 0)
+		return;
+
+	free(op->hop_statjobs);
+	op->hop_statjobs = NULL;
+	hyprlofs_work_queue(env, op->hop_hfs->hfs_tpool, &op->hop_work, eioRun,
+	    eioAsyncFini, op);
+}
+
+/*
+ * Invoked outside the event loop (via the threadpool) to run operation "op"
+ * (and any operations coalesced with it).  In owned mode, if any part of a
+ * change to the mappings failed, we can't tell exactly which parts of it were
+ * applied, so we also fetch the resulting mappings so that the index can be
+ * rebuilt.
+ */
+void
+HyprlofsFilesystem::eioRun(napi_env env, void *arg)
+{
+	hyprlofs_op_t *op = (hyprlofs_op_t *)arg;
+	hyprlofs_op_t *next;
+
+	op->hop_run(op);
+
+	if (!op->hop_hfs->hfs_owned || !mutates(op))
+		return;
+
+	for (next = op; next != NULL; next = next->hop_coalesced) {
+		if (next->hop_rv != 0) {
+			op->hop_hfs->doResync(op);
+			return;
+		}
+	}
+}
+
+/*
+ * Invoked outside the event loop to fetch the current mappings into op's
+ * hop_resync_ents without disturbing op's own result.
+ */
+void
+HyprlofsFilesystem::doResync(hyprlofs_op_t *op)
+{
+	char opname[sizeof (op->hop_opname)];
+	int rv = op->hop_rv;
+	int err = op->hop_errno;
+
+	(void) strlcpy(opname, op->hop_opname, sizeof (opname));
+	this->doGetEntries(op, &op->hop_resync_ents);
+	op->hop_resynced = op->hop_rv == 0;
+
+	op->hop_rv = rv;
+	op->hop_errno = err;
+	(void) strlcpy(op->hop_opname, opname, sizeof (op->hop_opname));
+}
+
+/*
+ * Invoked by dispatch() when the operation "op" about to be dispatched is
+ * followed in the queue by one or more operations issuing the same ioctl.  We
+ * remove all of them from the queue, chain them from "op", and build a single
+ * list of entries covering all of them so that they can be processed with one
+ * ioctl.  If we can't allocate that list, "op" is simply dispatched by itself.
+ *
+ * If the combined ioctl fails, doCoalescedRecover needs to tell which entries
+ * were applied, which it can only do if no alias appears twice in the chain:
+ * otherwise, a later operation could replace (or remove) what an earlier one
+ * did.  For removes, it also means knowing that every alias was present
+ * beforehand, so removes are only combined in owned mode, and only while the
+ * index shows that each alias is present.  The chain stops at the first
+ * operation that doesn't meet these conditions (see chainable()), which is
+ * left to run by itself.
+ */
+void
+HyprlofsFilesystem::coalesce(hyprlofs_op_t *op)
+{
+	hyprlofs_op_t *next, **tailp;
+	hyprlofs_entries_t *entrylstp, *mergedp;
+	hyprlofs_hnode_t *nodes = NULL;
+	hyprlofs_htable_t seen;
+	uint_t nentries, nnodes = 0, i;
+	bool rm = op->hop_ioctl_cmd == HYPRLOFS_RM_ENTRIES;
+
+	if (rm && (!this->hfs_owned || this->hfs_index_stale))
+		return;
+
+	nentries = ((hyprlofs_entries_t *)op->hop_ioctl_arg)->hle_len;
+	for (next = this->hfs_queue; next != NULL &&
+	    coalescable(op, next); next = next->hop_next)
+		nentries += ((hyprlofs_entries_t *)next->hop_ioctl_arg)->
+		    hle_len;
+
+	bzero(&seen, sizeof (seen));
+	if ((nodes = (hyprlofs_hnode_t *)calloc(nentries + 1,
+	    sizeof (hyprlofs_hnode_t))) == NULL ||
+	    hyprlofs_htable_init(&seen, nentries) != 0 ||
+	    !this->chainable(op, &seen, nodes, &nnodes)) {
+		hyprlofs_htable_fini(&seen);
+		free(nodes);
+		return;
+	}
+
+	if ((mergedp = hyprlofs_entries_alloc(nentries)) == NULL) {
+		hyprlofs_htable_fini(&seen);
+		free(nodes);
+		return;
+	}
+
+	/*
+	 * The combined entries point at the strings owned by each individual
+	 * operation's entries, so the combined list owns no strings itself.
+	 */
+	entrylstp = (hyprlofs_entries_t *)op->hop_ioctl_arg;
+	bcopy(entrylstp->hle_entries, mergedp->hle_entries,
+	    entrylstp->hle_len * sizeof (hyprlofs_entry_t));
+	mergedp->hle_len = entrylstp->hle_len;
+
+	tailp = &op->hop_coalesced;
+	while ((next = this->hfs_queue) != NULL &&
+	    coalescable(op, next) &&
+	    this->chainable(next, &seen, nodes, &nnodes)) {
+		if ((this->hfs_queue = next->hop_next) == NULL)
+			this->hfs_queue_tail = NULL;
+		next->hop_next = NULL;
+
+		entrylstp = (hyprlofs_entries_t *)next->hop_ioctl_arg;
+		for (i = 0; i < entrylstp->hle_len; i++)
+			mergedp->hle_entries[mergedp->hle_len++] =
+			    entrylstp->hle_entries[i];
+
+		*tailp = next;
+		tailp = &next->hop_coalesced;
+	}
+
+	hyprlofs_htable_fini(&seen);
+	free(nodes);
+
+	assert(mergedp->hle_len <= nentries);
+	if (op->hop_coalesced == NULL) {
+		hyprlofs_entries_free(mergedp);
+		return;
+	}
+
+	op->hop_merged = mergedp;
+}
+
+/*
+ * Invoked by coalesce() to check that none of the aliases of add or remove
+ * operation "op" is in "seenp", the aliases of the operations before it in the
+ * chain (or earlier in "op" itself), and for removes, that each one is in the
+ * index.  The aliases are added to "seenp" using the nodes in "nodes" starting
+ * at "*nnodesp".
+ */
+bool
+HyprlofsFilesystem::chainable(const hyprlofs_op_t *op,
+    hyprlofs_htable_t *seenp, hyprlofs_hnode_t *nodes, uint_t *nnodesp)
+{
+	hyprlofs_entries_t *entrylstp = (hyprlofs_entries_t *)op->hop_ioctl_arg;
+	bool rm = op->hop_ioctl_cmd == HYPRLOFS_RM_ENTRIES;
+	const char *name;
+
+	for (uint_t i = 0; i < entrylstp->hle_len; i++) {
+		name = entrylstp->hle_entries[i].hle_name;
+		if (hyprlofs_htable_lookup(seenp, name) != NULL || (rm &&
+		    hyprlofs_htable_lookup(&this->hfs_index, name) == NULL))
+			return (false);
+
+		nodes[*nnodesp].hn_key = name;
+		hyprlofs_htable_insert(seenp, &nodes[(*nnodesp)++]);
+	}
+
+	return (true);
+}
+
+/*
+ * Invoked outside the event loop (via the threadpool) to actually run
+ * umount(2).
+ */
+void
+HyprlofsFilesystem::eioUmountRun(hyprlofs_op_t *op)
+{
+	HyprlofsFilesystem *hfs = op->hop_hfs;
+	if (hyprlofs_debug || hfs->hfs_debug)
+		(void) fprintf(stderr, "hyprlofs umount %s\n", hfs->hfs_label);
+
+	/*
+	 * We have to close our fd first in order to unmount the filesystem.  It
+	 * will be reopened as-needed if the user goes to do another ioctl.  If
+	 * the fd belongs to a MountManager and another Filesystem is using it
+	 * right now, it's closed as soon as that ioctl finishes, but the
+	 * unmount itself may fail with EBUSY.
+	 */
+	if (hfs->hfs_pool != NULL) {
+		hyprlofs_pool_purge(hfs->hfs_pool, hfs->hfs_label);
+	} else if (hfs->hfs_fd != -1) {
+		(void) close(hfs->hfs_fd);
+		hfs->hfs_fd = -1;
+	}
+
+	hfs->hfs_get_hint = 0;
+
+	op->hop_errno = 0;
+	op->hop_rv = hyprlofs_backend->hbk_umount(hfs->hfs_label);
+	op->hop_errno = op->hop_rv != 0 ? errno : 0;
+	(void) strlcpy(op->hop_opname, "hyprlofs umount",
+	    sizeof (op->hop_opname));
+
+	if (hyprlofs_debug || hfs->hfs_debug)
+		(void) fprintf(stderr, "    hyprlofs umount (%s) returned %d "
+		    "(error = %s)\n", hfs->hfs_label, op->hop_rv,
+		    strerror(errno));
+}
+
+/*
+ * Invoked outside the event loop (via the threadpool) to actually run mount(2).
+ */
+void
+HyprlofsFilesystem::eioMountRun(hyprlofs_op_t *op)
+{
+	HyprlofsFilesystem *hfs = op->hop_hfs;
+	hyprlofs_poolent_t *entp;
+
+	if (hyprlofs_debug || hfs->hfs_debug)
+		(void) fprintf(stderr, "hyprlofs mount %s\n", hfs->hfs_label);
+
+	/*
+	 * Any fd the pool has for this path refers to whatever was there
+	 * before, not the new mount.
+	 */
+	if (hfs->hfs_pool != NULL)
+		hyprlofs_pool_purge(hfs->hfs_pool, hfs->hfs_label);
+
+	op->hop_errno = 0;
+	op->hop_rv = hyprlofs_backend->hbk_mount(hfs->hfs_label,
+	    op->hop_mountopts, MAX_MNTOPT_STR);
+	op->hop_errno = op->hop_rv != 0 ? errno : 0;
+	(void) strlcpy(op->hop_opname, "hyprlofs mount",
+	    sizeof (op->hop_opname));
+
+	if (hyprlofs_debug || hfs->hfs_debug)
+		(void) fprintf(stderr, "    hyprlofs mount (%s) returned %d "
+		    "(error = %s, optstr=\"%s\")\n", hfs->hfs_label,
+		    op->hop_rv, strerror(errno), op->hop_mountopts);
+
+	/*
+	 * The new mount is empty, but if the caller expects it to hold many
+	 * mappings, the first GET may as well have room for them, rather than
+	 * finding out how many there are with a separate ioctl.
+	 */
+	if (op->hop_rv == 0)
+		hfs->hfs_get_hint = op->hop_mounthint;
+
+	/*
+	 * For managed mounts, open the new mount now so that the first ioctl
+	 * doesn't have to.  If this fails, the first ioctl will report why.
+	 */
+	if (op->hop_rv == 0 && hfs->hfs_pool != NULL &&
+	    hyprlofs_pool_get(hfs->hfs_pool, hfs->hfs_label, &entp) == 0)
+		hyprlofs_pool_put(hfs->hfs_pool, entp, false);
+}
+
+/*
+ * Returns the largest number of mappings that operation "op" may add or remove
+ * with one ioctl without exceeding the bursts that this object's and the
+ * process-wide rate limits allow, or 0 if there's no such limit.  Only
+ * background operations wait for rate limits, so only they are limited.
+ */
+uint_t
+HyprlofsFilesystem::throttleMax(const hyprlofs_op_t *op)
+{
+	hyprlofs_bucket_t *buckets[2] = { this->hfs_bucket, &hyprlofs_bucket };
+	uint_t max = 0;
+	uint32_t rate;
+
+	if (op->hop_pri != HYPRLOFS_PRI_BACKGROUND)
+		return (0);
+
+	for (uint_t i = 0; i < 2; i++) {
+		if (buckets[i] != NULL &&
+		    (rate = hyprlofs_bucket_rate(buckets[i])) != 0 &&
+		    (max == 0 || rate < max))
+			max = rate;
+	}
+
+	return (max);
+}
+
+/*
+ * Invoked outside the event loop before operation "op" issues an ioctl to add
+ * or remove "nentries" mappings, to account for them against this object's rate
+ * limit and the process-wide one.  Background operations wait here until each
+ * limit allows them to proceed.
+ */
+void
+HyprlofsFilesystem::throttle(hyprlofs_op_t *op, uint_t nentries)
+{
+	hyprlofs_bucket_t *buckets[2] = { this->hfs_bucket, &hyprlofs_bucket };
+	bool wait = op->hop_pri == HYPRLOFS_PRI_BACKGROUND;
+	struct timespec ts;
+	hrtime_t start, delay;
+
+	start = gethrtime();
+	for (uint_t i = 0; i < 2; i++) {
+		if (buckets[i] == NULL)
+			continue;
+
+		while ((delay = hyprlofs_bucket_take(buckets[i], nentries,
+		    wait)) != 0) {
+			ts.tv_sec = delay / 1000000000;
+			ts.tv_nsec = delay % 1000000000;
+			(void) nanosleep(&ts, NULL);
+		}
+	}
+
+	if (wait)
+		op->hop_stats.hos_throttled += gethrtime() - start;
+}
+
+/*
+ * Invoked outside the event loop on behalf of operation "op" to issue a
+ * hyprlofs ioctl, waiting first for rate limits if needed (see throttle()).
+ * The result is recorded in op's hop_rv, hop_errno, and hop_opname.
+ *
+ * A background add or remove of more mappings than a rate limit allows in one
+ * burst is issued as several ioctls of at most that many mappings each, so
+ * that the limit holds for the request itself and not just the ones after it.
+ * Each piece is issued only if the ones before it succeeded.  Since the kernel
+ * also processes entries in order and stops at the first one that fails, the
+ * result is the same as for a single ioctl.
+ */
+void
+HyprlofsFilesystem::doIoctl(hyprlofs_op_t *op, int cmd, void *arg)
+{
+	hyprlofs_entries_t *entrylstp = (hyprlofs_entries_t *)arg;
+	hyprlofs_entries_t piece;
+	uint_t max, off;
+
+	if ((cmd != HYPRLOFS_ADD_ENTRIES && cmd != HYPRLOFS_RM_ENTRIES) ||
+	    arg == NULL) {
+		this->issueIoctl(op, cmd, arg);
+		return;
+	}
+
+	max = this->throttleMax(op);
+	if (max == 0 || entrylstp->hle_len <= max) {
+		this->throttle(op, entrylstp->hle_len);
+		this->issueIoctl(op, cmd, arg);
+		return;
+	}
+
+	for (off = 0; off < entrylstp->hle_len; off += piece.hle_len) {
+		piece.hle_entries = entrylstp->hle_entries + off;
+		piece.hle_len = MIN(max, entrylstp->hle_len - off);
+		this->throttle(op, piece.hle_len);
+		this->issueIoctl(op, cmd, &piece);
+		if (op->hop_rv != 0)
+			break;
+	}
+}
+
+/*
+ * Invoked by doIoctl() to issue a single hyprlofs ioctl, opening the
+ * mountpoint first if necessary (or, for objects created with a MountManager,
+ * getting it from the manager's pool).  The result is recorded in op's hop_rv,
+ * hop_errno, and hop_opname.
+ */
+void
+HyprlofsFilesystem::issueIoctl(hyprlofs_op_t *op, int cmd, void *arg)
+{
+	hyprlofs_poolent_t *entp = NULL;
+	hrtime_t start;
+	int fd, idx;
+
+	if (this->hfs_pool != NULL) {
+		fd = hyprlofs_pool_get(this->hfs_pool, this->hfs_label,
+		    &entp) == 0 ? entp->pe_fd : -1;
+	} else {
+		if (this->hfs_fd == -1 && (hyprlofs_debug || this->hfs_debug))
+			(void) fprintf(stderr, "    hyprlofs open (%s)\n",
+			    this->hfs_label);
+		if (this->hfs_fd == -1)
+			this->hfs_fd = hyprlofs_open(this->hfs_label);
+		fd = this->hfs_fd;
+	}
+
+	if (fd == -1) {
+		op->hop_rv = -1;
+		op->hop_errno = errno;
+		(void) strlcpy(op->hop_opname, "hyprlofs open",
+		    sizeof (op->hop_opname));
+		if (hyprlofs_debug || this->hfs_debug)
+			(void) fprintf(stderr, "    hyprlofs open (%s) "
+			    "failed: %s\n", this->hfs_label, strerror(errno));
+		return;
+	}
+
+	if (hyprlofs_debug || this->hfs_debug) {
+		(void) fprintf(stderr, "    hyprlofs ioctl (%s): %s\n",
+		    this->hfs_label, hyprlofs_cmdname(cmd));
+
+		if (arg != NULL && cmd != HYPRLOFS_GET_ENTRIES) {
+			hyprlofs_entries_t *entrylstp =
+			    (hyprlofs_entries_t *)arg;
+
+			for (uint_t i = 0; i < entrylstp->hle_len; i++) {
+				hyprlofs_entry_t *entryp =
+				    &entrylstp->hle_entries[i];
+				(void) fprintf(stderr, "    %3d: %s -> %s\n", i,
+				    entryp->hle_path, entryp->hle_name);
+			}
+		}
+	}
+
+	if (HYPRLOFS_IOCTL_ENTRY_ENABLED()) {
+		HYPRLOFS_IOCTL_ENTRY(this->hfs_label,
+		    (char *)hyprlofs_cmdname(cmd), arg == NULL ? 0 :
+		    cmd == HYPRLOFS_GET_ENTRIES ?
+		    ((hyprlofs_curr_entries_t *)arg)->hce_cnt :
+		    ((hyprlofs_entries_t *)arg)->hle_len);
+	}
+
+	op->hop_errno = 0;
+	start = gethrtime();
+	op->hop_rv = hyprlofs_backend->hbk_ioctl(fd, cmd, arg);
+	op->hop_errno = op->hop_rv != 0 ? errno : 0;
+	op->hop_stats.hos_ioctl += gethrtime() - start;
+	HYPRLOFS_IOCTL_RETURN(this->hfs_label, (char *)hyprlofs_cmdname(cmd),
+	    op->hop_rv, op->hop_errno);
+	if ((idx = hyprlofs_cmdidx(cmd)) != -1)
+		op->hop_stats.hos_nioctls[idx]++;
+	(void) snprintf(op->hop_opname, sizeof (op->hop_opname),
+	    "hyprlofs ioctl %s", hyprlofs_cmdname(cmd));
+
+	if (hyprlofs_debug || this->hfs_debug)
+		(void) fprintf(stderr, "    hyprlofs ioctl (%s) returned %d "
+		    "(error = %s)\n", this->hfs_label, op->hop_rv,
+		    strerror(errno));
+
+	/*
+	 * ENOTTY means the fd doesn't refer to a hyprlofs mount (e.g., it was
+	 * opened before the filesystem was mounted), so we close it in case
+	 * the filesystem has been mounted since.
+	 */
+	if (entp != NULL) {
+		hyprlofs_pool_put(this->hfs_pool, entp,
+		    op->hop_rv == -1 && op->hop_errno == ENOTTY);
+	} else if (op->hop_rv == -1 && op->hop_errno == ENOTTY) {
+		(void) close(this->hfs_fd);
+		this->hfs_fd = -1;
+	}
+}
+
+/*
+ * Invoked outside the event loop (via the threadpool) to actually perform a
+ * hyprlofs ioctl.
+ */
+void
+HyprlofsFilesystem::eioIoctlRun(hyprlofs_op_t *op)
+{
+	hyprlofs_op_t *next;
+
+	if (hyprlofs_op_checked(op)) {
+		op->hop_hfs->doAddChecked(op);
+		return;
+	}
+
+	if (op->hop_merged == NULL) {
+		op->hop_hfs->doIoctl(op, op->hop_ioctl_cmd, op->hop_ioctl_arg);
+		return;
+	}
+
+	op->hop_hfs->doIoctl(op, op->hop_ioctl_cmd, op->hop_merged);
+	if (op->hop_rv != 0) {
+		op->hop_hfs->doCoalescedRecover(op);
+		return;
+	}
+
+	for (next = op->hop_coalesced; next != NULL;
+	    next = next->hop_coalesced) {
+		next->hop_rv = op->hop_rv;
+		next->hop_errno = op->hop_errno;
+		(void) strlcpy(next->hop_opname, op->hop_opname,
+		    sizeof (next->hop_opname));
+	}
+}
+
+/*
+ * Invoked outside the event loop when a coalesced ioctl on behalf of "op" and
+ * the operations chained from it has failed.  The kernel processes entries in
+ * order and stops at the first one that fails, so the entries before it were
+ * applied, the error belongs to the operation containing it, and the entries
+ * after it weren't processed at all.  To find it, we fetch the current mappings
+ * and look for the first operation with an entry that isn't in the desired
+ * state.  That only works because coalesce() checked that no alias appears
+ * twice in the chain, so no entry's state was changed by a later one, and for
+ * removes, that every alias was present beforehand: an alias that's absent now
+ * was removed by this ioctl, not absent all along.  The operations before that one succeeded, it
+ * gets the error, and each operation after it is reissued by itself to obtain
+ * its own result.
+ *
+ * If we can't fetch the mappings, we can't tell where the ioctl stopped.  Adds
+ * are simply reissued, since adding a mapping again is harmless, but removes all
+ * get the error.  If every entry appears to have been applied, the failing one
+ * must have been an add of a mapping that already existed (or another writer
+ * has changed the mount), so the last operation is reissued.
+ */
+void
+HyprlofsFilesystem::doCoalescedRecover(hyprlofs_op_t *op)
+{
+	hyprlofs_curr_entries_t curr_ents;
+	hyprlofs_op_t *next;
+	char opname[sizeof (op->hop_opname)];
+	bool fetched, failed = false;
+	int err;
+
+	/*
+	 * "op" is about to be given its own result anyway, so it's fine for
+	 * the GET to clobber it.
+	 */
+	err = op->hop_errno;
+	(void) strlcpy(opname, op->hop_opname, sizeof (opname));
+	this->doGetEntries(op, &curr_ents);
+	fetched = op->hop_rv == 0;
+
+	if (fetched)
+		qsort(curr_ents.hce_entries, curr_ents.hce_cnt,
+		    sizeof (hyprlofs_curr_entry_t), hyprlofs_curr_entry_cmp);
+
+	for (next = op; next != NULL; next = next->hop_coalesced) {
+		if (!fetched && next->hop_ioctl_cmd == HYPRLOFS_ADD_ENTRIES) {
+			this->doIoctl(next, next->hop_ioctl_cmd,
+			    next->hop_ioctl_arg);
+		} else if (!fetched || (!failed &&
+		    !hyprlofs_op_applied(next, &curr_ents))) {
+			next->hop_rv = -1;
+			next->hop_errno = err;
+			(void) strlcpy(next->hop_opname, opname,
+			    sizeof (next->hop_opname));
+			failed = true;
+		} else if (failed || next->hop_coalesced == NULL) {
+			this->doIoctl(next, next->hop_ioctl_cmd,
+			    next->hop_ioctl_arg);
+		} else {
+			next->hop_rv = 0;
+			next->hop_errno = 0;
+			(void) snprintf(next->hop_opname,
+			    sizeof (next->hop_opname), "hyprlofs ioctl %s",
+			    hyprlofs_cmdname(next->hop_ioctl_cmd));
+		}
+	}
+
+	free(curr_ents.hce_entries);
+}
+
+/*
+ * Invoked outside the event loop to apply the entries of add operation "op" in
+ * partial or validate mode, skipping those that can't be applied.  We first
+ * check each path, which catches the common case of files that have
+ * disappeared without involving the kernel.  (In validate mode, that's usually
+ * already been done, in parallel, and the results are in hop_staterrs.)  Then
+ * we add the remaining entries.
+ *
+ * In partial mode, if the add fails anyway, the kernel will have applied the
+ * entries before the one that failed, so we fetch the current mappings to find
+ * the first entry that wasn't applied, record the failure against it, and try
+ * again with the entries after it.  If we can't tell which entry failed
+ * (because the GET fails, too), or if we're not in partial mode, the whole
+ * operation fails with the error from the kernel.
+ */
+void
+HyprlofsFilesystem::doAddChecked(hyprlofs_op_t *op)
+{
+	hyprlofs_entries_t *entrylstp = (hyprlofs_entries_t *)op->hop_ioctl_arg;
+	hyprlofs_entries_t *pendingp;
+	hyprlofs_curr_entries_t curr_ents;
+	char opname[sizeof (op->hop_opname)];
+	hyprlofs_failure_t *failp;
+	struct stat st;
+	uint_t *indexes, *idxp;
+	uint_t i, n;
+	int err;
+
+	assert(op->hop_failures == NULL);
+	n = entrylstp->hle_len;
+	indexes = (uint_t *)calloc(n + 1, sizeof (uint_t));
+	op->hop_failures = (hyprlofs_failure_t *)calloc(n + 1,
+	    sizeof (hyprlofs_failure_t));
+	if ((pendingp = hyprlofs_entries_alloc(n)) == NULL ||
+	    indexes == NULL || op->hop_failures == NULL) {
+		op->hop_rv = -1;
+		op->hop_errno = ENOMEM;
+		(void) strlcpy(op->hop_opname, "hyprlofs addMappings",
+		    sizeof (op->hop_opname));
+		goto out;
+	}
+
+	/*
+	 * idxp maps each pending entry back to its index in the original list
+	 * of entries.  As entries are retired from the front of pendingp, both
+	 * pendingp->hle_entries and idxp advance past them.  pendingp is still
+	 * a single arena, so freeing it works the same as ever.
+	 */
+	idxp = indexes;
+	pendingp->hle_len = 0;
+	for (i = 0; i < n; i++) {
+		if (op->hop_staterrs != NULL)
+			err = op->hop_staterrs[i];
+		else
+			err = stat(entrylstp->hle_entries[i].hle_path,
+			    &st) != 0 ? errno : 0;
+
+		if (err != 0) {
+			failp = &op->hop_failures[op->hop_nfailures++];
+			failp->hf_index = i;
+			failp->hf_errno = err;
+			continue;
+		}
+
+		idxp[pendingp->hle_len] = i;
+		pendingp->hle_entries[pendingp->hle_len++] =
+		    entrylstp->hle_entries[i];
+	}
+
+	while (pendingp->hle_len > 0) {
+		this->doIoctl(op, HYPRLOFS_ADD_ENTRIES, pendingp);
+		if (op->hop_rv == 0 || !op->hop_partial)
+			break;
+
+		err = op->hop_errno;
+		(void) strlcpy(opname, op->hop_opname, sizeof (opname));
+		this->doGetEntries(op, &curr_ents);
+		if (op->hop_rv != 0) {
+			op->hop_rv = -1;
+			op->hop_errno = err;
+			(void) strlcpy(op->hop_opname, opname,
+			    sizeof (op->hop_opname));
+			goto out;
+		}
+
+		qsort(curr_ents.hce_entries, curr_ents.hce_cnt,
+		    sizeof (hyprlofs_curr_entry_t), hyprlofs_curr_entry_cmp);
+		for (i = 0; i < pendingp->hle_len; i++) {
+			if (!hyprlofs_entry_applied(&pendingp->hle_entries[i],
+			    HYPRLOFS_ADD_ENTRIES, &curr_ents))
+				break;
+		}
+		free(curr_ents.hce_entries);
+
+		/*
+		 * If everything was applied after all, there's nothing more
+		 * to do.  Otherwise, entry "i" is the one that failed.
+		 */
+		if (i == pendingp->hle_len)
+			break;
+
+		failp = &op->hop_failures[op->hop_nfailures++];
+		failp->hf_index = idxp[i];
+		failp->hf_errno = err;
+
+		pendingp->hle_entries += i + 1;
+		pendingp->hle_len -= i + 1;
+		idxp += i + 1;
+	}
+
+	if (op->hop_rv != 0 && !op->hop_partial)
+		goto out;
+
+	qsort(op->hop_failures, op->hop_nfailures, sizeof (hyprlofs_failure_t),
+	    hyprlofs_failure_cmp);
+	op->hop_rv = 0;
+	op->hop_errno = 0;
+	(void) strlcpy(op->hop_opname, "hyprlofs ioctl ADD",
+	    sizeof (op->hop_opname));
+
+out:
+	hyprlofs_entries_free(pendingp);
+	free(indexes);
+}
+
+void
+HyprlofsFilesystem::eioIoctlGetRun(hyprlofs_op_t *op)
+{
+
+	assert(op->hop_ioctl_arg == NULL);
+	op->hop_hfs->doFetchEntries(op);
+	if (op->hop_rv == 0 && op->hop_prefix != NULL)
+		hyprlofs_op_filter(op);
+
+	if (!op->hop_packed || op->hop_rv != 0)
+		return;
+
+	if (hyprlofs_mappings_pack(op) != 0) {
+		op->hop_rv = -1;
+		op->hop_errno = ENOMEM;
+		return;
+	}
+
+	/*
+	 * Mappings fetched from the kernel are no longer needed once they've
+	 * been packed, unless we're going to rebuild the index from them.
+	 * hop_count still reflects the number of mappings.
+	 */
+	if (!op->hop_hfs->hfs_owned && op->hop_cursor.hc_curr != NULL) {
+		free(op->hop_curr_ents.hce_entries);
+		op->hop_curr_ents.hce_entries = NULL;
+		op->hop_cursor.hc_curr = NULL;
+	}
+}
+
+/*
+ * Invoked outside the event loop (via the threadpool) to make the set of
+ * mappings match the desired set described by the operation's entries.
+ */
+void
+HyprlofsFilesystem::eioSetRun(hyprlofs_op_t *op)
+{
+	op->hop_hfs->doSetMappings(op);
+}
+
+/*
+ * Invoked outside the event loop (via the threadpool) to replace the current
+ * mappings with the operation's entries.  The entries are fully marshalled
+ * before we get here, so the two ioctls are issued back to back, which keeps
+ * the window during which the mount is empty as short as we can make it.  If
+ * adding the new mappings fails, the mount is left empty.
+ */
+void
+HyprlofsFilesystem::eioReplaceRun(hyprlofs_op_t *op)
+{
+	HyprlofsFilesystem *hfs = op->hop_hfs;
+	hyprlofs_entries_t *entrylstp = (hyprlofs_entries_t *)op->hop_ioctl_arg;
+
+	hfs->doIoctl(op, HYPRLOFS_RM_ALL, NULL);
+	if (op->hop_rv != 0 || entrylstp->hle_len == 0)
+		return;
+
+	hfs->doIoctl(op, HYPRLOFS_ADD_ENTRIES, entrylstp);
+	if (op->hop_rv == 0)
+		op->hop_nadded = entrylstp->hle_len;
+}
+
+/*
+ * Invoked outside the event loop (via the threadpool) to write the current
+ * mappings to the operation's snapshot file.  The file holds them in packed
+ * form (see hyprlofs_mappings_pack), just as addMappingsBuffer accepts them.
+ */
+void
+HyprlofsFilesystem::eioSnapshotRun(hyprlofs_op_t *op)
+{
+	const char *syscall;
+
+	op->hop_hfs->doFetchEntries(op);
+	if (op->hop_rv != 0)
+		return;
+
+	if (hyprlofs_mappings_pack(op) != 0) {
+		op->hop_rv = -1;
+		op->hop_errno = ENOMEM;
+		(void) strlcpy(op->hop_opname, "hyprlofs snapshot",
+		    sizeof (op->hop_opname));
+		return;
+	}
+
+	/* Only the strings themselves are needed. */
+	free(op->hop_packoffs);
+	op->hop_packoffs = NULL;
+
+	if (hyprlofs_file_write(op->hop_file, op->hop_packbuf,
+	    op->hop_packlen, &syscall) != 0) {
+		op->hop_rv = -1;
+		op->hop_errno = errno;
+		op->hop_errpath = op->hop_file;
+		(void) strlcpy(op->hop_opname, syscall,
+		    sizeof (op->hop_opname));
+	}
+
+	free(op->hop_packbuf);
+	op->hop_packbuf = NULL;
+}
+
+/*
+ * Invoked outside the event loop (via the threadpool) to add the mappings in
+ * the operation's snapshot file, hop_restorechunk of them per ioctl.  The file
+ * is mapped rather than read, and the entries point directly into it.  If an
+ * ioctl fails, the mappings added by those before it are left in place.
+ */
+void
+HyprlofsFilesystem::eioRestoreRun(hyprlofs_op_t *op)
+{
+	HyprlofsFilesystem *hfs = op->hop_hfs;
+	hyprlofs_entries_t *entrylstp, chunk;
+	const char *syscall;
+	struct stat st;
+	hrtime_t start;
+	uint_t nentries, i;
+	size_t used;
+	int fd, err;
+
+	op->hop_errpath = op->hop_file;
+	if ((fd = open(op->hop_file, O_RDONLY)) < 0) {
+		syscall = "open";
+		goto fail;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		syscall = "fstat";
+		err = errno;
+		(void) close(fd);
+		errno = err;
+		goto fail;
+	}
+
+	if (st.st_size > 0) {
+		op->hop_maplen = st.st_size;
+		if ((op->hop_map = mmap(NULL, op->hop_maplen, PROT_READ,
+		    MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+			op->hop_map = NULL;
+			syscall = "mmap";
+			err = errno;
+			(void) close(fd);
+			errno = err;
+			goto fail;
+		}
+	}
+
+	(void) close(fd);
+	start = gethrtime();
+	if (hyprlofs_buffer_count((char *)op->hop_map, op->hop_maplen, true,
+	    &nentries) != 0) {
+		syscall = "hyprlofs restore";
+		errno = EINVAL;
+		goto fail;
+	}
+
+	if ((entrylstp = hyprlofs_entries_populate_buffer((char *)op->hop_map,
+	    op->hop_maplen, true, nentries, &used)) == NULL) {
+		syscall = "hyprlofs restore";
+		errno = ENOMEM;
+		goto fail;
+	}
+
+	op->hop_stats.hos_marshal = gethrtime() - start;
+	op->hop_ioctl_arg = entrylstp;
+	op->hop_errpath = NULL;
+	op->hop_rv = 0;
+	op->hop_errno = 0;
+	(void) strlcpy(op->hop_opname, "hyprlofs restore",
+	    sizeof (op->hop_opname));
+
+	for (i = 0; i < nentries; i += chunk.hle_len) {
+		chunk.hle_entries = &entrylstp->hle_entries[i];
+		chunk.hle_len = MIN(nentries - i, op->hop_restorechunk);
+		hfs->doIoctl(op, HYPRLOFS_ADD_ENTRIES, &chunk);
+		if (op->hop_rv != 0)
+			return;
+		op->hop_nadded += chunk.hle_len;
+	}
+
+	return;
+
+fail:
+	op->hop_rv = -1;
+	op->hop_errno = errno;
+	(void) strlcpy(op->hop_opname, syscall, sizeof (op->hop_opname));
+}
+
+/*
+ * Invoked outside the event loop (via the threadpool) to remove the mappings
+ * whose aliases begin with the operation's prefix, HYPRLOFS_IOCTL_CHUNK of
+ * them per ioctl.  The list of removals is kept in hop_set_rm, as for
+ * setMappings, and refers to the current mappings, which are kept until the
+ * operation completes.
+ */
+void
+HyprlofsFilesystem::eioPrefixRemoveRun(hyprlofs_op_t *op)
+{
+	HyprlofsFilesystem *hfs = op->hop_hfs;
+	hyprlofs_entries_t *rmlstp, chunk;
+	hyprlofs_entry_t *entryp;
+	hyprlofs_cursor_t cursor;
+	const char *path, *name;
+	uint_t i;
+
+	hfs->doFetchEntries(op);
+	if (op->hop_rv != 0)
+		return;
+
+	hyprlofs_op_filter(op);
+	if ((rmlstp = hyprlofs_entries_alloc(op->hop_count)) == NULL) {
+		op->hop_rv = -1;
+		op->hop_errno = ENOMEM;
+		(void) strlcpy(op->hop_opname, "hyprlofs removeByPrefix",
+		    sizeof (op->hop_opname));
+		return;
+	}
+
+	cursor = op->hop_cursor;
+	for (i = 0; i < op->hop_count &&
+	    hyprlofs_cursor_next(&cursor, &path, &name); i++) {
+		entryp = &rmlstp->hle_entries[i];
+		entryp->hle_name = (char *)name;
+		entryp->hle_nlen = strlen(name);
+	}
+
+	op->hop_set_rm = rmlstp;
+	op->hop_rv = 0;
+	op->hop_errno = 0;
+	(void) strlcpy(op->hop_opname, "hyprlofs removeByPrefix",
+	    sizeof (op->hop_opname));
+
+	for (i = 0; i < rmlstp->hle_len; i += chunk.hle_len) {
+		chunk.hle_entries = &rmlstp->hle_entries[i];
+		chunk.hle_len = MIN(rmlstp->hle_len - i, HYPRLOFS_IOCTL_CHUNK);
+		hfs->doIoctl(op, HYPRLOFS_RM_ENTRIES, &chunk);
+		if (op->hop_rv != 0)
+			return;
+		op->hop_nremoved += chunk.hle_len;
+	}
+}
+
+/*
+ * Invoked outside the event loop (via the threadpool) to fetch the current
+ * mappings from the kernel for resync().  eioAsyncFini rebuilds the index from
+ * them.
+ */
+void
+HyprlofsFilesystem::eioResyncRun(hyprlofs_op_t *op)
+{
+	HyprlofsFilesystem *hfs = op->hop_hfs;
+
+	hfs->doGetEntries(op, &op->hop_curr_ents);
+	if (op->hop_rv == 0)
+		hyprlofs_cursor_init_curr(&op->hop_cursor, &op->hop_curr_ents);
+}
+
+/*
+ * Applies the minimal set of changes needed to make the current mappings match
+ * the desired entries of operation "op".  We fetch the current mappings, index
+ * the desired ones by alias, and then:
+ *
+ *     o remove every current mapping whose alias isn't desired, or which maps
+ *       the alias to a different file than desired, and then
+ *
+ *     o add every desired mapping that isn't already present.
+ *
+ * Mappings that are already correct are left alone, so readers of the mount
+ * never see them disappear.  As with hyprlofs_op_applied, we only compare the
+ * end of each current path with the desired path.
+ */
+void
+HyprlofsFilesystem::doSetMappings(hyprlofs_op_t *op)
+{
+	hyprlofs_entries_t *desiredp = (hyprlofs_entries_t *)op->hop_ioctl_arg;
+	hyprlofs_entries_t *rmlstp = NULL, *addlstp = NULL;
+	hyprlofs_hnode_t *nodes = NULL, *nodep;
+	hyprlofs_entry_t *entryp;
+	hyprlofs_cursor_t cursor;
+	hyprlofs_htable_t table;
+	const char *path, *name;
+	uint_t i;
+
+	bzero(&table, sizeof (table));
+	this->doFetchEntries(op);
+	if (op->hop_rv != 0)
+		return;
+
+	if ((nodes = (hyprlofs_hnode_t *)calloc(desiredp->hle_len + 1,
+	    sizeof (hyprlofs_hnode_t))) == NULL ||
+	    hyprlofs_htable_init(&table, desiredp->hle_len) != 0 ||
+	    (rmlstp = hyprlofs_entries_alloc(op->hop_count)) == NULL ||
+	    (addlstp = hyprlofs_entries_alloc(desiredp->hle_len)) == NULL) {
+		op->hop_rv = -1;
+		op->hop_errno = ENOMEM;
+		(void) strlcpy(op->hop_opname, "hyprlofs setMappings",
+		    sizeof (op->hop_opname));
+		goto out;
+	}
+
+	/*
+	 * Each node's value points to the corresponding desired entry until we
+	 * find that mapping already present, at which point we clear it.  An
+	 * alias can only be mapped once, so duplicates are invalid.
+	 */
+	for (i = 0; i < desiredp->hle_len; i++) {
+		if (hyprlofs_htable_lookup(&table,
+		    desiredp->hle_entries[i].hle_name) != NULL) {
+			op->hop_rv = -1;
+			op->hop_errno = EINVAL;
+			(void) strlcpy(op->hop_opname, "hyprlofs setMappings",
+			    sizeof (op->hop_opname));
+			goto out;
+		}
+
+		nodes[i].hn_key = desiredp->hle_entries[i].hle_name;
+		nodes[i].hn_value = &desiredp->hle_entries[i];
+		hyprlofs_htable_insert(&table, &nodes[i]);
+	}
+
+	rmlstp->hle_len = 0;
+	cursor = op->hop_cursor;
+	while (hyprlofs_cursor_next(&cursor, &path, &name)) {
+		nodep = hyprlofs_htable_lookup(&table, name);
+
+		if (nodep != NULL && nodep->hn_value != NULL) {
+			entryp = (hyprlofs_entry_t *)nodep->hn_value;
+			if (hyprlofs_path_matches(path, entryp->hle_path,
+			    entryp->hle_plen)) {
+				nodep->hn_value = NULL;
+				continue;
+			}
+		}
+
+		entryp = &rmlstp->hle_entries[rmlstp->hle_len++];
+		entryp->hle_name = (char *)name;
+		entryp->hle_nlen = strlen(name);
+	}
+
+	addlstp->hle_len = 0;
+	for (i = 0; i < desiredp->hle_len; i++) {
+		if (nodes[i].hn_value != NULL)
+			addlstp->hle_entries[addlstp->hle_len++] =
+			    desiredp->hle_entries[i];
+	}
+
+	op->hop_rv = 0;
+	op->hop_errno = 0;
+	(void) strlcpy(op->hop_opname, "hyprlofs setMappings",
+	    sizeof (op->hop_opname));
+
+	if (rmlstp->hle_len > 0) {
+		this->doIoctl(op, HYPRLOFS_RM_ENTRIES, rmlstp);
+		if (op->hop_rv != 0)
+			goto out;
+		op->hop_nremoved = rmlstp->hle_len;
+	}
+
+	if (addlstp->hle_len > 0) {
+		this->doIoctl(op, HYPRLOFS_ADD_ENTRIES, addlstp);
+		if (op->hop_rv != 0)
+			goto out;
+		op->hop_nadded = addlstp->hle_len;
+	}
+
+out:
+	hyprlofs_htable_fini(&table);
+	free(nodes);
+
+	/*
+	 * The lists of changes (and the current mappings they refer to) are
+	 * kept until the operation completes so that they can be applied to
+	 * the index.
+	 */
+	op->hop_set_rm = rmlstp;
+	op->hop_set_add = addlstp;
+}
+
+/*
+ * Invoked outside the event loop to make the current mappings available to
+ * operation "op" via hop_cursor and hop_count.  In owned mode, these come from
+ * the index if it's usable.  Otherwise, they're fetched from the kernel into
+ * hop_curr_ents.
+ */
+void
+HyprlofsFilesystem::doFetchEntries(hyprlofs_op_t *op)
+{
+	if (this->hfs_owned && !this->hfs_index_stale) {
+		hyprlofs_cursor_init_index(&op->hop_cursor, &this->hfs_index);
+		op->hop_count = this->hfs_index.ht_count;
+		op->hop_rv = 0;
+		op->hop_errno = 0;
+		return;
+	}
+
+	this->doGetEntries(op, &op->hop_curr_ents);
+	if (op->hop_rv == 0) {
+		hyprlofs_cursor_init_curr(&op->hop_cursor, &op->hop_curr_ents);
+		op->hop_count = op->hop_curr_ents.hce_cnt;
+	}
+}
+
+/*
+ * Invoked outside the event loop on behalf of operation "op" to fetch all of
+ * the current mappings from the kernel into "currp".  On success, the caller
+ * must free currp->hce_entries.
+ */
+void
+HyprlofsFilesystem::doGetEntries(hyprlofs_op_t *op,
+    hyprlofs_curr_entries_t *currp)
+{
+	uint_t count;
+
+	/*
+	 * The "GET" ioctl is a bit more complex than the others because we're
+	 * retrieving a variable-size amount of data.  If the kernel needs more
+	 * entries than we've provided, it fails with E2BIG and tells us how
+	 * many it needs, and we try again with that many.
+	 *
+	 * To avoid a separate ioctl just to find out how many mappings there
+	 * are, we start with the number we saw last time plus some headroom
+	 * for growth.  That's usually enough on a mount that isn't changing
+	 * much, in which case this is a single ioctl.  The first time through
+	 * (or when we last saw an empty mount), we start with no entries at
+	 * all, which is also the cheapest way to list an empty mount.
+	 */
+	bzero(currp, sizeof (*currp));
+	count = this->hfs_get_hint;
+
+	for (;;) {
+		if (count > 0) {
+			count = hyprlofs_get_headroom(count);
+			if ((currp->hce_entries = (hyprlofs_curr_entry_t *)
+			    calloc(sizeof (hyprlofs_curr_entry_t),
+			    count)) == NULL) {
+				op->hop_rv = -1;
+				op->hop_errno = ENOMEM;
+				return;
+			}
+		}
+
+		currp->hce_cnt = count;
+		this->doIoctl(op, HYPRLOFS_GET_ENTRIES, currp);
+
+		if (op->hop_rv == 0) {
+			/*
+			 * We're done.  The kernel has updated hce_cnt to
+			 * reflect the number of entries actually returned.
+			 */
+			this->hfs_get_hint = currp->hce_cnt;
+			if (currp->hce_cnt == 0) {
+				free(currp->hce_entries);
+				currp->hce_entries = NULL;
+			}
+			return;
+		}
+
+		free(currp->hce_entries);
+		currp->hce_entries = NULL;
+
+		if (op->hop_errno != E2BIG) {
+			/*
+			 * Bail out and let the fini function figure out how to
+			 * express the error back to the user.
+			 */
+			currp->hce_cnt = 0;
+			return;
+		}
+
+		count = currp->hce_cnt;
+		op->hop_stats.hos_e2big++;
+	}
+}
+
+/*
+ * Invoked back in the context of the event loop after an asynchronous ioctl has
+ * completed.  Here we dispatch the next queued operation and then invoke the
+ * user's callback to indicate that the operation has completed.
+ */
+void
+HyprlofsFilesystem::eioAsyncFini(napi_env env, napi_status status, void *arg)
+{
+	hyprlofs_op_t *op = (hyprlofs_op_t *)arg;
+	hyprlofs_op_t *next;
+	HyprlofsFilesystem *hfs = op->hop_hfs;
+	uint64_t seq = hfs->hfs_jseq;
+
+	hyprlofs_work_done(env, &op->hop_work);
+
+	/*
+	 * The next operation doesn't depend on anything the user's callback
+	 * might do, so dispatch it right away rather than leaving the
+	 * threadpool idle while we call back into JavaScript.  The callback
+	 * may itself queue more operations, which will be processed after
+	 * everything already queued.
+	 */
+	assert(hfs->hfs_inflight == op);
+
+	/*
+	 * Nothing is in flight right now, so this is our chance to bring the
+	 * index up to date with the results of this operation.  The journal
+	 * goes first, since updating the index may free the current mappings
+	 * that a setMappings operation's removals refer to.
+	 */
+	hfs->journalUpdate(op);
+	hfs->indexUpdate(op);
+	if (hyprlofs_op_checked(op) && op->hop_rv == 0)
+		hyprlofs_op_failures(op);
+
+	/*
+	 * Operations applied in chunks remain in flight until the last chunk
+	 * has been applied (or one has failed).  Listeners hear about each
+	 * chunk's changes once the next chunk is on its way.
+	 */
+	if (op->hop_batchsize != 0 && op->hop_rv == 0 && hfs->batchNext(op)) {
+		hfs->journalNotify(seq);
+		return;
+	}
+
+	/*
+	 * Chunked listings remain in flight until all of the mappings have
+	 * been delivered so that callbacks are still invoked in order.
+	 */
+	if (op->hop_chunksize != 0 && op->hop_rv == 0 && op->hop_count > 0) {
+		hyprlofs_work_queue(env, NULL, &op->hop_work,
+		    hyprlofs_work_noop, listChunk, op);
+		return;
+	}
+
+	hfs->hfs_inflight = NULL;
+	hfs->dispatch();
+	hfs->journalNotify(seq);
+
+	/*
+	 * If this ioctl was coalesced from several operations, complete each
+	 * of them in the order in which they were issued.
+	 */
+	for (; op != NULL; op = next) {
+		next = op->hop_coalesced;
+		hfs->complete(op);
+	}
+}
+
+/*
+ * Invoked in the context of the event loop when a chunk of batched operation
+ * "op" has been applied successfully.  If there's another chunk, we hand it to
+ * the threadpool right away, start marshalling the one after it, and return
+ * true.  Otherwise, we return false and the operation completes, possibly with
+ * an error if the next chunk couldn't be marshalled.  Either way, the user's
+ * onProgress callback is told how many entries have been applied so far.
+ */
+bool
+HyprlofsFilesystem::batchNext(hyprlofs_op_t *op)
+{
+	napi_env env = this->hfs_env;
+	napi_handle_scope scope;
+	hyprlofs_entries_t *entrylstp = (hyprlofs_entries_t *)op->hop_ioctl_arg;
+	napi_value argv[2];
+	bool more = false;
+
+	op->hop_batchdone += entrylstp->hle_len;
+
+	if (op->hop_batchdone < op->hop_batchtotal &&
+	    op->hop_batchnext == NULL) {
+		op->hop_rv = -1;
+		op->hop_errno = EINVAL;
+		(void) snprintf(op->hop_opname, sizeof (op->hop_opname),
+		    "hyprlofs ioctl %s", hyprlofs_cmdname(op->hop_ioctl_cmd));
+	} else if (op->hop_batchdone < op->hop_batchtotal) {
+		hyprlofs_entries_free(entrylstp);
+		op->hop_ioctl_arg = op->hop_batchnext;
+		op->hop_batchnext = NULL;
+		free(op->hop_staterrs);
+		op->hop_staterrs = NULL;
+		this->submit(op);
+		hyprlofs_op_batch_prepare(op);
+		more = true;
+	}
+
+	if (op->hop_onprogress != NULL) {
+		(void) napi_open_handle_scope(env, &scope);
+		argv[0] = hyprlofs_uint(env, op->hop_batchdone);
+		argv[1] = hyprlofs_uint(env, op->hop_batchtotal);
+		hyprlofs_call(env, hyprlofs_deref(env, op->hop_onprogress), 2,
+		    argv);
+		(void) napi_close_handle_scope(env, scope);
+	}
+
+	return (more);
+}
+
+/*
+ * Invoked once per event loop iteration while a chunked listing is being
+ * delivered to pass the next hop_chunksize mappings to the user's onChunk
+ * callback.  Delivering the listing across several iterations bounds both the
+ * time spent in each one and the number of mappings materialized on the
+ * JavaScript heap at once.  Each chunk is scheduled as a trivial work item
+ * whose completion runs here; after the last chunk, we complete the operation.
+ */
+void
+HyprlofsFilesystem::listChunk(napi_env env, napi_status status, void *arg)
+{
+	hyprlofs_op_t *op = (hyprlofs_op_t *)arg;
+	HyprlofsFilesystem *hfs = op->hop_hfs;
+	napi_value argv[1];
+	uint_t count;
+
+	hyprlofs_work_done(env, &op->hop_work);
+
+	count = op->hop_count - op->hop_chunkdone;
+	if (count > op->hop_chunksize)
+		count = op->hop_chunksize;
+
+	argv[0] = hyprlofs_mappings_array(env, &op->hop_cursor, count);
+	op->hop_chunkdone += count;
+	hyprlofs_call(env, hyprlofs_deref(env, op->hop_onchunk), 1, argv);
+
+	if (op->hop_chunkdone < op->hop_count) {
+		hyprlofs_work_queue(env, NULL, &op->hop_work,
+		    hyprlofs_work_noop, listChunk, op);
+		return;
+	}
+
+	assert(hfs->hfs_inflight == op);
+	hfs->hfs_inflight = NULL;
+	hfs->dispatch();
+	hfs->complete(op);
+}
+
+/*
+ * Invoked once per event loop iteration while operation "op" is queued but
+ * still being marshalled to marshal the next piece of its mappings, in the
+ * same way that listChunk delivers a listing.  Once they've all been
+ * marshalled, the operation may be dispatched.  If they turn out to be invalid,
+ * the operation fails with EINVAL when it reaches the head of the queue.
+ */
+void
+HyprlofsFilesystem::marshalNext(napi_env env, napi_status status, void *arg)
+{
+	hyprlofs_op_t *op = (hyprlofs_op_t *)arg;
+	HyprlofsFilesystem *hfs = op->hop_hfs;
+	int rv;
+
+	hyprlofs_work_done(env, &op->hop_work);
+
+	if ((rv = hyprlofs_op_marshal(op)) > 0) {
+		hyprlofs_work_queue(env, NULL, &op->hop_work,
+		    hyprlofs_work_noop, marshalNext, op);
+		return;
+	}
+
+	if (rv != 0) {
+		op->hop_rv = -1;
+		op->hop_errno = EINVAL;
+		(void) snprintf(op->hop_opname, sizeof (op->hop_opname),
+		    "%s", opName(op));
+	}
+
+	op->hop_marshalling = false;
+	hfs->dispatch();
+}
+
+/*
+ * Invoked in the context of the event loop to complete operation "op", whose
+ * mappings were found to be invalid by marshalNext.  See dispatch().
+ */
+void
+HyprlofsFilesystem::marshalFail(napi_env env, napi_status status, void *arg)
+{
+	hyprlofs_op_t *op = (hyprlofs_op_t *)arg;
+	HyprlofsFilesystem *hfs = op->hop_hfs;
+
+	hyprlofs_work_done(env, &op->hop_work);
+
+	assert(hfs->hfs_inflight == op);
+	hfs->hfs_inflight = NULL;
+	hfs->dispatch();
+	hfs->complete(op);
+}
+
+/*
+ * Invoked in the context of the event loop to report the result of operation
+ * "op" to the user's callback (or settle its Promise) and release it.
+ */
+void
+HyprlofsFilesystem::complete(hyprlofs_op_t *op)
+{
+	napi_env env = this->hfs_env;
+	napi_handle_scope scope;
+	napi_value callback = NULL, err, rv;
+	hyprlofs_module_t *modp = NULL;
+	napi_deferred deferred;
+	hyprlofs_group_t *group;
+	napi_value argv[3];
+	uint_t groupidx;
+	bool failed;
+	int argc = 0;
+
+	(void) napi_open_handle_scope(env, &scope);
+
+	failed = op->hop_rv != 0;
+	deferred = op->hop_deferred;
+	group = op->hop_group;
+	groupidx = op->hop_groupidx;
+	if (deferred == NULL && group == NULL)
+		callback = hyprlofs_deref(env, op->hop_callback);
+
+	if (op->hop_rv != 0) {
+		err = hyprlofs_errno_error(env, op->hop_errno, op->hop_opname,
+		    op->hop_errpath != NULL ? op->hop_errpath :
+		    this->hfs_label);
+		argv[argc++] = err;
+		if (op->hop_batchsize != 0) {
+			hyprlofs_set(env, err, "chunk", hyprlofs_uint(env,
+			    op->hop_batchdone / op->hop_batchsize));
+			hyprlofs_set(env, err, "chunkSize",
+			    hyprlofs_uint(env, op->hop_batchsize));
+			hyprlofs_set(env, err, "completed",
+			    hyprlofs_uint(env, op->hop_batchdone));
+		}
+	} else if (hyprlofs_op_checked(op)) {
+		argv[argc++] = hyprlofs_null(env);
+		argv[argc++] = op->hop_failed == NULL ? hyprlofs_array(env, 0) :
+		    hyprlofs_deref(env, op->hop_failed);
+	} else if (op->hop_run == eioMountRun) {
+		argv[argc++] = hyprlofs_null(env);
+		argv[argc++] = hyprlofs_string(env, op->hop_mountopts,
+		    NAPI_AUTO_LENGTH);
+	} else if (op->hop_run == eioSnapshotRun) {
+		argv[argc++] = hyprlofs_null(env);
+		argv[argc++] = hyprlofs_uint(env, op->hop_count);
+	} else if (op->hop_run == eioRestoreRun) {
+		argv[argc++] = hyprlofs_null(env);
+		argv[argc++] = hyprlofs_uint(env, op->hop_nadded);
+	} else if (op->hop_run == eioPrefixRemoveRun) {
+		argv[argc++] = hyprlofs_null(env);
+		argv[argc++] = hyprlofs_uint(env, op->hop_nremoved);
+	} else if (op->hop_run == eioSetRun) {
+		(void) napi_create_object(env, &rv);
+		hyprlofs_set(env, rv, "added", hyprlofs_uint(env,
+		    op->hop_nadded));
+		hyprlofs_set(env, rv, "removed", hyprlofs_uint(env,
+		    op->hop_nremoved));
+		argv[argc++] = hyprlofs_null(env);
+		argv[argc++] = rv;
+	} else if (op->hop_ioctl_cmd == HYPRLOFS_GET_ENTRIES &&
+	    op->hop_external) {
+		argv[argc++] = hyprlofs_null(env);
+		argv[argc++] = hyprlofs_mappings_external(env, op);
+	} else if (op->hop_ioctl_cmd == HYPRLOFS_GET_ENTRIES &&
+	    op->hop_packed) {
+		argv[argc++] = hyprlofs_null(env);
+		argv[argc++] = hyprlofs_buffer_give(env, op->hop_packbuf,
+		    op->hop_packlen);
+		argv[argc++] = hyprlofs_buffer_give(env, op->hop_packoffs,
+		    2 * op->hop_count * sizeof (uint32_t));
+		op->hop_packbuf = NULL;
+		op->hop_packoffs = NULL;
+	} else if (op->hop_ioctl_cmd == HYPRLOFS_GET_ENTRIES &&
+	    op->hop_chunksize == 0) {
+		argv[argc++] = hyprlofs_null(env);
+		argv[argc++] = hyprlofs_mappings_array(env, &op->hop_cursor,
+		    op->hop_count);
+	}
+
+	(void) napi_get_instance_data(env, (void **)&modp);
+	hyprlofs_stats_record(&this->hfs_stats, op);
+	hyprlofs_stats_record(&modp->hm_stats, op);
+
+	if (HYPRLOFS_OP_DONE_ENABLED()) {
+		HYPRLOFS_OP_DONE((uintptr_t)op, this->hfs_label,
+		    (char *)opName(op), hyprlofs_op_nentries(op),
+		    failed ? op->hop_errno : 0);
+	}
+
+	hyprlofs_op_free(op);
+	this->Unref();
+
+	/*
+	 * A Promise is rejected with the error or resolved with the single
+	 * result, if there is one.  Where the callback would receive several
+	 * results, the Promise is resolved with an array of them.  Results of
+	 * the operations making up an addMappingsMulti request are collected
+	 * until they're all available.
+	 */
+	if (group != NULL) {
+		hyprlofs_group_done(env, group, groupidx,
+		    failed ? argv[0] : hyprlofs_null(env));
+	} else if (deferred != NULL && failed) {
+		(void) napi_reject_deferred(env, deferred, argv[0]);
+	} else if (deferred != NULL && argc > 2) {
+		rv = hyprlofs_array(env, argc - 1);
+		for (int i = 1; i < argc; i++)
+			(void) napi_set_element(env, rv, i - 1, argv[i]);
+		(void) napi_resolve_deferred(env, deferred, rv);
+	} else if (deferred != NULL) {
+		(void) napi_resolve_deferred(env, deferred,
+		    argc > 1 ? argv[1] : hyprlofs_undefined(env));
+	} else {
+		hyprlofs_call(env, callback, argc, argv);
+	}
+
+	(void) napi_close_handle_scope(env, scope);
+}
+
+/*
+ * Invoked in the context of the event loop, while no operation is in flight,
+ * to apply the results of operation "op" (and any operations coalesced with it)
+ * to the index.  If the index cannot be kept accurate, it's marked stale.
+ */
+void
+HyprlofsFilesystem::indexUpdate(hyprlofs_op_t *op)
+{
+	hyprlofs_cursor_t cursor;
+	hyprlofs_op_t *next;
+
+	if (!this->hfs_owned)
+		return;
+
+	if (op->hop_resynced) {
+		hyprlofs_cursor_init_curr(&cursor, &op->hop_resync_ents);
+		this->hfs_index_stale = hyprlofs_index_load(&this->hfs_index,
+		    this->hfs_intern, &cursor) != 0;
+		return;
+	}
+
+	if (mutates(op)) {
+		for (next = op; next != NULL; next = next->hop_coalesced) {
+			if (next->hop_rv != 0) {
+				hyprlofs_index_clear(&this->hfs_index,
+				    this->hfs_intern);
+				this->hfs_index_stale = true;
+				return;
+			}
+		}
+	}
+
+	for (next = op; next != NULL; next = next->hop_coalesced)
+		this->indexApply(next);
+}
+
+void
+HyprlofsFilesystem::indexApply(hyprlofs_op_t *op)
+{
+	hyprlofs_htable_t *tablep = &this->hfs_index;
+	hyprlofs_intern_t *internp = this->hfs_intern;
+	hyprlofs_entries_t *entrylstp;
+	hyprlofs_entry_t *entryp;
+	hyprlofs_cursor_t cursor;
+	uint_t i, f;
+
+	if (op->hop_rv != 0) {
+		if (op->hop_run == eioResyncRun)
+			this->hfs_index_stale = true;
+		return;
+	}
+
+	if (op->hop_run == eioMountRun || op->hop_run == eioUmountRun ||
+	    op->hop_ioctl_cmd == HYPRLOFS_RM_ALL) {
+		/*
+		 * A newly mounted filesystem and one we've just cleared are
+		 * both empty.  Once unmounted, there's nothing to describe.
+		 */
+		hyprlofs_index_clear(tablep, internp);
+		this->hfs_index_stale = op->hop_run == eioUmountRun;
+		if (op->hop_mounthint != 0)
+			(void) hyprlofs_htable_reserve(tablep,
+			    op->hop_mounthint);
+		return;
+	}
+
+	/*
+	 * After replaceAll, the mount holds exactly the new entries, whatever
+	 * we knew about it before.
+	 */
+	if (op->hop_run == eioReplaceRun) {
+		hyprlofs_index_clear(tablep, internp);
+		this->hfs_index_stale = false;
+	}
+
+	/*
+	 * Whenever we've fetched the mappings from the kernel, we take the
+	 * opportunity to rebuild the index from them.
+	 */
+	if (op->hop_cursor.hc_curr != NULL) {
+		hyprlofs_cursor_init_curr(&cursor, op->hop_cursor.hc_curr);
+		this->hfs_index_stale =
+		    hyprlofs_index_load(tablep, internp, &cursor) != 0;
+	}
+
+	if (this->hfs_index_stale)
+		return;
+
+	if (op->hop_run == eioSetRun || op->hop_run == eioPrefixRemoveRun) {
+		for (i = 0; i < op->hop_set_rm->hle_len; i++)
+			hyprlofs_index_delete(tablep, internp,
+			    op->hop_set_rm->hle_entries[i].hle_name);
+		if ((entrylstp = op->hop_set_add) == NULL)
+			return;
+	} else if (op->hop_ioctl_cmd == HYPRLOFS_RM_ENTRIES) {
+		entrylstp = (hyprlofs_entries_t *)op->hop_ioctl_arg;
+		for (i = 0; i < entrylstp->hle_len; i++)
+			hyprlofs_index_delete(tablep, internp,
+			    entrylstp->hle_entries[i].hle_name);
+		return;
+	} else if (op->hop_ioctl_cmd == HYPRLOFS_ADD_ENTRIES ||
+	    op->hop_run == eioReplaceRun || op->hop_run == eioRestoreRun) {
+		entrylstp = (hyprlofs_entries_t *)op->hop_ioctl_arg;
+	} else {
+		return;
+	}
+
+	/*
+	 * Entries of partial-mode operations that couldn't be applied are
+	 * listed in hop_failures in order, so we can skip them as we go.
+	 */
+	for (i = 0, f = 0; i < entrylstp->hle_len; i++) {
+		if (f < op->hop_nfailures &&
+		    op->hop_failures[f].hf_index == i) {
+			f++;
+			continue;
+		}
+
+		entryp = &entrylstp->hle_entries[i];
+		if (hyprlofs_index_put(tablep, internp, entryp->hle_name,
+		    entryp->hle_nlen, entryp->hle_path,
+		    entryp->hle_plen) != 0) {
+			hyprlofs_index_clear(tablep, internp);
+			this->hfs_index_stale = true;
+			return;
+		}
+	}
+}
+
+/*
+ * Invoked in the event loop context after operation "op" (and any operations
+ * coalesced with it) has been processed to record the resulting changes in the
+ * journal, if there is one.  Like the index, the journal only reflects changes
+ * made by this object.
+ */
+void
+HyprlofsFilesystem::journalUpdate(hyprlofs_op_t *op)
+{
+	if (this->hfs_jsize == 0)
+		return;
+
+	for (; op != NULL; op = op->hop_coalesced)
+		this->journalApply(op);
+}
+
+void
+HyprlofsFilesystem::journalApply(hyprlofs_op_t *op)
+{
+	/*
+	 * When a change fails, we can't tell how much of it was applied, so
+	 * consumers have to fetch the mappings again.
+	 */
+	if (op->hop_rv != 0) {
+		if (mutates(op))
+			this->journalRecord("reset", NULL);
+		return;
+	}
+
+	if (op->hop_run == eioMountRun || op->hop_run == eioUmountRun ||
+	    op->hop_ioctl_cmd == HYPRLOFS_RM_ALL) {
+		this->journalRecord("clear", NULL);
+	} else if (op->hop_run == eioReplaceRun) {
+		this->journalRecord("clear", NULL);
+		this->journalEntries(op, "add",
+		    (hyprlofs_entries_t *)op->hop_ioctl_arg);
+	} else if (op->hop_run == eioSetRun) {
+		this->journalEntries(op, "remove", op->hop_set_rm);
+		this->journalEntries(op, "add", op->hop_set_add);
+	} else if (op->hop_run == eioPrefixRemoveRun) {
+		this->journalEntries(op, "remove", op->hop_set_rm);
+	} else if (op->hop_ioctl_cmd == HYPRLOFS_RM_ENTRIES) {
+		this->journalEntries(op, "remove",
+		    (hyprlofs_entries_t *)op->hop_ioctl_arg);
+	} else if (op->hop_ioctl_cmd == HYPRLOFS_ADD_ENTRIES ||
+	    op->hop_run == eioRestoreRun) {
+		this->journalEntries(op, "add",
+		    (hyprlofs_entries_t *)op->hop_ioctl_arg);
+	}
+}
+
+/*
+ * Records a change of kind "type" for each of the entries of "entrylstp", as
+ * applied by operation "op".  As in indexApply, entries of partial-mode
+ * operations that couldn't be applied are skipped.
+ */
+void
+HyprlofsFilesystem::journalEntries(const hyprlofs_op_t *op, const char *type,
+    const hyprlofs_entries_t *entrylstp)
+{
+	uint_t i, f;
+
+	for (i = 0, f = 0; i < entrylstp->hle_len; i++) {
+		if (f < op->hop_nfailures &&
+		    op->hop_failures[f].hf_index == i) {
+			f++;
+			continue;
+		}
+
+		this->journalRecord(type, &entrylstp->hle_entries[i]);
+	}
+}
+
+/*
+ * Appends a change of kind "type" for "entryp" (which may be NULL) to the
+ * journal, discarding the oldest change if the journal is full.  If we can't
+ * allocate memory for the strings, a "reset" is recorded instead.
+ */
+void
+HyprlofsFilesystem::journalRecord(const char *type,
+    const hyprlofs_entry_t *entryp)
+{
+	hyprlofs_jrec_t *recp;
+	char *buf = NULL;
+	size_t plen = 0;
+
+	if (entryp != NULL) {
+		if (entryp->hle_path != NULL)
+			plen = entryp->hle_plen + 1;
+		if ((buf = (char *)malloc(entryp->hle_nlen + 1 + plen)) ==
+		    NULL)
+			type = "reset";
+	}
+
+	if (this->hfs_jcount == this->hfs_jsize) {
+		free(this->hfs_journal[this->hfs_jhead].hj_alias);
+		this->hfs_jhead = (this->hfs_jhead + 1) % this->hfs_jsize;
+		this->hfs_jcount--;
+	}
+
+	recp = &this->hfs_journal[(this->hfs_jhead + this->hfs_jcount++) %
+	    this->hfs_jsize];
+	recp->hj_seq = ++this->hfs_jseq;
+	recp->hj_type = type;
+	recp->hj_alias = buf;
+	recp->hj_path = NULL;
+
+	if (buf != NULL) {
+		bcopy(entryp->hle_name, buf, entryp->hle_nlen);
+		buf[entryp->hle_nlen] = '\0';
+		if (plen != 0) {
+			recp->hj_path = buf + entryp->hle_nlen + 1;
+			bcopy(entryp->hle_path, recp->hj_path, plen - 1);
+			recp->hj_path[plen - 1] = '\0';
+		}
+	}
+}
+
+/*
+ * Invoked in the event loop context to pass the changes recorded after
+ * sequence number "seq" to each listener for "change" events.
+ */
+void
+HyprlofsFilesystem::journalNotify(uint64_t seq)
+{
+	napi_env env = this->hfs_env;
+	napi_handle_scope scope;
+	napi_value listeners, changes, fn;
+	uint32_t i, n;
+
+	if (this->hfs_listeners == NULL || this->hfs_jseq == seq)
+		return;
+
+	(void) napi_open_handle_scope(env, &scope);
+	listeners = hyprlofs_deref(env, this->hfs_listeners);
+	changes = this->journalArray(seq);
+	n = hyprlofs_array_length(env, listeners);
+	for (i = 0; i < n; i++) {
+		if (napi_get_element(env, listeners, i, &fn) == napi_ok)
+			hyprlofs_call(env, fn, 1, &changes);
+	}
+	(void) napi_close_handle_scope(env, scope);
+}
+
+/*
+ * Returns an array describing the changes in the journal after sequence number
+ * "seq", oldest first.
+ */
+napi_value
+HyprlofsFilesystem::journalArray(uint64_t seq)
+{
+	napi_env env = this->hfs_env;
+	hyprlofs_jrec_t *recp;
+	napi_value rv, change;
+	uint_t i, skip;
+
+	skip = seq <= this->hfs_jseq - this->hfs_jcount ? 0 :
+	    seq >= this->hfs_jseq ? this->hfs_jcount :
+	    (uint_t)(seq - (this->hfs_jseq - this->hfs_jcount));
+	rv = hyprlofs_array(env, this->hfs_jcount - skip);
+	for (i = skip; i < this->hfs_jcount; i++) {
+		recp = &this->hfs_journal[(this->hfs_jhead + i) %
+		    this->hfs_jsize];
+		(void) napi_create_object(env, &change);
+		hyprlofs_set(env, change, "seq",
+		    hyprlofs_double(env, (double)recp->hj_seq));
+		hyprlofs_set(env, change, "type",
+		    hyprlofs_string(env, recp->hj_type, NAPI_AUTO_LENGTH));
+		if (recp->hj_alias != NULL)
+			hyprlofs_set(env, change, "alias", hyprlofs_string(env,
+			    recp->hj_alias, NAPI_AUTO_LENGTH));
+		if (recp->hj_path != NULL)
+			hyprlofs_set(env, change, "path", hyprlofs_string(env,
+			    recp->hj_path, NAPI_AUTO_LENGTH));
+		(void) napi_set_element(env, rv, i - skip, change);
+	}
+
+	return (rv);
+}
+
+/*
+ * Operation management functions.
+ */
+
+static hyprlofs_op_t *
+hyprlofs_op_alloc(napi_env env, void (*run)(hyprlofs_op_t *),
+    napi_value callback)
+{
+	hyprlofs_op_t *op = new hyprlofs_op_t;
+
+	op->hop_next = NULL;
+	op->hop_hfs = NULL;
+	op->hop_env = env;
+	bzero(&op->hop_work, sizeof (op->hop_work));
+	op->hop_run = run;
+	op->hop_callback = hyprlofs_typeof(env, callback) == napi_function ?
+	    hyprlofs_ref(env, callback) : NULL;
+	op->hop_deferred = NULL;
+	bzero(&op->hop_stats, sizeof (op->hop_stats));
+	op->hop_ioctl_cmd = -1;
+	op->hop_ioctl_arg = NULL;
+	op->hop_mountopts = NULL;
+	op->hop_mounthint = 0;
+	op->hop_file = NULL;
+	op->hop_map = NULL;
+	op->hop_maplen = 0;
+	op->hop_restorechunk = 0;
+	op->hop_errpath = NULL;
+	op->hop_prefix = NULL;
+	op->hop_opname[0] = '\0';
+	op->hop_rv = 0;
+	op->hop_errno = 0;
+	bzero(&op->hop_curr_ents, sizeof (op->hop_curr_ents));
+	bzero(&op->hop_cursor, sizeof (op->hop_cursor));
+	op->hop_count = 0;
+	op->hop_chunksize = 0;
+	op->hop_chunkdone = 0;
+	op->hop_onchunk = NULL;
+	op->hop_pri = HYPRLOFS_PRI_DEFAULT;
+	op->hop_packed = false;
+	op->hop_external = false;
+	op->hop_packbuf = NULL;
+	op->hop_packlen = 0;
+	op->hop_packoffs = NULL;
+	op->hop_nadded = 0;
+	op->hop_nremoved = 0;
+	op->hop_set_rm = NULL;
+	op->hop_set_add = NULL;
+	op->hop_coalesced = NULL;
+	op->hop_merged = NULL;
+	op->hop_group = NULL;
+	op->hop_groupidx = 0;
+	bzero(&op->hop_yield, sizeof (op->hop_yield));
+	op->hop_marshalling = false;
+	op->hop_marshalpass = 0;
+	op->hop_marshalnext = 0;
+	op->hop_marshalbytes = 0;
+	op->hop_marshalstrp = NULL;
+	op->hop_marshalsrc = NULL;
+	op->hop_buffer = NULL;
+	op->hop_resynced = false;
+	bzero(&op->hop_resync_ents, sizeof (op->hop_resync_ents));
+	op->hop_batchsize = 0;
+	op->hop_batchtotal = 0;
+	op->hop_batchdone = 0;
+	op->hop_batchqueued = 0;
+	op->hop_batchbufoff = 0;
+	op->hop_batchnext = NULL;
+	op->hop_batchsrc = NULL;
+	op->hop_onprogress = NULL;
+	op->hop_partial = false;
+	op->hop_validate = false;
+	op->hop_statjobs = NULL;
+	op->hop_statpending = 0;
+	op->hop_staterrs = NULL;
+	op->hop_failures = NULL;
+	op->hop_nfailures = 0;
+	op->hop_failed = NULL;
+
+	return (op);
+}
+
+static void
+hyprlofs_op_free(hyprlofs_op_t *op)
+{
+	napi_env env = op->hop_env;
+
+	assert(op->hop_work.hw_work == NULL);
+	if (op->hop_group == NULL)
+		hyprlofs_entries_free((hyprlofs_entries_t *)op->hop_ioctl_arg);
+	free(op->hop_curr_ents.hce_entries);
+	free(op->hop_resync_ents.hce_entries);
+	free(op->hop_mountopts);
+	free(op->hop_file);
+	free(op->hop_prefix);
+	if (op->hop_map != NULL)
+		(void) munmap(op->hop_map, op->hop_maplen);
+
+	hyprlofs_entries_free(op->hop_merged);
+	hyprlofs_entries_free(op->hop_set_rm);
+	hyprlofs_entries_free(op->hop_set_add);
+	hyprlofs_entries_free(op->hop_batchnext);
+	free(op->hop_failures);
+	assert(op->hop_statjobs == NULL);
+	free(op->hop_staterrs);
+	free(op->hop_packbuf);
+	free(op->hop_packoffs);
+	hyprlofs_unref(env, &op->hop_callback);
+	hyprlofs_unref(env, &op->hop_onchunk);
+	hyprlofs_unref(env, &op->hop_buffer);
+	hyprlofs_unref(env, &op->hop_batchsrc);
+	hyprlofs_unref(env, &op->hop_marshalsrc);
+	hyprlofs_unref(env, &op->hop_onprogress);
+	hyprlofs_unref(env, &op->hop_failed);
+	delete op;
+}
+
+/*
+ * Invoked in the event loop context when the operation at index "idx" of
+ * addMappingsMulti request "group" has completed with error "err" (which is
+ * null on success).  When it's the last one, the caller's callback is invoked
+ * (or its Promise settled) and the request is freed.
+ */
+static void
+hyprlofs_group_done(napi_env env, hyprlofs_group_t *group, uint_t idx,
+    napi_value err)
+{
+	napi_value errors, callback, argv[1];
+	napi_deferred deferred;
+	char errbuf[128];
+	bool failed;
+
+	errors = hyprlofs_deref(env, group->hg_errors);
+	(void) napi_set_element(env, errors, idx, err);
+	if (hyprlofs_typeof(env, err) != napi_null)
+		group->hg_nfailed++;
+
+	assert(group->hg_pending > 0);
+	if (--group->hg_pending > 0)
+		return;
+
+	if (group->hg_nfailed == 0) {
+		argv[0] = hyprlofs_null(env);
+	} else {
+		(void) snprintf(errbuf, sizeof (errbuf),
+		    "addMappingsMulti: failed on %u of %u filesystems",
+		    group->hg_nfailed, hyprlofs_array_length(env, errors));
+		(void) napi_create_error(env, NULL, hyprlofs_string(env,
+		    errbuf, NAPI_AUTO_LENGTH), &argv[0]);
+		hyprlofs_set(env, argv[0], "errors", errors);
+	}
+
+	deferred = group->hg_deferred;
+	callback = deferred == NULL ?
+	    hyprlofs_deref(env, group->hg_callback) : NULL;
+	failed = group->hg_nfailed > 0;
+	hyprlofs_unref(env, &group->hg_callback);
+	hyprlofs_unref(env, &group->hg_errors);
+	hyprlofs_entries_free(group->hg_entries);
+	free(group);
+
+	if (deferred != NULL && failed)
+		(void) napi_reject_deferred(env, deferred, argv[0]);
+	else if (deferred != NULL)
+		(void) napi_resolve_deferred(env, deferred,
+		    hyprlofs_undefined(env));
+	else
+		hyprlofs_call(env, callback, 1, argv);
+}
+
+/*
+ * Returns the number of entries in the next chunk of a batch with chunk size
+ * "chunksize" (or 0, for no chunking) when "remaining" entries are left.
+ */
+static uint_t
+hyprlofs_batch_len(uint_t chunksize, uint_t remaining)
+{
+	return (chunksize == 0 || chunksize > remaining ?
+	    remaining : chunksize);
+}
+
+/*
+ * Sets up "op", whose first chunk has already been marshalled into
+ * hop_ioctl_arg, to apply "total" entries in chunks of "chunksize".  The
+ * caller must also set up hop_batchsrc or hop_buffer.
+ */
+static void
+hyprlofs_op_batch(hyprlofs_op_t *op, uint_t chunksize, uint_t total,
+    napi_value onprogress)
+{
+	op->hop_batchsize = chunksize;
+	op->hop_batchtotal = total;
+	op->hop_batchqueued =
+	    ((hyprlofs_entries_t *)op->hop_ioctl_arg)->hle_len;
+	if (onprogress != NULL &&
+	    hyprlofs_typeof(op->hop_env, onprogress) == napi_function)
+		op->hop_onprogress = hyprlofs_ref(op->hop_env, onprogress);
+}
+
+/*
+ * Invoked in the context of the event loop while a chunk of batched operation
+ * "op" is being applied to marshal the following chunk, if any, into
+ * hop_batchnext.  If that fails, hop_batchnext is left NULL, and the operation
+ * fails when it gets to that chunk.  We report EINVAL in that case because the
+ * most likely cause is that the caller's array contains an invalid mapping.
+ */
+static void
+hyprlofs_op_batch_prepare(hyprlofs_op_t *op)
+{
+	napi_env env = op->hop_env;
+	napi_handle_scope scope;
+	hyprlofs_entries_t *entrylstp;
+	hrtime_t start;
+	uint_t count;
+	size_t len, used;
+	char *buf;
+
+	assert(op->hop_batchnext == NULL);
+	if (op->hop_batchqueued == op->hop_batchtotal)
+		return;
+
+	start = gethrtime();
+
+	count = hyprlofs_batch_len(op->hop_batchsize,
+	    op->hop_batchtotal - op->hop_batchqueued);
+
+	(void) napi_open_handle_scope(env, &scope);
+	if (op->hop_buffer != NULL) {
+		hyprlofs_buffer_data(env, hyprlofs_deref(env, op->hop_buffer),
+		    &buf, &len);
+		entrylstp = hyprlofs_entries_populate_buffer(
+		    buf + op->hop_batchbufoff, len - op->hop_batchbufoff,
+		    op->hop_ioctl_cmd == HYPRLOFS_ADD_ENTRIES, count, &used);
+		if (entrylstp != NULL)
+			op->hop_batchbufoff += used;
+	} else if (op->hop_ioctl_cmd == HYPRLOFS_ADD_ENTRIES) {
+		entrylstp = hyprlofs_entries_populate_add(env,
+		    hyprlofs_deref(env, op->hop_batchsrc), op->hop_batchqueued,
+		    count);
+	} else {
+		entrylstp = hyprlofs_entries_populate_remove(env,
+		    hyprlofs_deref(env, op->hop_batchsrc), op->hop_batchqueued,
+		    count);
+	}
+	(void) napi_close_handle_scope(env, scope);
+	op->hop_stats.hos_marshal += gethrtime() - start;
+
+	if (entrylstp == NULL)
+		return;
+
+	op->hop_batchnext = entrylstp;
+	op->hop_batchqueued += count;
+}
+
+/*
+ * Marshals the first "nentries" JavaScript mappings of "arg" into hop_ioctl_arg
+ * for new add, remove, or set operation "op".  If "yieldp" is non-NULL and
+ * sets any limit, only as much as that allows is marshalled now, and the rest
+ * is marshalled a piece at a time after the operation has been queued (see
+ * async and marshalNext).  Returns -1 if the mappings marshalled so far are
+ * invalid.
+ */
+static int
+hyprlofs_op_marshal_start(hyprlofs_op_t *op, napi_value arg, uint_t nentries,
+    const hyprlofs_yield_t *yieldp)
+{
+	napi_env env = op->hop_env;
+	bool add = op->hop_ioctl_cmd != HYPRLOFS_RM_ENTRIES;
+	hrtime_t start;
+	int rv;
+
+	if (yieldp == NULL ||
+	    (yieldp->hy_entries == 0 && yieldp->hy_usec == 0)) {
+		start = gethrtime();
+		op->hop_ioctl_arg = hyprlofs_entries_populate(env, arg, add, 0,
+		    nentries);
+		op->hop_stats.hos_marshal = gethrtime() - start;
+		return (op->hop_ioctl_arg == NULL ? -1 : 0);
+	}
+
+	if ((op->hop_ioctl_arg = hyprlofs_entries_alloc(nentries)) == NULL)
+		return (-1);
+
+	HYPRLOFS_MARSHAL_START((char *)(add ? "ADD" : "REMOVE"), nentries);
+	op->hop_yield = *yieldp;
+	op->hop_marshalsrc = hyprlofs_ref(env, arg);
+	if ((rv = hyprlofs_op_marshal(op)) > 0)
+		op->hop_marshalling = true;
+	return (rv < 0 ? -1 : 0);
+}
+
+/*
+ * Marshals the next piece of the mappings of operation "op" (see
+ * hop_marshalling), stopping once this iteration's budget has been used up.
+ * Each call visits at least one mapping, so marshalling always makes progress.
+ * The caller's array may have been changed since the previous piece, so the
+ * strings are measured again as they're copied.  Returns 1 if there's more to
+ * do, 0 once all of the mappings have been marshalled, or -1 if they're invalid
+ * (or we ran out of memory).
+ */
+static int
+hyprlofs_op_marshal(hyprlofs_op_t *op)
+{
+	napi_env env = op->hop_env;
+	hyprlofs_entries_t *entrylstp = (hyprlofs_entries_t *)op->hop_ioctl_arg;
+	hyprlofs_yield_t *yieldp = &op->hop_yield;
+	bool add = op->hop_ioctl_cmd != HYPRLOFS_RM_ENTRIES;
+	uint_t nentries = entrylstp->hle_len;
+	hyprlofs_entry_t *entryp;
+	hrtime_t start, deadline;
+	napi_value arg;
+	uint_t count;
+	int rv = 1;
+
+	start = gethrtime();
+	deadline = start + (hrtime_t)yieldp->hy_usec * 1000;
+	arg = hyprlofs_deref(env, op->hop_marshalsrc);
+
+	for (count = 0; ; count++) {
+		if (op->hop_marshalnext == nentries) {
+			if (op->hop_marshalpass == 1) {
+				rv = 0;
+				break;
+			}
+
+			/*
+			 * We've measured all of the strings, so we can make
+			 * room for them and start copying.
+			 */
+			op->hop_ioctl_arg = entrylstp = hyprlofs_entries_grow(
+			    entrylstp, op->hop_marshalbytes,
+			    &op->hop_marshalstrp);
+			if (entrylstp == NULL) {
+				rv = -1;
+				break;
+			}
+			op->hop_marshalpass = 1;
+			op->hop_marshalnext = 0;
+		}
+
+		if (count > 0 && ((yieldp->hy_entries != 0 &&
+		    count >= yieldp->hy_entries) || (yieldp->hy_usec != 0 &&
+		    gethrtime() >= deadline)))
+			break;
+
+		if (op->hop_marshalnext == nentries)
+			continue;
+
+		entryp = &entrylstp->hle_entries[op->hop_marshalnext];
+		if (op->hop_marshalpass == 0) {
+			if (hyprlofs_entry_measure(env, arg,
+			    op->hop_marshalnext, add, entryp) != 0) {
+				rv = -1;
+				break;
+			}
+			op->hop_marshalbytes += hyprlofs_entry_strsize(entryp,
+			    add);
+		} else if ((op->hop_marshalstrp = hyprlofs_entry_copy(env, arg,
+		    op->hop_marshalnext, add, true, entryp,
+		    op->hop_marshalstrp)) == NULL) {
+			rv = -1;
+			break;
+		}
+		op->hop_marshalnext++;
+	}
+
+	op->hop_stats.hos_marshal += gethrtime() - start;
+	if (rv <= 0) {
+		hyprlofs_unref(env, &op->hop_marshalsrc);
+		HYPRLOFS_MARSHAL_DONE((char *)(add ? "ADD" : "REMOVE"),
+		    nentries, rv != 0);
+	}
+	return (rv);
+}
+
+/*
+ * Parses the "yieldEntries" and "yieldMicros" properties of "options" into
+ * "yieldp", leaving alone the limits for properties that are absent.  Returns
+ * NULL on success, or else a description of the problem.
+ */
+static const char *
+hyprlofs_yield_parse(napi_env env, napi_value options,
+    hyprlofs_yield_t *yieldp)
+{
+	napi_value entries, usec;
+	uint32_t value;
+
+	entries = hyprlofs_get(env, options, "yieldEntries");
+	usec = hyprlofs_get(env, options, "yieldMicros");
+
+	if (hyprlofs_typeof(env, entries) != napi_undefined) {
+		if (!hyprlofs_get_uint32(env, entries, &value) || value == 0)
+			return ("yieldEntries must be a positive integer");
+		yieldp->hy_entries = value;
+	}
+
+	if (hyprlofs_typeof(env, usec) != napi_undefined) {
+		if (!hyprlofs_get_uint32(env, usec, &value) || value == 0)
+			return ("yieldMicros must be a positive integer");
+		yieldp->hy_usec = value;
+	}
+
+	return (NULL);
+}
+
+/*
+ * Parses the "priority" property of "options" into "prip", leaving it alone if
+ * the property is absent.  Returns NULL on success, or else a description of
+ * the problem.
+ */
+static const char *
+hyprlofs_pri_parse(napi_env env, napi_value options, hyprlofs_pri_t *prip)
+{
+	napi_value value;
+	char buf[16];
+
+	value = hyprlofs_get(env, options, "priority");
+	if (hyprlofs_typeof(env, value) == napi_undefined)
+		return (NULL);
+
+	if (hyprlofs_typeof(env, value) != napi_string ||
+	    napi_get_value_string_utf8(env, value, buf, sizeof (buf),
+	    NULL) != napi_ok)
+		buf[0] = '\0';
+
+	if (strcmp(buf, "interactive") == 0)
+		*prip = HYPRLOFS_PRI_INTERACTIVE;
+	else if (strcmp(buf, "background") == 0)
+		*prip = HYPRLOFS_PRI_BACKGROUND;
+	else
+		return ("priority must be \"interactive\" or \"background\"");
+
+	return (NULL);
+}
+
+/*
+ * Parses rate limit "value" into "ratep": a positive number of mappings per
+ * second, or null or undefined (stored as 0) for no limit.  Returns NULL on
+ * success, or else a description of the problem.
+ */
+static const char *
+hyprlofs_rate_parse(napi_env env, napi_value value, uint32_t *ratep)
+{
+	*ratep = 0;
+	if (hyprlofs_typeof(env, value) == napi_undefined ||
+	    hyprlofs_typeof(env, value) == napi_null)
+		return (NULL);
+
+	if (!hyprlofs_get_uint32(env, value, ratep) || *ratep == 0)
+		return ("rateLimit must be a positive integer or null");
+
+	return (NULL);
+}
+
+/*
+ * Returns the name of the entry point that requested operation "op", for
+ * DTrace probes.
+ */
+const char *
+HyprlofsFilesystem::opName(const hyprlofs_op_t *op)
+{
+	if (op->hop_run == eioMountRun)
+		return ("mount");
+	if (op->hop_run == eioUmountRun)
+		return ("unmount");
+	if (op->hop_run == eioSetRun)
+		return ("setMappings");
+	if (op->hop_run == eioReplaceRun)
+		return ("replaceAll");
+	if (op->hop_run == eioSnapshotRun)
+		return ("snapshot");
+	if (op->hop_run == eioRestoreRun)
+		return ("restore");
+	if (op->hop_run == eioPrefixRemoveRun)
+		return ("removeByPrefix");
+	if (op->hop_prefix != NULL)
+		return ("listByPrefix");
+	if (op->hop_run == eioResyncRun)
+		return ("resync");
+
+	switch (op->hop_ioctl_cmd) {
+	case HYPRLOFS_ADD_ENTRIES:	return ("addMappings");
+	case HYPRLOFS_RM_ENTRIES:	return ("removeMappings");
+	case HYPRLOFS_RM_ALL:		return ("removeAll");
+	case HYPRLOFS_GET_ENTRIES:	return ("listMappings");
+	default:			break;
+	}
+
+	return ("unknown");
+}
+
+/*
+ * Returns true if queued operation "next" may be processed with the same ioctl
+ * as operation "op".  This is only the case for plain add and remove
+ * operations issuing the same command.  Operations that are already split into
+ * chunks or that are in partial or validate mode are never combined.
+ */
+bool
+HyprlofsFilesystem::coalescable(const hyprlofs_op_t *op,
+    const hyprlofs_op_t *next)
+{
+	if (op->hop_run != HyprlofsFilesystem::eioIoctlRun ||
+	    next->hop_run != HyprlofsFilesystem::eioIoctlRun)
+		return (false);
+
+	if (op->hop_batchsize != 0 || next->hop_batchsize != 0 ||
+	    hyprlofs_op_checked(op) || hyprlofs_op_checked(next))
+		return (false);
+
+	if (next->hop_marshalling || next->hop_rv != 0 ||
+	    next->hop_pri != op->hop_pri)
+		return (false);
+
+	if (op->hop_ioctl_cmd != HYPRLOFS_ADD_ENTRIES &&
+	    op->hop_ioctl_cmd != HYPRLOFS_RM_ENTRIES)
+		return (false);
+
+	return (next->hop_ioctl_cmd == op->hop_ioctl_cmd);
+}
+
+/*
+ * Returns true if operation "op" changes the set of mappings.
+ */
+bool
+HyprlofsFilesystem::mutates(const hyprlofs_op_t *op)
+{
+	if (op->hop_run == HyprlofsFilesystem::eioSetRun ||
+	    op->hop_run == HyprlofsFilesystem::eioReplaceRun ||
+	    op->hop_run == HyprlofsFilesystem::eioRestoreRun ||
+	    op->hop_run == HyprlofsFilesystem::eioPrefixRemoveRun)
+		return (true);
+
+	return (op->hop_run == HyprlofsFilesystem::eioIoctlRun &&
+	    (op->hop_ioctl_cmd == HYPRLOFS_ADD_ENTRIES ||
+	    op->hop_ioctl_cmd == HYPRLOFS_RM_ENTRIES ||
+	    op->hop_ioctl_cmd == HYPRLOFS_RM_ALL));
+}
+
+/*
+ * Returns true if all of the entries of add or remove operation "op" are
+ * already reflected in the current mappings described by "currp", which must
+ * be sorted by alias: for an add, each alias must be mapped to its file; for a
+ * remove, none of the aliases may be present.
+ */
+static bool
+hyprlofs_op_applied(const hyprlofs_op_t *op,
+    const hyprlofs_curr_entries_t *currp)
+{
+	hyprlofs_entries_t *entrylstp = (hyprlofs_entries_t *)op->hop_ioctl_arg;
+	uint_t i;
+
+	for (i = 0; i < entrylstp->hle_len; i++) {
+		if (!hyprlofs_entry_applied(&entrylstp->hle_entries[i],
+		    op->hop_ioctl_cmd, currp))
+			return (false);
+	}
+
+	return (true);
+}
+
+/*
+ * Like hyprlofs_op_applied, but for the single entry "entryp" of an add or
+ * remove ("cmd").
+ */
+static bool
+hyprlofs_entry_applied(const hyprlofs_entry_t *entryp, int cmd,
+    const hyprlofs_curr_entries_t *currp)
+{
+	hyprlofs_curr_entry_t key, *currentp;
+	bool found;
+
+	if (strlcpy(key.hce_name, entryp->hle_name,
+	    sizeof (key.hce_name)) >= sizeof (key.hce_name))
+		return (false);
+
+	currentp = (hyprlofs_curr_entry_t *)bsearch(&key,
+	    currp->hce_entries, currp->hce_cnt,
+	    sizeof (hyprlofs_curr_entry_t), hyprlofs_curr_entry_cmp);
+
+	if (currentp == NULL || cmd == HYPRLOFS_RM_ENTRIES) {
+		found = currentp != NULL;
+	} else {
+		found = hyprlofs_path_matches(currentp->hce_path,
+		    entryp->hle_path, entryp->hle_plen);
+	}
+
+	return (found == (cmd == HYPRLOFS_ADD_ENTRIES));
+}
+
+/*
+ * Returns true if "op" is an add operation in partial or validate mode, which
+ * reports the entries it skipped.
+ */
+static bool
+hyprlofs_op_checked(const hyprlofs_op_t *op)
+{
+	return (op->hop_partial || op->hop_validate);
+}
+
+/*
+ * Invoked in the context of the event loop after add operation "op" (or one
+ * chunk of it) in partial or validate mode has been applied to append the
+ * entries that were skipped to hop_failed.
+ */
+static void
+hyprlofs_op_failures(hyprlofs_op_t *op)
+{
+	napi_env env = op->hop_env;
+	napi_handle_scope scope;
+	hyprlofs_entries_t *entrylstp = (hyprlofs_entries_t *)op->hop_ioctl_arg;
+	hyprlofs_entry_t *entryp;
+	napi_value failed, failure, errnum;
+	uint_t i, base;
+
+	(void) napi_open_handle_scope(env, &scope);
+	if (op->hop_failed == NULL)
+		op->hop_failed = hyprlofs_ref(env, hyprlofs_array(env, 0));
+
+	failed = hyprlofs_deref(env, op->hop_failed);
+	base = hyprlofs_array_length(env, failed);
+	for (i = 0; i < op->hop_nfailures; i++) {
+		entryp = &entrylstp->hle_entries[op->hop_failures[i].hf_index];
+		failure = hyprlofs_array(env, 3);
+		(void) napi_set_element(env, failure, 0, hyprlofs_string(env,
+		    entryp->hle_path, entryp->hle_plen));
+		(void) napi_set_element(env, failure, 1, hyprlofs_string(env,
+		    entryp->hle_name, entryp->hle_nlen));
+		(void) napi_create_int32(env, op->hop_failures[i].hf_errno,
+		    &errnum);
+		(void) napi_set_element(env, failure, 2, errnum);
+		(void) napi_set_element(env, failed, base + i, failure);
+	}
+	(void) napi_close_handle_scope(env, scope);
+
+	free(op->hop_failures);
+	op->hop_failures = NULL;
+	op->hop_nfailures = 0;
+}
+
+static int
+hyprlofs_failure_cmp(const void *l, const void *r)
+{
+	uint_t li = ((const hyprlofs_failure_t *)l)->hf_index;
+	uint_t ri = ((const hyprlofs_failure_t *)r)->hf_index;
+
+	return (li < ri ? -1 : li > ri ? 1 : 0);
+}
+
+/*
+ * Invoked outside the event loop to restrict the current mappings fetched by
+ * operation "op" to those whose aliases begin with hop_prefix, updating
+ * hop_count to match.  The mappings themselves are kept, since rebuilding the
+ * index uses all of them.
+ */
+static void
+hyprlofs_op_filter(hyprlofs_op_t *op)
+{
+	hyprlofs_cursor_t cursor;
+	const char *path, *name;
+	uint_t count = 0;
+
+	op->hop_cursor.hc_prefix = op->hop_prefix;
+	op->hop_cursor.hc_prefixlen = strlen(op->hop_prefix);
+
+	cursor = op->hop_cursor;
+	while (hyprlofs_cursor_next(&cursor, &path, &name))
+		count++;
+	op->hop_count = count;
+}
+
+/*
+ * Converts the next "count" mappings from "cursor" into the JavaScript
+ * representation returned by listMappings.
+ */
+static napi_value
+hyprlofs_mappings_array(napi_env env, hyprlofs_cursor_t *cursor, uint_t count)
+{
+	napi_escapable_handle_scope scope;
+	napi_value rv, entry;
+	const char *path, *name;
+
+	(void) napi_open_escapable_handle_scope(env, &scope);
+	rv = hyprlofs_array(env, count);
+	for (uint_t i = 0; i < count &&
+	    hyprlofs_cursor_next(cursor, &path, &name); i++) {
+		entry = hyprlofs_array(env, 2);
+		(void) napi_set_element(env, entry, 0,
+		    hyprlofs_string(env, path, NAPI_AUTO_LENGTH));
+		(void) napi_set_element(env, entry, 1,
+		    hyprlofs_string(env, name, NAPI_AUTO_LENGTH));
+		(void) napi_set_element(env, rv, i, entry);
+	}
+
+	(void) napi_escape_handle(env, scope, rv, &rv);
+	(void) napi_close_escapable_handle_scope(env, scope);
+	return (rv);
+}
+
+/*
+ * Like hyprlofs_mappings_array, but converts the packed mappings of operation
+ * "op", taking over hop_packbuf.  Where the runtime supports it, strings made
+ * up entirely of ASCII characters (for which Latin-1 and UTF-8 agree) are
+ * created as external strings that refer to hop_packbuf rather than copies of
+ * it.  The buffer is then freed when the last of them has been collected.  Our
+ * own reference keeps it alive while we're still creating them.
+ */
+static napi_value
+hyprlofs_mappings_external(napi_env env, hyprlofs_op_t *op)
+{
+	napi_escapable_handle_scope scope;
+	hyprlofs_module_t *modp = NULL;
+	hyprlofs_xbuf_t *xbp = NULL;
+	napi_value rv, entry;
+	char *data;
+
+	(void) napi_get_instance_data(env, (void **)&modp);
+	if (modp->hm_extstr != NULL && (xbp = (hyprlofs_xbuf_t *)malloc(
+	    sizeof (*xbp))) != NULL) {
+		xbp->hx_refs = 1;
+		xbp->hx_data = op->hop_packbuf;
+		op->hop_packbuf = NULL;
+	}
+
+	data = xbp != NULL ? xbp->hx_data : op->hop_packbuf;
+	(void) napi_open_escapable_handle_scope(env, &scope);
+	rv = hyprlofs_array(env, op->hop_count);
+	for (uint_t i = 0; i < op->hop_count; i++) {
+		entry = hyprlofs_array(env, 2);
+		(void) napi_set_element(env, entry, 0, hyprlofs_xbuf_string(env,
+		    modp->hm_extstr, xbp, data + op->hop_packoffs[2 * i]));
+		(void) napi_set_element(env, entry, 1, hyprlofs_xbuf_string(env,
+		    modp->hm_extstr, xbp, data + op->hop_packoffs[2 * i + 1]));
+		(void) napi_set_element(env, rv, i, entry);
+	}
+
+	(void) napi_escape_handle(env, scope, rv, &rv);
+	(void) napi_close_escapable_handle_scope(env, scope);
+	if (xbp != NULL)
+		hyprlofs_xbuf_rele(xbp);
+	return (rv);
+}
+
+/*
+ * Returns a string for the NUL-terminated "str", which refers to the packed
+ * mappings in "xbp" if possible and is a copy otherwise.
+ */
+static napi_value
+hyprlofs_xbuf_string(napi_env env, hyprlofs_extstr_f extstr,
+    hyprlofs_xbuf_t *xbp, char *str)
+{
+	napi_value rv;
+	bool ascii = true, copied;
+	size_t len;
+
+	for (len = 0; str[len] != '\0'; len++) {
+		if ((uint8_t)str[len] >= 0x80)
+			ascii = false;
+	}
+
+	/*
+	 * The finalizer is invoked as soon as the string is collected, or
+	 * right away if it was copied after all, but not if creating it failed.
+	 */
+	if (xbp != NULL && ascii) {
+		xbp->hx_refs++;
+		if (extstr(env, str, len, hyprlofs_xbuf_free, xbp, &rv,
+		    &copied) == napi_ok)
+			return (rv);
+		hyprlofs_xbuf_rele(xbp);
+	}
+
+	return (hyprlofs_string(env, str, len));
+}
+
+static void
+hyprlofs_xbuf_rele(hyprlofs_xbuf_t *xbp)
+{
+	assert(xbp->hx_refs > 0);
+	if (--xbp->hx_refs > 0)
+		return;
+
+	free(xbp->hx_data);
+	free(xbp);
+}
+
+static void
+hyprlofs_xbuf_free(napi_env env, void *data, void *hint)
+{
+	hyprlofs_xbuf_rele((hyprlofs_xbuf_t *)hint);
+}
+
+/*
+ * Invoked outside the event loop to convert the mappings fetched by operation
+ * "op" into packed form.
+ */
+static int
+hyprlofs_mappings_pack(hyprlofs_op_t *op)
+{
+	hyprlofs_cursor_t cursor;
+	const char *path, *name;
+	size_t len, off;
+	uint_t i;
+
+	assert(op->hop_packbuf == NULL && op->hop_packoffs == NULL);
+
+	len = 0;
+	cursor = op->hop_cursor;
+	while (hyprlofs_cursor_next(&cursor, &path, &name))
+		len += strlen(path) + strlen(name) + 2;
+
+	/*
+	 * Buffers must be non-NULL even when empty, so always allocate at
+	 * least one byte.
+	 */
+	if (len > UINT32_MAX ||
+	    (op->hop_packbuf = (char *)malloc(len + 1)) == NULL ||
+	    (op->hop_packoffs = (uint32_t *)malloc(
+	    2 * op->hop_count * sizeof (uint32_t) + 1)) == NULL) {
+		free(op->hop_packbuf);
+		op->hop_packbuf = NULL;
+		return (-1);
+	}
+
+	off = 0;
+	cursor = op->hop_cursor;
+	for (i = 0; hyprlofs_cursor_next(&cursor, &path, &name); i++) {
+		op->hop_packoffs[2 * i] = off;
+		off += strlcpy(op->hop_packbuf + off, path, len - off) + 1;
+
+		op->hop_packoffs[2 * i + 1] = off;
+		off += strlcpy(op->hop_packbuf + off, name, len - off) + 1;
+	}
+
+	assert(off == len && i == op->hop_count);
+	op->hop_packlen = len;
+	return (0);
+}
+
+/*
+ * Invoked outside the event loop to write the "len" bytes at "buf" to "file".
+ * The data is written to a uniquely named temporary file alongside it, which is
+ * then renamed into place, so that "file" is never seen partially written.  The
+ * directory is then synced so that the rename itself survives a crash.  On
+ * failure, returns -1 with errno set and stores into "syscallp" the name of the
+ * call that failed.
+ */
+static int
+hyprlofs_file_write(const char *file, const char *buf, size_t len,
+    const char **syscallp)
+{
+	char tmpfile[PATH_MAX], dir[PATH_MAX];
+	char *slash;
+	ssize_t rv;
+	size_t off;
+	int fd, err;
+
+	if (snprintf(tmpfile, sizeof (tmpfile), "%s.XXXXXX", file) >=
+	    (int)sizeof (tmpfile)) {
+		*syscallp = "open";
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	/*
+	 * mkstemp creates the file readable only by us, but the file it
+	 * replaces is meant to be read by other programs.
+	 */
+	if ((fd = mkstemp(tmpfile)) < 0) {
+		*syscallp = "mkstemp";
+		return (-1);
+	}
+
+	if (fchmod(fd, 0644) != 0) {
+		*syscallp = "fchmod";
+		goto fail;
+	}
+
+	for (off = 0; off < len; off += rv) {
+		if ((rv = write(fd, buf + off, len - off)) < 0) {
+			if (errno == EINTR) {
+				rv = 0;
+				continue;
+			}
+
+			*syscallp = "write";
+			goto fail;
+		}
+	}
+
+	if (fsync(fd) != 0) {
+		*syscallp = "fsync";
+		goto fail;
+	}
+
+	if (close(fd) != 0) {
+		fd = -1;
+		*syscallp = "close";
+		goto fail;
+	}
+
+	fd = -1;
+	if (rename(tmpfile, file) != 0) {
+		*syscallp = "rename";
+		goto fail;
+	}
+
+	(void) strlcpy(dir, file, sizeof (dir));
+	if ((slash = strrchr(dir, '/')) == NULL)
+		(void) strlcpy(dir, ".", sizeof (dir));
+	else if (slash == dir)
+		slash[1] = '\0';
+	else
+		*slash = '\0';
+
+	if ((fd = open(dir, O_RDONLY)) < 0) {
+		*syscallp = "open";
+		return (-1);
+	}
+
+	if (fsync(fd) != 0) {
+		err = errno;
+		(void) close(fd);
+		*syscallp = "fsync";
+		errno = err;
+		return (-1);
+	}
+
+	(void) close(fd);
+	return (0);
+
+fail:
+	err = errno;
+	if (fd >= 0)
+		(void) close(fd);
+	(void) unlink(tmpfile);
+	errno = err;
+	return (-1);
+}
+
+static void
+hyprlofs_buffer_free(napi_env env, void *data, void *hint)
+{
+	free(data);
+}
+
+/*
+ * Returns the number of entries to provide to the GET ioctl when we expect
+ * about "count" mappings.
+ */
+static uint_t
+hyprlofs_get_headroom(uint_t count)
+{
+	uint_t extra;
+
+	extra = (count >> HYPRLOFS_GET_HEADROOM_SHIFT) +
+	    HYPRLOFS_GET_HEADROOM_MIN;
+	return (count > UINT_MAX - extra ? UINT_MAX : count + extra);
+}
+
+/*
+ * Returns true if "currpath", a path reported by the kernel for a current
+ * mapping, refers to "path", a path supplied by the user, which is "plen" bytes
+ * long.  As in test/basic.js, the kernel may report paths prefixed with this
+ * zone's root directory, so we only compare the end of the current path.
+ */
+static bool
+hyprlofs_path_matches(const char *currpath, const char *path, size_t plen)
+{
+	size_t clen = strlen(currpath);
+
+	return (clen >= plen && strcmp(currpath + clen - plen, path) == 0);
+}
+
+static int
+hyprlofs_curr_entry_cmp(const void *l, const void *r)
+{
+	return (strcmp(((const hyprlofs_curr_entry_t *)l)->hce_name,
+	    ((const hyprlofs_curr_entry_t *)r)->hce_name));
+}
+
+/*
+ * hyprlofs interface functions.
+ */
+
+/*
+ * Returns the index of "cmd" in the per-command statistics, or -1 if it has
+ * none.  The order matches hyprlofs_stats_object.
+ */
+static int
+hyprlofs_cmdidx(int cmd)
+{
+	switch (cmd) {
+	case HYPRLOFS_ADD_ENTRIES:	return (0);
+	case HYPRLOFS_RM_ENTRIES:	return (1);
+	case HYPRLOFS_RM_ALL:		return (2);
+	case HYPRLOFS_GET_ENTRIES:	return (3);
+	default:			break;
+	}
+
+	return (-1);
+}
+
+static const char *
+hyprlofs_cmdname(int cmd)
+{
+	switch (cmd) {
+	case HYPRLOFS_ADD_ENTRIES:	return ("ADD");
+	case HYPRLOFS_RM_ENTRIES:	return ("REMOVE");
+	case HYPRLOFS_RM_ALL:		return ("CLEAR");
+	case HYPRLOFS_GET_ENTRIES:	return ("GET");
+	default:			break;
+	}
+
+	return ("UNKNOWN");
+}
+
+/*
+ * Each list of entries passed to the kernel is allocated as a single arena
+ * containing the hyprlofs_entries_t itself, followed by the array of "nentries"
+ * entries, followed by any string storage.  The whole thing is released with a
+ * single call to free().  Callers that need string storage first allocate the
+ * arena with hyprlofs_entries_alloc, fill in the length of each string, and
+ * then use hyprlofs_entries_grow to extend the arena with "nbytes" bytes of
+ * string storage.
+ */
+static hyprlofs_entries_t *
+hyprlofs_entries_alloc(uint_t nentries)
+{
+	hyprlofs_entries_t *entrylstp;
+
+	if (nentries > (SIZE_MAX - sizeof (hyprlofs_entries_t)) /
+	    sizeof (hyprlofs_entry_t))
+		return (NULL);
+
+	if ((entrylstp = (hyprlofs_entries_t *)calloc(1,
+	    sizeof (hyprlofs_entries_t) +
+	    nentries * sizeof (hyprlofs_entry_t))) == NULL)
+		return (NULL);
+
+	entrylstp->hle_entries = (hyprlofs_entry_t *)(entrylstp + 1);
+	entrylstp->hle_len = nentries;
+	return (entrylstp);
+}
+
+/*
+ * See above.  On success, returns the (possibly moved) arena and stores a
+ * pointer to the string storage into "strp".  On failure, the original arena is
+ * freed.
+ */
+static hyprlofs_entries_t *
+hyprlofs_entries_grow(hyprlofs_entries_t *entrylstp, size_t nbytes,
+    char **strp)
+{
+	hyprlofs_entries_t *newlstp;
+	size_t hdrsz;
+
+	hdrsz = sizeof (hyprlofs_entries_t) +
+	    entrylstp->hle_len * sizeof (hyprlofs_entry_t);
+	if (nbytes > SIZE_MAX - hdrsz || (newlstp = (hyprlofs_entries_t *)
+	    realloc(entrylstp, hdrsz + nbytes)) == NULL) {
+		free(entrylstp);
+		return (NULL);
+	}
+
+	newlstp->hle_entries = (hyprlofs_entry_t *)(newlstp + 1);
+	*strp = (char *)newlstp + hdrsz;
+	return (newlstp);
+}
+
+/*
+ * Copies the "len"-byte UTF-8 representation of "value" (converted to a
+ * string) into "buf" and NUL-terminates it.  Returns a pointer just past the
+ * terminator, or NULL if the conversion failed.
+ */
+static char *
+hyprlofs_entries_copystr(napi_env env, char *buf, napi_value value,
+    size_t len)
+{
+	napi_value str;
+
+	if (napi_coerce_to_string(env, value, &str) != napi_ok ||
+	    napi_get_value_string_utf8(env, str, buf, len + 1, NULL) !=
+	    napi_ok)
+		return (NULL);
+
+	buf[len] = '\0';
+	return (buf + len + 1);
+}
+
+/*
+ * Records in "entryp" the UTF-8 lengths of the strings of the JavaScript
+ * mapping at index "idx" of "arg": a [path, alias] pair if "add" is true, or
+ * just an alias otherwise.  Returns -1 if the mapping is invalid.
+ */
+static int
+hyprlofs_entry_measure(napi_env env, napi_value arg, uint_t idx, bool add,
+    hyprlofs_entry_t *entryp)
+{
+	napi_handle_scope scope;
+	napi_value entry, path, name;
+	int rv = 0;
+
+	(void) napi_open_handle_scope(env, &scope);
+	if (!add) {
+		if (napi_get_element(env, arg, idx, &name) != napi_ok ||
+		    hyprlofs_strlen(env, name, &entryp->hle_nlen) != 0)
+			rv = -1;
+	} else if (napi_get_element(env, arg, idx, &entry) != napi_ok ||
+	    !hyprlofs_is_array(env, entry) ||
+	    hyprlofs_array_length(env, entry) != 2 ||
+	    napi_get_element(env, entry, 0, &path) != napi_ok ||
+	    napi_get_element(env, entry, 1, &name) != napi_ok ||
+	    hyprlofs_strlen(env, path, &entryp->hle_plen) != 0 ||
+	    hyprlofs_strlen(env, name, &entryp->hle_nlen) != 0) {
+		rv = -1;
+	}
+	(void) napi_close_handle_scope(env, scope);
+	return (rv);
+}
+
+/*
+ * Copies the strings of the mapping at index "idx" of "arg", whose lengths were
+ * recorded in "entryp" by hyprlofs_entry_measure, into the string storage at
+ * "strp".  Returns a pointer just past them, or NULL on failure.
+ *
+ * Converting a non-string value may have run arbitrary JavaScript, so we check
+ * again that each mapping is still an array.  The copies themselves never
+ * exceed the recorded lengths.  If "recheck" is true, the strings are measured
+ * again as well, and the copy fails if they've changed length.  That's needed
+ * when the caller (and anything else) may have run since they were measured.
+ */
+static char *
+hyprlofs_entry_copy(napi_env env, napi_value arg, uint_t idx, bool add,
+    bool recheck, hyprlofs_entry_t *entryp, char *strp)
+{
+	napi_handle_scope scope;
+	napi_value entry, path = NULL, name;
+	uint_t plen, nlen;
+
+	(void) napi_open_handle_scope(env, &scope);
+	if (!add) {
+		if (napi_get_element(env, arg, idx, &name) != napi_ok)
+			strp = NULL;
+	} else if (napi_get_element(env, arg, idx, &entry) != napi_ok ||
+	    !hyprlofs_is_array(env, entry) ||
+	    napi_get_element(env, entry, 0, &path) != napi_ok ||
+	    napi_get_element(env, entry, 1, &name) != napi_ok) {
+		strp = NULL;
+	}
+
+	if (strp != NULL && recheck &&
+	    ((add && (hyprlofs_strlen(env, path, &plen) != 0 ||
+	    plen != entryp->hle_plen)) ||
+	    hyprlofs_strlen(env, name, &nlen) != 0 ||
+	    nlen != entryp->hle_nlen))
+		strp = NULL;
+
+	if (strp != NULL && add) {
+		entryp->hle_path = strp;
+		strp = hyprlofs_entries_copystr(env, strp, path,
+		    entryp->hle_plen);
+	}
+
+	if (strp != NULL) {
+		entryp->hle_name = strp;
+		strp = hyprlofs_entries_copystr(env, strp, name,
+		    entryp->hle_nlen);
+	}
+	(void) napi_close_handle_scope(env, scope);
+	return (strp);
+}
+
+/*
+ * Returns the number of bytes of string storage needed for "entryp".
+ */
+static size_t
+hyprlofs_entry_strsize(const hyprlofs_entry_t *entryp, bool add)
+{
+	return (add ? entryp->hle_plen + entryp->hle_nlen + 2 :
+	    entryp->hle_nlen + 1);
+}
+
+/*
+ * Marshals the "nentries" JavaScript mappings of "arg" starting at index
+ * "start" into a single arena.  We make one pass over the mappings to validate
+ * them and record the UTF-8 length of each string, and then a second pass to
+ * copy the strings into the arena.  See also hyprlofs_op_marshal, which does
+ * the same thing a piece at a time.
+ */
+static hyprlofs_entries_t *
+hyprlofs_entries_populate(napi_env env, napi_value arg, bool add,
+    uint_t start, uint_t nentries)
+{
+	hyprlofs_entries_t *entrylstp;
+	hyprlofs_entry_t *entries;
+	size_t nbytes = 0;
+	char *strp;
+
+	HYPRLOFS_MARSHAL_START((char *)(add ? "ADD" : "REMOVE"), nentries);
+	if ((entrylstp = hyprlofs_entries_alloc(nentries)) == NULL)
+		goto fail;
+
+	entries = entrylstp->hle_entries;
+
+	for (uint_t i = 0; i < nentries; i++) {
+		if (hyprlofs_entry_measure(env, arg, start + i, add,
+		    &entries[i]) != 0)
+			goto fail;
+		nbytes += hyprlofs_entry_strsize(&entries[i], add);
+	}
+
+	if ((entrylstp = hyprlofs_entries_grow(entrylstp, nbytes,
+	    &strp)) == NULL)
+		goto fail;
+
+	entries = entrylstp->hle_entries;
+
+	for (uint_t i = 0; i < nentries; i++) {
+		if ((strp = hyprlofs_entry_copy(env, arg, start + i, add,
+		    false, &entries[i], strp)) == NULL)
+			goto fail;
+	}
+
+	HYPRLOFS_MARSHAL_DONE((char *)(add ? "ADD" : "REMOVE"), nentries, 0);
+	return (entrylstp);
+
+fail:
+	hyprlofs_entries_free(entrylstp);
+	HYPRLOFS_MARSHAL_DONE((char *)(add ? "ADD" : "REMOVE"), nentries, 1);
+	return (NULL);
+}
+
+/*
+ * Marshals the [path, alias] pairs passed to addMappings or setMappings.
+ */
+static hyprlofs_entries_t *
+hyprlofs_entries_populate_add(napi_env env, napi_value arg, uint_t start,
+    uint_t nentries)
+{
+	return (hyprlofs_entries_populate(env, arg, true, start, nentries));
+}
+
+/*
+ * Marshals the array of aliases passed to removeMappings.
+ */
+static hyprlofs_entries_t *
+hyprlofs_entries_populate_remove(napi_env env, napi_value arg, uint_t start,
+    uint_t nentries)
+{
+	return (hyprlofs_entries_populate(env, arg, false, start, nentries));
+}
+
+/*
+ * Validates the "len"-byte packed buffer "buf", which consists of a sequence of
+ * NUL-terminated strings: alternating paths and aliases if "add" is true, or
+ * just aliases otherwise.  See README.md.  On success, stores the number of
+ * mappings it describes into "nentriesp".
+ */
+static int
+hyprlofs_buffer_count(const char *buf, size_t len, bool add, uint_t *nentriesp)
+{
+	const char *p, *endp, *nulp;
+	size_t nstrs = 0;
+
+	if (len > 0 && buf[len - 1] != '\0')
+		return (-1);
+
+	endp = buf + len;
+	for (p = buf; p < endp; p = nulp + 1) {
+		nulp = (const char *)memchr(p, '\0', endp - p);
+		nstrs++;
+	}
+
+	if (add && nstrs % 2 != 0)
+		return (-1);
+
+	if (add)
+		nstrs /= 2;
+
+	if (nstrs > UINT_MAX)
+		return (-1);
+
+	*nentriesp = (uint_t)nstrs;
+	return (0);
+}
+
+/*
+ * Builds a list of the first "nentries" entries in the "len"-byte packed buffer
+ * "buf" (see hyprlofs_buffer_count), pointing into the buffer itself, and
+ * stores into "usedp" the number of bytes they occupy.  The returned arena
+ * contains only the entries themselves.
+ */
+static hyprlofs_entries_t *
+hyprlofs_entries_populate_buffer(char *buf, size_t len, bool add,
+    uint_t nentries, size_t *usedp)
+{
+	hyprlofs_entries_t *entrylstp;
+	hyprlofs_entry_t *entries;
+	char *p, *endp;
+	size_t slen;
+	uint_t i;
+
+	HYPRLOFS_MARSHAL_START((char *)hyprlofs_cmdname(add ?
+	    HYPRLOFS_ADD_ENTRIES : HYPRLOFS_RM_ENTRIES), nentries);
+	if ((entrylstp = hyprlofs_entries_alloc(nentries)) == NULL)
+		goto fail;
+
+	/*
+	 * The buffer was validated when the operation was requested, but it
+	 * may have since been modified, so we're careful not to run off the
+	 * end of it.
+	 */
+	entries = entrylstp->hle_entries;
+	endp = buf + len;
+	for (p = buf, i = 0; i < nentries; i++) {
+		if (add) {
+			if ((slen = strnlen(p, endp - p)) == (size_t)(endp - p))
+				goto fail;
+			entries[i].hle_path = p;
+			entries[i].hle_plen = slen;
+			p += slen + 1;
+		}
+
+		if ((slen = strnlen(p, endp - p)) == (size_t)(endp - p))
+			goto fail;
+		entries[i].hle_name = p;
+		entries[i].hle_nlen = slen;
+		p += slen + 1;
+	}
+
+	*usedp = p - buf;
+	HYPRLOFS_MARSHAL_DONE((char *)hyprlofs_cmdname(add ?
+	    HYPRLOFS_ADD_ENTRIES : HYPRLOFS_RM_ENTRIES), nentries, 0);
+	return (entrylstp);
+
+fail:
+	hyprlofs_entries_free(entrylstp);
+	HYPRLOFS_MARSHAL_DONE((char *)hyprlofs_cmdname(add ?
+	    HYPRLOFS_ADD_ENTRIES : HYPRLOFS_RM_ENTRIES), nentries, 1);
+	return (NULL);
+}
+
+static void
+hyprlofs_entries_free(hyprlofs_entries_t *entrylstp)
+{
+	free(entrylstp);
+}
+
+/*
+ * Hash table functions.
+ */
+
+/*
+ * Initializes "tablep" with enough buckets for about "count" nodes.
+ */
+static int
+hyprlofs_htable_init(hyprlofs_htable_t *tablep, uint32_t count)
+{
+	uint32_t nbuckets = 16;
+
+	while (nbuckets < count && nbuckets < (1U << 30))
+		nbuckets <<= 1;
+
+	if ((tablep->ht_buckets = (hyprlofs_hnode_t **)calloc(nbuckets,
+	    sizeof (hyprlofs_hnode_t *))) == NULL)
+		return (-1);
+
+	tablep->ht_nbuckets = nbuckets;
+	tablep->ht_count = 0;
+	return (0);
+}
+
+/*
+ * Ensures that "tablep", which must be empty, has enough buckets for about
+ * "count" nodes, so that inserting them won't have to grow it.
+ */
+static int
+hyprlofs_htable_reserve(hyprlofs_htable_t *tablep, uint32_t count)
+{
+	assert(tablep->ht_count == 0);
+	if (tablep->ht_buckets != NULL && tablep->ht_nbuckets >= count)
+		return (0);
+
+	hyprlofs_htable_fini(tablep);
+	return (hyprlofs_htable_init(tablep, count));
+}
+
+/*
+ * Releases the bucket array of "tablep".  The nodes themselves belong to the
+ * consumer.
+ */
+static void
+hyprlofs_htable_fini(hyprlofs_htable_t *tablep)
+{
+	free(tablep->ht_buckets);
+	bzero(tablep, sizeof (*tablep));
+}
+
+/*
+ * FNV-1a.
+ */
+static uint32_t
+hyprlofs_htable_hash(const char *key)
+{
+	uint32_t hash = 2166136261U;
+
+	for (; *key != '\0'; key++) {
+		hash ^= (uint8_t)*key;
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
+
+static hyprlofs_hnode_t *
+hyprlofs_htable_lookup(const hyprlofs_htable_t *tablep, const char *key)
+{
+	hyprlofs_hnode_t *nodep;
+	uint32_t hash;
+
+	if (tablep->ht_count == 0)
+		return (NULL);
+
+	hash = hyprlofs_htable_hash(key);
+	for (nodep = tablep->ht_buckets[hash & (tablep->ht_nbuckets - 1)];
+	    nodep != NULL; nodep = nodep->hn_next) {
+		if (nodep->hn_hash == hash && strcmp(nodep->hn_key, key) == 0)
+			return (nodep);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Links "nodep", whose hn_key must already be set, into "tablep".  The caller
+ * is responsible for making sure that the key isn't already present.
+ */
+static void
+hyprlofs_htable_insert(hyprlofs_htable_t *tablep, hyprlofs_hnode_t *nodep)
+{
+	hyprlofs_hnode_t **bucketp;
+
+	nodep->hn_hash = hyprlofs_htable_hash(nodep->hn_key);
+	bucketp = &tablep->ht_buckets[nodep->hn_hash &
+	    (tablep->ht_nbuckets - 1)];
+	nodep->hn_next = *bucketp;
+	*bucketp = nodep;
+	tablep->ht_count++;
+}
+
+/*
+ * Unlinks and returns the node with key "key" from "tablep", or returns NULL if
+ * there is no such node.
+ */
+static hyprlofs_hnode_t *
+hyprlofs_htable_remove(hyprlofs_htable_t *tablep, const char *key)
+{
+	hyprlofs_hnode_t **nodepp, *nodep;
+	uint32_t hash;
+
+	if (tablep->ht_count == 0)
+		return (NULL);
+
+	hash = hyprlofs_htable_hash(key);
+	for (nodepp = &tablep->ht_buckets[hash & (tablep->ht_nbuckets - 1)];
+	    (nodep = *nodepp) != NULL; nodepp = &nodep->hn_next) {
+		if (nodep->hn_hash == hash &&
+		    strcmp(nodep->hn_key, key) == 0) {
+			*nodepp = nodep->hn_next;
+			tablep->ht_count--;
+			return (nodep);
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * Doubles the number of buckets in "tablep".  If we can't allocate the new
+ * bucket array, the table is left as it was, which is still correct.
+ */
+static void
+hyprlofs_htable_grow(hyprlofs_htable_t *tablep)
+{
+	hyprlofs_hnode_t **buckets, **bucketp, *nodep, *nextp;
+	uint32_t nbuckets, i;
+
+	if (tablep->ht_nbuckets >= (1U << 30))
+		return;
+
+	nbuckets = tablep->ht_nbuckets << 1;
+	if ((buckets = (hyprlofs_hnode_t **)calloc(nbuckets,
+	    sizeof (hyprlofs_hnode_t *))) == NULL)
+		return;
+
+	for (i = 0; i < tablep->ht_nbuckets; i++) {
+		for (nodep = tablep->ht_buckets[i]; nodep != NULL;
+		    nodep = nextp) {
+			nextp = nodep->hn_next;
+			bucketp = &buckets[nodep->hn_hash & (nbuckets - 1)];
+			nodep->hn_next = *bucketp;
+			*bucketp = nodep;
+		}
+	}
+
+	free(tablep->ht_buckets);
+	tablep->ht_buckets = buckets;
+	tablep->ht_nbuckets = nbuckets;
+}
+
+/*
+ * Index functions.  The index is a hash table of hyprlofs_mapping_t, which it
+ * owns.  "internp" is the table of shared strings used by the index's owner,
+ * or NULL if it doesn't use one.
+ */
+
+/*
+ * Records that alias "name" ("nlen" bytes long) maps "path" ("plen" bytes
+ * long), replacing any existing mapping for "name".
+ */
+static int
+hyprlofs_index_put(hyprlofs_htable_t *tablep, hyprlofs_intern_t *internp,
+    const char *name, size_t nlen, const char *path, size_t plen)
+{
+	hyprlofs_mapping_t *mp;
+	hyprlofs_istr_t *dirp = NULL;
+	size_t size, dlen;
+
+	if (tablep->ht_buckets == NULL && hyprlofs_htable_init(tablep, 0) != 0)
+		return (-1);
+
+	/*
+	 * Only the part of the path up to its last "/" is shared.  If that's
+	 * short, or we can't get it from the table, we just store the whole
+	 * path.  Paths that wouldn't fit in a cursor's buffer once reassembled
+	 * are never split.
+	 */
+	if (internp != NULL && plen < MAXPATHLEN) {
+		for (dlen = plen; dlen > 0 && path[dlen - 1] != '/'; dlen--)
+			continue;
+		if (dlen >= HYPRLOFS_INTERN_MIN &&
+		    (dirp = hyprlofs_intern_get(internp, path, dlen)) != NULL) {
+			path += dlen;
+			plen -= dlen;
+		}
+	}
+
+	size = offsetof(hyprlofs_mapping_t, hm_strs);
+	if (nlen > SIZE_MAX - size - 2 || plen > SIZE_MAX - size - 2 - nlen ||
+	    (mp = (hyprlofs_mapping_t *)malloc(size + nlen + plen + 2)) ==
+	    NULL) {
+		if (dirp != NULL)
+			hyprlofs_intern_put(internp, dirp);
+		return (-1);
+	}
+
+	bcopy(name, mp->hm_strs, nlen);
+	mp->hm_strs[nlen] = '\0';
+	bcopy(path, mp->hm_strs + nlen + 1, plen);
+	mp->hm_strs[nlen + 1 + plen] = '\0';
+	mp->hm_dir = dirp;
+	mp->hm_path = mp->hm_strs + nlen + 1;
+	mp->hm_node.hn_key = mp->hm_strs;
+	mp->hm_node.hn_value = mp;
+
+	hyprlofs_index_delete(tablep, internp, mp->hm_strs);
+	if (tablep->ht_count >= 2 * tablep->ht_nbuckets)
+		hyprlofs_htable_grow(tablep);
+	hyprlofs_htable_insert(tablep, &mp->hm_node);
+	return (0);
+}
+
+static void
+hyprlofs_index_delete(hyprlofs_htable_t *tablep, hyprlofs_intern_t *internp,
+    const char *name)
+{
+	hyprlofs_hnode_t *nodep;
+
+	if ((nodep = hyprlofs_htable_remove(tablep, name)) != NULL)
+		hyprlofs_mapping_free(internp,
+		    (hyprlofs_mapping_t *)nodep->hn_value);
+}
+
+/*
+ * Removes all mappings from the index, keeping its bucket array.
+ */
+static void
+hyprlofs_index_clear(hyprlofs_htable_t *tablep, hyprlofs_intern_t *internp)
+{
+	hyprlofs_hnode_t *nodep, *nextp;
+	uint32_t i;
+
+	for (i = 0; i < tablep->ht_nbuckets; i++) {
+		for (nodep = tablep->ht_buckets[i]; nodep != NULL;
+		    nodep = nextp) {
+			nextp = nodep->hn_next;
+			hyprlofs_mapping_free(internp,
+			    (hyprlofs_mapping_t *)nodep->hn_value);
+		}
+
+		tablep->ht_buckets[i] = NULL;
+	}
+
+	tablep->ht_count = 0;
+}
+
+/*
+ * Replaces the contents of the index with the mappings from "cursor", which
+ * must not refer to the index itself.  On failure, the index is left empty.
+ */
+static int
+hyprlofs_index_load(hyprlofs_htable_t *tablep, hyprlofs_intern_t *internp,
+    hyprlofs_cursor_t *cursor)
+{
+	const char *path, *name;
+
+	hyprlofs_index_clear(tablep, internp);
+
+	while (hyprlofs_cursor_next(cursor, &path, &name)) {
+		if (hyprlofs_index_put(tablep, internp, name, strlen(name),
+		    path, strlen(path)) != 0) {
+			hyprlofs_index_clear(tablep, internp);
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+static void
+hyprlofs_mapping_free(hyprlofs_intern_t *internp, hyprlofs_mapping_t *mp)
+{
+	if (mp->hm_dir != NULL)
+		hyprlofs_intern_put(internp, mp->hm_dir);
+	free(mp);
+}
+
+/*
+ * Shared string functions.  These are only used in the event loop context.
+ */
+
+static hyprlofs_intern_t *
+hyprlofs_intern_create(void)
+{
+	hyprlofs_intern_t *internp;
+
+	if ((internp = (hyprlofs_intern_t *)calloc(1,
+	    sizeof (*internp))) == NULL)
+		return (NULL);
+
+	if (hyprlofs_htable_init(&internp->hi_table, 0) != 0) {
+		free(internp);
+		return (NULL);
+	}
+
+	internp->hi_refs = 1;
+	return (internp);
+}
+
+static void
+hyprlofs_intern_hold(hyprlofs_intern_t *internp)
+{
+	internp->hi_refs++;
+}
+
+static void
+hyprlofs_intern_rele(hyprlofs_intern_t *internp)
+{
+	assert(internp->hi_refs > 0);
+	if (--internp->hi_refs > 0)
+		return;
+
+	/*
+	 * Every string is held by some mapping, and every index that uses the
+	 * table holds it, so there's nothing left in it by now.
+	 */
+	assert(internp->hi_table.ht_count == 0);
+	hyprlofs_htable_fini(&internp->hi_table);
+	free(internp);
+}
+
+/*
+ * Returns a hold on the shared copy of the "len" bytes at "str", creating it if
+ * necessary, or returns NULL if there isn't one and we can't make one.  "len"
+ * must be less than MAXPATHLEN.
+ */
+static hyprlofs_istr_t *
+hyprlofs_intern_get(hyprlofs_intern_t *internp, const char *str, size_t len)
+{
+	char key[MAXPATHLEN];
+	hyprlofs_hnode_t *nodep;
+	hyprlofs_istr_t *isp;
+
+	assert(len < sizeof (key));
+	bcopy(str, key, len);
+	key[len] = '\0';
+
+	if ((nodep = hyprlofs_htable_lookup(&internp->hi_table, key)) != NULL) {
+		isp = (hyprlofs_istr_t *)nodep->hn_value;
+		isp->is_refs++;
+		return (isp);
+	}
+
+	if ((isp = (hyprlofs_istr_t *)malloc(offsetof(hyprlofs_istr_t,
+	    is_str) + len + 1)) == NULL)
+		return (NULL);
+
+	bcopy(key, isp->is_str, len + 1);
+	isp->is_refs = 1;
+	isp->is_len = len;
+	isp->is_node.hn_key = isp->is_str;
+	isp->is_node.hn_value = isp;
+
+	if (internp->hi_table.ht_count >= 2 * internp->hi_table.ht_nbuckets)
+		hyprlofs_htable_grow(&internp->hi_table);
+	hyprlofs_htable_insert(&internp->hi_table, &isp->is_node);
+	return (isp);
+}
+
+static void
+hyprlofs_intern_put(hyprlofs_intern_t *internp, hyprlofs_istr_t *isp)
+{
+	assert(isp->is_refs > 0);
+	if (--isp->is_refs > 0)
+		return;
+
+	(void) hyprlofs_htable_remove(&internp->hi_table, isp->is_str);
+	free(isp);
+}
+
+/*
+ * Cursor functions.
+ */
+
+static void
+hyprlofs_cursor_init_curr(hyprlofs_cursor_t *cursor,
+    const hyprlofs_curr_entries_t *currp)
+{
+	bzero(cursor, sizeof (*cursor));
+	cursor->hc_curr = currp;
+}
+
+static void
+hyprlofs_cursor_init_index(hyprlofs_cursor_t *cursor,
+    const hyprlofs_htable_t *tablep)
+{
+	bzero(cursor, sizeof (*cursor));
+	cursor->hc_table = tablep;
+}
+
+/*
+ * Stores the path and alias of the next mapping from "cursor" into "pathp" and
+ * "namep" and returns true, or returns false if there are no more mappings.
+ */
+static bool
+hyprlofs_cursor_next(hyprlofs_cursor_t *cursor, const char **pathp,
+    const char **namep)
+{
+	while (hyprlofs_cursor_step(cursor, pathp, namep)) {
+		if (cursor->hc_prefix == NULL || strncmp(*namep,
+		    cursor->hc_prefix, cursor->hc_prefixlen) == 0)
+			return (true);
+	}
+
+	return (false);
+}
+
+/*
+ * Like hyprlofs_cursor_next, but ignores the cursor's prefix.
+ */
+static bool
+hyprlofs_cursor_step(hyprlofs_cursor_t *cursor, const char **pathp,
+    const char **namep)
+{
+	const hyprlofs_curr_entry_t *currentp;
+	const hyprlofs_mapping_t *mp;
+
+	if (cursor->hc_curr != NULL) {
+		if (cursor->hc_pos >= cursor->hc_curr->hce_cnt)
+			return (false);
+
+		currentp = &cursor->hc_curr->hce_entries[cursor->hc_pos++];
+		*pathp = currentp->hce_path;
+		*namep = currentp->hce_name;
+		return (true);
+	}
+
+	if (cursor->hc_table == NULL)
+		return (false);
+
+	while (cursor->hc_node == NULL) {
+		if (cursor->hc_bucket >= cursor->hc_table->ht_nbuckets)
+			return (false);
+		cursor->hc_node =
+		    cursor->hc_table->ht_buckets[cursor->hc_bucket++];
+	}
+
+	mp = (const hyprlofs_mapping_t *)cursor->hc_node->hn_value;
+	cursor->hc_node = cursor->hc_node->hn_next;
+	*namep = mp->hm_node.hn_key;
+	if (mp->hm_dir == NULL) {
+		*pathp = mp->hm_path;
+		return (true);
+	}
+
+	/*
+	 * The path is split between a shared string and the mapping, so it's
+	 * reassembled into the cursor.  It's only valid until the next call.
+	 */
+	bcopy(mp->hm_dir->is_str, cursor->hc_path, mp->hm_dir->is_len);
+	(void) strlcpy(cursor->hc_path + mp->hm_dir->is_len, mp->hm_path,
+	    sizeof (cursor->hc_path) - mp->hm_dir->is_len);
+	*pathp = cursor->hc_path;
+	return (true);
+}
+
+/*
+ * Statistics functions.
+ */
+
+/*
+ * Returns the number of mappings operation "op" passed to or received from the
+ * kernel on the caller's behalf, for the "entries" histogram.
+ */
+static uint_t
+hyprlofs_op_nentries(const hyprlofs_op_t *op)
+{
+	switch (op->hop_ioctl_cmd) {
+	case HYPRLOFS_ADD_ENTRIES:
+	case HYPRLOFS_RM_ENTRIES:
+		if (op->hop_ioctl_arg == NULL)
+			return (0);
+		return (op->hop_batchsize != 0 ? op->hop_batchtotal :
+		    ((hyprlofs_entries_t *)op->hop_ioctl_arg)->hle_len);
+	case HYPRLOFS_GET_ENTRIES:
+		return (op->hop_count);
+	default:
+		/* setMappings, replaceAll, and restore */
+		return (op->hop_nadded + op->hop_nremoved);
+	}
+}
+
+/*
+ * Invoked in the event loop context to add the statistics of completed
+ * operation "op" to "statsp".  Time in ioctls is only recorded for operations
+ * that issued any: an operation coalesced into another's ioctl (see
+ * coalesce()) issues none itself.  Likewise, the entries of an addMappingsMulti
+ * request are marshalled once, and that's recorded for its first operation.
+ */
+static void
+hyprlofs_stats_record(hyprlofs_stats_t *statsp, const hyprlofs_op_t *op)
+{
+	const hyprlofs_opstats_t *osp = &op->hop_stats;
+	uint_t i, nioctls = 0;
+
+	statsp->hs_nops++;
+	for (i = 0; i < HYPRLOFS_NCMDS; i++) {
+		statsp->hs_nioctls[i] += osp->hos_nioctls[i];
+		nioctls += osp->hos_nioctls[i];
+	}
+
+	statsp->hs_e2big += osp->hos_e2big;
+	if (op->hop_rv != 0 && op->hop_errno >= 0 &&
+	    op->hop_errno < HYPRLOFS_NERRNO)
+		statsp->hs_errors[op->hop_errno]++;
+
+	if (op->hop_ioctl_arg != NULL ||
+	    op->hop_ioctl_cmd == HYPRLOFS_GET_ENTRIES)
+		hyprlofs_hist_add(&statsp->hs_entries,
+		    hyprlofs_op_nentries(op));
+	if (osp->hos_dispatched != 0)
+		hyprlofs_hist_add(&statsp->hs_queued,
+		    osp->hos_dispatched - osp->hos_queued);
+	if (op->hop_ioctl_arg != NULL && op->hop_groupidx == 0)
+		hyprlofs_hist_add(&statsp->hs_marshal, osp->hos_marshal);
+	if (nioctls > 0)
+		hyprlofs_hist_add(&statsp->hs_ioctl, osp->hos_ioctl);
+	if (op->hop_pri == HYPRLOFS_PRI_BACKGROUND && nioctls > 0)
+		hyprlofs_hist_add(&statsp->hs_throttled, osp->hos_throttled);
+}
+
+static void
+hyprlofs_hist_add(hyprlofs_hist_t *histp, uint64_t value)
+{
+	uint_t bucket = 0;
+
+	while (value >> bucket != 0 && bucket < HYPRLOFS_HIST_NBUCKETS - 1)
+		bucket++;
+
+	histp->hh_count++;
+	histp->hh_sum += value;
+	histp->hh_buckets[bucket]++;
+}
+
+/*
+ * Returns a JavaScript object describing "statsp".  See README.md.
+ */
+static napi_value
+hyprlofs_stats_object(napi_env env, const hyprlofs_stats_t *statsp)
+{
+	static const int cmds[HYPRLOFS_NCMDS] = {
+		HYPRLOFS_ADD_ENTRIES, HYPRLOFS_RM_ENTRIES, HYPRLOFS_RM_ALL,
+		HYPRLOFS_GET_ENTRIES
+	};
+	napi_value rv, ioctls, errors;
+	char name[64];
+	uint_t i;
+
+	(void) napi_create_object(env, &rv);
+	(void) napi_create_object(env, &ioctls);
+	(void) napi_create_object(env, &errors);
+
+	for (i = 0; i < HYPRLOFS_NCMDS; i++) {
+		assert(hyprlofs_cmdidx(cmds[i]) == (int)i);
+		hyprlofs_set(env, ioctls, hyprlofs_cmdname(cmds[i]),
+		    hyprlofs_double(env, (double)statsp->hs_nioctls[i]));
+	}
+
+	for (i = 1; i < HYPRLOFS_NERRNO; i++) {
+		if (statsp->hs_errors[i] != 0)
+			hyprlofs_set(env, errors,
+			    hyprlofs_errname((int)i, name, sizeof (name)),
+			    hyprlofs_double(env,
+			    (double)statsp->hs_errors[i]));
+	}
+
+	hyprlofs_set(env, rv, "operations",
+	    hyprlofs_double(env, (double)statsp->hs_nops));
+	hyprlofs_set(env, rv, "ioctls", ioctls);
+	hyprlofs_set(env, rv, "getRetries",
+	    hyprlofs_double(env, (double)statsp->hs_e2big));
+	hyprlofs_set(env, rv, "errors", errors);
+	hyprlofs_set(env, rv, "entries",
+	    hyprlofs_hist_object(env, &statsp->hs_entries));
+	hyprlofs_set(env, rv, "queuedTime",
+	    hyprlofs_hist_object(env, &statsp->hs_queued));
+	hyprlofs_set(env, rv, "marshalTime",
+	    hyprlofs_hist_object(env, &statsp->hs_marshal));
+	hyprlofs_set(env, rv, "ioctlTime",
+	    hyprlofs_hist_object(env, &statsp->hs_ioctl));
+	hyprlofs_set(env, rv, "throttledTime",
+	    hyprlofs_hist_object(env, &statsp->hs_throttled));
+	return (rv);
+}
+
+/*
+ * Returns a JavaScript object describing histogram "histp": the count and sum
+ * of its values, and "buckets", mapping the lower bound of each non-empty
+ * bucket to the number of values in it.
+ */
+static napi_value
+hyprlofs_hist_object(napi_env env, const hyprlofs_hist_t *histp)
+{
+	napi_value rv, buckets;
+	char key[32];
+	uint_t i;
+
+	(void) napi_create_object(env, &rv);
+	(void) napi_create_object(env, &buckets);
+
+	for (i = 0; i < HYPRLOFS_HIST_NBUCKETS; i++) {
+		if (histp->hh_buckets[i] == 0)
+			continue;
+		(void) snprintf(key, sizeof (key), "%llu", i == 0 ? 0ULL :
+		    1ULL << (i - 1));
+		hyprlofs_set(env, buckets, key,
+		    hyprlofs_double(env, (double)histp->hh_buckets[i]));
+	}
+
+	hyprlofs_set(env, rv, "count",
+	    hyprlofs_double(env, (double)histp->hh_count));
+	hyprlofs_set(env, rv, "sum",
+	    hyprlofs_double(env, (double)histp->hh_sum));
+	hyprlofs_set(env, rv, "buckets", buckets);
+	return (rv);
+}
+
+/*
+ * See README.md.  This reports on all of the Filesystems in this environment.
+ */
+static napi_value
+hyprlofs_module_stats(napi_env env, napi_callback_info info)
+{
+	hyprlofs_module_t *modp = NULL;
+
+	(void) napi_get_instance_data(env, (void **)&modp);
+	return (hyprlofs_stats_object(env, &modp->hm_stats));
+}
+
+/*
+ * Mount manager functions.  The MountManager JavaScript object wraps a
+ * hyprlofs_pool_t, which is described above.
+ */
+
+/*
+ * See README.md.
+ */
+static napi_value
+hyprlofs_mgr_new(napi_env env, napi_callback_info info)
+{
+	hyprlofs_pool_t *pool;
+	hyprlofs_args_t args;
+	napi_value target, maxopen;
+	uint32_t max = HYPRLOFS_POOL_MAXOPEN;
+
+	hyprlofs_args_get(env, info, &args);
+
+	if (napi_get_new_target(env, info, &target) != napi_ok ||
+	    target == NULL)
+		return (hyprlofs_throw(env,
+		    "MountManager must be invoked with \"new\""));
+
+	if (args.ha_argc > 0 &&
+	    hyprlofs_typeof(env, args.ha_argv[0]) != napi_undefined) {
+		if (hyprlofs_typeof(env, args.ha_argv[0]) != napi_object)
+			return (hyprlofs_throw(env,
+			    "MountManager: expected options object"));
+
+		maxopen = hyprlofs_get(env, args.ha_argv[0], "maxOpen");
+		if (hyprlofs_typeof(env, maxopen) != napi_undefined &&
+		    (!hyprlofs_get_uint32(env, maxopen, &max) || max == 0))
+			return (hyprlofs_throw(env, "MountManager: maxOpen "
+			    "must be a positive integer"));
+	}
+
+	if ((pool = hyprlofs_pool_create(max)) == NULL)
+		return (hyprlofs_throw(env, "MountManager: out of memory"));
+
+	if (napi_wrap(env, args.ha_this, pool, hyprlofs_mgr_finalize, NULL,
+	    NULL) != napi_ok) {
+		hyprlofs_pool_rele(pool);
+		return (hyprlofs_throw(env, "failed to create MountManager"));
+	}
+
+	(void) napi_type_tag_object(env, args.ha_this, &hyprlofs_mgr_tag);
+	return (args.ha_this);
+}
+
+static void
+hyprlofs_mgr_finalize(napi_env env, void *data, void *hint)
+{
+	hyprlofs_pool_rele((hyprlofs_pool_t *)data);
+}
+
+/*
+ * Opens mountpoint "path" for issuing ioctls.  Returns the fd, or -1 with errno
+ * set on failure.
+ */
+static int
+hyprlofs_open(const char *path)
+{
+	int fd, flags;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return (-1);
+
+	if ((flags = fcntl(fd, F_GETFD)) != -1) {
+		flags |= FD_CLOEXEC;
+		(void) fcntl(fd, F_SETFD, flags);
+	}
+
+	return (fd);
+}
+
+/*
+ * Returns a new pool that keeps at most "maxopen" idle fds open, with one
+ * reference (held by its MountManager).
+ */
+static hyprlofs_pool_t *
+hyprlofs_pool_create(uint_t maxopen)
+{
+	hyprlofs_pool_t *pool;
+
+	if ((pool = (hyprlofs_pool_t *)calloc(1, sizeof (*pool))) == NULL)
+		return (NULL);
+
+	if (hyprlofs_htable_init(&pool->hp_table, 0) != 0) {
+		free(pool);
+		return (NULL);
+	}
+
+	(void) pthread_mutex_init(&pool->hp_lock, NULL);
+	pool->hp_refs = 1;
+	pool->hp_maxopen = maxopen;
+	return (pool);
+}
+
+static void
+hyprlofs_pool_hold(hyprlofs_pool_t *pool)
+{
+	(void) pthread_mutex_lock(&pool->hp_lock);
+	pool->hp_refs++;
+	(void) pthread_mutex_unlock(&pool->hp_lock);
+}
+
+/*
+ * Releases a reference on "pool".  When the last one is released, there can be
+ * no ioctls using the pool, so every entry is idle, and we close them all.
+ */
+static void
+hyprlofs_pool_rele(hyprlofs_pool_t *pool)
+{
+	hyprlofs_poolent_t *entp, *nextp;
+	bool last;
+
+	(void) pthread_mutex_lock(&pool->hp_lock);
+	assert(pool->hp_refs > 0);
+	last = --pool->hp_refs == 0;
+	(void) pthread_mutex_unlock(&pool->hp_lock);
+
+	if (!last)
+		return;
+
+	assert(pool->hp_table.ht_count == 0 || pool->hp_lru_head != NULL);
+	for (entp = pool->hp_lru_head; entp != NULL; entp = nextp) {
+		nextp = entp->pe_next;
+		assert(entp->pe_holds == 0);
+		(void) close(entp->pe_fd);
+		free(entp);
+	}
+
+	hyprlofs_htable_fini(&pool->hp_table);
+	(void) pthread_mutex_destroy(&pool->hp_lock);
+	free(pool);
+}
+
+/*
+ * Removes idle entry "entp" from the LRU list of "pool".
+ */
+static void
+hyprlofs_pool_lru_remove(hyprlofs_pool_t *pool, hyprlofs_poolent_t *entp)
+{
+	if (entp->pe_prev == NULL)
+		pool->hp_lru_head = entp->pe_next;
+	else
+		entp->pe_prev->pe_next = entp->pe_next;
+
+	if (entp->pe_next == NULL)
+		pool->hp_lru_tail = entp->pe_prev;
+	else
+		entp->pe_next->pe_prev = entp->pe_prev;
+
+	entp->pe_prev = entp->pe_next = NULL;
+}
+
+/*
+ * Stores into "entpp" a held entry of "pool" for mountpoint "path", opening the
+ * mountpoint if the pool doesn't already have it open.  The caller uses the
+ * entry's fd and then releases it with hyprlofs_pool_put.  Returns -1 with
+ * errno set if the mountpoint couldn't be opened.
+ */
+static int
+hyprlofs_pool_get(hyprlofs_pool_t *pool, const char *path,
+    hyprlofs_poolent_t **entpp)
+{
+	hyprlofs_hnode_t *nodep;
+	hyprlofs_poolent_t *entp, *newp;
+	size_t len;
+	int fd;
+
+	(void) pthread_mutex_lock(&pool->hp_lock);
+	if ((nodep = hyprlofs_htable_lookup(&pool->hp_table, path)) != NULL) {
+		entp = (hyprlofs_poolent_t *)nodep->hn_value;
+		if (entp->pe_holds++ == 0)
+			hyprlofs_pool_lru_remove(pool, entp);
+		(void) pthread_mutex_unlock(&pool->hp_lock);
+		*entpp = entp;
+		return (0);
+	}
+	(void) pthread_mutex_unlock(&pool->hp_lock);
+
+	/*
+	 * Don't hold the lock while opening the mountpoint, since that may
+	 * block, and ioctls for other mounts shouldn't have to wait for it.
+	 */
+	len = strlen(path);
+	if ((fd = hyprlofs_open(path)) == -1)
+		return (-1);
+
+	if ((newp = (hyprlofs_poolent_t *)calloc(1,
+	    offsetof(hyprlofs_poolent_t, pe_path) + len + 1)) == NULL) {
+		(void) close(fd);
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	bcopy(path, newp->pe_path, len + 1);
+	newp->pe_node.hn_key = newp->pe_path;
+	newp->pe_node.hn_value = newp;
+	newp->pe_fd = fd;
+	newp->pe_holds = 1;
+
+	/*
+	 * Another thread may have opened the same mountpoint in the meantime,
+	 * in which case we use its entry instead.
+	 */
+	(void) pthread_mutex_lock(&pool->hp_lock);
+	if ((nodep = hyprlofs_htable_lookup(&pool->hp_table, path)) != NULL) {
+		entp = (hyprlofs_poolent_t *)nodep->hn_value;
+		if (entp->pe_holds++ == 0)
+			hyprlofs_pool_lru_remove(pool, entp);
+	} else {
+		if (pool->hp_table.ht_count >= 2 * pool->hp_table.ht_nbuckets)
+			hyprlofs_htable_grow(&pool->hp_table);
+		hyprlofs_htable_insert(&pool->hp_table, &newp->pe_node);
+		entp = newp;
+		newp = NULL;
+	}
+	(void) pthread_mutex_unlock(&pool->hp_lock);
+
+	if (newp != NULL) {
+		(void) close(newp->pe_fd);
+		free(newp);
+	}
+
+	*entpp = entp;
+	return (0);
+}
+
+/*
+ * Releases a hold on entry "entp" of "pool" obtained with hyprlofs_pool_get.
+ * If "invalidate" is set, the fd is no longer useful, and the entry won't be
+ * used again.  Either way, if too many entries are open, the least recently
+ * used idle ones are closed.
+ */
+static void
+hyprlofs_pool_put(hyprlofs_pool_t *pool, hyprlofs_poolent_t *entp,
+    bool invalidate)
+{
+	hyprlofs_poolent_t *victimp;
+
+	(void) pthread_mutex_lock(&pool->hp_lock);
+	assert(entp->pe_holds > 0);
+
+	if (invalidate && !entp->pe_defunct) {
+		(void) hyprlofs_htable_remove(&pool->hp_table, entp->pe_path);
+		entp->pe_defunct = true;
+	}
+
+	if (--entp->pe_holds == 0 && entp->pe_defunct) {
+		(void) close(entp->pe_fd);
+		free(entp);
+	} else if (entp->pe_holds == 0) {
+		entp->pe_prev = pool->hp_lru_tail;
+		entp->pe_next = NULL;
+		if (pool->hp_lru_tail == NULL)
+			pool->hp_lru_head = entp;
+		else
+			pool->hp_lru_tail->pe_next = entp;
+		pool->hp_lru_tail = entp;
+	}
+
+	while (pool->hp_table.ht_count > pool->hp_maxopen &&
+	    (victimp = pool->hp_lru_head) != NULL) {
+		hyprlofs_pool_lru_remove(pool, victimp);
+		(void) hyprlofs_htable_remove(&pool->hp_table,
+		    victimp->pe_path);
+		(void) close(victimp->pe_fd);
+		free(victimp);
+	}
+
+	(void) pthread_mutex_unlock(&pool->hp_lock);
+}
+
+/*
+ * Closes the pool's fd for mountpoint "path", if it has one, or arranges for it
+ * to be closed as soon as it's no longer in use.
+ */
+static void
+hyprlofs_pool_purge(hyprlofs_pool_t *pool, const char *path)
+{
+	hyprlofs_hnode_t *nodep;
+	hyprlofs_poolent_t *entp;
+
+	(void) pthread_mutex_lock(&pool->hp_lock);
+	if ((nodep = hyprlofs_htable_remove(&pool->hp_table, path)) != NULL) {
+		entp = (hyprlofs_poolent_t *)nodep->hn_value;
+		if (entp->pe_holds == 0) {
+			hyprlofs_pool_lru_remove(pool, entp);
+			(void) close(entp->pe_fd);
+			free(entp);
+		} else {
+			entp->pe_defunct = true;
+		}
+	}
+	(void) pthread_mutex_unlock(&pool->hp_lock);
+}
+
+/*
+ * Rate limit functions.
+ */
+
+/*
+ * See README.md.
+ */
+static napi_value
+hyprlofs_set_rate(napi_env env, napi_callback_info info)
+{
+	hyprlofs_args_t args;
+	uint32_t rate;
+	const char *msg;
+	char errbuf[128];
+
+	hyprlofs_args_get(env, info, &args);
+	if ((msg = hyprlofs_rate_parse(env, args.ha_argv[0], &rate)) != NULL) {
+		(void) snprintf(errbuf, sizeof (errbuf), "setRateLimit: %s",
+		    msg);
+		return (hyprlofs_throw(env, errbuf));
+	}
+
+	hyprlofs_bucket_set(&hyprlofs_bucket, rate);
+	return (NULL);
+}
+
+/*
+ * Sets the rate of "bucketp" to "rate" mappings per second, and fills it.
+ */
+static void
+hyprlofs_bucket_set(hyprlofs_bucket_t *bucketp, uint32_t rate)
+{
+	(void) pthread_mutex_lock(&bucketp->hb_lock);
+	bucketp->hb_rate = rate;
+	bucketp->hb_tokens = rate;
+	bucketp->hb_last = gethrtime();
+	(void) pthread_mutex_unlock(&bucketp->hb_lock);
+}
+
+/*
+ * Returns the rate of "bucketp" in mappings per second, or 0 if it's unlimited.
+ */
+static uint32_t
+hyprlofs_bucket_rate(hyprlofs_bucket_t *bucketp)
+{
+	uint32_t rate;
+
+	(void) pthread_mutex_lock(&bucketp->hb_lock);
+	rate = bucketp->hb_rate;
+	(void) pthread_mutex_unlock(&bucketp->hb_lock);
+	return (rate);
+}
+
+/*
+ * Takes "n" tokens from "bucketp" and returns 0, or, if "wait" is set and there
+ * aren't enough, returns the number of nanoseconds after which there should be.
+ * Requests for more than the bucket can hold only wait for it to be full.
+ * doIoctl() avoids those for background operations, but the rate can still be
+ * lowered while one is waiting.
+ */
+static hrtime_t
+hyprlofs_bucket_take(hyprlofs_bucket_t *bucketp, uint_t n, bool wait)
+{
+	double want;
+	hrtime_t now, delay = 0;
+
+	(void) pthread_mutex_lock(&bucketp->hb_lock);
+	if (bucketp->hb_rate != 0) {
+		now = gethrtime();
+		bucketp->hb_tokens = MIN((double)bucketp->hb_rate,
+		    bucketp->hb_tokens + (double)(now - bucketp->hb_last) *
+		    bucketp->hb_rate / 1e9);
+		bucketp->hb_last = now;
+
+		want = MIN((double)n, (double)bucketp->hb_rate);
+		if (wait && bucketp->hb_tokens < want)
+			delay = (hrtime_t)((want - bucketp->hb_tokens) * 1e9 /
+			    bucketp->hb_rate) + 1;
+		else
+			bucketp->hb_tokens -= n;
+	}
+	(void) pthread_mutex_unlock(&bucketp->hb_lock);
+
+	return (delay);
+}
+
+/*
+ * Backend functions.
+ */
+
+/*
+ * See README.md.
+ */
+static napi_value
+hyprlofs_set_backend(napi_env env, napi_callback_info info)
+{
+	hyprlofs_args_t args;
+	hyprlofs_mock_t *mockp = &hyprlofs_mock;
+	const hyprlofs_backend_t *bkp = NULL;
+	napi_value options, latency, entrylat, faults;
+	hyprlofs_fault_t *faultsp = NULL, *oldp;
+	uint32_t usec = 0, nsec = 0, nfaults = 0;
+	const char *msg = NULL;
+	char name[16], errbuf[128];
+	uint_t i;
+
+	hyprlofs_args_get(env, info, &args);
+	if (hyprlofs_typeof(env, args.ha_argv[0]) != napi_string ||
+	    napi_get_value_string_utf8(env, args.ha_argv[0], name,
+	    sizeof (name), NULL) != napi_ok)
+		name[0] = '\0';
+
+	for (i = 0; i < sizeof (hyprlofs_backends) /
+	    sizeof (hyprlofs_backends[0]); i++) {
+		if (strcmp(name, hyprlofs_backends[i].hbk_name) == 0)
+			bkp = &hyprlofs_backends[i];
+	}
+
+	options = args.ha_argv[1];
+	if (bkp == NULL)
+		msg = "backend must be \"kernel\" or \"mock\"";
+	else if (hyprlofs_typeof(env, options) != napi_undefined &&
+	    hyprlofs_typeof(env, options) != napi_object)
+		msg = "options must be an object";
+	else if (hyprlofs_typeof(env, options) != napi_undefined &&
+	    strcmp(bkp->hbk_name, "mock") != 0)
+		msg = "options are only supported for the mock backend";
+
+	if (msg == NULL && hyprlofs_typeof(env, options) == napi_object) {
+		latency = hyprlofs_get(env, options, "latencyMicros");
+		entrylat = hyprlofs_get(env, options, "entryNanos");
+		faults = hyprlofs_get(env, options, "faults");
+
+		if (hyprlofs_typeof(env, latency) != napi_undefined &&
+		    !hyprlofs_get_uint32(env, latency, &usec))
+			msg = "latencyMicros must be a non-negative integer";
+		else if (hyprlofs_typeof(env, entrylat) != napi_undefined &&
+		    !hyprlofs_get_uint32(env, entrylat, &nsec))
+			msg = "entryNanos must be a non-negative integer";
+		else if (hyprlofs_typeof(env, faults) != napi_undefined &&
+		    !hyprlofs_is_array(env, faults))
+			msg = "faults must be an array";
+		else if (hyprlofs_typeof(env, faults) != napi_undefined)
+			nfaults = hyprlofs_array_length(env, faults);
+
+		if (msg == NULL && nfaults > 0 &&
+		    (faultsp = (hyprlofs_fault_t *)calloc(nfaults,
+		    sizeof (hyprlofs_fault_t))) == NULL)
+			msg = "failed to allocate faults";
+
+		for (i = 0; msg == NULL && i < nfaults; i++) {
+			napi_value elt;
+
+			if (napi_get_element(env, faults, i, &elt) != napi_ok)
+				msg = "failed to read faults";
+			else
+				msg = hyprlofs_fault_parse(env, elt,
+				    &faultsp[i]);
+		}
+	}
+
+	if (msg != NULL) {
+		free(faultsp);
+		(void) snprintf(errbuf, sizeof (errbuf), "setBackend: %s", msg);
+		return (hyprlofs_throw(env, errbuf));
+	}
+
+	/*
+	 * Selecting the mock backend always replaces its configuration, but
+	 * the mock's mounts and their mappings persist, as the kernel's would.
+	 */
+	if (strcmp(bkp->hbk_name, "mock") == 0) {
+		(void) pthread_mutex_lock(&mockp->hk_lock);
+		oldp = mockp->hk_faults;
+		mockp->hk_latency = usec;
+		mockp->hk_entrylat = nsec;
+		mockp->hk_faults = faultsp;
+		mockp->hk_nfaults = nfaults;
+		(void) pthread_mutex_unlock(&mockp->hk_lock);
+		free(oldp);
+	}
+
+	hyprlofs_backend = bkp;
+	return (NULL);
+}
+
+/*
+ * Parses JavaScript object "value" describing a fault for the mock backend to
+ * inject into "faultp".  Returns an error message if it's invalid.
+ */
+static const char *
+hyprlofs_fault_parse(napi_env env, napi_value value, hyprlofs_fault_t *faultp)
+{
+	napi_value command, err, after, count;
+	uint32_t u;
+	char buf[16];
+
+	if (hyprlofs_typeof(env, value) != napi_object)
+		return ("faults must be objects");
+
+	command = hyprlofs_get(env, value, "command");
+	err = hyprlofs_get(env, value, "errno");
+	after = hyprlofs_get(env, value, "after");
+	count = hyprlofs_get(env, value, "count");
+
+	if (hyprlofs_typeof(env, command) != napi_string ||
+	    napi_get_value_string_utf8(env, command, buf, sizeof (buf),
+	    NULL) != napi_ok)
+		buf[0] = '\0';
+
+	if (strcmp(buf, "add") == 0)
+		faultp->hf_cmd = HYPRLOFS_ADD_ENTRIES;
+	else if (strcmp(buf, "remove") == 0)
+		faultp->hf_cmd = HYPRLOFS_RM_ENTRIES;
+	else if (strcmp(buf, "clear") == 0)
+		faultp->hf_cmd = HYPRLOFS_RM_ALL;
+	else if (strcmp(buf, "get") == 0)
+		faultp->hf_cmd = HYPRLOFS_GET_ENTRIES;
+	else if (strcmp(buf, "mount") == 0)
+		faultp->hf_cmd = HYPRLOFS_MOCK_MOUNT;
+	else if (strcmp(buf, "unmount") == 0)
+		faultp->hf_cmd = HYPRLOFS_MOCK_UMOUNT;
+	else
+		return ("fault command must be \"add\", \"remove\", \"clear\", "
+		    "\"get\", \"mount\", or \"unmount\"");
+
+	if (!hyprlofs_get_uint32(env, err, &u) || u == 0 || u > INT_MAX)
+		return ("fault errno must be a positive integer");
+	faultp->hf_errno = (int)u;
+
+	faultp->hf_after = 0;
+	if (hyprlofs_typeof(env, after) != napi_undefined &&
+	    !hyprlofs_get_uint32(env, after, &faultp->hf_after))
+		return ("fault after must be a non-negative integer");
+
+	faultp->hf_count = 1;
+	if (hyprlofs_typeof(env, count) != napi_undefined &&
+	    (!hyprlofs_get_uint32(env, count, &faultp->hf_count) ||
+	    faultp->hf_count == 0))
+		return ("fault count must be a positive integer");
+
+	return (NULL);
+}
+
+/*
+ * The kernel backend.  "optstr" is both the mount options and, on return, the
+ * options in effect (see hop_mountopts).  In builds without hyprlofs, these
+ * fail with ENOTSUP.
+ */
+#ifndef HYPRLOFS_MOCK_ONLY
+static int
+hyprlofs_kernel_mount(const char *path, char *optstr, int optlen)
+{
+	return (mount("swap", path, MS_OPTIONSTR, "hyprlofs", NULL, 0,
+	    optstr, optlen));
+}
+
+static int
+hyprlofs_kernel_umount(const char *path)
+{
+	return (umount(path));
+}
+
+static int
+hyprlofs_kernel_ioctl(int fd, int cmd, void *arg)
+{
+	return (ioctl(fd, cmd, arg));
+}
+#else
+static int
+hyprlofs_kernel_mount(const char *path, char *optstr, int optlen)
+{
+	errno = ENOTSUP;
+	return (-1);
+}
+
+static int
+hyprlofs_kernel_umount(const char *path)
+{
+	errno = ENOTSUP;
+	return (-1);
+}
+
+static int
+hyprlofs_kernel_ioctl(int fd, int cmd, void *arg)
+{
+	errno = ENOTSUP;
+	return (-1);
+}
+#endif
+
+/*
+ * The mock backend.  Mounting requires only that the mountpoint be a directory,
+ * and the mount options are left as they were given.  The mock doesn't create
+ * anything in the mountpoint: its mappings are only visible via ioctls.
+ */
+static int
+hyprlofs_mock_mount(const char *path, char *optstr, int optlen)
+{
+	hyprlofs_mock_t *mockp = &hyprlofs_mock;
+	hyprlofs_mockmnt_t *mntp;
+	struct stat st;
+	int err;
+
+	if ((err = hyprlofs_mock_enter(HYPRLOFS_MOCK_MOUNT, 0)) == 0 &&
+	    stat(path, &st) != 0)
+		err = errno;
+	else if (err == 0 && !S_ISDIR(st.st_mode))
+		err = ENOTDIR;
+
+	if (err != 0) {
+		errno = err;
+		return (-1);
+	}
+
+	if ((mntp = (hyprlofs_mockmnt_t *)calloc(1, sizeof (*mntp))) == NULL ||
+	    hyprlofs_htable_init(&mntp->hmm_entries, 0) != 0) {
+		free(mntp);
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	mntp->hmm_dev = st.st_dev;
+	mntp->hmm_ino = st.st_ino;
+
+	(void) pthread_mutex_lock(&mockp->hk_lock);
+	if (*hyprlofs_mock_find(st.st_dev, st.st_ino) != NULL) {
+		(void) pthread_mutex_unlock(&mockp->hk_lock);
+		hyprlofs_htable_fini(&mntp->hmm_entries);
+		free(mntp);
+		errno = EBUSY;
+		return (-1);
+	}
+
+	mntp->hmm_next = mockp->hk_mounts;
+	mockp->hk_mounts = mntp;
+	(void) pthread_mutex_unlock(&mockp->hk_lock);
+	return (0);
+}
+
+static int
+hyprlofs_mock_umount(const char *path)
+{
+	hyprlofs_mock_t *mockp = &hyprlofs_mock;
+	hyprlofs_mockmnt_t **mntpp, *mntp;
+	struct stat st;
+	int err;
+
+	if ((err = hyprlofs_mock_enter(HYPRLOFS_MOCK_UMOUNT, 0)) == 0 &&
+	    stat(path, &st) != 0)
+		err = errno;
+
+	if (err != 0) {
+		errno = err;
+		return (-1);
+	}
+
+	(void) pthread_mutex_lock(&mockp->hk_lock);
+	if ((mntp = *(mntpp = hyprlofs_mock_find(st.st_dev,
+	    st.st_ino))) == NULL) {
+		(void) pthread_mutex_unlock(&mockp->hk_lock);
+		errno = EINVAL;
+		return (-1);
+	}
+
+	*mntpp = mntp->hmm_next;
+	(void) pthread_mutex_unlock(&mockp->hk_lock);
+
+	hyprlofs_mock_clear(mntp);
+	hyprlofs_htable_fini(&mntp->hmm_entries);
+	free(mntp);
+	return (0);
+}
+
+static int
+hyprlofs_mock_ioctl(int fd, int cmd, void *arg)
+{
+	hyprlofs_mock_t *mockp = &hyprlofs_mock;
+	hyprlofs_mockmnt_t *mntp;
+	hyprlofs_mockent_t **entps = NULL;
+	struct stat st;
+	uint_t nentries, nprepared = 0;
+	int err, preperr = 0;
+
+	if (fstat(fd, &st) != 0)
+		return (-1);
+
+	if (arg == NULL && cmd != HYPRLOFS_RM_ALL) {
+		errno = EFAULT;
+		return (-1);
+	}
+
+	nentries = cmd == HYPRLOFS_ADD_ENTRIES || cmd == HYPRLOFS_RM_ENTRIES ?
+	    ((hyprlofs_entries_t *)arg)->hle_len : 0;
+	err = hyprlofs_mock_enter(cmd, nentries);
+
+	/*
+	 * The mappings to add are checked and copied before taking the lock,
+	 * since that's most of the work.  If one of them is invalid, the ones
+	 * before it are still added.
+	 */
+	if (err == 0 && cmd == HYPRLOFS_ADD_ENTRIES)
+		preperr = hyprlofs_mock_prepare((hyprlofs_entries_t *)arg,
+		    &entps, &nprepared);
+
+	/*
+	 * An injected E2BIG reports how many entries there are, just as a real
+	 * one does, as though some had been added since the caller last looked.
+	 */
+	(void) pthread_mutex_lock(&mockp->hk_lock);
+	if ((mntp = *hyprlofs_mock_find(st.st_dev, st.st_ino)) == NULL) {
+		err = ENOTTY;
+	} else if (err == E2BIG && cmd == HYPRLOFS_GET_ENTRIES) {
+		((hyprlofs_curr_entries_t *)arg)->hce_cnt =
+		    mntp->hmm_entries.ht_count;
+	} else if (err == 0) {
+		switch (cmd) {
+		case HYPRLOFS_ADD_ENTRIES:
+			hyprlofs_mock_add(mntp, entps, nprepared);
+			nprepared = 0;
+			err = preperr;
+			break;
+		case HYPRLOFS_RM_ENTRIES:
+			err = hyprlofs_mock_remove(mntp,
+			    (hyprlofs_entries_t *)arg);
+			break;
+		case HYPRLOFS_RM_ALL:
+			hyprlofs_mock_clear(mntp);
+			break;
+		case HYPRLOFS_GET_ENTRIES:
+			err = hyprlofs_mock_get(mntp,
+			    (hyprlofs_curr_entries_t *)arg);
+			break;
+		default:
+			err = ENOTTY;
+			break;
+		}
+	}
+	(void) pthread_mutex_unlock(&mockp->hk_lock);
+
+	for (uint_t i = 0; i < nprepared; i++)
+		free(entps[i]);
+	free(entps);
+
+	if (err != 0) {
+		errno = err;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Begins a mock request for command "cmd" passing "nentries" entries: delays it
+ * by the configured latency and returns the errno of the fault to inject, if
+ * any, or 0.
+ */
+static int
+hyprlofs_mock_enter(int cmd, uint_t nentries)
+{
+	hyprlofs_mock_t *mockp = &hyprlofs_mock;
+	hyprlofs_fault_t *faultp;
+	struct timespec ts;
+	hrtime_t delay;
+	int err = 0;
+
+	(void) pthread_mutex_lock(&mockp->hk_lock);
+	delay = (hrtime_t)mockp->hk_latency * 1000 +
+	    (hrtime_t)mockp->hk_entrylat * nentries;
+
+	for (uint_t i = 0; i < mockp->hk_nfaults; i++) {
+		faultp = &mockp->hk_faults[i];
+		if (faultp->hf_cmd != cmd || faultp->hf_count == 0)
+			continue;
+
+		if (faultp->hf_after > 0) {
+			faultp->hf_after--;
+		} else if (err == 0) {
+			faultp->hf_count--;
+			err = faultp->hf_errno;
+		}
+	}
+	(void) pthread_mutex_unlock(&mockp->hk_lock);
+
+	if (delay > 0) {
+		ts.tv_sec = delay / 1000000000;
+		ts.tv_nsec = delay % 1000000000;
+		(void) nanosleep(&ts, NULL);
+	}
+
+	return (err);
+}
+
+/*
+ * Returns a pointer to the link to the mock mount whose mountpoint has device
+ * "dev" and inode "ino", which refers to NULL if there's no such mount.  The
+ * caller must hold hk_lock.
+ */
+static hyprlofs_mockmnt_t **
+hyprlofs_mock_find(dev_t dev, ino_t ino)
+{
+	hyprlofs_mockmnt_t **mntpp;
+
+	for (mntpp = &hyprlofs_mock.hk_mounts; *mntpp != NULL;
+	    mntpp = &(*mntpp)->hmm_next) {
+		if ((*mntpp)->hmm_dev == dev && (*mntpp)->hmm_ino == ino)
+			break;
+	}
+
+	return (mntpp);
+}
+
+/*
+ * Checks and copies the mappings in "entrylstp" for hyprlofs_mock_add, in the
+ * order given, stopping at the first invalid one, as the kernel does.  Like the
+ * kernel, we record each file's resolved path.  Stores the copies and how many
+ * there are into "entpsp" and "nentpsp", and returns 0 or the errno value for
+ * the invalid mapping.
+ */
+static int
+hyprlofs_mock_prepare(const hyprlofs_entries_t *entrylstp,
+    hyprlofs_mockent_t ***entpsp, uint_t *nentpsp)
+{
+	const hyprlofs_entry_t *entryp;
+	hyprlofs_mockent_t *entp, **entps;
+	char name[MAXPATHLEN], path[MAXPATHLEN], resolved[PATH_MAX];
+	size_t plen;
+	uint_t i;
+	int err = 0;
+
+	*entpsp = NULL;
+	*nentpsp = 0;
+	if (entrylstp->hle_len == 0)
+		return (0);
+
+	if ((entps = (hyprlofs_mockent_t **)calloc(entrylstp->hle_len,
+	    sizeof (hyprlofs_mockent_t *))) == NULL)
+		return (ENOMEM);
+
+	for (i = 0; i < entrylstp->hle_len; i++) {
+		entryp = &entrylstp->hle_entries[i];
+		if (entryp->hle_plen >= MAXPATHLEN ||
+		    entryp->hle_nlen >= MAXPATHLEN) {
+			err = ENAMETOOLONG;
+			break;
+		}
+
+		bcopy(entryp->hle_name, name, entryp->hle_nlen);
+		name[entryp->hle_nlen] = '\0';
+		bcopy(entryp->hle_path, path, entryp->hle_plen);
+		path[entryp->hle_plen] = '\0';
+
+		if (!hyprlofs_mock_name_valid(name)) {
+			err = EINVAL;
+			break;
+		}
+
+		if (realpath(path, resolved) == NULL) {
+			err = errno;
+			break;
+		}
+
+		plen = strlen(resolved);
+		if ((entp = (hyprlofs_mockent_t *)malloc(
+		    offsetof(hyprlofs_mockent_t, hme_name) +
+		    entryp->hle_nlen + plen + 2)) == NULL) {
+			err = ENOMEM;
+			break;
+		}
+
+		bcopy(name, entp->hme_name, entryp->hle_nlen + 1);
+		entp->hme_path = entp->hme_name + entryp->hle_nlen + 1;
+		bcopy(resolved, entp->hme_path, plen + 1);
+		entp->hme_node.hn_key = entp->hme_name;
+		entp->hme_node.hn_value = entp;
+		entps[i] = entp;
+	}
+
+	*entpsp = entps;
+	*nentpsp = i;
+	return (err);
+}
+
+/*
+ * Adds the "nentps" mappings in "entps" from hyprlofs_mock_prepare to "mntp",
+ * replacing any existing mappings with the same names.  The mount takes over
+ * the mappings, but not the array.
+ */
+static void
+hyprlofs_mock_add(hyprlofs_mockmnt_t *mntp, hyprlofs_mockent_t **entps,
+    uint_t nentps)
+{
+	hyprlofs_hnode_t *nodep;
+
+	for (uint_t i = 0; i < nentps; i++) {
+		if ((nodep = hyprlofs_htable_remove(&mntp->hmm_entries,
+		    entps[i]->hme_name)) != NULL)
+			free(nodep->hn_value);
+
+		if (mntp->hmm_entries.ht_count >=
+		    2 * mntp->hmm_entries.ht_nbuckets)
+			hyprlofs_htable_grow(&mntp->hmm_entries);
+
+		hyprlofs_htable_insert(&mntp->hmm_entries,
+		    &entps[i]->hme_node);
+	}
+}
+
+/*
+ * Removes the mappings named in "entrylstp" in the order given, stopping at the
+ * first one that doesn't exist.  Returns 0 or an errno value.
+ */
+static int
+hyprlofs_mock_remove(hyprlofs_mockmnt_t *mntp,
+    const hyprlofs_entries_t *entrylstp)
+{
+	const hyprlofs_entry_t *entryp;
+	hyprlofs_hnode_t *nodep;
+	char name[MAXPATHLEN];
+
+	for (uint_t i = 0; i < entrylstp->hle_len; i++) {
+		entryp = &entrylstp->hle_entries[i];
+		if (entryp->hle_nlen >= MAXPATHLEN)
+			return (ENAMETOOLONG);
+
+		bcopy(entryp->hle_name, name, entryp->hle_nlen);
+		name[entryp->hle_nlen] = '\0';
+		if ((nodep = hyprlofs_htable_remove(&mntp->hmm_entries,
+		    name)) == NULL)
+			return (ENOENT);
+
+		free(nodep->hn_value);
+	}
+
+	return (0);
+}
+
+/*
+ * Copies out the mappings of "mntp" if "currp" has room for them.  Otherwise,
+ * fails with E2BIG and reports how many there are in hce_cnt.
+ */
+static int
+hyprlofs_mock_get(hyprlofs_mockmnt_t *mntp, hyprlofs_curr_entries_t *currp)
+{
+	hyprlofs_htable_t *tablep = &mntp->hmm_entries;
+	hyprlofs_curr_entry_t *currentp;
+	hyprlofs_mockent_t *entp;
+	hyprlofs_hnode_t *nodep;
+	uint_t n = 0;
+
+	if (currp->hce_cnt < tablep->ht_count) {
+		currp->hce_cnt = tablep->ht_count;
+		return (E2BIG);
+	}
+
+	for (uint32_t i = 0; i < tablep->ht_nbuckets; i++) {
+		for (nodep = tablep->ht_buckets[i]; nodep != NULL;
+		    nodep = nodep->hn_next) {
+			entp = (hyprlofs_mockent_t *)nodep->hn_value;
+			currentp = &currp->hce_entries[n++];
+			(void) strlcpy(currentp->hce_path, entp->hme_path,
+			    sizeof (currentp->hce_path));
+			(void) strlcpy(currentp->hce_name, entp->hme_name,
+			    sizeof (currentp->hce_name));
+		}
+	}
+
+	assert(n == tablep->ht_count);
+	currp->hce_cnt = n;
+	return (0);
+}
+
+/*
+ * Removes all of the mappings of "mntp", keeping its bucket array.
+ */
+static void
+hyprlofs_mock_clear(hyprlofs_mockmnt_t *mntp)
+{
+	hyprlofs_htable_t *tablep = &mntp->hmm_entries;
+	hyprlofs_hnode_t *nodep, *nextp;
+
+	for (uint32_t i = 0; i < tablep->ht_nbuckets; i++) {
+		for (nodep = tablep->ht_buckets[i]; nodep != NULL;
+		    nodep = nextp) {
+			nextp = nodep->hn_next;
+			free(nodep->hn_value);
+		}
+
+		tablep->ht_buckets[i] = NULL;
+	}
+
+	tablep->ht_count = 0;
+}
+
+/*
+ * Returns whether "name" is acceptable as the name of a mapping: a relative
+ * path with no empty, ".", or ".." components.
+ */
+static bool
+hyprlofs_mock_name_valid(const char *name)
+{
+	const char *p, *end;
+	size_t len;
+
+	for (p = name; ; p = end + 1) {
+		if ((end = strchr(p, '/')) == NULL)
+			end = p + strlen(p);
+
+		len = (size_t)(end - p);
+		if (len == 0 || (len == 1 && p[0] == '.') ||
+		    (len == 2 && p[0] == '.' && p[1] == '.'))
+			return (false);
+
+		if (*end == '\0')
+			return (true);
+	}
+}
+
+/*
+ * Thread pool functions.  The ThreadPool JavaScript object wraps a
+ * hyprlofs_tpool_t, which is described above.
+ */
+
+/*
+ * See README.md.
+ */
+static napi_value
+hyprlofs_tpool_new(napi_env env, napi_callback_info info)
+{
+	hyprlofs_tpool_t *tpool;
+	hyprlofs_args_t args;
+	napi_value target, size;
+	uint32_t nthreads = HYPRLOFS_TPOOL_SIZE;
+
+	hyprlofs_args_get(env, info, &args);
+
+	if (napi_get_new_target(env, info, &target) != napi_ok ||
+	    target == NULL)
+		return (hyprlofs_throw(env,
+		    "ThreadPool must be invoked with \"new\""));
+
+	if (args.ha_argc > 0 &&
+	    hyprlofs_typeof(env, args.ha_argv[0]) != napi_undefined) {
+		if (hyprlofs_typeof(env, args.ha_argv[0]) != napi_object)
+			return (hyprlofs_throw(env,
+			    "ThreadPool: expected options object"));
+
+		size = hyprlofs_get(env, args.ha_argv[0], "size");
+		if (hyprlofs_typeof(env, size) != napi_undefined &&
+		    (!hyprlofs_get_uint32(env, size, &nthreads) ||
+		    nthreads == 0 || nthreads > HYPRLOFS_TPOOL_MAXSIZE))
+			return (hyprlofs_throw(env, "ThreadPool: size must be "
+			    "a positive integer no larger than 128"));
+	}
+
+	if ((tpool = hyprlofs_tpool_create(env, nthreads)) == NULL)
+		return (hyprlofs_throw(env,
+		    "ThreadPool: failed to create threads"));
+
+	if (napi_wrap(env, args.ha_this, tpool, hyprlofs_tpool_finalize, NULL,
+	    NULL) != napi_ok) {
+		hyprlofs_tpool_rele(tpool);
+		return (hyprlofs_throw(env, "failed to create ThreadPool"));
+	}
+
+	(void) napi_type_tag_object(env, args.ha_this, &hyprlofs_tpool_tag);
+	return (args.ha_this);
+}
+
+static void
+hyprlofs_tpool_finalize(napi_env env, void *data, void *hint)
+{
+	hyprlofs_tpool_rele((hyprlofs_tpool_t *)data);
+}
+
+/*
+ * See README.md.
+ */
+static napi_value
+hyprlofs_tpool_stats(napi_env env, napi_callback_info info)
+{
+	hyprlofs_tpool_t *tpool;
+	hyprlofs_args_t args;
+	napi_value rv;
+
+	hyprlofs_args_get(env, info, &args);
+	if ((tpool = (hyprlofs_tpool_t *)hyprlofs_unwrap(env, args.ha_this,
+	    &hyprlofs_tpool_tag)) == NULL) {
+		(void) napi_throw_type_error(env, NULL,
+		    "method invoked on an object that is not a ThreadPool");
+		return (NULL);
+	}
+
+	(void) napi_create_object(env, &rv);
+	(void) pthread_mutex_lock(&tpool->tp_lock);
+	hyprlofs_set(env, rv, "size", hyprlofs_uint(env, tpool->tp_nthreads));
+	hyprlofs_set(env, rv, "queued", hyprlofs_uint(env, tpool->tp_nqueued));
+	hyprlofs_set(env, rv, "running",
+	    hyprlofs_uint(env, tpool->tp_nrunning));
+	hyprlofs_set(env, rv, "maxQueued",
+	    hyprlofs_uint(env, tpool->tp_maxqueued));
+	hyprlofs_set(env, rv, "submitted",
+	    hyprlofs_double(env, (double)tpool->tp_nsubmitted));
+	hyprlofs_set(env, rv, "completed",
+	    hyprlofs_double(env, (double)tpool->tp_ncompleted));
+	(void) pthread_mutex_unlock(&tpool->tp_lock);
+	return (rv);
+}
+
+/*
+ * See README.md.  This sets the pool used by Filesystem objects subsequently
+ * created in this environment without a "threadPool" option.
+ */
+static napi_value
+hyprlofs_set_tpool(napi_env env, napi_callback_info info)
+{
+	hyprlofs_module_t *modp = NULL;
+	hyprlofs_tpool_t *tpool = NULL;
+	hyprlofs_args_t args;
+
+	hyprlofs_args_get(env, info, &args);
+	if (hyprlofs_typeof(env, args.ha_argv[0]) != napi_null &&
+	    (tpool = (hyprlofs_tpool_t *)hyprlofs_unwrap(env, args.ha_argv[0],
+	    &hyprlofs_tpool_tag)) == NULL)
+		return (hyprlofs_throw(env,
+		    "setThreadPool: expected ThreadPool or null"));
+
+	(void) napi_get_instance_data(env, (void **)&modp);
+	if (tpool != NULL)
+		hyprlofs_tpool_hold(tpool);
+	if (modp->hm_tpool != NULL)
+		hyprlofs_tpool_rele(modp->hm_tpool);
+	modp->hm_tpool = tpool;
+	return (NULL);
+}
+
+/*
+ * Returns a new pool of "nthreads" threads in environment "env", with one
+ * reference (held by its ThreadPool), or NULL on failure.
+ */
+static hyprlofs_tpool_t *
+hyprlofs_tpool_create(napi_env env, uint_t nthreads)
+{
+	hyprlofs_tpool_t *tpool;
+	napi_value name, resource;
+	uint_t i;
+
+	if ((tpool = (hyprlofs_tpool_t *)calloc(1, sizeof (*tpool))) == NULL)
+		return (NULL);
+
+	if ((tpool->tp_threads = (pthread_t *)calloc(nthreads,
+	    sizeof (pthread_t))) == NULL) {
+		free(tpool);
+		return (NULL);
+	}
+
+	tpool->tp_env = env;
+	tpool->tp_refs = 1;
+	(void) pthread_mutex_init(&tpool->tp_lock, NULL);
+	(void) pthread_cond_init(&tpool->tp_workcv, NULL);
+	(void) pthread_cond_init(&tpool->tp_donecv, NULL);
+
+	/*
+	 * Completions are delivered via a threadsafe function, which doesn't
+	 * keep the event loop alive unless there's work outstanding, and run in
+	 * an async context of their own so that JavaScript sees them as it
+	 * would the completion of any other asynchronous operation.
+	 */
+	name = hyprlofs_string(env, "hyprlofs", NAPI_AUTO_LENGTH);
+	(void) napi_create_object(env, &resource);
+	if (napi_create_threadsafe_function(env, NULL, NULL, name, 0, 1, NULL,
+	    NULL, tpool, hyprlofs_tpool_notify, &tpool->tp_tsfn) != napi_ok) {
+		hyprlofs_tpool_destroy(tpool);
+		return (NULL);
+	}
+
+	(void) napi_unref_threadsafe_function(env, tpool->tp_tsfn);
+	tpool->tp_resource = hyprlofs_ref(env, resource);
+	(void) napi_async_init(env, resource, name, &tpool->tp_context);
+	(void) napi_add_env_cleanup_hook(env, hyprlofs_tpool_cleanup, tpool);
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&tpool->tp_threads[i], NULL,
+		    hyprlofs_tpool_thread, tpool) != 0) {
+			hyprlofs_tpool_destroy(tpool);
+			return (NULL);
+		}
+		tpool->tp_nthreads++;
+	}
+
+	return (tpool);
+}
+
+/*
+ * Stops the threads of "tpool", which must have no work outstanding, and frees
+ * it.
+ */
+static void
+hyprlofs_tpool_destroy(hyprlofs_tpool_t *tpool)
+{
+	napi_env env = tpool->tp_env;
+	uint_t i;
+
+	assert(tpool->tp_outstanding == 0);
+
+	(void) pthread_mutex_lock(&tpool->tp_lock);
+	tpool->tp_exiting = true;
+	(void) pthread_cond_broadcast(&tpool->tp_workcv);
+	(void) pthread_mutex_unlock(&tpool->tp_lock);
+
+	for (i = 0; i < tpool->tp_nthreads; i++)
+		(void) pthread_join(tpool->tp_threads[i], NULL);
 
-HyprlofsFilesystem::~HyprlofsFilesystem()
-{
-	if (this->hfs_fd != -1)
-		(void) close(this->hfs_fd);
+	if (tpool->tp_tsfn != NULL) {
+		(void) napi_remove_env_cleanup_hook(env,
+		    hyprlofs_tpool_cleanup, tpool);
+		(void) napi_async_destroy(env, tpool->tp_context);
+		hyprlofs_unref(env, &tpool->tp_resource);
+		(void) napi_release_threadsafe_function(tpool->tp_tsfn,
+		    napi_tsfn_release);
+	}
+
+	(void) pthread_cond_destroy(&tpool->tp_donecv);
+	(void) pthread_cond_destroy(&tpool->tp_workcv);
+	(void) pthread_mutex_destroy(&tpool->tp_lock);
+	free(tpool->tp_threads);
+	free(tpool);
 }
 
 /*
- * See README.md.
+ * A pool is referenced by its ThreadPool object, by each Filesystem that uses
+ * it, and by the environment while it's the default pool.  These are only
+ * manipulated in the event loop context of the environment that created it.
  */
-Handle<Value>
-HyprlofsFilesystem::Mount(const Arguments& args)
+static void
+hyprlofs_tpool_hold(hyprlofs_tpool_t *tpool)
 {
-	HandleScope scope;
-	HyprlofsFilesystem *hfs;
-	
-	hfs = ObjectWrap::Unwrap<HyprlofsFilesystem>(args.Holder());
-
-	if (hfs->argsCheck("mount", args, 0) == 0)
-		hfs->async(eioMountRun, args[0]);
+	tpool->tp_refs++;
+}
 
-	return (Undefined());
+static void
+hyprlofs_tpool_rele(hyprlofs_tpool_t *tpool)
+{
+	assert(tpool->tp_refs > 0);
+	if (--tpool->tp_refs == 0)
+		hyprlofs_tpool_destroy(tpool);
 }
 
 /*
- * See README.md.
+ * Invoked in the event loop context to queue "workp" on "tpool".
  */
-Handle<Value>
-HyprlofsFilesystem::Unmount(const Arguments& args)
+static void
+hyprlofs_tpool_submit(hyprlofs_tpool_t *tpool, hyprlofs_work_t *workp)
 {
-	HandleScope scope;
-	HyprlofsFilesystem *hfs;
-	
-	hfs = ObjectWrap::Unwrap<HyprlofsFilesystem>(args.Holder());
+	if (tpool->tp_outstanding++ == 0)
+		(void) napi_ref_threadsafe_function(tpool->tp_env,
+		    tpool->tp_tsfn);
 
-	if (hfs->argsCheck("unmount", args, 0) == 0)
-		hfs->async(eioUmountRun, args[0]);
-
-	return (Undefined());
+	workp->hw_next = NULL;
+	(void) pthread_mutex_lock(&tpool->tp_lock);
+	if (!workp->hw_background) {
+		if (tpool->tp_queue_fg == NULL) {
+			workp->hw_next = tpool->tp_queue;
+			tpool->tp_queue = workp;
+		} else {
+			workp->hw_next = tpool->tp_queue_fg->hw_next;
+			tpool->tp_queue_fg->hw_next = workp;
+		}
+		tpool->tp_queue_fg = workp;
+		if (workp->hw_next == NULL)
+			tpool->tp_queue_tail = workp;
+	} else if (tpool->tp_queue_tail == NULL) {
+		tpool->tp_queue = workp;
+		tpool->tp_queue_tail = workp;
+	} else {
+		tpool->tp_queue_tail->hw_next = workp;
+		tpool->tp_queue_tail = workp;
+	}
+	tpool->tp_nsubmitted++;
+	if (++tpool->tp_nqueued > tpool->tp_maxqueued)
+		tpool->tp_maxqueued = tpool->tp_nqueued;
+	(void) pthread_cond_signal(&tpool->tp_workcv);
+	(void) pthread_mutex_unlock(&tpool->tp_lock);
 }
 
 /*
- * See README.md.
+ * Each thread of the pool runs queued work until the pool is destroyed, and
+ * then appends it to the list of work whose completion callbacks are waiting
+ * to be run in the event loop.  When that list becomes non-empty, we ring the
+ * threadsafe function to have the event loop run them.
  */
-Handle<Value>
-HyprlofsFilesystem::AddMappings(const Arguments& args)
+static void *
+hyprlofs_tpool_thread(void *arg)
 {
-	HandleScope scope;
-	HyprlofsFilesystem *hfs;
-	hyprlofs_entries_t *entrylstp;
+	hyprlofs_tpool_t *tpool = (hyprlofs_tpool_t *)arg;
+	hyprlofs_work_t *workp;
+	bool notify, background;
+
+	(void) pthread_mutex_lock(&tpool->tp_lock);
+	for (;;) {
+		while ((workp = hyprlofs_tpool_next(tpool)) == NULL &&
+		    !tpool->tp_exiting)
+			(void) pthread_cond_wait(&tpool->tp_workcv,
+			    &tpool->tp_lock);
+
+		if (workp == NULL)
+			break;
 
-	hfs = ObjectWrap::Unwrap<HyprlofsFilesystem>(args.Holder());
+		background = workp->hw_background;
+		(void) pthread_mutex_unlock(&tpool->tp_lock);
 
-	if (args.Length() < 1 || !args[0]->IsArray())
-		return (ThrowException(Exception::Error(String::New(
-		    "addMappings: expected array"))));
+		workp->hw_execute(tpool->tp_env, workp->hw_arg);
 
-	if (hfs->argsCheck("addMappings", args, 1) != 0)
-		return (Undefined());
+		(void) pthread_mutex_lock(&tpool->tp_lock);
+		tpool->tp_nrunning--;
+		tpool->tp_ncompleted++;
+		if (background) {
+			tpool->tp_nbackground--;
+			if (tpool->tp_queue != NULL)
+				(void) pthread_cond_signal(&tpool->tp_workcv);
+		}
+		workp->hw_next = NULL;
+		notify = tpool->tp_done == NULL;
+		if (tpool->tp_done_tail == NULL)
+			tpool->tp_done = workp;
+		else
+			tpool->tp_done_tail->hw_next = workp;
+		tpool->tp_done_tail = workp;
+		(void) pthread_cond_broadcast(&tpool->tp_donecv);
 
-	if ((entrylstp = hyprlofs_entries_populate_add(
-	    Array::Cast(*args[0]))) == NULL)
-		return (ThrowException(Exception::Error(String::New(
-		    "addMappings: invalid mappings"))));
+		if (notify) {
+			(void) pthread_mutex_unlock(&tpool->tp_lock);
+			(void) napi_call_threadsafe_function(tpool->tp_tsfn,
+			    NULL, napi_tsfn_nonblocking);
+			(void) pthread_mutex_lock(&tpool->tp_lock);
+		}
+	}
+	(void) pthread_mutex_unlock(&tpool->tp_lock);
 
-	hfs->hfs_ioctl_cmd = HYPRLOFS_ADD_ENTRIES;
-	hfs->hfs_ioctl_arg = entrylstp;
-	hfs->async(eioIoctlRun, args[1]);
-	return (Undefined());
+	return (NULL);
 }
 
 /*
- * See README.md.
+ * Removes and returns the next item of work that may be started from the queue
+ * of "tpool", or returns NULL if there's none.  The caller must hold tp_lock.
  */
-Handle<Value>
-HyprlofsFilesystem::ListMappings(const Arguments& args)
+static hyprlofs_work_t *
+hyprlofs_tpool_next(hyprlofs_tpool_t *tpool)
 {
-	HandleScope scope;
-	HyprlofsFilesystem *hfs;
+	hyprlofs_work_t *workp;
 
-	hfs = ObjectWrap::Unwrap<HyprlofsFilesystem>(args.Holder());
+	if ((workp = tpool->tp_queue) == NULL)
+		return (NULL);
 
-	if (hfs->argsCheck("listMappings", args, 0) == 0) {
-		hfs->hfs_ioctl_cmd = HYPRLOFS_GET_ENTRIES;
-		hfs->async(eioIoctlGetRun, args[0]);
-	}
+	if (workp->hw_background && tpool->tp_nthreads > 1 &&
+	    tpool->tp_nbackground + 1 >= tpool->tp_nthreads)
+		return (NULL);
 
-	return (Undefined());
+	if ((tpool->tp_queue = workp->hw_next) == NULL)
+		tpool->tp_queue_tail = NULL;
+	if (tpool->tp_queue_fg == workp)
+		tpool->tp_queue_fg = NULL;
+	if (workp->hw_background)
+		tpool->tp_nbackground++;
+	tpool->tp_nqueued--;
+	tpool->tp_nrunning++;
+	return (workp);
 }
 
 /*
- * See README.md.
+ * Invoked in the event loop context to run the completion callbacks of work
+ * that's finished.  Completion callbacks may submit more work.
  */
-Handle<Value>
-HyprlofsFilesystem::RemoveMappings(const Arguments& args)
+static void
+hyprlofs_tpool_drain(hyprlofs_tpool_t *tpool)
 {
-	HandleScope scope;
-	HyprlofsFilesystem *hfs;
-	hyprlofs_entries_t *entrylstp;
+	hyprlofs_work_t *workp, *nextp;
 
-	hfs = ObjectWrap::Unwrap<HyprlofsFilesystem>(args.Holder());
+	(void) pthread_mutex_lock(&tpool->tp_lock);
+	workp = tpool->tp_done;
+	tpool->tp_done = tpool->tp_done_tail = NULL;
+	(void) pthread_mutex_unlock(&tpool->tp_lock);
 
-	if (args.Length() < 1 || !args[0]->IsArray())
-		return (ThrowException(Exception::Error(String::New(
-		    "removeMappings: expected array"))));
+	for (; workp != NULL; workp = nextp) {
+		nextp = workp->hw_next;
+		assert(tpool->tp_outstanding > 0);
+		if (--tpool->tp_outstanding == 0)
+			(void) napi_unref_threadsafe_function(tpool->tp_env,
+			    tpool->tp_tsfn);
+		workp->hw_complete(tpool->tp_env, napi_ok, workp->hw_arg);
+	}
+}
 
-	if (hfs->argsCheck("removeMappings", args, 1) != 0)
-		return (Undefined());
+/*
+ * Invoked via the threadsafe function when work has finished.
+ */
+static void
+hyprlofs_tpool_notify(napi_env env, napi_value js_cb, void *context,
+    void *data)
+{
+	hyprlofs_tpool_t *tpool = (hyprlofs_tpool_t *)context;
+	napi_callback_scope scope;
 
-	if ((entrylstp = hyprlofs_entries_populate_remove(
-	    Array::Cast(*args[0]))) == NULL)
-		return (ThrowException(Exception::Error(String::New(
-		    "removeMappings: invalid mappings"))));
+	if (env == NULL)
+		return;
 
-	hfs->hfs_ioctl_cmd = HYPRLOFS_RM_ENTRIES;
-	hfs->hfs_ioctl_arg = entrylstp;
-	hfs->async(eioIoctlRun, args[1]);
-	return (Undefined());
+	(void) napi_open_callback_scope(env,
+	    hyprlofs_deref(env, tpool->tp_resource), tpool->tp_context, &scope);
+	hyprlofs_tpool_drain(tpool);
+	(void) napi_close_callback_scope(env, scope);
 }
 
 /*
- * See README.md.
+ * Invoked when the environment is being torn down while the pool still exists.
+ * Node finishes work it's running on behalf of the environment before its
+ * objects are finalized, and we must do the same, since finalizing a
+ * Filesystem with work outstanding would free it out from under the work.
  */
-Handle<Value>
-HyprlofsFilesystem::RemoveAll(const Arguments& args)
+static void
+hyprlofs_tpool_cleanup(void *arg)
 {
-	HandleScope scope;
-	HyprlofsFilesystem *hfs;
+	hyprlofs_tpool_t *tpool = (hyprlofs_tpool_t *)arg;
 
-	hfs = ObjectWrap::Unwrap<HyprlofsFilesystem>(args.Holder());
-
-	if (hfs->argsCheck("removeAll", args, 0) == 0) {
-		hfs->hfs_ioctl_cmd = HYPRLOFS_RM_ALL;
-		hfs->async(eioIoctlRun, args[0]);
+	while (tpool->tp_outstanding > 0) {
+		(void) pthread_mutex_lock(&tpool->tp_lock);
+		while (tpool->tp_done == NULL)
+			(void) pthread_cond_wait(&tpool->tp_donecv,
+			    &tpool->tp_lock);
+		(void) pthread_mutex_unlock(&tpool->tp_lock);
+		hyprlofs_tpool_drain(tpool);
 	}
-
-	return (Undefined());
 }
 
 /*
- * Validates arguments common to asynchronous functions.  If this function
- * returns -1, the caller must return back to V8 without invoking more
- * JavaScript code, since a JavaScript exception has already been scheduled to
- * be thrown.
+ * Node-API utility functions.  Unless otherwise noted, these ignore failures
+ * from Node-API itself, which can only happen if we've misused it or if an
+ * exception is already pending (in which case it'll be reported as soon as we
+ * return to JavaScript).
  */
-int
-HyprlofsFilesystem::argsCheck(const char *label, const Arguments& args,
-    int idx)
-{
-	char errbuf[128];
 
-	if (idx >= args.Length() || !args[idx]->IsFunction()) {
-		(void) snprintf(errbuf, sizeof (errbuf),
-		    "%s: expected callback argument", label);
-		ThrowException(Exception::Error(String::New(errbuf)));
-		return (-1);
-	}
+/*
+ * Retrieves the arguments and receiver of the current call into "argsp".
+ */
+static void
+hyprlofs_args_get(napi_env env, napi_callback_info info, hyprlofs_args_t *argsp)
+{
+	size_t i;
 
-	if (this->hfs_pending) {
-		(void) snprintf(errbuf, sizeof (errbuf),
-		    "%s: operation already in progress", label);
-		ThrowException(Exception::Error(String::New(errbuf)));
-		return (-1);
+	argsp->ha_argc = HYPRLOFS_MAXARGS;
+	if (napi_get_cb_info(env, info, &argsp->ha_argc, argsp->ha_argv,
+	    &argsp->ha_this, NULL) != napi_ok) {
+		argsp->ha_argc = 0;
+		argsp->ha_this = hyprlofs_undefined(env);
 	}
 
-	return (0);
+	for (i = argsp->ha_argc; i < HYPRLOFS_MAXARGS; i++)
+		argsp->ha_argv[i] = hyprlofs_undefined(env);
 }
 
 /*
- * Invoked from Unmount and the hyprlofs ioctl entry points, running in the
- * event loop context, to invoke operations asynchronously.  This is pretty much
- * boilerplate for Node add-ons implementing asynchronous operations.
+ * Returns the native state wrapped by "obj" if it's been tagged with "tag", or
+ * NULL otherwise.
  */
-void
-HyprlofsFilesystem::async(void (*eiofunc)(uv_work_t *), Local<Value> callback)
+static void *
+hyprlofs_unwrap(napi_env env, napi_value obj, const napi_type_tag *tag)
 {
-	assert(!this->hfs_pending);
-	this->hfs_pending = true;
-	this->hfs_callback = Persistent<Function>::New(
-	    Local<Function>::Cast(callback));
-	this->Ref();
+	void *rv = NULL;
+	bool tagged = false;
+
+	if (hyprlofs_typeof(env, obj) != napi_object ||
+	    napi_check_object_type_tag(env, obj, tag, &tagged) != napi_ok ||
+	    !tagged || napi_unwrap(env, obj, &rv) != napi_ok)
+		return (NULL);
 
-	uv_work_t *req = new uv_work_t;
-	req->data = this;
-	uv_queue_work(uv_default_loop(), req, eiofunc,
-	    (uv_after_work_cb)eioAsyncFini);
+	return (rv);
 }
 
 /*
- * Invoked outside the event loop (via uv_queue_work) to actually run umount(2).
+ * Schedules an Error with message "msg" to be thrown.  This always returns
+ * NULL, which entry points return back to JavaScript in that case.
  */
-void
-HyprlofsFilesystem::eioUmountRun(uv_work_t *req)
+static napi_value
+hyprlofs_throw(napi_env env, const char *msg)
 {
-	HyprlofsFilesystem *hfs = static_cast<HyprlofsFilesystem *>(req->data);
-	if (hyprlofs_debug || hfs->hfs_debug)
-		(void) fprintf(stderr, "hyprlofs umount %s\n", hfs->hfs_label);
-
-	/*
-	 * We have to close our fd first in order to unmount the filesystem.  It
-	 * will be reopened as-needed if the user goes to do another ioctl.
-	 */
-	if (hfs->hfs_fd != -1) {
-		(void) close(hfs->hfs_fd);
-		hfs->hfs_fd = -1;
-	}
-
-	hfs->hfs_errno = 0;
-	hfs->hfs_rv = umount(hfs->hfs_label);
-	hfs->hfs_errno = hfs->hfs_rv != 0 ? errno : 0;
-	(void) strlcpy(hfs->hfs_opname, "hyprlofs umount",
-	    sizeof (hfs->hfs_opname));
-
-	if (hyprlofs_debug || hfs->hfs_debug)
-		(void) fprintf(stderr, "    hyprlofs umount (%s) returned %d "
-		    "(error = %s)\n", hfs->hfs_label, hfs->hfs_rv,
-		    strerror(errno));
+	(void) napi_throw_error(env, NULL, msg);
+	return (NULL);
 }
 
 /*
- * Invoked outside the event loop (via uv_queue_work) to actually run mount(2).
+ * Returns an Error describing the failure of "syscall" on "path" with errno
+ * "err".  This is the same form of Error that Node's own filesystem functions
+ * report, with "errno", "code", "syscall", and "path" properties.
  */
-void
-HyprlofsFilesystem::eioMountRun(uv_work_t *req)
+static napi_value
+hyprlofs_errno_error(napi_env env, int err, const char *syscall,
+    const char *path)
 {
-	char optstr[256];
+	napi_value rv, errnum;
+	const char *code;
+	char msg[PATH_MAX + 128], name[64];
 
-	HyprlofsFilesystem *hfs = static_cast<HyprlofsFilesystem *>(req->data);
-	if (hyprlofs_debug || hfs->hfs_debug)
-		(void) fprintf(stderr, "hyprlofs mount %s\n", hfs->hfs_label);
+	code = hyprlofs_errname(err, name, sizeof (name));
+	(void) snprintf(msg, sizeof (msg), "%s, %s '%s'", code, strerror(err),
+	    path);
+	(void) napi_create_error(env, NULL, hyprlofs_string(env, msg,
+	    NAPI_AUTO_LENGTH), &rv);
 
-	(void) strlcpy(optstr, "ro", sizeof (optstr));
-	hfs->hfs_errno = 0;
-	hfs->hfs_rv = mount("swap", hfs->hfs_label, MS_OPTIONSTR,
-	    "hyprlofs", NULL, 0, optstr, sizeof (optstr));
-	hfs->hfs_errno = hfs->hfs_rv != 0 ? errno : 0;
-	(void) strlcpy(hfs->hfs_opname, "hyprlofs mount",
-	    sizeof (hfs->hfs_opname));
-
-	if (hyprlofs_debug || hfs->hfs_debug)
-		(void) fprintf(stderr, "    hyprlofs mount (%s) returned %d "
-		    "(error = %s, optstr=\"%s\")\n", hfs->hfs_label,
-		    hfs->hfs_rv, strerror(errno), optstr);
+	(void) napi_create_int32(env, err, &errnum);
+	hyprlofs_set(env, rv, "errno", errnum);
+	hyprlofs_set(env, rv, "code", hyprlofs_string(env, code,
+	    NAPI_AUTO_LENGTH));
+	hyprlofs_set(env, rv, "syscall", hyprlofs_string(env, syscall,
+	    NAPI_AUTO_LENGTH));
+	hyprlofs_set(env, rv, "path", hyprlofs_string(env, path,
+	    NAPI_AUTO_LENGTH));
+	return (rv);
 }
 
-void
-HyprlofsFilesystem::doIoctl(int cmd, void *arg)
+/*
+ * Returns the name of errno "err" (e.g., "ENOENT"), stored in "buf" if needed.
+ * Unlike uv_err_name, this doesn't leak memory for errors that libuv doesn't
+ * know, which are instead named by their number.
+ */
+static const char *
+hyprlofs_errname(int err, char *buf, size_t len)
 {
-	int flags;
-
-	if (this->hfs_fd == -1) {
-		if (hyprlofs_debug || this->hfs_debug)
-			(void) fprintf(stderr, "    hyprlofs open (%s)\n",
-			    this->hfs_label);
+	(void) uv_err_name_r(-err, buf, len);
+	if (strncmp(buf, "Unknown system error", 20) == 0)
+		(void) snprintf(buf, len, "%d", err);
+	return (buf);
+}
 
-		if ((this->hfs_fd = open(this->hfs_label, O_RDONLY)) < 0) {
-			this->hfs_rv = -1;
-			this->hfs_errno = errno;
-			(void) strlcpy(this->hfs_opname, "hyprlofs open",
-			    sizeof (this->hfs_opname));
-			if (hyprlofs_debug || this->hfs_debug)
-				(void) fprintf(stderr, "    hyprlofs open (%s) "
-				    "failed: %s\n", this->hfs_label,
-				    strerror(errno));
-			return;
-		}
+/*
+ * Invokes user callback "fn" from the event loop context.  If it throws, the
+ * exception is reported as uncaught, just as though the callback had been
+ * invoked directly from the event loop.
+ */
+static void
+hyprlofs_call(napi_env env, napi_value fn, size_t argc, napi_value *argv)
+{
+	napi_value global, rv, exn;
 
-		if ((flags = fcntl(this->hfs_fd, F_GETFD)) != -1) {
-			flags |= FD_CLOEXEC;
-			(void) fcntl(this->hfs_fd, F_SETFD, flags);
-		}
-	}
+	(void) napi_get_global(env, &global);
+	if (napi_call_function(env, global, fn, argc, argv, &rv) ==
+	    napi_pending_exception &&
+	    napi_get_and_clear_last_exception(env, &exn) == napi_ok)
+		(void) napi_fatal_exception(env, exn);
+}
 
-	if (hyprlofs_debug || this->hfs_debug) {
-		(void) fprintf(stderr, "    hyprlofs ioctl (%s): %s\n",
-		    this->hfs_label, hyprlofs_cmdname(cmd));
+/*
+ * Sets up "workp" to run "execute" off the event loop, on "tpool" if that's
+ * non-NULL or Node's threadpool otherwise, and then "complete" in the event
+ * loop context, and queues it.  Since Node tracks its own work (and we do the
+ * same for a ThreadPool), work that's outstanding when an environment (e.g., a
+ * worker thread) is torn down is finished before its objects are finalized.
+ */
+static void
+hyprlofs_work_queue(napi_env env, hyprlofs_tpool_t *tpool,
+    hyprlofs_work_t *workp, napi_async_execute_callback execute,
+    napi_async_complete_callback complete, void *arg)
+{
+	napi_value name;
 
-		if (arg != NULL) {
-			hyprlofs_entries_t *entrylstp =
-			    (hyprlofs_entries_t *)arg;
+	assert(workp->hw_work == NULL);
+	workp->hw_execute = execute;
+	workp->hw_complete = complete;
+	workp->hw_arg = arg;
 
-			for (uint_t i = 0; i < entrylstp->hle_len; i++) {
-				hyprlofs_entry_t *entryp =
-				    &entrylstp->hle_entries[i];
-				(void) fprintf(stderr, "    %3d: %s -> %s\n", i,
-				    entryp->hle_path, entryp->hle_name);
-			}
-		}
+	if (tpool != NULL) {
+		hyprlofs_tpool_submit(tpool, workp);
+		return;
 	}
 
-	this->hfs_errno = 0;
-	this->hfs_rv = ioctl(this->hfs_fd, cmd, arg);
-	this->hfs_errno = this->hfs_rv != 0 ? errno : 0;
-	(void) snprintf(this->hfs_opname, sizeof (this->hfs_opname),
-	    "hyprlofs ioctl %s", hyprlofs_cmdname(cmd));
-
-	if (hyprlofs_debug || this->hfs_debug)
-		(void) fprintf(stderr, "    hyprlofs ioctl (%s) returned %d "
-		    "(error = %s)\n", this->hfs_label, this->hfs_rv,
-		    strerror(errno));
+	name = hyprlofs_string(env, "hyprlofs", NAPI_AUTO_LENGTH);
+	if (napi_create_async_work(env, NULL, name, execute, complete, arg,
+	    &workp->hw_work) != napi_ok ||
+	    napi_queue_async_work(env, workp->hw_work) != napi_ok)
+		(void) napi_fatal_error("hyprlofs_work_queue", NAPI_AUTO_LENGTH,
+		    "failed to queue async work", NAPI_AUTO_LENGTH);
+}
 
-	if (this->hfs_rv == -1 && this->hfs_errno == ENOTTY) {
-		(void) close(this->hfs_fd);
-		this->hfs_fd = -1;
+/*
+ * Invoked first thing by each completion callback to release the resources
+ * associated with running "workp".
+ */
+static void
+hyprlofs_work_done(napi_env env, hyprlofs_work_t *workp)
+{
+	if (workp->hw_work != NULL) {
+		(void) napi_delete_async_work(env, workp->hw_work);
+		workp->hw_work = NULL;
 	}
 }
 
 /*
- * Invoked outside the event loop (via uv_queue_work) to actually perform a
- * hyprlofs ioctl.
+ * Work items that exist only to schedule their completion callback on a later
+ * event loop iteration (see listChunk) do nothing in the threadpool.
  */
-void
-HyprlofsFilesystem::eioIoctlRun(uv_work_t *req)
+static void
+hyprlofs_work_noop(napi_env env, void *arg)
 {
-	HyprlofsFilesystem *hfs = (HyprlofsFilesystem *)(req->data);
-	hfs->doIoctl(hfs->hfs_ioctl_cmd, hfs->hfs_ioctl_arg);
 }
 
-void
-HyprlofsFilesystem::eioIoctlGetRun(uv_work_t *req)
+static napi_ref
+hyprlofs_ref(napi_env env, napi_value value)
 {
-	HyprlofsFilesystem *hfs = (HyprlofsFilesystem *)(req->data);
+	napi_ref rv = NULL;
 
-	/*
-	 * The "GET" ioctl is a bit more complex than the others because we're
-	 * retrieving a variable-size amount of data.  We invoke the ioctl
-	 * twice: once to see how many mappings we got, and once to actually
-	 * retrieve them.
-	 */
-	assert(hfs->hfs_ioctl_arg == NULL);
-	assert(hfs->hfs_entv == NULL);
+	(void) napi_create_reference(env, value, 1, &rv);
+	return (rv);
+}
 
-	bzero(&hfs->hfs_curr_ents, sizeof (hfs->hfs_curr_ents));
-	hfs->doIoctl(HYPRLOFS_GET_ENTRIES, &hfs->hfs_curr_ents);
+static napi_value
+hyprlofs_deref(napi_env env, napi_ref ref)
+{
+	napi_value rv = NULL;
 
-	if (hfs->hfs_rv == 0 || hfs->hfs_errno != E2BIG) {
-		/*
-		 * We either got zero entries, or we got an unexpected error.
-		 * Either way, bail out and let the fini function figure out
-		 * how to express it back to the user.
-		 */
-		return;
-	}
+	(void) napi_get_reference_value(env, ref, &rv);
+	return (rv == NULL ? hyprlofs_undefined(env) : rv);
+}
 
-top:
-	if ((hfs->hfs_entv = (hyprlofs_curr_entry_t *)calloc(
-	    sizeof (hyprlofs_curr_entry_t),
-	    hfs->hfs_curr_ents.hce_cnt)) == NULL) {
-		hfs->hfs_errno = ENOMEM;
-		return;
+static void
+hyprlofs_unref(napi_env env, napi_ref *refp)
+{
+	if (*refp != NULL) {
+		(void) napi_delete_reference(env, *refp);
+		*refp = NULL;
 	}
+}
 
-	hfs->hfs_curr_ents.hce_entries = hfs->hfs_entv;
-	hfs->doIoctl(HYPRLOFS_GET_ENTRIES, &hfs->hfs_curr_ents);
+static napi_valuetype
+hyprlofs_typeof(napi_env env, napi_value value)
+{
+	napi_valuetype rv = napi_undefined;
 
-	if (hfs->hfs_rv == 0) {
-		/*
-		 * We're done.  The fini eio callback will convert hfs_entv into
-		 * a JavaScript object and invoke the callback.
-		 */
-		return;
-	}
+	(void) napi_typeof(env, value, &rv);
+	return (rv);
+}
 
-	free(hfs->hfs_entv);
-	hfs->hfs_curr_ents.hce_entries = hfs->hfs_entv = NULL;
+static bool
+hyprlofs_is_array(napi_env env, napi_value value)
+{
+	bool rv = false;
 
-	if (hfs->hfs_errno == E2BIG)
-		goto top;
+	(void) napi_is_array(env, value, &rv);
+	return (rv);
 }
 
-/*
- * Invoked back in the context of the event loop after an asynchronous ioctl has
- * completed.  Here we invoke the user's callback to indicate that the operation
- * has completed.
- */
-void
-HyprlofsFilesystem::eioAsyncFini(uv_work_t *req)
+static bool
+hyprlofs_is_buffer(napi_env env, napi_value value)
 {
-	HandleScope scope;
-	Local<Function> callback;
-	int cmd;
+	bool rv = false;
 
-	HyprlofsFilesystem *hfs = (HyprlofsFilesystem *)req->data;
-	delete req;
-	hfs->Unref();
-
-	/*
-	 * We must clear out internal per-operation state before invoking the
-	 * callback because the caller may call right back into us to begin
-	 * another asynchronous operation.
-	 */
-	hfs->hfs_pending = false;
+	(void) napi_is_buffer(env, value, &rv);
+	return (rv);
+}
 
-	hyprlofs_entries_free((hyprlofs_entries_t *)hfs->hfs_ioctl_arg);
-	hfs->hfs_ioctl_arg = NULL;
+static bool
+hyprlofs_truthy(napi_env env, napi_value value)
+{
+	napi_value boolval;
+	bool rv = false;
 
-	cmd = hfs->hfs_ioctl_cmd;
-	hfs->hfs_ioctl_cmd = -1;
+	if (napi_coerce_to_bool(env, value, &boolval) == napi_ok)
+		(void) napi_get_value_bool(env, boolval, &rv);
+	return (rv);
+}
 
-	callback = Local<Function>::New(hfs->hfs_callback);
-	hfs->hfs_callback.Dispose();
+/*
+ * Returns true and stores the value of "value" into "up" if it's a number
+ * representing an integer in the range of a 32-bit unsigned value.
+ */
+static bool
+hyprlofs_get_uint32(napi_env env, napi_value value, uint32_t *up)
+{
+	double d;
 
-	Handle<Value> argv[2];
-	int argc = 0;
+	if (hyprlofs_typeof(env, value) != napi_number ||
+	    napi_get_value_double(env, value, &d) != napi_ok ||
+	    d < 0 || d > UINT32_MAX || d != (double)(uint32_t)d)
+		return (false);
 
-	if (hfs->hfs_rv != 0) {
-		assert(hfs->hfs_entv == NULL);
-		argv[argc++] = ErrnoException(hfs->hfs_errno, hfs->hfs_opname,
-		    "", hfs->hfs_label);
-	} else if (cmd == HYPRLOFS_GET_ENTRIES) {
-		argv[argc++] = Null();
+	*up = (uint32_t)d;
+	return (true);
+}
 
-		Local<Array> rv = Array::New(hfs->hfs_curr_ents.hce_cnt);
-		argv[argc++] = rv;
+static uint32_t
+hyprlofs_array_length(napi_env env, napi_value value)
+{
+	uint32_t rv = 0;
 
-		/*
-		 * hfs_entv (which is hfs_curr_ents.hce_entries) may be NULL,
-		 * but only if hfs_curr_ents.hce_cnt == 0.
-		 */
-		for (uint_t i = 0; i < hfs->hfs_curr_ents.hce_cnt; i++) {
-			Local<Array> entry = Array::New(2);
-			hyprlofs_curr_entry_t *ent = &hfs->hfs_curr_ents.
-			    hce_entries[i];
-			entry->Set(0, String::New(ent->hce_path));
-			entry->Set(1, String::New(ent->hce_name));
-			rv->Set(i, entry);
-		}
+	(void) napi_get_array_length(env, value, &rv);
+	return (rv);
+}
 
-		free(hfs->hfs_entv);
-		hfs->hfs_curr_ents.hce_entries = hfs->hfs_entv = NULL;
-	}
+static void
+hyprlofs_buffer_data(napi_env env, napi_value value, char **datap,
+    size_t *lenp)
+{
+	void *data = NULL;
 
-	TryCatch try_catch;
-	callback->Call(Context::GetCurrent()->Global(), argc, argv);
-	if (try_catch.HasCaught())
-		FatalException(try_catch);
+	*lenp = 0;
+	(void) napi_get_buffer_info(env, value, &data, lenp);
+	*datap = (char *)data;
 }
 
 /*
- * hyprlofs interface functions.
+ * Returns a Buffer for the "len"-byte malloc'd region "data", ownership of
+ * which passes to the Buffer.  Where external buffers aren't permitted, the
+ * contents are copied instead.
  */
-
-static const char *
-hyprlofs_cmdname(int cmd)
+static napi_value
+hyprlofs_buffer_give(napi_env env, void *data, size_t len)
 {
-	switch (cmd) {
-	case HYPRLOFS_ADD_ENTRIES:	return ("ADD");
-	case HYPRLOFS_RM_ENTRIES:	return ("REMOVE");
-	case HYPRLOFS_RM_ALL:		return ("CLEAR");
-	case HYPRLOFS_GET_ENTRIES:	return ("GET");
-	default:			break;
-	}
+	napi_value rv = NULL;
 
-	return ("UNKNOWN");
+	if (napi_create_external_buffer(env, len, data, hyprlofs_buffer_free,
+	    NULL, &rv) == napi_ok)
+		return (rv);
+
+	(void) napi_create_buffer_copy(env, len, data, NULL, &rv);
+	free(data);
+	return (rv);
 }
 
-static hyprlofs_entries_t *
-hyprlofs_entries_populate_add(const Local<Array>& arg)
+/*
+ * Stores the length of the UTF-8 representation of "value" (converted to a
+ * string) into "lenp".  Returns -1 if the conversion failed, which may leave an
+ * exception pending.
+ */
+static int
+hyprlofs_strlen(napi_env env, napi_value value, uint_t *lenp)
 {
-	hyprlofs_entries_t *entrylstp;
-	hyprlofs_entry_t *entries;
-
-	if ((entrylstp = (hyprlofs_entries_t *)calloc(1,
-	    sizeof (hyprlofs_entries_t))) == NULL ||
-	    ((entries = (hyprlofs_entry_t *)calloc(arg->Length(),
-	    sizeof (hyprlofs_entry_t))) == NULL)) {
-		free(entrylstp);
-		return (NULL);
-	}
+	napi_value str;
+	size_t len;
 
-	entrylstp->hle_entries = entries;
-	entrylstp->hle_len = arg->Length();
+	if (napi_coerce_to_string(env, value, &str) != napi_ok ||
+	    napi_get_value_string_utf8(env, str, NULL, 0, &len) != napi_ok ||
+	    len > UINT_MAX)
+		return (-1);
 
-	for (uint_t i = 0; i < arg->Length(); i++) {
-		if (!arg->Get(i)->IsArray()) {
-			hyprlofs_entries_free(entrylstp);
-			return (NULL);
-		}
+	*lenp = (uint_t)len;
+	return (0);
+}
 
-		Local<Array> entry = Array::Cast(*(arg->Get(i)));
-		if (*entry == NULL || entry->Length() != 2) {
-			hyprlofs_entries_free(entrylstp);
-			return (NULL);
-		}
+/*
+ * Returns a malloc'd copy of the UTF-8 representation of string "value", or
+ * NULL if we run out of memory.
+ */
+static char *
+hyprlofs_strdup(napi_env env, napi_value value)
+{
+	size_t len;
+	char *rv;
 
-		String::Utf8Value file(entry->Get(0)->ToString());
-		String::Utf8Value alias(entry->Get(1)->ToString());
+	if (napi_get_value_string_utf8(env, value, NULL, 0, &len) != napi_ok ||
+	    (rv = (char *)malloc(len + 1)) == NULL)
+		return (NULL);
 
-		entries[i].hle_path = strdup(*file);
-		entries[i].hle_name = strdup(*alias);
+	(void) napi_get_value_string_utf8(env, value, rv, len + 1, NULL);
+	return (rv);
+}
 
-		if (entries[i].hle_path == NULL ||
-		    entries[i].hle_name == NULL) {
-			hyprlofs_entries_free(entrylstp);
-			return (NULL);
-		}
+static napi_value
+hyprlofs_get(napi_env env, napi_value obj, const char *name)
+{
+	napi_value rv = NULL;
 
-		entries[i].hle_plen = strlen(entries[i].hle_path);
-		entries[i].hle_nlen = strlen(entries[i].hle_name);
-	}
+	(void) napi_get_named_property(env, obj, name, &rv);
+	return (rv == NULL ? hyprlofs_undefined(env) : rv);
+}
 
-	return (entrylstp);
+static void
+hyprlofs_set(napi_env env, napi_value obj, const char *name, napi_value value)
+{
+	(void) napi_set_named_property(env, obj, name, value);
 }
 
-static hyprlofs_entries_t *
-hyprlofs_entries_populate_remove(const Local<Array>& arg)
+static napi_value
+hyprlofs_string(napi_env env, const char *str, size_t len)
 {
-	hyprlofs_entries_t *entrylstp;
-	hyprlofs_entry_t *entries;
+	napi_value rv = NULL;
 
-	if ((entrylstp = (hyprlofs_entries_t *)calloc(1,
-	    sizeof (hyprlofs_entries_t))) == NULL ||
-	    ((entries = (hyprlofs_entry_t *)calloc(arg->Length(),
-	    sizeof (hyprlofs_entry_t))) == NULL)) {
-		free(entrylstp);
-		return (NULL);
-	}
+	(void) napi_create_string_utf8(env, str, len, &rv);
+	return (rv);
+}
 
-	entrylstp->hle_entries = entries;
-	entrylstp->hle_len = arg->Length();
+static napi_value
+hyprlofs_uint(napi_env env, uint32_t value)
+{
+	napi_value rv = NULL;
 
-	for (uint_t i = 0; i < arg->Length(); i++) {
-		String::Utf8Value alias(arg->Get(i)->ToString());
+	(void) napi_create_uint32(env, value, &rv);
+	return (rv);
+}
 
-		entries[i].hle_name = strdup(*alias);
+static napi_value
+hyprlofs_double(napi_env env, double value)
+{
+	napi_value rv = NULL;
 
-		if (entries[i].hle_name == NULL) {
-			hyprlofs_entries_free(entrylstp);
-			return (NULL);
-		}
+	(void) napi_create_double(env, value, &rv);
+	return (rv);
+}
 
-		entries[i].hle_nlen = strlen(entries[i].hle_name);
-	}
+static napi_value
+hyprlofs_array(napi_env env, uint32_t length)
+{
+	napi_value rv = NULL;
 
-	return (entrylstp);
+	(void) napi_create_array_with_length(env, length, &rv);
+	return (rv);
 }
 
-static void
-hyprlofs_entries_free(hyprlofs_entries_t *entrylstp)
+static napi_value
+hyprlofs_null(napi_env env)
 {
-	if (entrylstp == NULL)
-		return;
+	napi_value rv = NULL;
 
-	for (uint_t i = 0; i < entrylstp->hle_len; i++) {
-		free(entrylstp->hle_entries[i].hle_name);
-		free(entrylstp->hle_entries[i].hle_path);
-	}
+	(void) napi_get_null(env, &rv);
+	return (rv);
+}
 
-	free(entrylstp->hle_entries);
-	free(entrylstp);
+static napi_value
+hyprlofs_undefined(napi_env env)
+{
+	napi_value rv = NULL;
+
+	(void) napi_get_undefined(env, &rv);
+	return (rv);
 }
@@ -25,7 +25,7 @@ fs.mount(function (callback) {
 	}, /expected array/);
 
 	mod_assert.throws(function () {
-		fs.addMappings([]);
+		fs.addMappings([], null);
 	}, /expected callback/);
 
 	mod_assert.throws(function () {
@@ -62,7 +62,7 @@ fs.mount(function (callback) {
 	}, /expected array/);
 
 	mod_assert.throws(function () {
-		fs.removeMappings([]);
+		fs.removeMappings([], null);
 	}, /expected callback/);
 
 	mod_assert.throws(function () {
@@ -71,21 +71,320 @@ fs.mount(function (callback) {
 
 
 	mod_assert.throws(function () {
-		fs.listMappings();
+		fs.addMappingsBuffer();
+	}, /expected buffer/);
+
+	mod_assert.throws(function () {
+		fs.addMappingsBuffer([ [ '/etc/release', 'release' ] ],
+		    function () {});
+	}, /expected buffer/);
+
+	mod_assert.throws(function () {
+		fs.addMappingsBuffer(Buffer.alloc(0), null);
+	}, /expected callback/);
+
+	mod_assert.throws(function () {
+		fs.addMappingsBuffer(Buffer.from('/etc/release\0release'),
+		    function () {});
+	}, /invalid mappings/);
+
+	mod_assert.throws(function () {
+		fs.addMappingsBuffer(Buffer.from('/etc/release\0'),
+		    function () {});
+	}, /invalid mappings/);
+
+
+	mod_assert.throws(function () {
+		fs.removeMappingsBuffer();
+	}, /expected buffer/);
+
+	mod_assert.throws(function () {
+		fs.removeMappingsBuffer([ 'release' ], function () {});
+	}, /expected buffer/);
+
+	mod_assert.throws(function () {
+		fs.removeMappingsBuffer(Buffer.alloc(0), null);
+	}, /expected callback/);
+
+	mod_assert.throws(function () {
+		fs.removeMappingsBuffer(Buffer.from('release'),
+		    function () {});
+	}, /invalid mappings/);
+
+
+	mod_assert.throws(function () {
+		fs.addMappings([], { 'chunkSize': 0 }, function () {});
+	}, /chunkSize must be a positive integer/);
+
+	mod_assert.throws(function () {
+		fs.removeMappings([], { 'chunkSize': 2, 'onProgress': 3 },
+		    function () {});
+	}, /onProgress must be a function/);
+
+	mod_assert.throws(function () {
+		fs.addMappingsBuffer(Buffer.alloc(0),
+		    { 'onProgress': function () {} }, function () {});
+	}, /onProgress requires chunkSize/);
+
+	mod_assert.throws(function () {
+		fs.removeMappingsBuffer(Buffer.alloc(0), { 'chunkSize': 2 },
+		    null);
+	}, /expected callback/);
+
+	mod_assert.throws(function () {
+		fs.addMappings([ [ 1 ] ], { 'partial': true }, function () {});
+	}, /invalid mappings/);
+
+	mod_assert.throws(function () {
+		fs.addMappingsBuffer(Buffer.from('/etc/release\0'),
+		    { 'validate': true }, function () {});
+	}, /invalid mappings/);
+
+	mod_assert.throws(function () {
+		fs.addMappings([], { 'yieldEntries': 0 }, function () {});
+	}, /yieldEntries must be a positive integer/);
+
+	mod_assert.throws(function () {
+		new mod_hyprlofs.Filesystem(tmpdir, { 'yieldMicros': -1 });
+	}, /yieldMicros must be a positive integer/);
+
+	mod_assert.throws(function () {
+		fs.addMappings([ [ '/etc/release', 'a' ], [ 1 ] ],
+		    { 'yieldEntries': 10 }, function () {});
+	}, /invalid mappings/);
+
+	mod_assert.throws(function () {
+		fs.setMappings();
+	}, /expected array or buffer/);
+
+	mod_assert.throws(function () {
+		fs.setMappings({}, function () {});
+	}, /expected array or buffer/);
+
+	mod_assert.throws(function () {
+		fs.setMappings([], null);
+	}, /expected callback/);
+
+	mod_assert.throws(function () {
+		fs.setMappings([ [1] ], function () {});
+	}, /invalid mappings/);
+
+	mod_assert.throws(function () {
+		fs.setMappings(Buffer.from('/etc/release\0'), function () {});
+	}, /invalid mappings/);
+
+	mod_assert.throws(function () {
+		fs.replaceAll('/etc/release', function () {});
+	}, /replaceAll: expected array or buffer/);
+
+	mod_assert.throws(function () {
+		fs.replaceAll([ [ '/etc/release' ] ], function () {});
+	}, /replaceAll: invalid mappings/);
+
+
+	mod_assert.throws(function () {
+		fs.hasMapping('my_release');
+	}, /not owned/);
+
+	mod_assert.throws(function () {
+		fs.resync(function () {});
+	}, /not owned/);
+
+	mod_assert.throws(function () {
+		new mod_hyprlofs.MountManager({ 'maxOpen': 0 });
+	}, /maxOpen must be a positive integer/);
+
+	mod_assert.throws(function () {
+		new mod_hyprlofs.Filesystem(tmpdir, { 'manager': {} });
+	}, /manager must be a MountManager/);
+
+	mod_assert.throws(function () {
+		fs.removeAll.call(new mod_hyprlofs.MountManager(),
+		    function () {});
+	}, TypeError);
+
+	mod_assert.throws(function () {
+		new mod_hyprlofs.ThreadPool({ 'size': 0 });
+	}, /size must be a positive integer/);
+
+	mod_assert.throws(function () {
+		new mod_hyprlofs.Filesystem(tmpdir, { 'threadPool': {} });
+	}, /threadPool must be a ThreadPool/);
+
+	mod_assert.throws(function () {
+		mod_hyprlofs.setThreadPool({});
+	}, /expected ThreadPool or null/);
+
+	mod_assert.throws(function () {
+		mod_hyprlofs.addMappingsMulti([], [], function () {});
+	}, /expected array of Filesystems/);
+
+	mod_assert.throws(function () {
+		mod_hyprlofs.addMappingsMulti([ fs, {} ], [], function () {});
+	}, /expected array of Filesystems/);
+
+	mod_assert.throws(function () {
+		mod_hyprlofs.addMappingsMulti([ fs ], {}, function () {});
+	}, /expected array/);
+
+	mod_assert.throws(function () {
+		mod_hyprlofs.addMappingsMulti([ fs ], [ [ 1 ] ],
+		    function () {});
+	}, /invalid mappings/);
+
+	mod_assert.throws(function () {
+		mod_hyprlofs.addMappingsMulti([ fs ], [], null);
+	}, /expected callback/);
+
+	var ownedfs = new mod_hyprlofs.Filesystem(tmpdir, { 'owned': true });
+
+	mod_assert.throws(function () {
+		ownedfs.hasMapping();
+	}, /expected alias/);
+
+	mod_assert.throws(function () {
+		ownedfs.hasMapping('my_release');
+	}, /index is stale/);
+
+	mod_assert.throws(function () {
+		ownedfs.resync(null);
+	}, /expected callback/);
+
+
+	mod_assert.throws(function () {
+		fs.listMappings(null);
+	}, /expected callback/);
+
+	mod_assert.throws(function () {
+		fs.listMappings({}, null);
+	}, /expected callback/);
+
+	mod_assert.throws(function () {
+		fs.listMappings({ 'chunkSize': 0, 'onChunk': function () {} },
+		    function () {});
+	}, /chunkSize must be a positive integer/);
+
+	mod_assert.throws(function () {
+		fs.listMappings({ 'chunkSize': 1.5, 'onChunk': function () {} },
+		    function () {});
+	}, /chunkSize must be a positive integer/);
+
+	mod_assert.throws(function () {
+		fs.listMappings({ 'chunkSize': 10 }, function () {});
+	}, /expected onChunk function/);
+
+	mod_assert.throws(function () {
+		fs.listMappings({ 'format': 'json' }, function () {});
+	}, /format must be/);
+
+	mod_assert.throws(function () {
+		fs.listMappings({ 'format': 'buffer', 'chunkSize': 10,
+		    'onChunk': function () {} }, function () {});
+	}, /chunkSize is not supported/);
+
+	mod_assert.throws(function () {
+		fs.listMappings({ 'format': 'external', 'chunkSize': 10,
+		    'onChunk': function () {} }, function () {});
+	}, /chunkSize is not supported with format "external"/);
+
+	mod_assert.throws(function () {
+		fs.removeAll(null);
 	}, /expected callback/);
 
 	mod_assert.throws(function () {
-		fs.removeAll();
+		fs.mount(null);
 	}, /expected callback/);
 
 	mod_assert.throws(function () {
-		fs.mount();
+		fs.mount({ 'expectedMappings': 0 }, function () {});
+	}, /expectedMappings must be a positive integer/);
+
+	mod_assert.throws(function () {
+		fs.mount({ 'mountOptions': [ 'ro' ] }, function () {});
+	}, /mountOptions must be a string/);
+
+	mod_assert.throws(function () {
+		fs.mount({}, null);
 	}, /expected callback/);
 
 	mod_assert.throws(function () {
-		fs.unmount();
+		fs.unmount(null);
 	}, /expected callback/);
 
+	mod_assert.throws(function () {
+		fs.snapshot(function () {});
+	}, /snapshot: expected path/);
+
+	mod_assert.throws(function () {
+		fs.restore(tmpdir + '.snapshot', { 'chunkSize': 0 },
+		    function () {});
+	}, /chunkSize must be a positive integer/);
+
+	fs.restore(tmpdir + '.nonexistent', function (err) {
+		console.error('saw expected error: %j', err);
+		mod_assert.equal(err.code, 'ENOENT');
+		mod_assert.equal(err.path, tmpdir + '.nonexistent');
+	});
+
+	mod_assert.throws(function () {
+		fs.changesSince(0);
+	}, /journal is not enabled/);
+
+	mod_assert.throws(function () {
+		new mod_hyprlofs.Filesystem(tmpdir, { 'journalSize': 0 });
+	}, /journalSize must be a positive integer/);
+
+	mod_assert.throws(function () {
+		new mod_hyprlofs.Filesystem(tmpdir, { 'journalSize': 1 }).on(
+		    'data', function () {});
+	}, /on: unsupported event/);
+
+	mod_assert.throws(function () {
+		new mod_hyprlofs.Filesystem(tmpdir, { 'priority': 'urgent' });
+	}, /priority must be "interactive" or "background"/);
+
+	mod_assert.throws(function () {
+		fs.addMappings([], { 'priority': 1 }, function () {});
+	}, /addMappings: priority must be/);
+
+	mod_assert.throws(function () {
+		new mod_hyprlofs.Filesystem(tmpdir, { 'rateLimit': 0 });
+	}, /rateLimit must be a positive integer or null/);
+
+	mod_assert.throws(function () {
+		mod_hyprlofs.setRateLimit(-1);
+	}, /setRateLimit: rateLimit must be/);
+
+	mod_assert.throws(function () {
+		mod_hyprlofs.setBackend('tmpfs');
+	}, /setBackend: backend must be/);
+
+	mod_assert.throws(function () {
+		mod_hyprlofs.setBackend('mock', { 'latencyMicros': -1 });
+	}, /setBackend: latencyMicros must be a non-negative integer/);
+
+	mod_assert.throws(function () {
+		mod_hyprlofs.setBackend('mock',
+		    { 'faults': [ { 'command': 'stat', 'errno': 5 } ] });
+	}, /setBackend: fault command must be/);
+
+	mod_assert.throws(function () {
+		mod_hyprlofs.setBackend('mock',
+		    { 'faults': [ { 'command': 'add' } ] });
+	}, /setBackend: fault errno must be a positive integer/);
+
+	mod_assert.throws(function () {
+		new mod_hyprlofs.Filesystem(tmpdir, { 'internPaths': true });
+	}, /internPaths requires owned/);
+
+	mod_assert.throws(function () {
+		fs.removeByPrefix(function () {});
+	}, /removeByPrefix: expected prefix/);
+
+	mod_assert.throws(function () {
+		fs.listByPrefix('job/', { 'format': 'json' }, function () {});
+	}, /listByPrefix: format must be/);
+
 	var newfs = new mod_hyprlofs.Filesystem('/var/tmp/nope');
 
 	newfs.removeAll(function (err) {
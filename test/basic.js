@@ -3,12 +3,14 @@
  */
 
 var mod_assert = require('assert');
+var mod_constants = require('constants');
 var mod_fs = require('fs');
 var mod_hyprlofs = require('hyprlofs');
+var mod_path = require('path');
 
 var tmpdir = '/var/tmp/hylofs.basic/' + process.pid;
 var stages = [];
-var fs;
+var fs, ofs;
 
 /*
  * Example files
@@ -208,6 +210,753 @@ stages.push(function (callback) {
 	checkFiles([ 'my_release', 'my_ls', 'some/other/bash' ], callback);
 });
 
+/*
+ * Check that operations issued without waiting are processed in order.
+ */
+stages.push(function (callback) {
+	process.stdout.write('Queueing several operations ... ');
+
+	var order = [];
+	var errs = [];
+
+	function done(label) {
+		return (function (err) {
+			order.push(label);
+			if (err)
+				errs.push(err);
+		});
+	}
+
+	fs.removeMappings([ 'my_ls' ], done('remove'));
+	fs.addMappings([ [ '/usr/bin/grep', 'my_grep' ] ], done('add'));
+	fs.listMappings(function (err, mappings) {
+		done('list')(err);
+
+		if (errs.length > 0)
+			return (callback(errs[0]));
+
+		mod_assert.deepEqual(order, [ 'remove', 'add', 'list' ]);
+		mod_assert.deepEqual(mappings.map(function (entry) {
+			return (entry[1]);
+		}).sort(), [ 'my_grep', 'my_release', 'some/other/bash' ]);
+		return (callback());
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Checking mappings ... ');
+	checkFiles([ 'my_release', 'my_grep', 'some/other/bash' ], callback);
+});
+
+/*
+ * Check that queued operations that are coalesced into a single ioctl still
+ * report their own results.
+ */
+stages.push(function (callback) {
+	process.stdout.write('Queueing adds with a failure ... ');
+
+	var results = [];
+
+	function done(label) {
+		return (function (err) {
+			results.push([ label, err ? err['code'] : null ]);
+			if (results.length == 4) {
+				mod_assert.deepEqual(results, [
+				    [ 'grep', null ],
+				    [ 'cat', null ],
+				    [ 'bogus', 'ENOENT' ],
+				    [ 'ls', null ]
+				]);
+				callback();
+			}
+		});
+	}
+
+	fs.removeMappings([ 'my_grep' ], done('grep'));
+	fs.addMappings([ [ '/usr/bin/cat', 'my_cat' ] ], done('cat'));
+	fs.addMappings([ [ '/nonexistent/file', 'my_bogus' ] ], done('bogus'));
+	fs.addMappings([ [ '/usr/bin/ls', 'my_ls' ] ], done('ls'));
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Checking mappings ... ');
+	checkFiles([ 'my_release', 'my_cat', 'my_ls', 'some/other/bash' ],
+	    callback);
+});
+
+/*
+ * Check the packed buffer interfaces.
+ */
+stages.push(function (callback) {
+	process.stdout.write('Removing mappings from a buffer ... ');
+	fs.removeMappingsBuffer(Buffer.from('my_cat\0my_ls\0'), callback);
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Adding mappings from a buffer ... ');
+	fs.addMappingsBuffer(Buffer.from('/usr/bin/grep\0my_grep\0' +
+	    '/usr/bin/ls\0my_ls\0'), callback);
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Checking mappings ... ');
+	checkFiles([ 'my_release', 'my_grep', 'my_ls', 'some/other/bash' ],
+	    callback);
+});
+
+/*
+ * Check batches applied in chunks.
+ */
+stages.push(function (callback) {
+	var progress = [];
+
+	process.stdout.write('Removing mappings in chunks ... ');
+	fs.removeMappings([ 'my_grep', 'my_ls' ], {
+	    'chunkSize': 1,
+	    'onProgress': function (done, total) {
+		progress.push([ done, total ]);
+	    }
+	}, function (err) {
+		if (err)
+			return (callback(err));
+
+		mod_assert.deepEqual(progress, [ [ 1, 2 ], [ 2, 2 ] ]);
+		return (callback());
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Adding mappings in chunks with a failure ... ');
+	fs.addMappings(makeMappings([ 'my_grep', 'my_ls' ]).concat([
+	    [ '/nonexistent/file', 'my_bogus' ] ]).concat(
+	    makeMappings([ 'my_cat' ])), { 'chunkSize': 2 }, function (err) {
+		mod_assert.ok(err);
+		mod_assert.equal(err['code'], 'ENOENT');
+		mod_assert.equal(err['chunk'], 1);
+		mod_assert.equal(err['chunkSize'], 2);
+		mod_assert.equal(err['completed'], 2);
+		callback();
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Adding mappings in partial mode ... ');
+	fs.addMappings([ [ '/nonexistent/file', 'my_bogus' ] ].concat(
+	    makeMappings([ 'my_cat' ])), { 'partial': true },
+	    function (err, failed) {
+		if (err)
+			return (callback(err));
+
+		mod_assert.deepEqual(failed, [ [ '/nonexistent/file',
+		    'my_bogus', mod_constants.ENOENT ] ]);
+		return (fs.removeMappings([ 'my_cat' ], callback));
+	    });
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Adding mappings with validation ... ');
+	fs.addMappings(makeMappings([ 'my_cat' ]).concat([
+	    [ '/nonexistent/file', 'my_bogus' ] ]), { 'validate': true },
+	    function (err, failed) {
+		if (err)
+			return (callback(err));
+
+		mod_assert.deepEqual(failed, [ [ '/nonexistent/file',
+		    'my_bogus', mod_constants.ENOENT ] ]);
+		return (fs.removeMappings([ 'my_cat' ], callback));
+	    });
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Checking mappings ... ');
+	checkFiles([ 'my_release', 'my_grep', 'my_ls', 'some/other/bash' ],
+	    callback);
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Listing mappings in chunks ... ');
+
+	var chunks = [];
+
+	fs.listMappings({
+	    'chunkSize': 3,
+	    'onChunk': function (mappings) { chunks.push(mappings); }
+	}, function (err, mappings) {
+		if (err)
+			return (callback(err));
+
+		mod_assert.ok(mappings === undefined);
+		mod_assert.deepEqual(chunks.map(function (chunk) {
+			return (chunk.length);
+		}), [ 3, 1 ]);
+		mod_assert.deepEqual(Array.prototype.concat.apply([],
+		    chunks).map(function (entry) {
+			return (entry[1]);
+		}).sort(), [ 'my_grep', 'my_ls', 'my_release',
+		    'some/other/bash' ]);
+		return (callback());
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Listing mappings as external strings ... ');
+
+	fs.listMappings(function (err, expected) {
+		if (err)
+			return (callback(err));
+
+		fs.listMappings({ 'format': 'external' },
+		    function (err2, mappings) {
+			if (err2)
+				return (callback(err2));
+
+			mod_assert.deepEqual(mappings.sort(), expected.sort());
+			return (callback());
+		    });
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Listing mappings as a buffer ... ');
+
+	fs.listMappings({ 'format': 'buffer' }, function (err, data, offsets) {
+		if (err)
+			return (callback(err));
+
+		var strs = data.toString('utf8', 0, data.length - 1).
+		    split('\0');
+		var aliases = [];
+
+		mod_assert.equal(offsets.length, strs.length * 4);
+		for (var i = 0; i < strs.length; i++) {
+			var off = offsets.readUInt32LE(i * 4);
+			mod_assert.equal(data.toString('utf8', off,
+			    off + Buffer.byteLength(strs[i])), strs[i]);
+			if (i % 2 == 1)
+				aliases.push(strs[i]);
+		}
+
+		mod_assert.deepEqual(aliases.sort(), [ 'my_grep', 'my_ls',
+		    'my_release', 'some/other/bash' ]);
+		return (callback());
+	});
+});
+
+/*
+ * Check reconciliation.
+ */
+stages.push(function (callback) {
+	process.stdout.write('Setting mappings ... ');
+	fs.setMappings([
+	    [ '/etc/release',	'my_release' ],
+	    [ '/usr/bin/cat',	'my_cat' ],
+	    [ '/usr/bin/grep',	'my_ls' ],
+	    [ '/bin/bash',	'some/other/bash' ]
+	], function (err, result) {
+		if (err)
+			return (callback(err));
+
+		/* my_grep is removed, my_ls is changed, and my_cat is added. */
+		mod_assert.deepEqual(result, { 'added': 2, 'removed': 2 });
+		return (callback());
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Checking mappings ... ');
+	fs.listMappings(function (err, mappings) {
+		if (err)
+			return (callback(err));
+
+		var found = {};
+		mappings.forEach(function (entry) {
+			found[entry[1]] = entry[0];
+		});
+
+		mod_assert.deepEqual(Object.keys(found).sort(), [ 'my_cat',
+		    'my_ls', 'my_release', 'some/other/bash' ]);
+		mod_assert.ok(/\/grep$/.test(found['my_ls']));
+		return (callback());
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Setting the same mappings again ... ');
+	fs.setMappings(Buffer.from('/etc/release\0my_release\0' +
+	    '/usr/bin/cat\0my_cat\0/usr/bin/grep\0my_ls\0' +
+	    '/bin/bash\0some/other/bash\0'), function (err, result) {
+		if (err)
+			return (callback(err));
+
+		mod_assert.deepEqual(result, { 'added': 0, 'removed': 0 });
+		return (callback());
+	});
+});
+
+/*
+ * Check owned mode, in which a second object tracks the mappings itself.
+ */
+stages.push(function (callback) {
+	process.stdout.write('Resyncing an owned object ... ');
+	ofs = new mod_hyprlofs.Filesystem(tmpdir, { 'owned': true });
+	mod_assert.throws(function () { ofs.hasMapping('my_cat'); },
+	    /index is stale/);
+	ofs.resync(function (err) {
+		if (err)
+			return (callback(err));
+
+		mod_assert.ok(ofs.hasMapping('my_cat'));
+		mod_assert.ok(!ofs.hasMapping('my_grep'));
+		return (callback());
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Changing mappings via an owned object ... ');
+	ofs.removeMappings([ 'my_cat' ], function (err) {
+		if (err)
+			return (callback(err));
+
+		mod_assert.ok(!ofs.hasMapping('my_cat'));
+		mod_assert.ok(ofs.hasMapping('my_release'));
+	});
+	ofs.addMappings(makeMappings([ 'my_grep' ]), function (err) {
+		if (err)
+			return (callback(err));
+
+		mod_assert.ok(ofs.hasMapping('my_grep'));
+		return (callback());
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Failing a change via an owned object ... ');
+	ofs.removeMappings([ 'my_grep', 'nonexistent' ], function (err) {
+		mod_assert.ok(err);
+		mod_assert.ok(!ofs.hasMapping('my_grep'));
+		ofs.addMappings(makeMappings([ 'my_grep' ]), callback);
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Checking owned mappings ... ');
+	ofs.listMappings(function (err, mappings) {
+		if (err)
+			return (callback(err));
+
+		mod_assert.deepEqual(mappings.map(function (entry) {
+			return (entry[1]);
+		}).sort(), [ 'my_grep', 'my_ls', 'my_release',
+		    'some/other/bash' ]);
+		return (callback());
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Replacing all mappings ... ');
+	ofs.replaceAll(makeMappings([ 'my_grep', 'my_release' ]),
+	    function (err) {
+		if (err)
+			return (callback(err));
+
+		mod_assert.ok(ofs.hasMapping('my_grep'));
+		mod_assert.ok(!ofs.hasMapping('my_ls'));
+		fs.listMappings(function (err2, mappings) {
+			if (err2)
+				return (callback(err2));
+
+			mod_assert.deepEqual(mappings.map(function (entry) {
+				return (entry[1]);
+			}).sort(), [ 'my_grep', 'my_release' ]);
+			ofs.replaceAll(Buffer.from('/usr/bin/grep\0my_grep\0' +
+			    '/usr/bin/grep\0my_ls\0/etc/release\0my_release\0' +
+			    '/bin/bash\0some/other/bash\0'), callback);
+		});
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Using promises ... ');
+
+	var adding = fs.addMappings(makeMappings([ 'my_cat' ]));
+	var listing = fs.listMappings();
+
+	return (Promise.all([ adding, listing ]).then(function (results) {
+		mod_assert.ok(results[0] === undefined);
+		mod_assert.ok(results[1].some(function (entry) {
+			return (entry[1] == 'my_cat');
+		}));
+		return (fs.removeMappings([ 'my_bogus' ]));
+	}).then(function () {
+		callback(new Error('expected error'));
+	}, function (err) {
+		callback(err['code'] == 'ENOENT' ? null : err);
+	}));
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Saving and restoring a snapshot ... ');
+
+	var file = tmpdir + '.snapshot';
+	var saved;
+
+	fs.listMappings(function (err, mappings) {
+		if (err)
+			return (callback(err));
+
+		saved = mappings.sort();
+		fs.snapshot(file, function (err2, count) {
+			if (err2)
+				return (callback(err2));
+
+			mod_assert.equal(count, saved.length);
+			mod_assert.equal(mod_fs.statSync(file).mode & 0o777, 0o644);
+			mod_assert.deepEqual(mod_fs.readdirSync(
+			    mod_path.dirname(file)).filter(function (name) {
+				return (name.indexOf(mod_path.basename(file) +
+				    '.') === 0);
+			}), []);
+			fs.removeAll(function (err3) {
+				if (err3)
+					return (callback(err3));
+
+				fs.restore(file, { 'chunkSize': 2 }, restored);
+			});
+		});
+	});
+
+	function restored(err, count) {
+		mod_fs.unlinkSync(file);
+		if (err)
+			return (callback(err));
+
+		mod_assert.equal(count, saved.length);
+		fs.listMappings(function (err2, mappings) {
+			if (err2)
+				return (callback(err2));
+
+			mod_assert.deepEqual(mappings.sort(), saved);
+			return (callback());
+		});
+	}
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Following changes via the journal ... ');
+
+	var jfs = new mod_hyprlofs.Filesystem(tmpdir, { 'journalSize': 4 });
+	var seen = [];
+
+	function onChange(changes) {
+		seen = seen.concat(changes);
+	}
+
+	mod_assert.equal(jfs.journalSeq(), 0);
+	mod_assert.equal(jfs.on('change', onChange), jfs);
+	jfs.removeMappings([ 'my_cat' ]).then(function () {
+		return (jfs.addMappings(makeMappings([ 'my_cat' ])));
+	}).then(function () {
+		mod_assert.deepEqual(seen, [
+		    { 'seq': 1, 'type': 'remove', 'alias': 'my_cat' },
+		    { 'seq': 2, 'type': 'add', 'alias': 'my_cat',
+		    'path': file_paths['my_cat'] }
+		]);
+		mod_assert.deepEqual(jfs.changesSince(0), seen);
+		mod_assert.deepEqual(jfs.changesSince(2), []);
+
+		/* This pushes the first change out of the journal. */
+		jfs.off('change', onChange);
+		return (jfs.addMappings(makeMappings(
+		    [ 'my_cat', 'my_grep', 'my_release' ])));
+	}).then(function () {
+		mod_assert.equal(seen.length, 2);
+		mod_assert.equal(jfs.journalSeq(), 5);
+		mod_assert.strictEqual(jfs.changesSince(0), null);
+		mod_assert.deepEqual(jfs.changesSince(1).map(function (c) {
+			return (c.seq);
+		}), [ 2, 3, 4, 5 ]);
+		callback();
+	}, callback);
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Listing and removing by prefix ... ');
+
+	function aliases(mappings) {
+		return (mappings.map(function (entry) {
+			return (entry[1]);
+		}).sort());
+	}
+
+	fs.addMappings([
+	    [ '/etc/release', 'job1/task1/a' ],
+	    [ '/etc/release', 'job1/task1/b' ],
+	    [ '/etc/release', 'job1/task10/c' ]
+	]).then(function () {
+		return (fs.listByPrefix('job1/task1/'));
+	}).then(function (mappings) {
+		mod_assert.deepEqual(aliases(mappings),
+		    [ 'job1/task1/a', 'job1/task1/b' ]);
+		return (fs.removeByPrefix('job1/task1'));
+	}).then(function (count) {
+		mod_assert.equal(count, 3);
+		return (fs.listByPrefix('job1/', { 'format': 'buffer' }));
+	}).then(function (results) {
+		mod_assert.equal(results[0].length, 0);
+		return (fs.listMappings());
+	}).then(function (mappings) {
+		mod_assert.ok(aliases(mappings).indexOf('my_release') != -1);
+		callback();
+	}, callback);
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Sharing the mountpoint via a manager ... ');
+
+	/*
+	 * With maxOpen 1, the third object's mountpoint (which names the same
+	 * directory with a different path) evicts the one shared by the others.
+	 */
+	var mgr = new mod_hyprlofs.MountManager({ 'maxOpen': 1 });
+	var fs1 = new mod_hyprlofs.Filesystem(tmpdir, { 'manager': mgr });
+	var fs2 = new mod_hyprlofs.Filesystem(tmpdir, { 'manager': mgr });
+	var fs3 = new mod_hyprlofs.Filesystem(tmpdir + '/',
+	    { 'manager': mgr });
+
+	function hasLs(mappings) {
+		return (mappings.some(function (entry) {
+			return (entry[1] == 'my_ls');
+		}));
+	}
+
+	return (fs1.addMappings(makeMappings([ 'my_ls' ])).then(function () {
+		return (fs2.listMappings());
+	}).then(function (mappings) {
+		mod_assert.ok(hasLs(mappings));
+		return (fs3.removeMappings([ 'my_ls' ]));
+	}).then(function () {
+		return (fs1.listMappings());
+	}).then(function (mappings) {
+		mod_assert.ok(!hasLs(mappings));
+		callback();
+	}, callback));
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Running requests on a private ThreadPool ... ');
+
+	/*
+	 * Adding with "validate" also exercises the path-checking jobs, which
+	 * run on the same pool.
+	 */
+	var tp = new mod_hyprlofs.ThreadPool({ 'size': 2 });
+	var tpfs = new mod_hyprlofs.Filesystem(tmpdir, { 'threadPool': tp });
+
+	mod_assert.equal(tp.stats().size, 2);
+	tpfs.addMappings(makeMappings([ 'my_ls' ]), { 'validate': true },
+	    function (err) {
+		if (err) {
+			callback(err);
+			return;
+		}
+
+		tpfs.removeMappings([ 'my_ls' ], function (err2) {
+			var stats = tp.stats();
+			mod_assert.equal(stats.queued, 0);
+			mod_assert.equal(stats.running, 0);
+			mod_assert.ok(stats.completed >= 2);
+			mod_assert.equal(stats.submitted, stats.completed);
+			callback(err2);
+		});
+	    });
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Sharing directories of indexed paths ... ');
+
+	/*
+	 * Both objects index paths in this directory, which they share.  Each
+	 * must still report its paths in full.
+	 */
+	var ifs1 = new mod_hyprlofs.Filesystem(tmpdir,
+	    { 'owned': true, 'internPaths': true });
+	var ifs2 = new mod_hyprlofs.Filesystem(tmpdir,
+	    { 'owned': true, 'internPaths': true });
+	var mappings = [
+	    [ __dirname + '/basic.js', 'interned/basic' ],
+	    [ __dirname + '/badargs.js', 'interned/badargs' ]
+	];
+
+	ifs1.resync().then(function () {
+		return (ifs2.resync());
+	}).then(function () {
+		return (ifs1.addMappings(mappings));
+	}).then(function () {
+		return (ifs2.addMappings(mappings.slice(0, 1)));
+	}).then(function () {
+		mod_assert.ok(ifs1.hasMapping('interned/badargs'));
+		mod_assert.ok(!ifs2.hasMapping('interned/badargs'));
+		return (ifs1.listByPrefix('interned/'));
+	}).then(function (current) {
+		mod_assert.deepEqual(current.sort(), mappings.slice(0).sort());
+		return (ifs1.removeByPrefix('interned/'));
+	}).then(function () {
+		return (ifs2.listByPrefix('interned/'));
+	}).then(function (current) {
+		mod_assert.deepEqual(current, mappings.slice(0, 1));
+		return (ifs2.resync());
+	}).then(function () {
+		mod_assert.ok(!ifs2.hasMapping('interned/basic'));
+		callback();
+	}, callback);
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Prioritizing and throttling operations ... ');
+
+	/*
+	 * The background add is queued behind the listing.  The interactive
+	 * add that follows involves a different alias, so it goes ahead of the
+	 * background one, but the interactive remove of the same alias and the
+	 * second listing don't.  The first batch of throttled mappings uses up
+	 * the object's whole rate limit, so the second has to wait for more.
+	 */
+	var pfs = new mod_hyprlofs.Filesystem(tmpdir, { 'rateLimit': 100 });
+	var order = [];
+	var many = [];
+	var added, removed, start;
+
+	for (var i = 0; i < 100; i++)
+		many.push([ file_paths['my_release'], 'throttled/' + i ]);
+
+	pfs.listMappings(function () { order.push('list'); });
+	added = pfs.addMappings([ [ file_paths['my_ls'], 'prio/ls' ] ],
+	    { 'priority': 'background' });
+	pfs.addMappings([ [ file_paths['my_cat'], 'prio/cat' ] ],
+	    function () { order.push('independent'); });
+	removed = pfs.removeMappings([ 'prio/ls', 'prio/cat' ]);
+	pfs.listMappings(function () { order.push('relist'); });
+
+	added.then(function () {
+		mod_assert.deepEqual(order, [ 'list', 'independent' ]);
+		return (removed);
+	}).then(function () {
+		start = Date.now();
+		return (pfs.addMappings(many, { 'priority': 'background' }));
+	}).then(function () {
+		return (pfs.addMappings(many.slice(0, 10),
+		    { 'priority': 'background' }));
+	}).then(function () {
+		var throttled = pfs.stats().throttledTime;
+		mod_assert.ok(Date.now() - start >= 50);
+		mod_assert.equal(throttled.count, 3);
+		mod_assert.ok(throttled.sum >= 50000000);
+		return (pfs.removeByPrefix('throttled/'));
+	}).then(function () {
+		callback();
+	}, callback);
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Adding mappings to several mounts ... ');
+
+	var multidir = tmpdir + '.multi';
+	var mfs = new mod_hyprlofs.Filesystem(multidir);
+	var bogus = new mod_hyprlofs.Filesystem(tmpdir + '.nonexistent');
+	var mappings = makeMappings([ 'my_ls' ]);
+
+	function check(which) {
+		return (which.listMappings().then(function (current) {
+			mod_assert.ok(current.some(function (entry) {
+				return (entry[1] == 'my_ls');
+			}));
+		}));
+	}
+
+	mod_fs.mkdirSync(multidir);
+	mfs.mount().then(function () {
+		return (mod_hyprlofs.addMappingsMulti([ fs, mfs ], mappings));
+	}).then(function () {
+		return (Promise.all([ check(fs), check(mfs) ]));
+	}).then(function () {
+		return (mod_hyprlofs.addMappingsMulti([ mfs, bogus ],
+		    mappings).then(function () {
+			throw (new Error('expected failure'));
+		}, function (err) {
+			mod_assert.equal(err.errors.length, 2);
+			mod_assert.strictEqual(err.errors[0], null);
+			mod_assert.equal(err.errors[1].code, 'ENOENT');
+		}));
+	}).then(function () {
+		return (Promise.all([ fs.removeMappings([ 'my_ls' ]),
+		    mfs.unmount() ]));
+	}).then(function () {
+		mod_fs.rmdirSync(multidir);
+		callback();
+	}, callback);
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Marshalling mappings a piece at a time ... ');
+
+	/*
+	 * With a budget of one mapping per event loop iteration, an invalid
+	 * mapping past the first isn't noticed until after the call returns,
+	 * so it's reported to the callback rather than thrown.  Operations
+	 * still complete in the order they were requested.
+	 */
+	var yfs = new mod_hyprlofs.Filesystem(tmpdir, { 'yieldEntries': 1 });
+	var order = [];
+
+	yfs.addMappings(makeMappings([ 'my_cat', 'my_grep', 'my_ls' ]),
+	    function (err) {
+		order.push('add');
+		mod_assert.ok(!err);
+	    });
+	yfs.removeMappings([ 'my_grep' ], { 'yieldMicros': 1000 },
+	    function (err) {
+		order.push('remove');
+		mod_assert.ok(!err);
+	    });
+	yfs.addMappings([ [ '/etc/release', 'yield_release' ], [ 1 ] ],
+	    function (err) {
+		order.push('invalid');
+		mod_assert.equal(err.code, 'EINVAL');
+	    });
+
+	yfs.listMappings().then(function (current) {
+		var aliases = current.map(function (entry) {
+			return (entry[1]);
+		});
+		mod_assert.deepEqual(order, [ 'add', 'remove', 'invalid' ]);
+		mod_assert.ok(aliases.indexOf('my_ls') != -1);
+		mod_assert.ok(aliases.indexOf('my_grep') == -1);
+		mod_assert.ok(aliases.indexOf('yield_release') == -1);
+		return (yfs.removeMappings([ 'my_cat', 'my_ls' ]));
+	}).then(function () {
+		callback();
+	}, callback);
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Checking statistics ... ');
+
+	var stats = fs.stats();
+	var total = mod_hyprlofs.stats();
+
+	mod_assert.ok(stats.operations > 0);
+	mod_assert.ok(total.operations >= stats.operations);
+	mod_assert.ok(stats.ioctls.ADD > 0);
+	mod_assert.ok(stats.ioctls.GET > 0);
+	mod_assert.ok(stats.errors.ENOENT > 0);
+	mod_assert.ok(stats.entries.count > 0);
+	mod_assert.ok(stats.entries.buckets['1'] > 0);
+	mod_assert.equal(stats.queuedTime.count, stats.operations);
+	mod_assert.ok(stats.ioctlTime.sum > 0);
+	mod_assert.ok(total.marshalTime.count >= stats.marshalTime.count);
+	callback();
+});
+
 stages.push(function (callback) {
 	process.stdout.write('Clearing mappings ... ');
 	fs.removeAll(callback);
@@ -228,7 +977,11 @@ stages.push(function (callback) {
  */
 stages.push(function (callback) {
 	process.stdout.write('Remounting hyprlofs at ' + tmpdir + ' ... ');
-	fs.mount(callback);
+	fs.mount({ 'expectedMappings': 1000 }, function (err, options) {
+		if (!err)
+			mod_assert.ok(/\bro\b/.test(options));
+		callback(err);
+	});
 });
 
 stages.push(function (callback) {
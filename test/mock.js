@@ -0,0 +1,371 @@
+/*
+ * mock.js: exercise the bindings against the mock backend, injecting faults.
+ * Unlike the other tests, this one doesn't need hyprlofs, so it runs anywhere.
+ */
+
+var mod_assert = require('assert');
+var mod_constants = require('constants');
+var mod_fs = require('fs');
+var mod_hyprlofs = require('hyprlofs');
+
+var tmpdir = '/var/tmp/hylofs.mock/' + process.pid;
+var mntdir = tmpdir + '/mnt';
+var stages = [];
+var fs;
+
+/*
+ * Files to map, created under tmpdir.
+ */
+var names = [ 'a', 'b', 'c', 'd', 'e', 'f' ];
+
+function makeMappings(aliases)
+{
+	return (aliases.map(function (alias) {
+		return ([ tmpdir + '/files/' + alias, alias ]);
+	}));
+}
+
+/*
+ * Process the next asynchronous stage.
+ */
+function stageDone(i, err)
+{
+	if (err) {
+		console.log('FAILED: %s', err.message);
+		process.exit(1);
+	}
+
+	if (i >= 0)
+		console.log('done.');
+
+	if (i + 1 == stages.length)
+		return;
+
+	stages[i + 1](function (suberr) { stageDone(i + 1, suberr); });
+}
+
+/*
+ * Verify that the mount contains exactly the given aliases.
+ */
+function checkMappings(aliases, callback)
+{
+	fs.listMappings(function (err, mappings) {
+		if (err)
+			return (callback(err));
+
+		var found = JSON.stringify(mappings.map(function (m) {
+			mod_assert.equal(m[0], mod_fs.realpathSync(
+			    tmpdir + '/files/' + m[1]));
+			return (m[1]);
+		}).sort());
+		var expected = JSON.stringify(aliases.slice().sort());
+
+		if (found != expected)
+			return (callback(new Error('found ' + found +
+			    ', expected ' + expected)));
+
+		process.stdout.write('(' + aliases.length + ' mappings) ');
+		return (callback());
+	});
+}
+
+/*
+ * Setup: select the mock backend, create the files, and mount.
+ */
+stages.push(function (callback) {
+	process.stdout.write('Selecting the mock backend ... ');
+	mod_hyprlofs.setBackend('mock', { 'latencyMicros': 100 });
+	mod_fs.mkdirSync(tmpdir, { 'recursive': true });
+	mod_fs.mkdirSync(tmpdir + '/files');
+	mod_fs.mkdirSync(mntdir);
+	names.forEach(function (name) {
+		mod_fs.writeFileSync(tmpdir + '/files/' + name, name);
+	});
+	callback();
+});
+
+stages.push(function (callback) {
+	fs = new mod_hyprlofs.Filesystem(mntdir);
+	process.stdout.write('Mounting at ' + mntdir + ' ... ');
+	fs.mount(callback);
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Mounting again ... ');
+	fs.mount(function (err) {
+		mod_assert.equal(err['code'], 'EBUSY');
+		callback();
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Adding and removing mappings ... ');
+	fs.addMappings(makeMappings([ 'a', 'b', 'c' ]), function (err) {
+		if (err)
+			return (callback(err));
+
+		return (fs.removeMappings([ 'b' ], function (suberr) {
+			if (suberr)
+				return (callback(suberr));
+			return (checkMappings([ 'a', 'c' ], callback));
+		}));
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Checking kernel errors ... ');
+	fs.addMappings([ [ tmpdir + '/nonexistent', 'x' ] ], function (err) {
+		mod_assert.equal(err['code'], 'ENOENT');
+		fs.addMappings(makeMappings([ '../a' ]), function (suberr) {
+			mod_assert.equal(suberr['code'], 'EINVAL');
+			fs.removeMappings([ 'b' ], function (rmerr) {
+				mod_assert.equal(rmerr['code'], 'ENOENT');
+				checkMappings([ 'a', 'c' ], callback);
+			});
+		});
+	});
+});
+
+/*
+ * Check fault injection.
+ */
+stages.push(function (callback) {
+	process.stdout.write('Injecting an error ... ');
+	mod_hyprlofs.setBackend('mock', { 'faults': [
+	    { 'command': 'add', 'errno': mod_constants.EIO, 'after': 1 }
+	] });
+
+	fs.addMappings(makeMappings([ 'd' ]), function (err) {
+		if (err)
+			return (callback(err));
+
+		return (fs.addMappings(makeMappings([ 'e' ]), function (suberr) {
+			mod_assert.equal(suberr['code'], 'EIO');
+			mod_assert.equal(suberr['syscall'],
+			    'hyprlofs ioctl ADD');
+			checkMappings([ 'a', 'c', 'd' ], callback);
+		}));
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Injecting a stale GET count ... ');
+	mod_hyprlofs.setBackend('mock', { 'faults': [
+	    { 'command': 'get', 'errno': mod_constants.E2BIG, 'count': 2 }
+	] });
+
+	var before = fs.stats()['getRetries'];
+	checkMappings([ 'a', 'c', 'd' ], function (err) {
+		if (err)
+			return (callback(err));
+
+		mod_assert.equal(fs.stats()['getRetries'] - before, 2);
+		return (callback());
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Injecting an unknown error ... ');
+	mod_hyprlofs.setBackend('mock', { 'faults': [
+	    { 'command': 'get', 'errno': 200 }
+	] });
+
+	/*
+	 * Errors with no name are identified by their number instead.
+	 */
+	fs.listMappings(function (err) {
+		mod_assert.equal(err['code'], '200');
+		mod_assert.equal(err['errno'], 200);
+		mod_assert.equal(fs.stats()['errors']['200'], 1);
+		checkMappings([ 'a', 'c', 'd' ], callback);
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Failing a combined request ... ');
+	mod_hyprlofs.setBackend('mock', { 'faults': [
+	    { 'command': 'add', 'errno': mod_constants.EIO }
+	] });
+
+	/*
+	 * The three additions are queued behind the listing and combined into
+	 * a single request, which fails before applying anything.  The error
+	 * belongs to the first addition, and the others are retried on their
+	 * own.
+	 */
+	var ndone = 0;
+	var results = [];
+
+	fs.listMappings(function () {});
+	[ 'b', 'e', 'f' ].forEach(function (alias, i) {
+		fs.addMappings(makeMappings([ alias ]), function (err) {
+			results[i] = err ? err['code'] : null;
+			if (++ndone < 3)
+				return (undefined);
+
+			mod_assert.deepEqual(results, [ 'EIO', null, null ]);
+			return (fs.addMappings(makeMappings([ 'b' ]),
+			    function (adderr) {
+				if (adderr)
+					return (callback(adderr));
+				return (checkMappings(names, callback));
+			}));
+		});
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Failing a request after a repeated alias ... ');
+	mod_hyprlofs.setBackend('mock');
+
+	/*
+	 * The second addition remaps the first one's alias, so it can't be
+	 * combined with it: if the request containing both failed, there'd
+	 * be no telling whether the first had been applied.  The first must
+	 * succeed just as it would by itself.
+	 */
+	var ndone = 0;
+	var results = [];
+
+	fs.listMappings(function () {});
+	[ [ [ tmpdir + '/files/a', 'x' ] ],
+	    [ [ tmpdir + '/files/b', 'x' ] ],
+	    [ [ tmpdir + '/nonexistent', 'y' ] ] ].forEach(function (m, i) {
+		fs.addMappings(m, function (err) {
+			results[i] = err ? err['code'] : null;
+			if (++ndone < 3)
+				return (undefined);
+
+			mod_assert.deepEqual(results, [ null, null, 'ENOENT' ]);
+			return (fs.listMappings(function (lserr, mappings) {
+				if (lserr)
+					return (callback(lserr));
+
+				var target = mod_fs.realpathSync(tmpdir +
+				    '/files/b');
+				mod_assert.deepEqual(mappings.filter(
+				    function (mapping) {
+					return (mapping[1] == 'x');
+				}), [ [ target, 'x' ] ]);
+				return (fs.removeMappings([ 'x' ],
+				    function (rmerr) {
+					if (rmerr)
+						return (callback(rmerr));
+					return (checkMappings(names, callback));
+				}));
+			}));
+		});
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Failing a combined removal ... ');
+	mod_hyprlofs.setBackend('mock', { 'faults': [
+	    { 'command': 'remove', 'errno': mod_constants.EIO, 'count': 1 }
+	] });
+
+	/*
+	 * Removals are only combined by an owned object that knows each alias
+	 * is present.  When the combined request fails, the first removal
+	 * that wasn't applied gets the error and the rest are retried.
+	 */
+	var ofs = new mod_hyprlofs.Filesystem(mntdir, { 'owned': true });
+	ofs.resync(function (err) {
+		if (err)
+			return (callback(err));
+
+		var ndone = 0;
+		var results = [];
+
+		ofs.listMappings(function () {});
+		[ 'a', 'c', 'd' ].forEach(function (alias, i) {
+			ofs.removeMappings([ alias ], function (suberr) {
+				results[i] = suberr ? suberr['code'] : null;
+				if (++ndone < 3)
+					return (undefined);
+
+				mod_assert.deepEqual(results,
+				    [ 'EIO', null, null ]);
+				mod_assert.ok(ofs.hasMapping('a'));
+				mod_assert.ok(!ofs.hasMapping('c'));
+				return (fs.addMappings(
+				    makeMappings([ 'c', 'd' ]), readded));
+			});
+		});
+		return (undefined);
+	});
+
+	function readded(err) {
+		if (err)
+			return (callback(err));
+		return (checkMappings(names, callback));
+	}
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Splitting a throttled request ... ');
+	mod_hyprlofs.setBackend('mock');
+
+	/*
+	 * A background request for more mappings than the rate limit allows in
+	 * one burst goes to the kernel in pieces no larger than that.
+	 */
+	var tfs = new mod_hyprlofs.Filesystem(mntdir,
+	    { 'priority': 'background', 'rateLimit': 100 });
+	var aliases = [];
+	var mappings = [];
+
+	for (var i = 0; i < 150; i++) {
+		aliases.push('r' + i);
+		mappings.push([ tmpdir + '/files/a', 'r' + i ]);
+	}
+
+	tfs.addMappings(mappings, function (err) {
+		if (err)
+			return (callback(err));
+
+		mod_assert.equal(tfs.stats()['ioctls']['ADD'], 2);
+		mod_assert.ok(tfs.stats()['throttledTime']['sum'] >= 400000000);
+		return (fs.removeMappings(aliases, function (rmerr) {
+			if (rmerr)
+				return (callback(rmerr));
+			return (checkMappings(names, callback));
+		}));
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Failing an unmount ... ');
+	mod_hyprlofs.setBackend('mock', { 'faults': [
+	    { 'command': 'unmount', 'errno': mod_constants.EBUSY }
+	] });
+
+	fs.unmount(function (err) {
+		mod_assert.equal(err['code'], 'EBUSY');
+		checkMappings(names, callback);
+	});
+});
+
+/*
+ * Cleanup.
+ */
+stages.push(function (callback) {
+	process.stdout.write('Unmounting ' + mntdir + ' ... ');
+	mod_hyprlofs.setBackend('mock');
+	fs.unmount(callback);
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Checking the unmounted mount ... ');
+	fs.removeAll(function (err) {
+		mod_assert.equal(err['code'], 'ENOTTY');
+		callback();
+	});
+});
+
+stages.push(function (callback) {
+	process.stdout.write('Removing ' + tmpdir + ' ... ');
+	mod_fs.rm(tmpdir, { 'recursive': true }, callback);
+});
+
+stageDone(-1);